@@ -103,10 +103,18 @@ static inline int reg_int_cb(struct int_param_s *int_param)
 #define fabs(x)     (((x)>0)?(x):-(x))
 #elif defined EMPL_TARGET_LINUX
 #include "linux_glue.h"
+/* The counters are read from another thread by mpu_get_stats. */
+#define stat_inc(c)     __atomic_store_n(&(c), (c) + 1, __ATOMIC_RELAXED)
+#define stat_get(c)     __atomic_load_n(&(c), __ATOMIC_RELAXED)
 #else
 #error  Gyro driver is missing the system layer implementations.
 #endif
 
+#ifndef stat_inc
+#define stat_inc(c)     ((c)++)
+#define stat_get(c)     (c)
+#endif
+
 #if !defined MPU6050 && !defined MPU9150 && !defined MPU6500 && !defined MPU9250
 #error  Which gyro are you using? Define MPUxxxx in your compiler options.
 #endif
@@ -299,6 +307,8 @@ struct gyro_state_s {
     const struct hw_s *hw;
     struct chip_cfg_s chip_cfg;
     const struct test_s *test;
+    /* Not touched by mpu_init, counts from when the state was created. */
+    struct mpu_stats_s stats;
 };
 
 /* Filter configurations. */
@@ -513,7 +523,7 @@ const struct test_s test = {
     .max_accel_var  = 0.14f
 };
 
-static struct gyro_state_s st = {
+static struct gyro_state_s default_st = {
     .reg = &reg,
     .hw = &hw,
     .test = &test
@@ -593,13 +603,25 @@ const struct test_s test = {
     .max_accel_var  = 0.14f
 };
 
-static struct gyro_state_s st = {
+static struct gyro_state_s default_st = {
     .reg = &reg,
     .hw = &hw,
     .test = &test
 };
 #endif
 
+/* Every mpu_* call works on the state selected for the calling thread. Extra
+ * devices get their own gyro_state_s and hw from mpu_state_create(), only the
+ * slave address differs, and switch to it with mpu_state_select().
+ */
+struct mpu_state_s {
+    struct gyro_state_s gyro;
+    struct hw_s hw;
+};
+
+static __thread struct gyro_state_s *cur_st = &default_st;
+#define st (*cur_st)
+
 #define MAX_PACKET_LENGTH (12)
 
 #ifdef AK89xx_SECONDARY
@@ -642,6 +664,78 @@ static int set_int_enable(unsigned char enable)
     return 0;
 }
 
+/**
+ *  @brief      Allocate driver state for another device.
+ *  The new state starts out uninitialized, select it and call mpu_init().
+ *  @param[in]  addr    7-bit slave address, 0x68 or 0x69 depending on AD0.
+ *  @return     New state, NULL on failure.
+ */
+struct gyro_state_s *mpu_state_create(unsigned char addr)
+{
+    struct mpu_state_s *state;
+
+    state = (struct mpu_state_s*)calloc(1, sizeof(struct mpu_state_s));
+    if (!state)
+        return NULL;
+
+    memcpy(&state->hw, &hw, sizeof(struct hw_s));
+    state->hw.addr = addr;
+
+    state->gyro.reg = &reg;
+    state->gyro.hw = &state->hw;
+    state->gyro.test = &test;
+    return &state->gyro;
+}
+
+/**
+ *  @brief      Free state from mpu_state_create().
+ *  If the calling thread has it selected, the default state is selected.
+ *  @param[in]  state   State to free.
+ */
+void mpu_state_destroy(struct gyro_state_s *state)
+{
+    if (!state || state == &default_st)
+        return;
+    if (cur_st == state)
+        cur_st = &default_st;
+    free(state);
+}
+
+/**
+ *  @brief      Select the device the calling thread talks to.
+ *  @param[in]  state   State from mpu_state_create(), NULL for the default.
+ */
+void mpu_state_select(struct gyro_state_s *state)
+{
+    cur_st = state ? state : &default_st;
+}
+
+/**
+ *  @brief      Enable/disable the data ready interrupt without the FIFO.
+ *  For reading the output registers directly, the DMP must be off.
+ *  @param[in]  enable      1 to enable interrupt.
+ *  @return     0 if successful.
+ */
+int mpu_set_data_ready_int(unsigned char enable)
+{
+    if (st.chip_cfg.dmp_on)
+        return -1;
+    return set_int_enable(enable);
+}
+
+/**
+ *  @brief      Get the event counters of the selected device.
+ *  Plain increments, read from another thread they may be an event behind.
+ *  @param[out] stats   Counters.
+ *  @return     0 if successful.
+ */
+int mpu_get_stats(struct mpu_stats_s *stats)
+{
+    stats->fifo_resets = stat_get(st.stats.fifo_resets);
+    stats->fifo_overflows = stat_get(st.stats.fifo_overflows);
+    return 0;
+}
+
 /**
  *  @brief      Register dump for testing.
  *  @return     0 if successful.
@@ -661,6 +755,65 @@ int mpu_reg_dump(void)
     return 0;
 }
 
+/**
+ *  @brief      Read all registers at once, for diagnostics.
+ *  The FIFO and memory read/write registers would give up data, and the
+ *  interrupt status registers would be cleared, so those read as zero.
+ *  @param[out] data    st.hw->num_reg bytes, see @e mpu_get_num_reg.
+ *  @return     0 if successful.
+ */
+int mpu_reg_snapshot(unsigned char *data)
+{
+    /* [first, end) runs between the registers left out */
+    unsigned char runs[4][2];
+    unsigned char ii;
+
+    if (!data)
+        return -1;
+
+    runs[0][0] = 0;
+    runs[0][1] = st.reg->dmp_int_status;
+    runs[1][0] = st.reg->int_status + 1;
+    runs[1][1] = st.reg->mem_r_w;
+    runs[2][0] = st.reg->mem_r_w + 1;
+    runs[2][1] = st.reg->fifo_r_w;
+    runs[3][0] = st.reg->fifo_r_w + 1;
+    runs[3][1] = st.hw->num_reg;
+
+    memset(data, 0, st.hw->num_reg);
+
+#if defined EMPL_TARGET_LINUX
+    {
+        /* One bus transaction, repeated starts between the runs. */
+        struct linux_i2c_op_s ops[4];
+        for (ii = 0; ii < 4; ii++) {
+            ops[ii].reg_addr = runs[ii][0];
+            ops[ii].read = 1;
+            ops[ii].length = runs[ii][1] - runs[ii][0];
+            ops[ii].data = data + runs[ii][0];
+        }
+        if (linux_i2c_transfer(st.hw->addr, 4, ops))
+            return -1;
+    }
+#else
+    for (ii = 0; ii < 4; ii++) {
+        if (i2c_read(st.hw->addr, runs[ii][0], runs[ii][1] - runs[ii][0],
+                data + runs[ii][0]))
+            return -1;
+    }
+#endif
+    return 0;
+}
+
+/**
+ *  @brief      Number of registers @e mpu_reg_snapshot reads.
+ *  @return     Register count.
+ */
+int mpu_get_num_reg(void)
+{
+    return st.hw->num_reg;
+}
+
 /**
  *  @brief      Read from a single register.
  *  NOTE: The memory and FIFO read/write registers cannot be accessed.
@@ -789,8 +942,8 @@ int mpu_init(struct int_param_s *int_param)
     if (mpu_configure_fifo(0))
         return -1;
 
-    if (int_param)
-        reg_int_cb(int_param);
+    if (int_param && reg_int_cb(int_param))
+        return -1;
 
 #ifdef AK89xx_SECONDARY
     setup_compass();
@@ -1032,6 +1185,8 @@ int mpu_reset_fifo(void)
     if (!(st.chip_cfg.sensors))
         return -1;
 
+    stat_inc(st.stats.fifo_resets);
+
     data = 0;
     if (i2c_write(st.hw->addr, st.reg->int_enable, 1, &data))
         return -1;
@@ -1668,6 +1823,7 @@ int mpu_read_fifo(short *gyro, short *accel, unsigned long *timestamp,
         if (i2c_read(st.hw->addr, st.reg->int_status, 1, data))
             return -1;
         if (data[0] & BIT_FIFO_OVERFLOW) {
+            stat_inc(st.stats.fifo_overflows);
             mpu_reset_fifo();
             return -2;
         }
@@ -1734,6 +1890,7 @@ int mpu_read_fifo_stream(unsigned short length, unsigned char *data,
         if (i2c_read(st.hw->addr, st.reg->int_status, 1, tmp))
             return -1;
         if (tmp[0] & BIT_FIFO_OVERFLOW) {
+            stat_inc(st.stats.fifo_overflows);
             mpu_reset_fifo();
             return -2;
         }
@@ -1745,6 +1902,59 @@ int mpu_read_fifo_stream(unsigned short length, unsigned char *data,
     return 0;
 }
 
+/**
+ *  @brief      Get all queued unparsed packets from the FIFO.
+ *  Same as @e mpu_read_fifo_stream, but the FIFO count is read once and up to
+ *  @e max_packets packets are read back in a single burst.
+ *  @param[in]  length      Length of one FIFO packet.
+ *  @param[in]  max_packets Capacity of @e data, in packets.
+ *  @param[out] data        FIFO packets, back to back, oldest first.
+ *  @param[out] packets     Number of packets read.
+ *  @param[out] more        Number of packets left in the FIFO.
+ *  @return     0 if successful.
+ */
+int mpu_read_fifo_burst(unsigned short length, unsigned short max_packets,
+    unsigned char *data, unsigned short *packets, unsigned char *more)
+{
+    unsigned char tmp[2];
+    unsigned short fifo_count, count;
+
+    packets[0] = 0;
+    more[0] = 0;
+    if (!st.chip_cfg.dmp_on)
+        return -1;
+    if (!st.chip_cfg.sensors)
+        return -1;
+    if (!length || !max_packets)
+        return -1;
+
+    if (i2c_read(st.hw->addr, st.reg->fifo_count_h, 2, tmp))
+        return -1;
+    fifo_count = (tmp[0] << 8) | tmp[1];
+    if (fifo_count < length)
+        return -1;
+    if (fifo_count > (st.hw->max_fifo >> 1)) {
+        /* FIFO is 50% full, better check overflow bit. */
+        if (i2c_read(st.hw->addr, st.reg->int_status, 1, tmp))
+            return -1;
+        if (tmp[0] & BIT_FIFO_OVERFLOW) {
+            stat_inc(st.stats.fifo_overflows);
+            mpu_reset_fifo();
+            return -2;
+        }
+    }
+
+    count = fifo_count / length;
+    if (count > max_packets)
+        count = max_packets;
+
+    if (i2c_read(st.hw->addr, st.reg->fifo_r_w, count * length, data))
+        return -1;
+    packets[0] = count;
+    more[0] = fifo_count / length - count;
+    return 0;
+}
+
 /**
  *  @brief      Set device to bypass mode.
  *  @param[in]  bypass_on   1 to enable bypass mode.
@@ -2221,10 +2431,26 @@ int mpu_write_mem(unsigned short mem_addr, unsigned short length,
     if (tmp[1] + length > st.hw->bank_size)
         return -1;
 
+#if defined EMPL_TARGET_LINUX
+    {
+        /* Bank select and data in one bus transaction. */
+        struct linux_i2c_op_s ops[2] = {
+            { 0, 0, 2, tmp },
+            { 0, 0, 0, NULL }
+        };
+        ops[0].reg_addr = st.reg->bank_sel;
+        ops[1].reg_addr = st.reg->mem_r_w;
+        ops[1].length = length;
+        ops[1].data = data;
+        if (linux_i2c_transfer(st.hw->addr, 2, ops))
+            return -1;
+    }
+#else
     if (i2c_write(st.hw->addr, st.reg->bank_sel, 2, tmp))
         return -1;
     if (i2c_write(st.hw->addr, st.reg->mem_r_w, length, data))
         return -1;
+#endif
     return 0;
 }
 
@@ -2254,10 +2480,26 @@ int mpu_read_mem(unsigned short mem_addr, unsigned short length,
     if (tmp[1] + length > st.hw->bank_size)
         return -1;
 
+#if defined EMPL_TARGET_LINUX
+    {
+        /* Bank select, then the read after a repeated start. */
+        struct linux_i2c_op_s ops[2] = {
+            { 0, 0, 2, tmp },
+            { 0, 1, 0, NULL }
+        };
+        ops[0].reg_addr = st.reg->bank_sel;
+        ops[1].reg_addr = st.reg->mem_r_w;
+        ops[1].length = length;
+        ops[1].data = data;
+        if (linux_i2c_transfer(st.hw->addr, 2, ops))
+            return -1;
+    }
+#else
     if (i2c_write(st.hw->addr, st.reg->bank_sel, 2, tmp))
         return -1;
     if (i2c_read(st.hw->addr, st.reg->mem_r_w, length, data))
         return -1;
+#endif
     return 0;
 }
 
@@ -2305,6 +2547,177 @@ int mpu_load_firmware(unsigned short length, const unsigned char *firmware,
     return 0;
 }
 
+#define MAX_BANK_SIZE   (256)
+
+/* One bank of mpu_load_firmware_fast, returns the bytes done or -1. */
+static int load_firmware_bank(unsigned short length, const unsigned char *firmware,
+    unsigned short start_addr, const unsigned short *patched,
+    unsigned char num_patched, unsigned short ii)
+{
+    unsigned short jj, addr, end;
+    unsigned short this_write;
+    unsigned char cur[MAX_BANK_SIZE], mask[MAX_BANK_SIZE];
+
+    this_write = min(st.hw->bank_size, length - ii);
+    if (ii + this_write <= start_addr) {
+        if (mpu_write_mem(ii, this_write, (unsigned char*)&firmware[ii]))
+            return -1;
+        return this_write;
+    }
+
+    /* Mark the bytes of this bank the driver patches. */
+    memset(mask, 0, this_write);
+    for (jj = 0; jj < num_patched; jj++) {
+        addr = patched[2 * jj] > ii ? patched[2 * jj] : ii;
+        end = min(patched[2 * jj] + patched[2 * jj + 1], ii + this_write);
+        for (; addr < end; addr++)
+            mask[addr - ii] = 1;
+    }
+
+    if (mpu_read_mem(ii, this_write, cur))
+        return -1;
+    for (jj = 0; jj < this_write; jj++) {
+        if (!mask[jj] && cur[jj] != firmware[ii + jj])
+            break;
+    }
+
+    if (jj < this_write) {
+        if (mpu_write_mem(ii, this_write, (unsigned char*)&firmware[ii]))
+            return -1;
+        return this_write;
+    }
+
+    /* Same code, put the patched words back to the image values. */
+    for (jj = 0; jj < this_write; jj = addr) {
+        if (!mask[jj]) {
+            addr = jj + 1;
+            continue;
+        }
+        for (addr = jj; addr < this_write && mask[addr]; addr++)
+            ;
+        if (memcmp(&firmware[ii + jj], &cur[jj], addr - jj) &&
+            mpu_write_mem(ii + jj, addr - jj, (unsigned char*)&firmware[ii + jj]))
+            return -1;
+    }
+    return this_write;
+}
+
+/* Read the image back, then let the DMP run it from start_addr. */
+static int finish_firmware(unsigned short length, const unsigned char *firmware,
+    unsigned short start_addr, unsigned short sample_rate, unsigned char verify)
+{
+    unsigned short ii;
+    unsigned short this_write;
+    unsigned char cur[MAX_BANK_SIZE], tmp[2];
+
+    if (verify) {
+        for (ii = 0; ii < length; ii += this_write) {
+            this_write = min(st.hw->bank_size, length - ii);
+            if (mpu_read_mem(ii, this_write, cur))
+                return -1;
+            if (memcmp(firmware+ii, cur, this_write))
+                return -2;
+        }
+    }
+
+    /* Set program start address. */
+    tmp[0] = start_addr >> 8;
+    tmp[1] = start_addr & 0xFF;
+    if (i2c_write(st.hw->addr, st.reg->prgm_start_h, 2, tmp))
+        return -1;
+
+    st.chip_cfg.dmp_loaded = 1;
+    st.chip_cfg.dmp_sample_rate = sample_rate;
+    return 0;
+}
+
+/**
+ *  @brief      Load DMP image a bank at a time.
+ *  Memory below @e start_addr is data and always written. A code bank that
+ *  already holds the image, as after a restart without a power cycle, is
+ *  not written again. The configuration calls patch words inside the code
+ *  (see @e dmp_enable_feature), so those ranges are left out of the compare
+ *  and only they are rewritten from the image. Instead of checking every
+ *  chunk as it is written, the image can be read back once at the end.
+ *  @param[in]  length      Length of DMP image.
+ *  @param[in]  firmware    DMP code.
+ *  @param[in]  start_addr  Starting address of DMP code memory.
+ *  @param[in]  sample_rate Fixed sampling rate used when DMP is enabled.
+ *  @param[in]  patched     Address and length pairs the driver writes.
+ *  @param[in]  num_patched Number of pairs in @e patched.
+ *  @param[in]  verify      1 to read the whole image back after loading.
+ *  @return     0 if successful.
+ */
+int mpu_load_firmware_fast(unsigned short length, const unsigned char *firmware,
+    unsigned short start_addr, unsigned short sample_rate,
+    const unsigned short *patched, unsigned char num_patched, unsigned char verify)
+{
+    unsigned short ii;
+    int this_write;
+
+    if (st.chip_cfg.dmp_loaded)
+        /* DMP should only be loaded once. */
+        return -1;
+
+    if (!firmware)
+        return -1;
+    if (st.hw->bank_size > MAX_BANK_SIZE)
+        return -1;
+
+    for (ii = 0; ii < length; ii += this_write) {
+        this_write = load_firmware_bank(length, firmware, start_addr,
+            patched, num_patched, ii);
+        if (this_write < 0)
+            return -1;
+    }
+
+    return finish_firmware(length, firmware, start_addr, sample_rate, verify);
+}
+
+/**
+ *  @brief      Load DMP image one bank per call.
+ *  The same as @e mpu_load_firmware_fast, split up so other work can run
+ *  between the banks. Start with @e offset at 0 and call again while it
+ *  returns 1, nothing else may write the DMP memory in between. The
+ *  image only counts as loaded once it returns 0.
+ *  @param[in]  length      Length of DMP image.
+ *  @param[in]  firmware    DMP code.
+ *  @param[in]  start_addr  Starting address of DMP code memory.
+ *  @param[in]  sample_rate Fixed sampling rate used when DMP is enabled.
+ *  @param[in]  patched     Address and length pairs the driver writes.
+ *  @param[in]  num_patched Number of pairs in @e patched.
+ *  @param[in]  verify      1 to read the whole image back after the last bank.
+ *  @param[in,out] offset   Next byte of the image to load.
+ *  @return     1 with banks left, 0 once loaded, negative on error.
+ */
+int mpu_load_firmware_step(unsigned short length, const unsigned char *firmware,
+    unsigned short start_addr, unsigned short sample_rate,
+    const unsigned short *patched, unsigned char num_patched, unsigned char verify,
+    unsigned short *offset)
+{
+    int this_write;
+
+    if (st.chip_cfg.dmp_loaded)
+        return -1;
+
+    if (!firmware || !offset)
+        return -1;
+    if (st.hw->bank_size > MAX_BANK_SIZE)
+        return -1;
+
+    if (offset[0] < length) {
+        this_write = load_firmware_bank(length, firmware, start_addr,
+            patched, num_patched, offset[0]);
+        if (this_write < 0)
+            return -1;
+        offset[0] += this_write;
+        if (offset[0] < length)
+            return 1;
+    }
+
+    return finish_firmware(length, firmware, start_addr, sample_rate, verify);
+}
+
 /**
  *  @brief      Enable/disable DMP support.
  *  @param[in]  enable  1 to turn on the DMP.
@@ -2516,6 +2929,83 @@ int mpu_get_compass_reg(short *data, unsigned long *timestamp)
 #endif
 }
 
+/**
+ *  @brief      Read accel, temperature, gyro and compass in one burst.
+ *  The output registers run contiguously from the accel data through the
+ *  compass copy in EXT_SENS_DATA, so a single read replaces the separate
+ *  ones done by @e mpu_get_accel_reg, @e mpu_get_temperature,
+ *  @e mpu_get_gyro_reg and @e mpu_get_compass_reg.
+ *  @param[out] gyro        Raw gyro data in hardware units.
+ *  @param[out] accel       Raw accel data in hardware units.
+ *  @param[out] temperature Temperature in degrees Celsius in q16 format.
+ *  @param[out] compass     Raw compass data in hardware units. Null if not
+ *                          needed.
+ *  @param[out] compass_ok  1 if @e compass was filled with a valid sample.
+ *  @return     0 if successful.
+ */
+int mpu_get_sensor_reg(short *gyro, short *accel, long *temperature,
+    short *compass, unsigned char *compass_ok)
+{
+    unsigned char tmp[32], length, ii;
+    short raw;
+
+    compass_ok[0] = 0;
+    if (!(st.chip_cfg.sensors))
+        return -1;
+
+#if defined AK89xx_SECONDARY && !defined AK89xx_BYPASS
+    length = st.reg->raw_compass - st.reg->raw_accel + 8;
+#else
+    length = st.reg->raw_gyro - st.reg->raw_accel + 6;
+#endif
+    if (length > sizeof(tmp))
+        return -1;
+
+    if (i2c_read(st.hw->addr, st.reg->raw_accel, length, tmp))
+        return -1;
+
+    accel[0] = (tmp[0] << 8) | tmp[1];
+    accel[1] = (tmp[2] << 8) | tmp[3];
+    accel[2] = (tmp[4] << 8) | tmp[5];
+
+    ii = st.reg->temp - st.reg->raw_accel;
+    raw = (tmp[ii] << 8) | tmp[ii+1];
+    temperature[0] = (long)((35 + ((raw - (float)st.hw->temp_offset) / st.hw->temp_sens)) * 65536L);
+
+    ii = st.reg->raw_gyro - st.reg->raw_accel;
+    gyro[0] = (tmp[ii] << 8) | tmp[ii+1];
+    gyro[1] = (tmp[ii+2] << 8) | tmp[ii+3];
+    gyro[2] = (tmp[ii+4] << 8) | tmp[ii+5];
+
+#if defined AK89xx_SECONDARY && !defined AK89xx_BYPASS
+    if (!compass || !(st.chip_cfg.sensors & INV_XYZ_COMPASS))
+        return 0;
+
+    /* Same layout and checks as mpu_get_compass_reg. */
+    ii = st.reg->raw_compass - st.reg->raw_accel;
+#if defined AK8975_SECONDARY
+    if (!(tmp[ii] & AKM_DATA_READY))
+        return 0;
+    if ((tmp[ii+7] & AKM_OVERFLOW) || (tmp[ii+7] & AKM_DATA_ERROR))
+        return 0;
+#elif defined AK8963_SECONDARY
+    if (!(tmp[ii] & AKM_DATA_READY) || (tmp[ii] & AKM_DATA_OVERRUN))
+        return 0;
+    if (tmp[ii+7] & AKM_OVERFLOW)
+        return 0;
+#endif
+    compass[0] = (tmp[ii+2] << 8) | tmp[ii+1];
+    compass[1] = (tmp[ii+4] << 8) | tmp[ii+3];
+    compass[2] = (tmp[ii+6] << 8) | tmp[ii+5];
+
+    compass[0] = ((long)compass[0] * st.chip_cfg.mag_sens_adj[0]) >> 8;
+    compass[1] = ((long)compass[1] * st.chip_cfg.mag_sens_adj[1]) >> 8;
+    compass[2] = ((long)compass[2] * st.chip_cfg.mag_sens_adj[2]) >> 8;
+    compass_ok[0] = 1;
+#endif
+    return 0;
+}
+
 /**
  *  @brief      Get the compass full-scale range.
  *  @param[out] fsr Current full-scale range.
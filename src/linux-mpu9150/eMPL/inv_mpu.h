@@ -58,6 +58,20 @@ struct int_param_s {
 #define MPU_INT_STATUS_DMP_4            (0x1000)
 #define MPU_INT_STATUS_DMP_5            (0x2000)
 
+/* Event counters, see mpu_get_stats. */
+struct mpu_stats_s {
+    /* Every mpu_reset_fifo, overflows and corrupt DMP packets included. */
+    unsigned long fifo_resets;
+    /* Overflows seen by the FIFO read functions. */
+    unsigned long fifo_overflows;
+};
+
+/* Multiple device APIs */
+struct gyro_state_s;
+struct gyro_state_s *mpu_state_create(unsigned char addr);
+void mpu_state_destroy(struct gyro_state_s *state);
+void mpu_state_select(struct gyro_state_s *state);
+
 /* Set up APIs */
 int mpu_init(struct int_param_s *int_param);
 int mpu_init_slave(void);
@@ -69,6 +83,7 @@ int mpu_lp_motion_interrupt(unsigned short thresh, unsigned char time,
     unsigned char lpa_freq);
 int mpu_set_int_level(unsigned char active_low);
 int mpu_set_int_latched(unsigned char enable);
+int mpu_set_data_ready_int(unsigned char enable);
 
 int mpu_set_dmp_state(unsigned char enable);
 int mpu_get_dmp_state(unsigned char *enabled);
@@ -104,6 +119,8 @@ int mpu_set_accel_bias(const long *accel_bias);
 int mpu_get_gyro_reg(short *data, unsigned long *timestamp);
 int mpu_get_accel_reg(short *data, unsigned long *timestamp);
 int mpu_get_compass_reg(short *data, unsigned long *timestamp);
+int mpu_get_sensor_reg(short *gyro, short *accel, long *temperature,
+    short *compass, unsigned char *compass_ok);
 int mpu_get_temperature(long *data, unsigned long *timestamp);
 
 int mpu_get_int_status(short *status);
@@ -111,6 +128,8 @@ int mpu_read_fifo(short *gyro, short *accel, unsigned long *timestamp,
     unsigned char *sensors, unsigned char *more);
 int mpu_read_fifo_stream(unsigned short length, unsigned char *data,
     unsigned char *more);
+int mpu_read_fifo_burst(unsigned short length, unsigned short max_packets,
+    unsigned char *data, unsigned short *packets, unsigned char *more);
 int mpu_reset_fifo(void);
 
 int mpu_write_mem(unsigned short mem_addr, unsigned short length,
@@ -119,8 +138,19 @@ int mpu_read_mem(unsigned short mem_addr, unsigned short length,
     unsigned char *data);
 int mpu_load_firmware(unsigned short length, const unsigned char *firmware,
     unsigned short start_addr, unsigned short sample_rate);
+int mpu_load_firmware_fast(unsigned short length, const unsigned char *firmware,
+    unsigned short start_addr, unsigned short sample_rate,
+    const unsigned short *patched, unsigned char num_patched, unsigned char verify);
+int mpu_load_firmware_step(unsigned short length, const unsigned char *firmware,
+    unsigned short start_addr, unsigned short sample_rate,
+    const unsigned short *patched, unsigned char num_patched, unsigned char verify,
+    unsigned short *offset);
+
+int mpu_get_stats(struct mpu_stats_s *stats);
 
 int mpu_reg_dump(void);
+int mpu_reg_snapshot(unsigned char *data);
+int mpu_get_num_reg(void);
 int mpu_read_reg(unsigned char reg, unsigned char *data);
 int mpu_run_self_test(long *gyro, long *accel);
 int mpu_register_tap_cb(void (*func)(unsigned char, unsigned char));
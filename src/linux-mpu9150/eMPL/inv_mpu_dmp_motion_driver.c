@@ -457,6 +457,27 @@ static const unsigned char dmp_memory[DMP_CODE_SIZE] = {
 
 static const unsigned short sStartAddress = 0x0400;
 
+/* Words in the code banks the configuration functions below write, as
+ * address and length pairs. Everything else written lives below
+ * sStartAddress.
+ */
+static const unsigned short dmp_patched[] = {
+    FCFG_1, 3,
+    FCFG_2, 3,
+    FCFG_7, 3,
+    FCFG_3, 3,
+    CFG_MOTION_BIAS, 9,
+    CFG_ANDROID_ORIENT_INT, 1,
+    CFG_20, 1,
+    CFG_FIFO_ON_EVENT, 11,
+    CFG_LP_QUAT, 4,
+    CFG_8, 4,
+    CFG_GYRO_RAW_DATA, 4,
+    CFG_15, 10,
+    CFG_27, 1,
+    CFG_6, 12
+};
+
 /* END OF SECTION COPIED FROM dmpDefaultMPU6050.c */
 
 #define INT_SRC_TAP             (0x01)
@@ -487,7 +508,7 @@ struct dmp_s {
     unsigned char packet_length;
 };
 
-static struct dmp_s dmp = {
+static struct dmp_s default_dmp = {
     .tap_cb = NULL,
     .android_orient_cb = NULL,
     .orient = 0,
@@ -496,6 +517,43 @@ static struct dmp_s dmp = {
     .packet_length = 0
 };
 
+/* Like the mpu_* state in inv_mpu.c, selected per thread. */
+static __thread struct dmp_s *cur_dmp = &default_dmp;
+#define dmp (*cur_dmp)
+
+/**
+ *  @brief      Allocate DMP state for another device.
+ *  @return     New state, NULL on failure.
+ */
+struct dmp_s *dmp_state_create(void)
+{
+    return (struct dmp_s*)calloc(1, sizeof(struct dmp_s));
+}
+
+/**
+ *  @brief      Free state from dmp_state_create().
+ *  If the calling thread has it selected, the default state is selected.
+ *  @param[in]  state   State to free.
+ */
+void dmp_state_destroy(struct dmp_s *state)
+{
+    if (!state || state == &default_dmp)
+        return;
+    if (cur_dmp == state)
+        cur_dmp = &default_dmp;
+    free(state);
+}
+
+/**
+ *  @brief      Select the DMP state the calling thread uses.
+ *  Pair with mpu_state_select() for the same device.
+ *  @param[in]  state   State from dmp_state_create(), NULL for the default.
+ */
+void dmp_state_select(struct dmp_s *state)
+{
+    cur_dmp = state ? state : &default_dmp;
+}
+
 /**
  *  @brief  Load the DMP with this image.
  *  @return 0 if successful.
@@ -506,6 +564,33 @@ int dmp_load_motion_driver_firmware(void)
         DMP_SAMPLE_RATE);
 }
 
+/**
+ *  @brief  Load the DMP with this image using bank sized writes.
+ *  See @e mpu_load_firmware_fast.
+ *  @param[in]  verify  1 to read the image back once loaded.
+ *  @return 0 if successful.
+ */
+int dmp_load_motion_driver_firmware_fast(unsigned char verify)
+{
+    return mpu_load_firmware_fast(DMP_CODE_SIZE, dmp_memory, sStartAddress,
+        DMP_SAMPLE_RATE, dmp_patched, sizeof(dmp_patched) / (2 * sizeof(dmp_patched[0])),
+        verify);
+}
+
+/**
+ *  @brief  Load the DMP with this image one bank per call.
+ *  See @e mpu_load_firmware_step.
+ *  @param[in]  verify      1 to read the image back once loaded.
+ *  @param[in,out] offset   0 on the first call.
+ *  @return 1 with banks left, 0 once loaded, negative on error.
+ */
+int dmp_load_motion_driver_firmware_step(unsigned char verify, unsigned short *offset)
+{
+    return mpu_load_firmware_step(DMP_CODE_SIZE, dmp_memory, sStartAddress,
+        DMP_SAMPLE_RATE, dmp_patched, sizeof(dmp_patched) / (2 * sizeof(dmp_patched[0])),
+        verify, offset);
+}
+
 /**
  *  @brief      Push gyro and accel orientation to the DMP.
  *  The orientation is represented here as the output of
@@ -614,6 +699,47 @@ int dmp_set_gyro_bias(long *bias)
     return mpu_write_mem(D_EXT_GYRO_BIAS_Z, 4, regs);
 }
 
+/**
+ *  @brief      Read gyro biases back from the DMP.
+ *  With DMP-based gyro calibration enabled this is the bias the DMP has
+ *  computed so far, otherwise the last one pushed by dmp_set_gyro_bias().
+ *  @param[out] bias    Gyro biases in q16, as dmp_set_gyro_bias() takes them.
+ *  @return     0 if successful.
+ */
+int dmp_get_gyro_bias(long *bias)
+{
+    long gyro_bias_body[3];
+    unsigned char regs[12];
+    int i;
+
+    /* X, Y and Z are next to each other. */
+    if (mpu_read_mem(D_EXT_GYRO_BIAS_X, 12, regs))
+        return -1;
+
+    for (i = 0; i < 3; i++) {
+        gyro_bias_body[i] = ((long)regs[i * 4] << 24) | ((long)regs[i * 4 + 1] << 16) |
+            ((long)regs[i * 4 + 2] << 8) | regs[i * 4 + 3];
+        /* Sign extend where long is wider than the DMP word. */
+        gyro_bias_body[i] = (long)(int32_t)gyro_bias_body[i];
+#ifdef EMPL_NO_64BIT
+        gyro_bias_body[i] = (long)(((float)gyro_bias_body[i] * 1073741824.f) / GYRO_SF);
+#else
+        gyro_bias_body[i] = (long)(((long long)gyro_bias_body[i] << 30) / GYRO_SF);
+#endif
+    }
+
+    bias[dmp.orient & 3] = gyro_bias_body[0];
+    if (dmp.orient & 4)
+        bias[dmp.orient & 3] *= -1;
+    bias[(dmp.orient >> 3) & 3] = gyro_bias_body[1];
+    if (dmp.orient & 0x20)
+        bias[(dmp.orient >> 3) & 3] *= -1;
+    bias[(dmp.orient >> 6) & 3] = gyro_bias_body[2];
+    if (dmp.orient & 0x100)
+        bias[(dmp.orient >> 6) & 3] *= -1;
+    return 0;
+}
+
 /**
  *  @brief      Push accel biases to the DMP.
  *  These biases will be removed from the DMP 6-axis quaternion.
@@ -1237,29 +1363,32 @@ int dmp_set_interrupt_mode(unsigned char mode)
 }
 
 /**
- *  @brief      Get one packet from the FIFO.
- *  If @e sensors does not contain a particular sensor, disregard the data
- *  returned to that pointer.
- *  \n @e sensors can contain a combination of the following flags:
- *  \n INV_X_GYRO, INV_Y_GYRO, INV_Z_GYRO
- *  \n INV_XYZ_GYRO
- *  \n INV_XYZ_ACCEL
- *  \n INV_WXYZ_QUAT
- *  \n If the FIFO has no new data, @e sensors will be zero.
- *  \n If the FIFO is disabled, @e sensors will be zero and this function will
- *  return a non-zero error code.
+ *  @brief      Get the length of one DMP FIFO packet.
+ *  The length depends on the features enabled with @e dmp_enable_feature.
+ *  @param[out] length  Packet length in bytes.
+ *  @return     0 if successful.
+ */
+int dmp_get_packet_length(unsigned char *length)
+{
+    length[0] = dmp.packet_length;
+    return 0;
+}
+
+/**
+ *  @brief      Parse one DMP packet.
+ *  See @e dmp_read_fifo for the meaning of the output parameters. If the
+ *  quaternion in the packet is corrupted, the FIFO is reset and this function
+ *  returns an error; packets read in the same burst are misaligned as well.
+ *  @param[in]  fifo_data   One packet, @e dmp_get_packet_length bytes.
  *  @param[out] gyro        Gyro data in hardware units.
  *  @param[out] accel       Accel data in hardware units.
  *  @param[out] quat        3-axis quaternion data in hardware units.
- *  @param[out] timestamp   Timestamp in milliseconds.
- *  @param[out] sensors     Mask of sensors read from FIFO.
- *  @param[out] more        Number of remaining packets.
+ *  @param[out] sensors     Mask of sensors found in the packet.
  *  @return     0 if successful.
  */
-int dmp_read_fifo(short *gyro, short *accel, long *quat,
-    unsigned long *timestamp, short *sensors, unsigned char *more)
+int dmp_parse_packet(const unsigned char *fifo_data, short *gyro, short *accel,
+    long *quat, short *sensors)
 {
-    unsigned char fifo_data[MAX_PACKET_LENGTH];
     unsigned char ii = 0;
 
     /* TODO: sensors[0] only changes when dmp_enable_feature is called. We can
@@ -1267,10 +1396,6 @@ int dmp_read_fifo(short *gyro, short *accel, long *quat,
      */
     sensors[0] = 0;
 
-    /* Get a packet. */
-    if (mpu_read_fifo_stream(dmp.packet_length, fifo_data, more))
-        return -1;
-
     /* Parse DMP packet. */
     if (dmp.feature_mask & (DMP_FEATURE_LP_QUAT | DMP_FEATURE_6X_LP_QUAT)) {
 #ifdef FIFO_CORRUPTION_CHECK
@@ -1331,7 +1456,65 @@ int dmp_read_fifo(short *gyro, short *accel, long *quat,
      * the gesture callbacks (if registered).
      */
     if (dmp.feature_mask & (DMP_FEATURE_TAP | DMP_FEATURE_ANDROID_ORIENT))
-        decode_gesture(fifo_data + ii);
+        decode_gesture((unsigned char*)fifo_data + ii);
+
+    return 0;
+}
+
+/**
+ *  @brief      Get one packet from the FIFO.
+ *  If @e sensors does not contain a particular sensor, disregard the data
+ *  returned to that pointer.
+ *  \n @e sensors can contain a combination of the following flags:
+ *  \n INV_X_GYRO, INV_Y_GYRO, INV_Z_GYRO
+ *  \n INV_XYZ_GYRO
+ *  \n INV_XYZ_ACCEL
+ *  \n INV_WXYZ_QUAT
+ *  \n If the FIFO has no new data, @e sensors will be zero.
+ *  \n If the FIFO is disabled, @e sensors will be zero and this function will
+ *  return a non-zero error code.
+ *  @param[out] gyro        Gyro data in hardware units.
+ *  @param[out] accel       Accel data in hardware units.
+ *  @param[out] quat        3-axis quaternion data in hardware units.
+ *  @param[out] timestamp   Timestamp in milliseconds.
+ *  @param[out] sensors     Mask of sensors read from FIFO.
+ *  @param[out] more        Number of remaining packets.
+ *  @return     0 if successful.
+ */
+int dmp_read_fifo(short *gyro, short *accel, long *quat,
+    unsigned long *timestamp, short *sensors, unsigned char *more)
+{
+    unsigned char fifo_data[MAX_PACKET_LENGTH];
+
+    sensors[0] = 0;
+
+    /* Get a packet. */
+    if (mpu_read_fifo_stream(dmp.packet_length, fifo_data, more))
+        return -1;
+
+    if (dmp_parse_packet(fifo_data, gyro, accel, quat, sensors))
+        return -1;
+
+    get_ms(timestamp);
+    return 0;
+}
+
+/**
+ *  @brief      Get all queued packets from the FIFO in one burst.
+ *  The packets are left unparsed; pass each one to @e dmp_parse_packet.
+ *  @param[out] data        Packets, back to back, oldest first.
+ *  @param[in]  max_packets Capacity of @e data, in packets.
+ *  @param[out] packets     Number of packets read.
+ *  @param[out] timestamp   Timestamp in milliseconds.
+ *  @param[out] more        Number of packets left in the FIFO.
+ *  @return     0 if successful.
+ */
+int dmp_read_fifo_burst(unsigned char *data, unsigned short max_packets,
+    unsigned short *packets, unsigned long *timestamp, unsigned char *more)
+{
+    if (mpu_read_fifo_burst(dmp.packet_length, max_packets, data, packets,
+            more))
+        return -1;
 
     get_ms(timestamp);
     return 0;
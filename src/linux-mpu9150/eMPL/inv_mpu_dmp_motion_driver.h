@@ -49,8 +49,16 @@
 
 #define INV_WXYZ_QUAT       (0x100)
 
+/* Multiple device functions. */
+struct dmp_s;
+struct dmp_s *dmp_state_create(void);
+void dmp_state_destroy(struct dmp_s *state);
+void dmp_state_select(struct dmp_s *state);
+
 /* Set up functions. */
 int dmp_load_motion_driver_firmware(void);
+int dmp_load_motion_driver_firmware_fast(unsigned char verify);
+int dmp_load_motion_driver_firmware_step(unsigned char verify, unsigned short *offset);
 int dmp_set_fifo_rate(unsigned short rate);
 int dmp_get_fifo_rate(unsigned short *rate);
 int dmp_enable_feature(unsigned short mask);
@@ -58,6 +66,7 @@ int dmp_get_enabled_features(unsigned short *mask);
 int dmp_set_interrupt_mode(unsigned char mode);
 int dmp_set_orientation(unsigned short orient);
 int dmp_set_gyro_bias(long *bias);
+int dmp_get_gyro_bias(long *bias);
 int dmp_set_accel_bias(long *bias);
 
 /* Tap functions. */
@@ -93,5 +102,14 @@ int dmp_enable_gyro_cal(unsigned char enable);
 int dmp_read_fifo(short *gyro, short *accel, long *quat,
     unsigned long *timestamp, short *sensors, unsigned char *more);
 
+/* Burst read functions. dmp_read_fifo_burst drains the FIFO in a single I2C
+ * transaction; each packet is then decoded with dmp_parse_packet.
+ */
+int dmp_get_packet_length(unsigned char *length);
+int dmp_read_fifo_burst(unsigned char *data, unsigned short max_packets,
+    unsigned short *packets, unsigned long *timestamp, unsigned char *more);
+int dmp_parse_packet(const unsigned char *fifo_data, short *gyro, short *accel,
+    long *quat, short *sensors);
+
 #endif  /* #ifndef _INV_MPU_DMP_MOTION_DRIVER_H_ */
 
@@ -22,25 +22,74 @@
 //  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <time.h>
-#include <sys/time.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include "linux_glue.h"
 
 #define MAX_WRITE_LEN 511
 
+// Everything tied to one open bus and INT pin. Each device gets its own
+// and selects it with linux_glue_select() before talking to the chip.
+struct linux_glue_s {
+	int i2c_bus;
+	int i2c_fd;
+	int current_slave;
+	int rdwr_supported;
+
+	// Use a single I2C_RDWR repeated-start transaction for register reads.
+	// rdwr_supported is cleared at open time if the adapter can't do plain
+	// I2C messages, in which case we fall back to a write() of the register
+	// followed by a read().
+	int use_rdwr;
+
+	// see linux_set_i2c_retry()
+	int retries;
+	unsigned int retry_us;
+
+	// the adapter can continue a write without a new start, so the
+	// register address and the data can come from separate buffers
+	int nostart_supported;
+
+	// sysfs value file of the GPIO wired to the MPU INT pin, 0 if not used
+	int int_fd;
+
+	// when the last linux_wait_int() saw the edge
+	unsigned long long int_ns;
+
+	// NULL for /dev/i2c-N
+	const struct linux_glue_backend_s *backend;
+
+	// see linux_set_idle_work()
+	int (*idle_work)(void *ctx);
+	void *idle_ctx;
+
+	struct linux_glue_stats_s stats;
+
+	unsigned char txBuff[MAX_WRITE_LEN + 1];
+};
+
+#define GLUE_DEFAULTS	.use_rdwr = 1, .retries = 2, .retry_us = 50
+
 // default is the RPi
-int i2c_bus = 1;
+static struct linux_glue_s default_glue = { .i2c_bus = 1, GLUE_DEFAULTS };
+
+static const struct linux_glue_s glue_defaults = { GLUE_DEFAULTS };
 
-int i2c_fd;
-int current_slave;
-unsigned char txBuff[MAX_WRITE_LEN + 1];
+// per thread so each bus can be driven from its own thread
+static __thread struct linux_glue_s *gs = &default_glue;
+
+// The counters have a single writer, the thread driving the bus, and are
+// read by linux_glue_get_stats() from any thread
+#define STAT_ADD(c, n)	__atomic_store_n(&(c), (c) + (n), __ATOMIC_RELAXED)
+#define STAT_GET(c)		__atomic_load_n(&(c), __ATOMIC_RELAXED)
 
 
 void __no_operation(void) { }
@@ -48,21 +97,36 @@ void __no_operation(void) { }
 int i2c_open()
 {
 	char buff[32];
+	unsigned long funcs;
 
-	if (!i2c_fd) {
-		sprintf(buff, "/dev/i2c-%d", i2c_bus);
+	if (!gs->i2c_fd) {
+		sprintf(buff, "/dev/i2c-%d", gs->i2c_bus);
 
 #ifdef I2C_DEBUG
 		printf("\t\t\ti2c_open() : %s\n", buff);
 #endif
 
-		i2c_fd = open(buff, O_RDWR);
+		gs->i2c_fd = open(buff, O_RDWR);
 
-		if (i2c_fd < 0) {
+		if (gs->i2c_fd < 0) {
 			perror("open(i2c_bus)");
-			i2c_fd = 0;
+			gs->i2c_fd = 0;
 			return -1;
 		}
+
+		gs->rdwr_supported = 0;
+		gs->nostart_supported = 0;
+
+		if (ioctl(gs->i2c_fd, I2C_FUNCS, &funcs) == 0 && (funcs & I2C_FUNC_I2C)) {
+			gs->rdwr_supported = 1;
+			gs->nostart_supported = (funcs & I2C_FUNC_NOSTART) != 0;
+		}
+
+#ifdef I2C_DEBUG
+		printf("\t\t\ti2c_open() : I2C_RDWR %s, I2C_M_NOSTART %s\n", 
+			gs->rdwr_supported ? "supported" : "not supported",
+			gs->nostart_supported ? "supported" : "not supported");
+#endif
 	}
 
 	return 0;
@@ -70,16 +134,16 @@ int i2c_open()
 
 void i2c_close()
 {
-	if (i2c_fd) {
-		close(i2c_fd);
-		i2c_fd = 0;
-		current_slave = 0;
+	if (gs->i2c_fd) {
+		close(gs->i2c_fd);
+		gs->i2c_fd = 0;
+		gs->current_slave = 0;
 	}
 }
 
 int i2c_select_slave(unsigned char slave_addr)
 {
-	if (current_slave == slave_addr)
+	if (gs->current_slave == slave_addr)
 		return 0;
 
 	if (i2c_open())
@@ -89,26 +153,159 @@ int i2c_select_slave(unsigned char slave_addr)
 	printf("\t\ti2c_select_slave(%02X)\n", slave_addr);
 #endif
 
-	if (ioctl(i2c_fd, I2C_SLAVE, slave_addr) < 0) {
+	if (ioctl(gs->i2c_fd, I2C_SLAVE, slave_addr) < 0) {
+#ifdef I2C_DEBUG
 		perror("ioctl(I2C_SLAVE)");
+#endif
 		return -1;
 	}
 
-	current_slave = slave_addr;
+	gs->current_slave = slave_addr;
 
 	return 0;
 }
 
 void linux_set_i2c_bus(int bus)
 {
-	if (i2c_fd)
+	if (gs->i2c_fd)
 		i2c_close();
 
-	i2c_bus = bus;
+	gs->i2c_bus = bus;
+}
+
+void linux_set_i2c_rdwr(int on)
+{
+	gs->use_rdwr = on;
+}
+
+void linux_set_i2c_retry(int retries, unsigned int backoff_us)
+{
+	gs->retries = retries < 0 ? 0 : retries;
+	gs->retry_us = backoff_us;
+}
+
+void linux_set_idle_work(int (*work)(void *ctx), void *ctx)
+{
+	gs->idle_work = work;
+	gs->idle_ctx = ctx;
+}
+
+// Run the idle work for up to num_ms, returns the ms still to sleep
+static unsigned long idle_delay(unsigned long num_ms)
+{
+	int (*work)(void *ctx) = gs->idle_work;
+	unsigned long long now, end;
+	int more = 1;
+
+	if (linux_get_ns(&now))
+		return num_ms;
+
+	end = now + num_ms * 1000000ULL;
+
+	// a delay inside the work just sleeps
+	gs->idle_work = NULL;
+
+	while (more > 0 && now < end) {
+		more = work(gs->idle_ctx);
+
+		if (linux_get_ns(&now))
+			break;
+	}
+
+	// done or failed, it is not called again
+	if (more > 0)
+		gs->idle_work = work;
+
+	if (now >= end)
+		return 0;
+
+	return (unsigned long)((end - now + 999999ULL) / 1000000ULL);
+}
+
+// Wait before retry number tries (from 0), doubling the backoff each time
+void i2c_retry_wait(int tries)
+{
+	struct timespec ts;
+	unsigned long long us;
+
+	STAT_ADD(gs->stats.retries, 1);
+
+	if (gs->retry_us == 0)
+		return;
+
+	STAT_ADD(gs->stats.retry_sleeps, 1);
+
+	us = (unsigned long long)gs->retry_us << (tries < 16 ? tries : 16);
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+
+	nanosleep(&ts, NULL);
+}
+
+int i2c_rdwr_read(unsigned char slave_addr, unsigned char reg_addr,
+       unsigned short length, unsigned char *data)
+{
+	struct i2c_msg msgs[2];
+	struct i2c_rdwr_ioctl_data xfer;
+
+	msgs[0].addr = slave_addr;
+	msgs[0].flags = 0;
+	msgs[0].len = 1;
+	msgs[0].buf = &reg_addr;
+
+	msgs[1].addr = slave_addr;
+	msgs[1].flags = I2C_M_RD;
+	msgs[1].len = length;
+	msgs[1].buf = data;
+
+	xfer.msgs = msgs;
+	xfer.nmsgs = 2;
+
+	if (ioctl(gs->i2c_fd, I2C_RDWR, &xfer) != 2) {
+#ifdef I2C_DEBUG
+		perror("ioctl(I2C_RDWR)");
+#endif
+		return -1;
+	}
+
+	return 0;
+}
+
+// The register address and the caller's data as two messages, the second
+// one continuing the first without a start condition
+int i2c_rdwr_write(unsigned char slave_addr, unsigned char reg_addr,
+       unsigned short length, unsigned char const *data)
+{
+	struct i2c_msg msgs[2];
+	struct i2c_rdwr_ioctl_data xfer;
+
+	msgs[0].addr = slave_addr;
+	msgs[0].flags = 0;
+	msgs[0].len = 1;
+	msgs[0].buf = &reg_addr;
+
+	// the kernel only reads from a write buffer
+	msgs[1].addr = slave_addr;
+	msgs[1].flags = I2C_M_NOSTART;
+	msgs[1].len = length;
+	msgs[1].buf = (unsigned char *)data;
+
+	xfer.msgs = msgs;
+	xfer.nmsgs = 2;
+
+	if (ioctl(gs->i2c_fd, I2C_RDWR, &xfer) != 2) {
+#ifdef I2C_DEBUG
+		perror("ioctl(I2C_RDWR)");
+#endif
+		return -1;
+	}
+
+	return 0;
 }
 
 int linux_i2c_write(unsigned char slave_addr, unsigned char reg_addr,
-       unsigned char length, unsigned char const *data)
+       unsigned short length, unsigned char const *data)
 {
 	int result, i;
 
@@ -131,35 +328,76 @@ int linux_i2c_write(unsigned char slave_addr, unsigned char reg_addr,
 	}
 #endif
 
-	if (i2c_select_slave(slave_addr))
+	STAT_ADD(gs->stats.transfers, 1);
+	STAT_ADD(gs->stats.bytes, length);
+
+	if (gs->backend && gs->backend->i2c_write) {
+		result = gs->backend->i2c_write(gs->backend->ctx, slave_addr, reg_addr, length, data);
+
+		if (result)
+			STAT_ADD(gs->stats.errors, 1);
+
+		return result;
+	}
+
+	if (i2c_open()) {
+		STAT_ADD(gs->stats.errors, 1);
+		return -1;
+	}
+
+	// no copy into txBuff to put the register address in front
+	if (length && gs->use_rdwr && gs->nostart_supported) {
+		result = i2c_rdwr_write(slave_addr, reg_addr, length, data);
+
+		if (result)
+			STAT_ADD(gs->stats.errors, 1);
+
+		return result;
+	}
+
+	if (i2c_select_slave(slave_addr)) {
+		STAT_ADD(gs->stats.errors, 1);
 		return -1;
+	}
 
 	if (length == 0) {
-		result = write(i2c_fd, &reg_addr, 1);
+		result = write(gs->i2c_fd, &reg_addr, 1);
 
 		if (result < 0) {
+#ifdef I2C_DEBUG
 			perror("write:1");
+#endif
+			STAT_ADD(gs->stats.errors, 1);
 			return result;
 		}
 		else if (result != 1) {
+#ifdef I2C_DEBUG
 			printf("Write fail:1 Tried 1 Wrote 0\n");
+#endif
+			STAT_ADD(gs->stats.errors, 1);
 			return -1;
 		}
 	}
 	else {
-		txBuff[0] = reg_addr;
+		gs->txBuff[0] = reg_addr;
 
 		for (i = 0; i < length; i++)
-			txBuff[i+1] = data[i];
+			gs->txBuff[i+1] = data[i];
 
-		result = write(i2c_fd, txBuff, length + 1);
+		result = write(gs->i2c_fd, gs->txBuff, length + 1);
 
 		if (result < 0) {
+#ifdef I2C_DEBUG
 			perror("write:2");
+#endif
+			STAT_ADD(gs->stats.errors, 1);
 			return result;
 		}
 		else if (result < (int)length) {
+#ifdef I2C_DEBUG
 			printf("Write fail:2 Tried %u Wrote %d\n", length, result); 
+#endif
+			STAT_ADD(gs->stats.errors, 1);
 			return -1;
 		}
 	}
@@ -167,47 +405,107 @@ int linux_i2c_write(unsigned char slave_addr, unsigned char reg_addr,
 	return 0;
 }
 
-int linux_i2c_read(unsigned char slave_addr, unsigned char reg_addr,
-       unsigned char length, unsigned char *data)
+int i2c_write_then_read(unsigned char slave_addr, unsigned char reg_addr,
+       unsigned short length, unsigned char *data)
 {
 	int tries, result, total;
 
-#ifdef I2C_DEBUG
-	int i;
+	// not through linux_i2c_write(), the read is counted once by the caller
+	if (i2c_select_slave(slave_addr))
+		return -1;
 
-	printf("\tlinux_i2c_read(%02X, %02X, %u, ...)\n", slave_addr, reg_addr, length);
+	if (write(gs->i2c_fd, &reg_addr, 1) != 1) {
+#ifdef I2C_DEBUG
+		perror("write:1");
 #endif
-
-	if (linux_i2c_write(slave_addr, reg_addr, 0, NULL))
 		return -1;
+	}
 
 	total = 0;
 	tries = 0;
 
-	while (total < length && tries < 5) {
-		result = read(i2c_fd, data + total, length - total);
+	// a short read picks up where it stopped, the register pointer has
+	// already moved on (or stays put on FIFO_R_W)
+	while (total < length) {
+		result = read(gs->i2c_fd, data + total, length - total);
 
 		if (result < 0) {
+#ifdef I2C_DEBUG
 			perror("read");
+#endif
 			break;
 		}
 
 		total += result;
 
-		if (total == length)
+		if (total == length || tries >= gs->retries)
 			break;
 
-		tries++;		
-		linux_delay_ms(10);
+		i2c_retry_wait(tries++);
 	}
 
 	if (total < length)
 		return -1;
 
+	return 0;
+}
+
+int linux_i2c_read(unsigned char slave_addr, unsigned char reg_addr,
+       unsigned short length, unsigned char *data)
+{
+	int result, tries;
+
+#ifdef I2C_DEBUG
+	int i;
+
+	printf("\tlinux_i2c_read(%02X, %02X, %u, ...)\n", slave_addr, reg_addr, length);
+#endif
+
+	STAT_ADD(gs->stats.transfers, 1);
+	STAT_ADD(gs->stats.bytes, length);
+
+	if (gs->backend && gs->backend->i2c_read) {
+		for (tries = 0; ; tries++) {
+			result = gs->backend->i2c_read(gs->backend->ctx, slave_addr, reg_addr, length, data);
+
+			if (result == 0 || tries >= gs->retries)
+				break;
+
+			i2c_retry_wait(tries);
+		}
+	}
+	else {
+		if (i2c_open()) {
+			STAT_ADD(gs->stats.errors, 1);
+			return -1;
+		}
+
+		if (gs->use_rdwr && gs->rdwr_supported) {
+			// a lost FIFO byte shows up as a corrupt DMP packet, which resets it
+			for (tries = 0; ; tries++) {
+				result = i2c_rdwr_read(slave_addr, reg_addr, length, data);
+
+				if (result == 0 || tries >= gs->retries)
+					break;
+
+				i2c_retry_wait(tries);
+			}
+		}
+		else {
+			// short reads are retried inside
+			result = i2c_write_then_read(slave_addr, reg_addr, length, data);
+		}
+	}
+
+	if (result) {
+		STAT_ADD(gs->stats.errors, 1);
+		return -1;
+	}
+
 #ifdef I2C_DEBUG
-	printf("\tLeaving linux_i2c_read(), read %d bytes: ", total);
+	printf("\tLeaving linux_i2c_read(), read %d bytes: ", length);
 
-	for (i = 0; i < total; i++)
+	for (i = 0; i < length; i++)
 		printf("%02X ", data[i]); 
 
 	printf("\n");
@@ -216,30 +514,348 @@ int linux_i2c_read(unsigned char slave_addr, unsigned char reg_addr,
 	return 0;
 }
 
+int linux_i2c_transfer(unsigned char slave_addr, int count, struct linux_i2c_op_s *ops)
+{
+	struct i2c_msg msgs[2 * LINUX_I2C_MAX_OPS];
+	struct i2c_rdwr_ioctl_data xfer;
+	int i, n, used, result, rdwr;
+
+	if (count < 1 || count > LINUX_I2C_MAX_OPS)
+		return -1;
+
+	rdwr = 0;
+
+	if (!gs->backend && gs->use_rdwr) {
+		if (i2c_open()) {
+			STAT_ADD(gs->stats.errors, 1);
+			return -1;
+		}
+
+		rdwr = gs->rdwr_supported;
+	}
+
+	if (!rdwr) {
+		for (i = 0; i < count; i++) {
+			if (ops[i].read)
+				result = linux_i2c_read(slave_addr, ops[i].reg_addr, ops[i].length, ops[i].data);
+			else
+				result = linux_i2c_write(slave_addr, ops[i].reg_addr, ops[i].length, ops[i].data);
+
+			if (result)
+				return -1;
+		}
+
+		return 0;
+	}
+
+	STAT_ADD(gs->stats.transfers, count);
+
+	for (i = 0; i < count; i++)
+		STAT_ADD(gs->stats.bytes, ops[i].length);
+
+	for (i = 0, n = 0, used = 0; i < count; i++) {
+		msgs[n].addr = slave_addr;
+		msgs[n].flags = 0;
+
+		if (ops[i].read || ops[i].length == 0 || gs->nostart_supported) {
+			msgs[n].len = 1;
+			msgs[n].buf = &ops[i].reg_addr;
+			n++;
+
+			if (ops[i].length == 0)
+				continue;
+
+			msgs[n].addr = slave_addr;
+			msgs[n].flags = ops[i].read ? I2C_M_RD : I2C_M_NOSTART;
+			msgs[n].len = ops[i].length;
+			msgs[n].buf = ops[i].data;
+			n++;
+		}
+		else {
+			// no I2C_M_NOSTART, the address has to go in front of the data
+			if (used + 1 + ops[i].length > (int)sizeof(gs->txBuff)) {
+				printf("Max write length exceeded in linux_i2c_transfer()\n");
+				return -1;
+			}
+
+			gs->txBuff[used] = ops[i].reg_addr;
+			memcpy(gs->txBuff + used + 1, ops[i].data, ops[i].length);
+
+			msgs[n].len = 1 + ops[i].length;
+			msgs[n].buf = gs->txBuff + used;
+			n++;
+
+			used += 1 + ops[i].length;
+		}
+	}
+
+	xfer.msgs = msgs;
+	xfer.nmsgs = n;
+
+	if (ioctl(gs->i2c_fd, I2C_RDWR, &xfer) != n) {
+#ifdef I2C_DEBUG
+		perror("ioctl(I2C_RDWR)");
+#endif
+		STAT_ADD(gs->stats.errors, 1);
+		return -1;
+	}
+
+	return 0;
+}
+
+int gpio_write_attr(unsigned int pin, const char *attr, const char *val)
+{
+	char buff[64];
+	int fd, len, result;
+
+	if (attr)
+		sprintf(buff, "/sys/class/gpio/gpio%u/%s", pin, attr);
+	else
+		strcpy(buff, "/sys/class/gpio/export");
+
+	fd = open(buff, O_WRONLY);
+
+	if (fd < 0) {
+		perror(buff);
+		return -1;
+	}
+
+	len = strlen(val);
+	result = write(fd, val, len);
+	close(fd);
+
+	// exporting an already exported pin fails with EBUSY
+	if (result != len && !(attr == NULL && errno == EBUSY)) {
+		perror(buff);
+		return -1;
+	}
+
+	return 0;
+}
+
+int linux_reg_int_cb(struct int_param_s *int_param)
+{
+	char buff[64];
+
+	linux_int_close();
+
+	sprintf(buff, "%u", int_param->pin);
+
+	if (gpio_write_attr(int_param->pin, NULL, buff))
+		return -1;
+
+	if (gpio_write_attr(int_param->pin, "direction", "in"))
+		return -1;
+
+	// mpu_init() leaves the INT pin configured active low
+	if (gpio_write_attr(int_param->pin, "edge", "falling"))
+		return -1;
+
+	sprintf(buff, "/sys/class/gpio/gpio%u/value", int_param->pin);
+
+	gs->int_fd = open(buff, O_RDONLY | O_NONBLOCK);
+
+	if (gs->int_fd < 0) {
+		perror("open(gpio value)");
+		gs->int_fd = 0;
+		return -1;
+	}
+
+	// consume the current state so the first poll() waits for an edge
+	read(gs->int_fd, buff, sizeof(buff));
+
+	return 0;
+}
+
+void linux_int_close()
+{
+	if (gs->int_fd) {
+		close(gs->int_fd);
+		gs->int_fd = 0;
+	}
+}
+
+int linux_int_enabled()
+{
+	return gs->int_fd != 0;
+}
+
+unsigned long long linux_int_time_ns()
+{
+	return gs->int_ns;
+}
+
+int linux_wait_int(int timeout_ms)
+{
+	struct pollfd pfd;
+	char buff[8];
+	int result;
+
+	if (!gs->int_fd)
+		return -1;
+
+	pfd.fd = gs->int_fd;
+	pfd.events = POLLPRI | POLLERR;
+	pfd.revents = 0;
+
+	do {
+		result = poll(&pfd, 1, timeout_ms);
+	} while (result < 0 && errno == EINTR);
+
+	if (result < 0) {
+		perror("poll(gpio)");
+		return -1;
+	}
+
+	if (result == 0)
+		return 0;
+
+	// as close to the edge as userland gets when we were already waiting
+	linux_get_ns(&gs->int_ns);
+
+	// rearm, sysfs only reports the next edge after the value is read
+	lseek(gs->int_fd, 0, SEEK_SET);
+	read(gs->int_fd, buff, sizeof(buff));
+
+	return 1;
+}
+
 int linux_delay_ms(unsigned long num_ms)
 {
 	struct timespec ts;
 
+	if (gs->idle_work) {
+		num_ms = idle_delay(num_ms);
+
+		if (num_ms == 0)
+			return 0;
+	}
+
+	if (gs->backend && gs->backend->delay_ms)
+		return gs->backend->delay_ms(gs->backend->ctx, num_ms);
+
 	ts.tv_sec = num_ms / 1000;
 	ts.tv_nsec = (num_ms % 1000) * 1000000;
 
 	return nanosleep(&ts, NULL);
 }
 
+// CLOCK_MONOTONIC so sample times don't jump when NTP steps the clock
 int linux_get_ms(unsigned long *count)
 {
-	struct timeval t;
+	unsigned long long ns;
 
 	if (!count)
 		return -1;
 
-	if (gettimeofday(&t, NULL) < 0) {
-		perror("gettimeofday");
+	if (linux_get_ns(&ns))
+		return -1;
+
+	*count = (unsigned long)(ns / 1000000ULL);
+
+	return 0;
+}
+
+int linux_get_ns(unsigned long long *ns)
+{
+	struct timespec t;
+
+	if (!ns)
+		return -1;
+
+	if (gs->backend && gs->backend->get_ns)
+		return gs->backend->get_ns(gs->backend->ctx, ns);
+
+	if (clock_gettime(CLOCK_MONOTONIC, &t) < 0) {
+		perror("clock_gettime");
 		return -1;
 	}
 
-	*count = (t.tv_sec * 1000) + (t.tv_usec / 1000);	
+	*ns = (t.tv_sec * 1000000000ULL) + t.tv_nsec;
 
 	return 0;
 }
 
+// A backend clock only moves through delay_ms, so sleep there in whole ms
+int linux_sleep_until_ns(unsigned long long ns)
+{
+	struct timespec t;
+	unsigned long long now;
+	int result;
+
+	if (gs->backend && gs->backend->get_ns) {
+		if (linux_get_ns(&now))
+			return -1;
+
+		if (now >= ns)
+			return 0;
+
+		return linux_delay_ms((unsigned long)((ns - now + 999999ULL) / 1000000ULL));
+	}
+
+	t.tv_sec = ns / 1000000000ULL;
+	t.tv_nsec = ns % 1000000000ULL;
+
+	do {
+		result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+	} while (result == EINTR);
+
+	return result ? -1 : 0;
+}
+
+
+struct linux_glue_s *linux_glue_create(int bus)
+{
+	struct linux_glue_s *glue;
+
+	glue = (struct linux_glue_s *)malloc(sizeof(struct linux_glue_s));
+
+	if (glue) {
+		*glue = glue_defaults;
+		glue->i2c_bus = bus;
+	}
+
+	return glue;
+}
+
+void linux_glue_destroy(struct linux_glue_s *glue)
+{
+	struct linux_glue_s *prev;
+
+	if (!glue || glue == &default_glue)
+		return;
+
+	prev = gs;
+	gs = glue;
+	linux_int_close();
+	i2c_close();
+	gs = (prev == glue) ? &default_glue : prev;
+
+	free(glue);
+}
+
+void linux_glue_set_backend(struct linux_glue_s *glue,
+	const struct linux_glue_backend_s *backend)
+{
+	if (!glue)
+		glue = &default_glue;
+
+	glue->backend = backend;
+}
+
+void linux_glue_get_stats(struct linux_glue_s *glue, struct linux_glue_stats_s *stats)
+{
+	if (!glue)
+		glue = &default_glue;
+
+	stats->transfers = STAT_GET(glue->stats.transfers);
+	stats->bytes = STAT_GET(glue->stats.bytes);
+	stats->errors = STAT_GET(glue->stats.errors);
+	stats->retries = STAT_GET(glue->stats.retries);
+	stats->retry_sleeps = STAT_GET(glue->stats.retry_sleeps);
+}
+
+void linux_glue_select(struct linux_glue_s *glue)
+{
+	gs = glue ? glue : &default_glue;
+}
@@ -32,11 +32,7 @@
 #define MIN_I2C_BUS 0
 #define MAX_I2C_BUS 7
 
-static inline int reg_int_cb(struct int_param_s *int_param)
-{
-	return 0;
-}
-
+#define reg_int_cb	linux_reg_int_cb
 #define i2c_write	linux_i2c_write
 #define i2c_read	linux_i2c_read
 #define delay_ms	linux_delay_ms
@@ -47,16 +43,119 @@ static inline int reg_int_cb(struct int_param_s *int_param)
 
 void __no_operation(void);
 
+// Per device bus state. The functions below act on the state selected
+// for the calling thread, a NULL select goes back to the built-in default
+// used by the single device API.
+struct linux_glue_s;
+
+struct linux_glue_s *linux_glue_create(int bus);
+void linux_glue_destroy(struct linux_glue_s *glue);
+void linux_glue_select(struct linux_glue_s *glue);
+
 void linux_set_i2c_bus(int bus);
 
+// Bus counters of one glue. Written only by the thread driving the bus.
+// linux_glue_get_stats() may run on any thread and can be a transfer behind.
+struct linux_glue_stats_s {
+	unsigned long transfers;
+	unsigned long bytes;
+	unsigned long errors;
+
+	// extra attempts after a short or failed read, and how many of
+	// those waited first, see linux_set_i2c_retry()
+	unsigned long retries;
+	unsigned long retry_sleeps;
+};
+
+// NULL for the default state
+void linux_glue_get_stats(struct linux_glue_s *glue, struct linux_glue_stats_s *stats);
+
+// Where the bus transfers and the clock go. The default is /dev/i2c-N
+// and CLOCK_MONOTONIC, a NULL member keeps the default for that call.
+// ctx is handed back to every call, see mpu_sim.h for a register level
+// MPU-9150 model that plugs in here.
+struct linux_glue_backend_s {
+	void *ctx;
+
+	int (*i2c_write)(void *ctx, unsigned char slave_addr, unsigned char reg_addr,
+		unsigned short length, unsigned char const *data);
+
+	int (*i2c_read)(void *ctx, unsigned char slave_addr, unsigned char reg_addr,
+		unsigned short length, unsigned char *data);
+
+	// linux_get_ms() is derived from this
+	int (*get_ns)(void *ctx, unsigned long long *ns);
+
+	int (*delay_ms)(void *ctx, unsigned long num_ms);
+};
+
+// A NULL glue sets the default state's backend, a NULL backend goes back
+// to the real bus. The backend must outlive the glue.
+void linux_glue_set_backend(struct linux_glue_s *glue,
+	const struct linux_glue_backend_s *backend);
+
+// The settings below apply to the selected state, like linux_set_i2c_bus()
+
+// on = 0 forces the separate write()/read() path for register reads
+void linux_set_i2c_rdwr(int on);
+
+// A short read, or a failed I2C_RDWR or backend read, is tried again up
+// to retries times before linux_i2c_read() gives up. The first retry
+// waits backoff_us and each one after that twice as long, 0 retries at
+// once. The default is 2 retries from 50 us, a read that still fails
+// returns -1 well inside a sample period. Writes are never retried, a
+// repeated FIFO or DMP memory write would not be the same write.
+void linux_set_i2c_retry(int retries, unsigned int backoff_us);
+
+// While set, linux_delay_ms() spends its time calling work(ctx) and only
+// sleeps what is left, so waits for the sensor to settle can carry other
+// bus traffic, such as loading the DMP firmware. work returns > 0 while
+// it has more to do, after 0 or an error it is dropped. Each call should
+// be short, a delay can run over by one. NULL work to stop.
+void linux_set_idle_work(int (*work)(void *ctx), void *ctx);
+
 int linux_i2c_write(unsigned char slave_addr, unsigned char reg_addr,
-       unsigned char length, unsigned char const *data);
+       unsigned short length, unsigned char const *data);
 
 int linux_i2c_read(unsigned char slave_addr, unsigned char reg_addr,
-       unsigned char length, unsigned char *data);
+       unsigned short length, unsigned char *data);
+
+// One step of linux_i2c_transfer(), the register address followed by
+// length bytes written from or read into data
+struct linux_i2c_op_s {
+	unsigned char reg_addr;
+	unsigned char read;
+	unsigned short length;
+	unsigned char *data;
+};
+
+#define LINUX_I2C_MAX_OPS 8
+
+// Run up to LINUX_I2C_MAX_OPS register accesses to one slave as a single
+// I2C_RDWR transaction, a repeated start between them. Where the adapter
+// can do I2C_M_NOSTART the data is sent straight from the caller's buffer.
+// Falls back to one linux_i2c_write()/read() per op without I2C_RDWR. Not
+// retried, since it may hold writes.
+int linux_i2c_transfer(unsigned char slave_addr, int count, struct linux_i2c_op_s *ops);
  
+// The MPU INT pin is watched through the sysfs GPIO interface.
+// linux_wait_int() returns 1 on an interrupt, 0 on timeout, -1 on error.
+int linux_reg_int_cb(struct int_param_s *int_param);
+void linux_int_close();
+int linux_int_enabled();
+int linux_wait_int(int timeout_ms);
+
+// CLOCK_MONOTONIC time the last linux_wait_int() returned 1
+unsigned long long linux_int_time_ns();
+
 int linux_delay_ms(unsigned long num_ms);
 int linux_get_ms(unsigned long *count);
 
+// CLOCK_MONOTONIC nanoseconds, the clock linux_get_ms() also runs on
+int linux_get_ns(unsigned long long *ns);
+
+// Block until linux_get_ns() reaches ns, at once if it already has
+int linux_sleep_until_ns(unsigned long long ns);
+
 #endif /* ifndef LINUX_GLUE_H */
 
@@ -0,0 +1,313 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+#include "linux_spi.h"
+
+// the MPU at either AD0 address, anything else is on its auxiliary bus
+#define SPI_MPU_ADDR_LOW		0x68
+#define SPI_MPU_ADDR_HIGH		0x69
+
+// MPU-6500 register map
+#define REG_I2C_SLV4_ADDR		0x31
+#define REG_I2C_SLV4_DI			0x35
+#define REG_I2C_MST_STATUS		0x36
+#define REG_INT_STATUS			0x3A
+#define REG_EXT_SENS_DATA_23	0x60
+#define REG_USER_CTRL			0x6A
+#define REG_MEM_R_W				0x6F
+#define REG_FIFO_COUNT_H		0x72
+#define REG_FIFO_R_W			0x74
+
+#define BIT_SPI_READ			0x80
+#define BIT_I2C_IF_DIS			0x10
+#define BIT_I2C_MST_EN			0x20
+#define BIT_SLV4_EN				0x80
+#define BIT_SLV4_DONE			0x40
+#define BIT_SLV4_NACK			0x10
+
+// I2C_MST_STATUS reads at 1 MHz while slave 4 runs at ~400 kHz, a byte
+// takes a few of them
+#define SPI_SLV4_POLLS			200
+
+struct linux_spi_s {
+	int fd;
+	unsigned int read_hz;
+	struct linux_glue_backend_s backend;
+
+	unsigned char tx[LINUX_SPI_MAX_LENGTH + 1];
+	unsigned char rx[LINUX_SPI_MAX_LENGTH + 1];
+};
+
+static int spi_write(void *ctx, unsigned char slave_addr, unsigned char reg_addr,
+	unsigned short length, unsigned char const *data);
+static int spi_read(void *ctx, unsigned char slave_addr, unsigned char reg_addr,
+	unsigned short length, unsigned char *data);
+static int transfer(linux_spi_t *spi, unsigned char first, unsigned short length,
+	unsigned char const *out, unsigned char *in, unsigned int hz);
+static int reg_write(linux_spi_t *spi, unsigned char reg, unsigned short length,
+	unsigned char const *data);
+static int reg_read(linux_spi_t *spi, unsigned char reg, unsigned short length,
+	unsigned char *data);
+static int slv4_access(linux_spi_t *spi, unsigned char slave_addr, unsigned char reg,
+	unsigned char *val, int read);
+static int fast_read(unsigned char reg, unsigned short length);
+static int fixed_reg(unsigned char reg);
+
+linux_spi_t *linux_spi_create(int bus, int cs, unsigned int read_hz)
+{
+	linux_spi_t *spi;
+	char buff[32];
+	unsigned char mode = SPI_MODE_3, bits = 8;
+
+	if (read_hz == 0 || read_hz > LINUX_SPI_MAX_HZ)
+		read_hz = LINUX_SPI_MAX_HZ;
+
+	spi = (linux_spi_t *)calloc(1, sizeof(linux_spi_t));
+
+	if (!spi)
+		return NULL;
+
+	sprintf(buff, "/dev/spidev%d.%d", bus, cs);
+
+	spi->fd = open(buff, O_RDWR);
+
+	if (spi->fd < 0) {
+		perror("open(spidev)");
+		free(spi);
+		return NULL;
+	}
+
+	if (ioctl(spi->fd, SPI_IOC_WR_MODE, &mode) < 0
+			|| ioctl(spi->fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0
+			|| ioctl(spi->fd, SPI_IOC_WR_MAX_SPEED_HZ, &read_hz) < 0) {
+		perror("ioctl(spidev)");
+		close(spi->fd);
+		free(spi);
+		return NULL;
+	}
+
+	spi->read_hz = read_hz;
+
+	spi->backend.ctx = spi;
+	spi->backend.i2c_write = spi_write;
+	spi->backend.i2c_read = spi_read;
+
+	return spi;
+}
+
+void linux_spi_destroy(linux_spi_t *spi)
+{
+	if (!spi)
+		return;
+
+	close(spi->fd);
+	free(spi);
+}
+
+const struct linux_glue_backend_s *linux_spi_backend(linux_spi_t *spi)
+{
+	return &spi->backend;
+}
+
+int spi_write(void *ctx, unsigned char slave_addr, unsigned char reg_addr,
+	unsigned short length, unsigned char const *data)
+{
+	linux_spi_t *spi = (linux_spi_t *)ctx;
+	unsigned char val;
+	int i;
+
+	if (slave_addr == SPI_MPU_ADDR_LOW || slave_addr == SPI_MPU_ADDR_HIGH)
+		return reg_write(spi, reg_addr, length, data);
+
+	for (i = 0; i < length; i++) {
+		val = data[i];
+
+		if (slv4_access(spi, slave_addr, reg_addr + i, &val, 0))
+			return -1;
+	}
+
+	return 0;
+}
+
+int spi_read(void *ctx, unsigned char slave_addr, unsigned char reg_addr,
+	unsigned short length, unsigned char *data)
+{
+	linux_spi_t *spi = (linux_spi_t *)ctx;
+	int i;
+
+	if (slave_addr == SPI_MPU_ADDR_LOW || slave_addr == SPI_MPU_ADDR_HIGH)
+		return reg_read(spi, reg_addr, length, data);
+
+	for (i = 0; i < length; i++) {
+		if (slv4_access(spi, slave_addr, reg_addr + i, &data[i], 1))
+			return -1;
+	}
+
+	return 0;
+}
+
+// One full duplex transfer, the register byte then length bytes out of
+// out, or zeros, with what came back stored in in
+int transfer(linux_spi_t *spi, unsigned char first, unsigned short length,
+	unsigned char const *out, unsigned char *in, unsigned int hz)
+{
+	struct spi_ioc_transfer xfer;
+
+	spi->tx[0] = first;
+
+	if (out)
+		memcpy(spi->tx + 1, out, length);
+	else
+		memset(spi->tx + 1, 0, length);
+
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.tx_buf = (unsigned long)spi->tx;
+	xfer.rx_buf = (unsigned long)spi->rx;
+	xfer.len = length + 1;
+	xfer.speed_hz = hz;
+	xfer.bits_per_word = 8;
+
+	if (ioctl(spi->fd, SPI_IOC_MESSAGE(1), &xfer) != (int)xfer.len)
+		return -1;
+
+	if (in)
+		memcpy(in, spi->rx + 1, length);
+
+	return 0;
+}
+
+// Writes are all 1 MHz. USER_CTRL always keeps the I2C interface off,
+// whatever the driver writes to it.
+int reg_write(linux_spi_t *spi, unsigned char reg, unsigned short length,
+	unsigned char const *data)
+{
+	unsigned char buff[LINUX_SPI_MAX_LENGTH];
+	unsigned short n;
+
+	while (length > 0) {
+		n = length > LINUX_SPI_MAX_LENGTH ? LINUX_SPI_MAX_LENGTH : length;
+
+		memcpy(buff, data, n);
+
+		if (!fixed_reg(reg) && reg <= REG_USER_CTRL && reg + n > REG_USER_CTRL)
+			buff[REG_USER_CTRL - reg] |= BIT_I2C_IF_DIS;
+
+		if (transfer(spi, reg, n, buff, NULL, LINUX_SPI_REG_HZ))
+			return -1;
+
+		data += n;
+		length -= n;
+
+		if (!fixed_reg(reg))
+			reg += n;
+	}
+
+	return 0;
+}
+
+int reg_read(linux_spi_t *spi, unsigned char reg, unsigned short length,
+	unsigned char *data)
+{
+	unsigned short n;
+
+	while (length > 0) {
+		n = length > LINUX_SPI_MAX_LENGTH ? LINUX_SPI_MAX_LENGTH : length;
+
+		if (transfer(spi, reg | BIT_SPI_READ, n, NULL, data,
+				fast_read(reg, n) ? spi->read_hz : LINUX_SPI_REG_HZ))
+			return -1;
+
+		data += n;
+		length -= n;
+
+		if (!fixed_reg(reg))
+			reg += n;
+	}
+
+	return 0;
+}
+
+// One byte to or from the auxiliary bus through slave 4. The driver turns
+// the I2C master off for bypass mode, it is switched back on around the
+// transaction since over SPI bypass leads nowhere.
+int slv4_access(linux_spi_t *spi, unsigned char slave_addr, unsigned char reg,
+	unsigned char *val, int read)
+{
+	unsigned char cfg[4], user_ctrl, on, status;
+	int i, result = -1;
+
+	if (reg_read(spi, REG_USER_CTRL, 1, &user_ctrl))
+		return -1;
+
+	on = user_ctrl | BIT_I2C_MST_EN;
+
+	if (on != user_ctrl && reg_write(spi, REG_USER_CTRL, 1, &on))
+		return -1;
+
+	cfg[0] = slave_addr | (read ? 0x80 : 0);
+	cfg[1] = reg;
+	cfg[2] = read ? 0 : *val;
+	cfg[3] = BIT_SLV4_EN;
+
+	if (reg_write(spi, REG_I2C_SLV4_ADDR, sizeof(cfg), cfg) == 0) {
+		for (i = 0; i < SPI_SLV4_POLLS; i++) {
+			if (reg_read(spi, REG_I2C_MST_STATUS, 1, &status) || (status & BIT_SLV4_NACK))
+				break;
+
+			if (status & BIT_SLV4_DONE) {
+				result = read ? reg_read(spi, REG_I2C_SLV4_DI, 1, val) : 0;
+				break;
+			}
+		}
+	}
+
+	if (on != user_ctrl && reg_write(spi, REG_USER_CTRL, 1, &user_ctrl))
+		return -1;
+
+	return result;
+}
+
+// The interrupt status, sensor data and FIFO registers are good for 20 MHz
+int fast_read(unsigned char reg, unsigned short length)
+{
+	if (reg == REG_FIFO_R_W)
+		return 1;
+
+	if (reg >= REG_INT_STATUS && reg + length <= REG_EXT_SENS_DATA_23 + 1)
+		return 1;
+
+	return reg >= REG_FIFO_COUNT_H && reg + length <= REG_FIFO_R_W + 1;
+}
+
+// The FIFO and DMP memory ports stay put, the data behind them moves
+int fixed_reg(unsigned char reg)
+{
+	return reg == REG_FIFO_R_W || reg == REG_MEM_R_W;
+}
@@ -0,0 +1,59 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef LINUX_SPI_H
+#define LINUX_SPI_H
+
+#include "linux_glue.h"
+
+// spidev transport for the MPU-9250 and MPU-6500, which also talk SPI, behind
+// the linux_glue backend interface. The MPU-9150 is I2C only. Build the
+// library with -DMPU9250 in place of -DMPU9150 -DAK8975_SECONDARY and hand
+// linux_spi_backend() to mpu9150_set_backend() before mpu9150_init().
+//
+// Register accesses for the MPU itself, at 0x68 or 0x69, go straight out
+// on /dev/spidevB.C. The chip takes 1 MHz for every register and up to
+// 20 MHz for the sensor, interrupt status and FIFO reads, so those run at
+// read_hz and the rest at LINUX_SPI_REG_HZ. A FIFO burst is one transfer,
+// the 400 kHz I2C limit on the raw sample rate goes away.
+//
+// Over SPI the auxiliary bus can't be bypassed to the host, so accesses
+// to any other address, the AK8963 compass, are run a byte at a time
+// through the chip's I2C master slave 4. The primary I2C interface is
+// kept disabled as the datasheet asks.
+
+#define LINUX_SPI_REG_HZ		1000000
+#define LINUX_SPI_MAX_HZ		20000000
+
+// longest single transfer, a whole FIFO with the register byte
+#define LINUX_SPI_MAX_LENGTH	1024
+
+typedef struct linux_spi_s linux_spi_t;
+
+// /dev/spidev<bus>.<cs>, read_hz 0 for LINUX_SPI_MAX_HZ
+linux_spi_t *linux_spi_create(int bus, int cs, unsigned int read_hz);
+void linux_spi_destroy(linux_spi_t *spi);
+
+const struct linux_glue_backend_s *linux_spi_backend(linux_spi_t *spi);
+
+#endif /* LINUX_SPI_H */
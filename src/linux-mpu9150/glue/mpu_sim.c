@@ -0,0 +1,825 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "mpu_sim.h"
+
+#define SIM_NUM_REGS		128
+#define SIM_MEM_SIZE		4096
+#define SIM_FIFO_SIZE		1024
+
+// samples made up in one go after a long gap, more than fill the FIFO
+#define SIM_MAX_CATCHUP		2048
+
+// the end of a transfer is busy waited for, sleeping wakes up too late
+#define SIM_SPIN_NS			100000ULL
+
+#define AKM_ADDR			0x0C
+#define AKM_NUM_REGS		0x13
+
+// MPU-6050 registers
+#define REG_ACCEL_OFFS		0x06
+#define REG_RATE_DIV		0x19
+#define REG_LPF				0x1A
+#define REG_GYRO_CFG		0x1B
+#define REG_ACCEL_CFG		0x1C
+#define REG_FIFO_EN			0x23
+#define REG_S0_ADDR			0x25
+#define REG_S4_CTRL			0x34
+#define REG_INT_PIN_CFG		0x37
+#define REG_DMP_INT_STATUS	0x39
+#define REG_INT_STATUS		0x3A
+#define REG_RAW_ACCEL		0x3B
+#define REG_TEMP			0x41
+#define REG_RAW_GYRO		0x43
+#define REG_EXT_SENS_DATA	0x49
+#define REG_S0_DO			0x63
+#define REG_DELAY_CTRL		0x67
+#define REG_USER_CTRL		0x6A
+#define REG_PWR_MGMT_1		0x6B
+#define REG_BANK_SEL		0x6D
+#define REG_MEM_START_ADDR	0x6E
+#define REG_MEM_R_W			0x6F
+#define REG_FIFO_COUNT_H	0x72
+#define REG_FIFO_COUNT_L	0x73
+#define REG_FIFO_R_W		0x74
+#define REG_WHO_AM_I		0x75
+
+#define BIT_DMP_EN			0x80
+#define BIT_FIFO_EN			0x40
+#define BIT_AUX_IF_EN		0x20
+#define BIT_DMP_RST			0x08
+#define BIT_FIFO_RST		0x04
+#define BIT_RESET			0x80
+#define BIT_SLEEP			0x40
+#define BIT_BYPASS_EN		0x02
+#define BIT_SLAVE_EN		0x80
+#define BIT_I2C_READ		0x80
+#define BIT_FIFO_OVERFLOW	0x10
+#define BIT_DMP_INT			0x02
+#define BIT_DATA_RDY		0x01
+
+// DMP memory the motion driver writes its feature switches to
+#define DMP_D_0_22			(22 + 512)
+#define DMP_CFG_LP_QUAT		2712
+#define DMP_CFG_8			2718
+#define DMP_CFG_15			2727
+#define DMP_CFG_27			2742
+
+// AK8975 registers
+#define AKM_WIA				0x00
+#define AKM_ST1				0x02
+#define AKM_HXL				0x03
+#define AKM_ST2				0x09
+#define AKM_CNTL			0x0A
+#define AKM_ASAX			0x10
+
+#define AKM_MODE_SINGLE		0x01
+#define AKM_MODE_SELF_TEST	0x08
+
+#define AKM_UT_PER_LSB		0.3f
+
+struct mpu_sim_s {
+	mpu_sim_config_t cfg;
+	struct linux_glue_backend_s backend;
+	mpu_sim_stats_t stats;
+
+	unsigned char reg[SIM_NUM_REGS];
+	unsigned char mem[SIM_MEM_SIZE];
+
+	unsigned char fifo[SIM_FIFO_SIZE];
+	int fifo_head;
+	int fifo_count;
+
+	unsigned char akm[AKM_NUM_REGS];
+
+	// the model's clock runs ahead of CLOCK_MONOTONIC by skipped_ns
+	unsigned long long start_ns;
+	unsigned long long skipped_ns;
+
+	// when the next sample is due, 0 while the chip sleeps
+	unsigned long long next_sample_ns;
+
+	unsigned long dmp_count;
+	unsigned long aux_count;
+
+	float quat[4];
+	unsigned int rand_state;
+};
+
+static unsigned long long mono_ns(void);
+static unsigned long long sim_now(mpu_sim_t *sim);
+static void sim_reset(mpu_sim_t *sim);
+static void sim_advance(mpu_sim_t *sim);
+static void sim_sample(mpu_sim_t *sim, unsigned long long t);
+static void sim_bus_time(mpu_sim_t *sim, unsigned long long start, int bytes);
+static int sim_begin(mpu_sim_t *sim, unsigned char slave_addr);
+static void reg_write(mpu_sim_t *sim, unsigned char r, unsigned char val);
+static unsigned char reg_read(mpu_sim_t *sim, unsigned char r);
+static void akm_measure(mpu_sim_t *sim);
+static void akm_write(mpu_sim_t *sim, unsigned char r, unsigned char val);
+static unsigned char akm_read(mpu_sim_t *sim, unsigned char r);
+static void fifo_push(mpu_sim_t *sim, const unsigned char *data, int len);
+
+static int sim_i2c_write(void *ctx, unsigned char slave_addr, unsigned char reg_addr,
+	unsigned short length, unsigned char const *data);
+static int sim_i2c_read(void *ctx, unsigned char slave_addr, unsigned char reg_addr,
+	unsigned short length, unsigned char *data);
+static int sim_get_ns(void *ctx, unsigned long long *ns);
+static int sim_delay_ms(void *ctx, unsigned long num_ms);
+
+void mpu_sim_default_config(mpu_sim_config_t *cfg)
+{
+	memset(cfg, 0, sizeof(mpu_sim_config_t));
+
+	cfg->bus_hz = 400000;
+	cfg->latency_us = 50;
+
+	// 10 deg/s
+	cfg->gyro_rate[2] = 0.1745f;
+
+	// roughly mid latitudes, pointing down into the ground
+	cfg->field[0] = 20.0f;
+	cfg->field[2] = -45.0f;
+
+	cfg->seed = 1;
+}
+
+mpu_sim_t *mpu_sim_create(const mpu_sim_config_t *cfg)
+{
+	mpu_sim_t *sim;
+
+	sim = (mpu_sim_t *)calloc(1, sizeof(mpu_sim_t));
+
+	if (!sim)
+		return NULL;
+
+	if (cfg)
+		sim->cfg = *cfg;
+	else
+		mpu_sim_default_config(&sim->cfg);
+
+	sim->backend.ctx = sim;
+	sim->backend.i2c_write = sim_i2c_write;
+	sim->backend.i2c_read = sim_i2c_read;
+	sim->backend.get_ns = sim_get_ns;
+	sim->backend.delay_ms = sim_delay_ms;
+
+	sim->rand_state = sim->cfg.seed;
+	sim->start_ns = mono_ns();
+
+	// factory trim, survives a reset. The low bits read back as
+	// product revision 2, a full sensitivity accel.
+	sim->reg[REG_ACCEL_OFFS + 0] = 0xFA;
+	sim->reg[REG_ACCEL_OFFS + 1] = 0x24;
+	sim->reg[REG_ACCEL_OFFS + 2] = 0x02;
+	sim->reg[REG_ACCEL_OFFS + 3] = 0x19;
+	sim->reg[REG_ACCEL_OFFS + 4] = 0x05;
+	sim->reg[REG_ACCEL_OFFS + 5] = 0x20;
+
+	sim->akm[AKM_WIA] = 0x48;
+
+	// sensitivity adjustment of exactly 1
+	sim->akm[AKM_ASAX + 0] = 128;
+	sim->akm[AKM_ASAX + 1] = 128;
+	sim->akm[AKM_ASAX + 2] = 128;
+
+	sim->quat[0] = 1.0f;
+
+	sim_reset(sim);
+
+	return sim;
+}
+
+void mpu_sim_destroy(mpu_sim_t *sim)
+{
+	if (sim)
+		free(sim);
+}
+
+const struct linux_glue_backend_s *mpu_sim_backend(mpu_sim_t *sim)
+{
+	return &sim->backend;
+}
+
+void mpu_sim_get_stats(mpu_sim_t *sim, mpu_sim_stats_t *stats)
+{
+	*stats = sim->stats;
+}
+
+unsigned long long mono_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (unsigned long long)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+unsigned long long sim_now(mpu_sim_t *sim)
+{
+	return mono_ns() + sim->skipped_ns;
+}
+
+// Power on state of everything but the trim, the DMP memory and the
+// compass, which is a separate die
+void sim_reset(mpu_sim_t *sim)
+{
+	unsigned char trim[6];
+
+	memcpy(trim, sim->reg + REG_ACCEL_OFFS, sizeof(trim));
+	memset(sim->reg, 0, sizeof(sim->reg));
+	memcpy(sim->reg + REG_ACCEL_OFFS, trim, sizeof(trim));
+
+	sim->reg[REG_PWR_MGMT_1] = BIT_SLEEP;
+	sim->reg[REG_WHO_AM_I] = 0x68;
+
+	sim->fifo_head = 0;
+	sim->fifo_count = 0;
+	sim->next_sample_ns = 0;
+	sim->dmp_count = 0;
+	sim->aux_count = 0;
+}
+
+// ns between samples from the divider and the DLPF, 0 while asleep
+static unsigned long long sample_period(mpu_sim_t *sim)
+{
+	unsigned char lpf = sim->reg[REG_LPF] & 0x07;
+	unsigned long long rate;
+
+	if (sim->reg[REG_PWR_MGMT_1] & BIT_SLEEP)
+		return 0;
+
+	rate = (lpf == 0 || lpf == 7) ? 8000 : 1000;
+
+	return (1000000000ULL * (1 + sim->reg[REG_RATE_DIV])) / rate;
+}
+
+// Catch the chip up to now, one sample per period
+void sim_advance(mpu_sim_t *sim)
+{
+	unsigned long long now = sim_now(sim);
+	unsigned long long period = sample_period(sim);
+	int n = 0;
+
+	if (!period) {
+		sim->next_sample_ns = 0;
+		return;
+	}
+
+	if (!sim->next_sample_ns) {
+		sim->next_sample_ns = now + period;
+		return;
+	}
+
+	while (sim->next_sample_ns <= now && n++ < SIM_MAX_CATCHUP) {
+		sim_sample(sim, sim->next_sample_ns);
+		sim->next_sample_ns += period;
+	}
+
+	// the FIFO has long overflowed, skip what is left of the gap
+	if (sim->next_sample_ns <= now)
+		sim->next_sample_ns = now + period;
+}
+
+static float gauss(mpu_sim_t *sim)
+{
+	float u1 = (rand_r(&sim->rand_state) + 1.0f) / (RAND_MAX + 2.0f);
+	float u2 = (rand_r(&sim->rand_state) + 1.0f) / (RAND_MAX + 2.0f);
+
+	return sqrtf(-2.0f * logf(u1)) * cosf(2.0f * (float)M_PI * u2);
+}
+
+static short to_lsb(mpu_sim_t *sim, float val)
+{
+	if (sim->cfg.noise > 0.0f)
+		val += sim->cfg.noise * gauss(sim);
+
+	if (val > 32767.0f)
+		return 32767;
+
+	if (val < -32768.0f)
+		return -32768;
+
+	return (short)lrintf(val);
+}
+
+static void put_be16(unsigned char *p, short val)
+{
+	p[0] = (unsigned char)((val >> 8) & 0xFF);
+	p[1] = (unsigned char)(val & 0xFF);
+}
+
+// v in the body frame for the earth frame e, rotating by the conjugate
+static void earth_to_body(const float *q, const float *e, float *v)
+{
+	float w = q[0], x = -q[1], y = -q[2], z = -q[3];
+	float tx, ty, tz;
+
+	tx = 2.0f * (y * e[2] - z * e[1]);
+	ty = 2.0f * (z * e[0] - x * e[2]);
+	tz = 2.0f * (x * e[1] - y * e[0]);
+
+	v[0] = e[0] + w * tx + (y * tz - z * ty);
+	v[1] = e[1] + w * ty + (z * tx - x * tz);
+	v[2] = e[2] + w * tz + (x * ty - y * tx);
+}
+
+// Latch a new sample in the output registers, run the aux master and
+// feed the FIFO
+void sim_sample(mpu_sim_t *sim, unsigned long long t)
+{
+	const float *w = sim->cfg.gyro_rate;
+	const float up[3] = { 0.0f, 0.0f, 1.0f };
+	float rate, angle, s, accel_lsb, gyro_lsb;
+	float g[3];
+	unsigned char dly, ctrl, addr, r, user_ctrl = sim->reg[REG_USER_CTRL];
+	unsigned char packet[32];
+	unsigned char *ext;
+	long q30;
+	int i, j, len, run;
+
+	sim->stats.samples++;
+
+	// constant body rate from identity, so the attitude is closed form
+	rate = sqrtf(w[0] * w[0] + w[1] * w[1] + w[2] * w[2]);
+	angle = rate * ((t - sim->start_ns) / 1.0e9f);
+
+	sim->quat[0] = cosf(0.5f * angle);
+	s = (rate > 0.0f) ? sinf(0.5f * angle) / rate : 0.0f;
+
+	for (i = 0; i < 3; i++)
+		sim->quat[i + 1] = w[i] * s;
+
+	accel_lsb = 16384.0f / (1 << ((sim->reg[REG_ACCEL_CFG] >> 3) & 3));
+	gyro_lsb = (131.0f * 180.0f / (float)M_PI) / (1 << ((sim->reg[REG_GYRO_CFG] >> 3) & 3));
+
+	earth_to_body(sim->quat, up, g);
+
+	for (i = 0; i < 3; i++) {
+		put_be16(sim->reg + REG_RAW_ACCEL + 2 * i, to_lsb(sim, g[i] * accel_lsb));
+		put_be16(sim->reg + REG_RAW_GYRO + 2 * i, to_lsb(sim, w[i] * gyro_lsb));
+	}
+
+	// 25 C
+	put_be16(sim->reg + REG_TEMP, -3921);
+
+	// Slaves 0-3 in order, reads land back to back in EXT_SENS_DATA.
+	// Slaves with their delay bit set only run every 1 + I2C_MST_DLY samples.
+	if (user_ctrl & BIT_AUX_IF_EN) {
+		dly = sim->reg[REG_S4_CTRL] & 0x1F;
+		run = (sim->aux_count++ % (dly + 1)) == 0;
+		ext = sim->reg + REG_EXT_SENS_DATA;
+
+		for (i = 0; i < 4; i++) {
+			addr = sim->reg[REG_S0_ADDR + 3 * i];
+			r = sim->reg[REG_S0_ADDR + 3 * i + 1];
+			ctrl = sim->reg[REG_S0_ADDR + 3 * i + 2];
+			len = ctrl & 0x0F;
+
+			if (!(ctrl & BIT_SLAVE_EN))
+				continue;
+
+			if ((sim->reg[REG_DELAY_CTRL] & (1 << i)) && !run) {
+				if (addr & BIT_I2C_READ)
+					ext += len;
+
+				continue;
+			}
+
+			if ((addr & 0x7F) != AKM_ADDR)
+				continue;
+
+			if (addr & BIT_I2C_READ) {
+				for (j = 0; j < len && ext < sim->reg + REG_S0_DO; j++)
+					*ext++ = akm_read(sim, r + j);
+			}
+			else {
+				akm_write(sim, r, sim->reg[REG_S0_DO + i]);
+			}
+		}
+	}
+
+	sim->reg[REG_INT_STATUS] |= BIT_DATA_RDY;
+
+	if (!(user_ctrl & BIT_FIFO_EN))
+		return;
+
+	if (user_ctrl & BIT_DMP_EN) {
+		// the DMP runs at the sample rate and decimates by D_0_22 + 1
+		i = (sim->mem[DMP_D_0_22] << 8) | sim->mem[DMP_D_0_22 + 1];
+
+		if (sim->dmp_count++ % (i + 1))
+			return;
+
+		// laid out as dmp_enable_feature() asked for
+		len = 0;
+
+		if (sim->mem[DMP_CFG_LP_QUAT] == 0xC0 || sim->mem[DMP_CFG_8] == 0x20) {
+			for (i = 0; i < 4; i++) {
+				q30 = lrintf(sim->quat[i] * 1073741824.0f);
+
+				packet[len++] = (unsigned char)((q30 >> 24) & 0xFF);
+				packet[len++] = (unsigned char)((q30 >> 16) & 0xFF);
+				packet[len++] = (unsigned char)((q30 >> 8) & 0xFF);
+				packet[len++] = (unsigned char)(q30 & 0xFF);
+			}
+		}
+
+		if (sim->mem[DMP_CFG_15 + 1] == 0xC0) {
+			memcpy(packet + len, sim->reg + REG_RAW_ACCEL, 6);
+			len += 6;
+		}
+
+		if (sim->mem[DMP_CFG_15 + 4] == 0xC4) {
+			memcpy(packet + len, sim->reg + REG_RAW_GYRO, 6);
+			len += 6;
+		}
+
+		// no tap or orientation events
+		if (sim->mem[DMP_CFG_27] == 0x20) {
+			memset(packet + len, 0, 4);
+			len += 4;
+		}
+
+		fifo_push(sim, packet, len);
+		sim->stats.packets++;
+
+		sim->reg[REG_DMP_INT_STATUS] |= 0x01;
+		sim->reg[REG_INT_STATUS] |= BIT_DMP_INT;
+	}
+	else {
+		// FIFO_EN order is the register order, accel, temp, gyro
+		len = 0;
+
+		if (sim->reg[REG_FIFO_EN] & 0x08) {
+			memcpy(packet + len, sim->reg + REG_RAW_ACCEL, 6);
+			len += 6;
+		}
+
+		if (sim->reg[REG_FIFO_EN] & 0x80) {
+			memcpy(packet + len, sim->reg + REG_TEMP, 2);
+			len += 2;
+		}
+
+		for (i = 0; i < 3; i++) {
+			if (sim->reg[REG_FIFO_EN] & (0x40 >> i)) {
+				memcpy(packet + len, sim->reg + REG_RAW_GYRO + 2 * i, 2);
+				len += 2;
+			}
+		}
+
+		if (len) {
+			fifo_push(sim, packet, len);
+			sim->stats.packets++;
+		}
+	}
+}
+
+// A full FIFO keeps the newest bytes, so the packets after an overflow
+// are misaligned until it is reset, as on the chip
+void fifo_push(mpu_sim_t *sim, const unsigned char *data, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (sim->fifo_count == SIM_FIFO_SIZE) {
+			sim->fifo_head = (sim->fifo_head + 1) % SIM_FIFO_SIZE;
+			sim->fifo_count--;
+
+			if (!(sim->reg[REG_INT_STATUS] & BIT_FIFO_OVERFLOW)) {
+				sim->reg[REG_INT_STATUS] |= BIT_FIFO_OVERFLOW;
+				sim->stats.overflows++;
+			}
+		}
+
+		sim->fifo[(sim->fifo_head + sim->fifo_count) % SIM_FIFO_SIZE] = data[i];
+		sim->fifo_count++;
+	}
+}
+
+static unsigned char *mem_ptr(mpu_sim_t *sim)
+{
+	int addr = ((sim->reg[REG_BANK_SEL] << 8) | sim->reg[REG_MEM_START_ADDR]) % SIM_MEM_SIZE;
+
+	// auto increment, into the next bank at the end of this one
+	if (++sim->reg[REG_MEM_START_ADDR] == 0)
+		sim->reg[REG_BANK_SEL]++;
+
+	return sim->mem + addr;
+}
+
+void reg_write(mpu_sim_t *sim, unsigned char r, unsigned char val)
+{
+	switch (r) {
+	case REG_MEM_R_W:
+		*mem_ptr(sim) = val;
+		break;
+
+	case REG_FIFO_R_W:
+		fifo_push(sim, &val, 1);
+		break;
+
+	case REG_PWR_MGMT_1:
+		if (val & BIT_RESET)
+			sim_reset(sim);
+		else
+			sim->reg[r] = val;
+
+		break;
+
+	case REG_USER_CTRL:
+		if (val & BIT_FIFO_RST) {
+			sim->fifo_head = 0;
+			sim->fifo_count = 0;
+			sim->reg[REG_INT_STATUS] &= ~BIT_FIFO_OVERFLOW;
+		}
+
+		if (val & BIT_DMP_RST)
+			sim->dmp_count = 0;
+
+		// the reset bits clear themselves
+		sim->reg[r] = val & 0xF0;
+		break;
+
+	case REG_DMP_INT_STATUS:
+	case REG_INT_STATUS:
+	case REG_FIFO_COUNT_H:
+	case REG_FIFO_COUNT_L:
+	case REG_WHO_AM_I:
+		break;
+
+	default:
+		// sensor outputs and EXT_SENS_DATA are read only
+		if (r >= REG_RAW_ACCEL && r < REG_S0_DO)
+			break;
+
+		if (r < SIM_NUM_REGS)
+			sim->reg[r] = val;
+
+		break;
+	}
+}
+
+unsigned char reg_read(mpu_sim_t *sim, unsigned char r)
+{
+	unsigned char val;
+
+	switch (r) {
+	case REG_MEM_R_W:
+		return *mem_ptr(sim);
+
+	case REG_FIFO_R_W:
+		if (!sim->fifo_count)
+			return 0;
+
+		val = sim->fifo[sim->fifo_head];
+		sim->fifo_head = (sim->fifo_head + 1) % SIM_FIFO_SIZE;
+		sim->fifo_count--;
+		return val;
+
+	case REG_FIFO_COUNT_H:
+		return (unsigned char)(sim->fifo_count >> 8);
+
+	case REG_FIFO_COUNT_L:
+		return (unsigned char)(sim->fifo_count & 0xFF);
+
+	case REG_DMP_INT_STATUS:
+	case REG_INT_STATUS:
+		// cleared by reading
+		val = sim->reg[r];
+		sim->reg[r] = 0;
+		return val;
+
+	default:
+		return (r < SIM_NUM_REGS) ? sim->reg[r] : 0;
+	}
+}
+
+// The AK8975 axes are the accel's with x and y swapped and z flipped.
+// Conversion is instant, at the attitude of the last sample.
+void akm_measure(mpu_sim_t *sim)
+{
+	short val[3];
+	float b[3];
+	int i;
+
+	earth_to_body(sim->quat, sim->cfg.field, b);
+
+	val[0] = to_lsb(sim, b[1] / AKM_UT_PER_LSB);
+	val[1] = to_lsb(sim, b[0] / AKM_UT_PER_LSB);
+	val[2] = to_lsb(sim, -b[2] / AKM_UT_PER_LSB);
+
+	for (i = 0; i < 3; i++) {
+		sim->akm[AKM_HXL + 2 * i] = (unsigned char)(val[i] & 0xFF);
+		sim->akm[AKM_HXL + 2 * i + 1] = (unsigned char)((val[i] >> 8) & 0xFF);
+	}
+
+	sim->akm[AKM_ST1] = 0x01;
+	sim->akm[AKM_ST2] = 0;
+	sim->stats.compass_samples++;
+}
+
+void akm_write(mpu_sim_t *sim, unsigned char r, unsigned char val)
+{
+	if (r != AKM_CNTL)
+		return;
+
+	sim->akm[AKM_CNTL] = val & 0x0F;
+
+	if (sim->akm[AKM_CNTL] == AKM_MODE_SINGLE) {
+		akm_measure(sim);
+		sim->akm[AKM_CNTL] = 0;
+	}
+
+	// a fixed field within the datasheet's self test limits
+	if (sim->akm[AKM_CNTL] == AKM_MODE_SELF_TEST) {
+		sim->akm[AKM_HXL + 0] = 10;
+		sim->akm[AKM_HXL + 1] = 0;
+		sim->akm[AKM_HXL + 2] = (unsigned char)-10;
+		sim->akm[AKM_HXL + 3] = 0xFF;
+		sim->akm[AKM_HXL + 4] = (unsigned char)(-500 & 0xFF);
+		sim->akm[AKM_HXL + 5] = (unsigned char)((-500 >> 8) & 0xFF);
+		sim->akm[AKM_ST1] = 0x01;
+		sim->akm[AKM_CNTL] = 0;
+	}
+}
+
+// Reading any data register or ST2 clears DRDY until the next measurement
+unsigned char akm_read(mpu_sim_t *sim, unsigned char r)
+{
+	if (r >= AKM_NUM_REGS)
+		return 0;
+
+	if (r >= AKM_HXL && r <= AKM_ST2)
+		sim->akm[AKM_ST1] = 0;
+
+	return sim->akm[r];
+}
+
+// Time both dies have to have caught up to before the transfer, and
+// whether the address is acked
+int sim_begin(mpu_sim_t *sim, unsigned char slave_addr)
+{
+	sim->stats.transfers++;
+
+	if (sim->cfg.fail_every && (sim->stats.transfers % sim->cfg.fail_every) == 0) {
+		sim->stats.failed++;
+		return -1;
+	}
+
+	if (slave_addr == 0x68 || slave_addr == 0x69)
+		return 0;
+
+	// the compass is only on the main bus in bypass with the master off
+	if (slave_addr == AKM_ADDR && (sim->reg[REG_INT_PIN_CFG] & BIT_BYPASS_EN)
+			&& !(sim->reg[REG_USER_CTRL] & BIT_AUX_IF_EN))
+		return 0;
+
+	sim->stats.failed++;
+
+	return -1;
+}
+
+// 9 bits a byte plus start and stop, on top of the fixed latency
+void sim_bus_time(mpu_sim_t *sim, unsigned long long start, int bytes)
+{
+	unsigned long long cost = sim->cfg.latency_us * 1000ULL;
+	unsigned long long end;
+	struct timespec ts;
+
+	if (sim->cfg.bus_hz > 0)
+		cost += ((9ULL * bytes + 2) * 1000000000ULL) / sim->cfg.bus_hz;
+
+	sim->stats.bytes += bytes;
+
+	if (!cost)
+		return;
+
+	end = start + cost;
+
+	if (cost > SIM_SPIN_NS) {
+		ts.tv_sec = (end - SIM_SPIN_NS) / 1000000000ULL;
+		ts.tv_nsec = (end - SIM_SPIN_NS) % 1000000000ULL;
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+			;
+	}
+
+	while (mono_ns() < end)
+		;
+}
+
+int sim_i2c_write(void *ctx, unsigned char slave_addr, unsigned char reg_addr,
+	unsigned short length, unsigned char const *data)
+{
+	mpu_sim_t *sim = (mpu_sim_t *)ctx;
+	unsigned long long start = mono_ns();
+	unsigned char r = reg_addr;
+	int i, result;
+
+	sim_advance(sim);
+
+	result = sim_begin(sim, slave_addr);
+
+	if (result == 0) {
+		for (i = 0; i < length; i++) {
+			if (slave_addr == AKM_ADDR) {
+				akm_write(sim, r++, data[i]);
+			}
+			else {
+				reg_write(sim, r, data[i]);
+
+				// the memory and FIFO ports stream, everything else increments
+				if (r != REG_MEM_R_W && r != REG_FIFO_R_W)
+					r++;
+			}
+		}
+	}
+
+	sim_bus_time(sim, start, result ? 1 : 2 + length);
+
+	return result;
+}
+
+int sim_i2c_read(void *ctx, unsigned char slave_addr, unsigned char reg_addr,
+	unsigned short length, unsigned char *data)
+{
+	mpu_sim_t *sim = (mpu_sim_t *)ctx;
+	unsigned long long start = mono_ns();
+	unsigned char r = reg_addr;
+	int i, result;
+
+	sim_advance(sim);
+
+	result = sim_begin(sim, slave_addr);
+
+	if (result == 0) {
+		for (i = 0; i < length; i++) {
+			if (slave_addr == AKM_ADDR) {
+				data[i] = akm_read(sim, r++);
+			}
+			else {
+				data[i] = reg_read(sim, r);
+
+				if (r != REG_MEM_R_W && r != REG_FIFO_R_W)
+					r++;
+			}
+		}
+	}
+
+	sim_bus_time(sim, start, result ? 1 : 3 + length);
+
+	return result;
+}
+
+int sim_get_ns(void *ctx, unsigned long long *ns)
+{
+	*ns = sim_now((mpu_sim_t *)ctx);
+
+	return 0;
+}
+
+// The registers settle at once, the model just moves its clock on, or
+// waits the delay out with real_time
+int sim_delay_ms(void *ctx, unsigned long num_ms)
+{
+	mpu_sim_t *sim = (mpu_sim_t *)ctx;
+	struct timespec ts;
+
+	if (sim->cfg.real_time) {
+		ts.tv_sec = num_ms / 1000;
+		ts.tv_nsec = (num_ms % 1000) * 1000000L;
+
+		while (nanosleep(&ts, &ts))
+			;
+	}
+	else {
+		sim->skipped_ns += num_ms * 1000000ULL;
+	}
+
+	return 0;
+}
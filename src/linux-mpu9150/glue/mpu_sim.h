@@ -0,0 +1,90 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef MPU_SIM_H
+#define MPU_SIM_H
+
+#include "linux_glue.h"
+
+// Register level model of an MPU-9150, the MPU-6050 die with an AK8975
+// on its auxiliary bus, behind the linux_glue backend interface. It keeps
+// the register file, DMP memory and a 1 kB FIFO, fills the FIFO with DMP
+// packets or raw samples at the configured rate the way the chip does,
+// overflowing when it is not drained, and charges each transfer its time
+// on the bus. The body turns at a constant rate in a fixed field, so the
+// output is deterministic for a given config.
+//
+// The model's clock is CLOCK_MONOTONIC plus every delay the driver asked
+// for, delays return at once unless real_time is set. Everything reading
+// the time through linux_get_ns() sees the same clock as the FIFO.
+
+typedef struct {
+	// 0 for transfers that take no time, 400000 for a fast mode bus
+	int bus_hz;
+
+	// added to every transfer, for the adapter and syscall overhead
+	int latency_us;
+
+	// body rate in rad/s, sensor frame
+	float gyro_rate[3];
+
+	// earth field in uT with x north and z up
+	float field[3];
+
+	// standard deviation in LSB added to accel, gyro and mag
+	float noise;
+
+	// fail every Nth transfer, 0 never
+	int fail_every;
+
+	// sleep through the driver's delays instead of skipping them, so that
+	// several models, e.g. the devices of an mpu_array, keep one clock
+	int real_time;
+
+	unsigned int seed;
+} mpu_sim_config_t;
+
+typedef struct {
+	unsigned long transfers;
+	unsigned long failed;
+	unsigned long bytes;
+	unsigned long samples;
+	unsigned long packets;
+	unsigned long overflows;
+	unsigned long compass_samples;
+} mpu_sim_stats_t;
+
+typedef struct mpu_sim_s mpu_sim_t;
+
+// 400 kHz, 50 us latency, still with a slow turn about z, no noise
+void mpu_sim_default_config(mpu_sim_config_t *cfg);
+
+mpu_sim_t *mpu_sim_create(const mpu_sim_config_t *cfg);
+void mpu_sim_destroy(mpu_sim_t *sim);
+
+// hand to linux_glue_set_backend() or mpu9150_set_backend()
+const struct linux_glue_backend_s *mpu_sim_backend(mpu_sim_t *sim);
+
+void mpu_sim_get_stats(mpu_sim_t *sim, mpu_sim_stats_t *stats);
+
+#endif /* MPU_SIM_H */
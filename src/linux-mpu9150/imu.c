@@ -31,6 +31,7 @@
 
 #include "mpu9150.h"
 #include "linux_glue.h"
+#include "linux_spi.h"
 #include "local_defaults.h"
 
 int set_cal(int mag, char *cal_file);
@@ -48,7 +49,7 @@ void usage(char *argv_0)
 {
 	printf("\nUsage: %s [options]\n", argv_0);
 	printf("  -b <i2c-bus>          The I2C bus number where the IMU is. The default is 1 to use /dev/i2c-1.\n");
-	printf("  -s <sample-rate>      The IMU sample rate in Hz. Range 2-50, default 10.\n");
+	printf("  -s <sample-rate>      The IMU sample rate in Hz. Range 2-200, default 10.\n");
 	printf("  -y <yaw-mix-factor>   Effect of mag yaw on fused yaw data.\n");
 	printf("                           0 = gyro only\n");
 	printf("                           1 = mag only\n");
@@ -56,6 +57,8 @@ void usage(char *argv_0)
 	printf("                           The default is 4.\n");
 	printf("  -a <accelcal file>    Path to accelerometer calibration file. Default is ./accelcal.txt\n");
 	printf("  -m <magcal file>      Path to mag calibration file. Default is ./magcal.txt\n");
+	printf("  -p <bus.cs>           An MPU-9250 on /dev/spidev<bus>.<cs> instead of I2C.\n");
+	printf("                           Needs a -DMPU9250 build, see glue/linux_spi.h.\n");
 	printf("  -v                    Verbose messages\n");
 	printf("  -h                    Show this help\n");
 
@@ -73,8 +76,10 @@ int main(int argc, char **argv)
 	int verbose = 0;
 	char *mag_cal_file = NULL;
 	char *accel_cal_file = NULL;
+	int spi_bus = -1, spi_cs = 0;
+	linux_spi_t *spi = NULL;
 
-	while ((opt = getopt(argc, argv, "b:s:y:a:m:vh")) != -1) {
+	while ((opt = getopt(argc, argv, "b:s:y:a:m:p:vh")) != -1) {
 		switch (opt) {
 		case 'b':
 			i2c_bus = strtoul(optarg, NULL, 0);
@@ -135,6 +140,12 @@ int main(int argc, char **argv)
 			strcpy(mag_cal_file, optarg);
 			break;
 
+		case 'p':
+			if (sscanf(optarg, "%d.%d", &spi_bus, &spi_cs) != 2 || spi_bus < 0 || spi_cs < 0)
+				usage(argv[0]);
+
+			break;
+
 		case 'v':
 			verbose = 1;
 			break;
@@ -150,6 +161,19 @@ int main(int argc, char **argv)
 
 	mpu9150_set_debug(verbose);
 
+	if (spi_bus >= 0) {
+#ifdef MPU9150
+		printf("The MPU-9150 is I2C only, build with -DMPU9250 for SPI\n");
+		exit(1);
+#endif
+		spi = linux_spi_create(spi_bus, spi_cs, 0);
+
+		if (!spi)
+			exit(1);
+
+		mpu9150_set_backend(linux_spi_backend(spi));
+	}
+
 	if (mpu9150_init(i2c_bus, sample_rate, yaw_mix_factor))
 		exit(1);
 
@@ -166,6 +190,8 @@ int main(int argc, char **argv)
 
 	mpu9150_exit();
 
+	linux_spi_destroy(spi);
+
 	return 0;
 }
 
@@ -0,0 +1,816 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdio.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+
+#include "inv_mpu.h"
+#include "inv_mpu_dmp_motion_driver.h"
+#include "linux_glue.h"
+#include "mpu_sim.h"
+#include "mpu9150.h"
+#include "mpu_history.h"
+#include "mpu_array.h"
+#include "local_defaults.h"
+
+// Per stage latency of the read pipeline. Each stage is timed call by
+// call and reported as p50/p99/max with the throughput the mean implies.
+// The CPU stages run on synthetic samples and need no hardware, the bus
+// and FIFO stages run when a bus is given with -b, or against the
+// register model in mpu_sim.h with -S. -a runs an mpu_array of simulated
+// IMUs, two to a bus, and checks its sets stay within a sample period.
+
+#define MAX_LIST		16
+#define MPU_FIFO_R_W	0x74
+#define MAX_CHUNK		1024
+
+typedef struct {
+	const char *stage;
+	char param[16];
+	unsigned long long *ns;
+	int n;
+	// bytes or samples per call
+	int items;
+	const char *unit;
+} bench_t;
+
+int parse_list(char *s, int *list, int min, int max);
+int bench_alloc(bench_t *b, const char *stage, int count);
+void bench_report(bench_t *b);
+void print_header();
+void make_samples(mpudata_t *samples, int count, int sample_rate);
+void bench_cal(int count, int *chunks, int num_chunks);
+void bench_fusion(int count, int sample_rate);
+void bench_replay(int count, int sample_rate);
+void bench_history(int count, int sample_rate);
+void bench_i2c(int count, int *chunks, int num_chunks);
+void bench_fifo(int count, int sample_rate);
+int bench_array(int count, int sample_rate, int num_devs, const mpu_sim_config_t *cfg);
+int run_array(mpu_array_t *array, int count, int sample_rate);
+void print_sim_stats(mpu_sim_t *sim);
+unsigned long long mono_ns();
+void sleep_us(long us);
+
+int verbose;
+
+void usage(char *argv_0)
+{
+	printf("\nUsage: %s [options]\n", argv_0);
+	printf("  -b <i2c-bus>          Also time the I2C and FIFO stages on this bus\n");
+	printf("  -S                    Also time the I2C and FIFO stages on the simulated IMU\n");
+	printf("  -B <bus-hz>           Simulated bus clock, default 400000, 0 for no bus time\n");
+	printf("  -L <latency-us>       Simulated time per transfer on top, default 50\n");
+	printf("  -a <imus>             Also time an array of this many simulated IMUs,\n");
+	printf("                           two per bus, up to %d\n", MPU_ARRAY_MAX_DEVS);
+	printf("  -s <rates>            Comma separated sample rates, default 10,50,100,200\n");
+	printf("  -c <chunks>           Comma separated I2C read lengths and calibration batches,\n");
+	printf("                           default 1,6,14,28,64,128,256\n");
+	printf("  -n <count>            Calls timed per stage, default 1000\n");
+	printf("  -v                    Verbose messages\n");
+	printf("  -h                    Show this help\n");
+
+	printf("\nWithout -b or -S only the calibration and fusion stages are timed, on\n");
+	printf("synthetic samples. Times are in microseconds per call.\n");
+
+	printf("\nExample: %s -b%d -s100,200 -n5000\n\n", argv_0, DEFAULT_I2C_BUS);
+
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, i;
+	int i2c_bus = -1;
+	int count = 1000;
+	char default_rates[] = "10,50,100,200";
+	char default_chunks[] = "1,6,14,28,64,128,256";
+	char *rate_list = default_rates;
+	char *chunk_list = default_chunks;
+	int rates[MAX_LIST];
+	int chunks[MAX_LIST];
+	int num_rates, num_chunks;
+	int simulate = 0;
+	int array_devs = 0;
+	int failed = 0;
+	mpu_sim_config_t sim_cfg;
+	mpu_sim_t *sim = NULL;
+
+	mpu_sim_default_config(&sim_cfg);
+
+	while ((opt = getopt(argc, argv, "b:SB:L:a:s:c:n:vh")) != -1) {
+		switch (opt) {
+		case 'b':
+			i2c_bus = strtoul(optarg, NULL, 0);
+
+			if (errno == EINVAL)
+				usage(argv[0]);
+
+			if (i2c_bus < MIN_I2C_BUS || i2c_bus > MAX_I2C_BUS)
+				usage(argv[0]);
+
+			break;
+
+		case 'S':
+			simulate = 1;
+			break;
+
+		case 'B':
+			sim_cfg.bus_hz = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'L':
+			sim_cfg.latency_us = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'a':
+			array_devs = strtoul(optarg, NULL, 0);
+
+			if (errno == EINVAL || array_devs < 1 || array_devs > MPU_ARRAY_MAX_DEVS)
+				usage(argv[0]);
+
+			break;
+
+		case 's':
+			rate_list = optarg;
+			break;
+
+		case 'c':
+			chunk_list = optarg;
+			break;
+
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+
+			if (errno == EINVAL || count < 1)
+				usage(argv[0]);
+
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		case 'h':
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+
+	num_rates = parse_list(rate_list, rates, MIN_SAMPLE_RATE, MAX_SAMPLE_RATE);
+	num_chunks = parse_list(chunk_list, chunks, 1, MAX_CHUNK);
+
+	if (num_rates < 1 || num_chunks < 1)
+		usage(argv[0]);
+
+	mpu9150_set_debug(verbose);
+
+	print_header();
+
+	bench_cal(count, chunks, num_chunks);
+
+	for (i = 0; i < num_rates; i++)
+		bench_fusion(count, rates[i]);
+
+	for (i = 0; i < num_rates; i++)
+		bench_replay(count, rates[i]);
+
+	for (i = 0; i < num_rates; i++)
+		bench_history(count, rates[i]);
+
+	if (array_devs) {
+		for (i = 0; i < num_rates; i++) {
+			if (bench_array(count, rates[i], array_devs, &sim_cfg))
+				failed = 1;
+		}
+	}
+
+	if (simulate) {
+		sim = mpu_sim_create(&sim_cfg);
+
+		if (!sim) {
+			perror("mpu_sim_create");
+			exit(1);
+		}
+
+		mpu9150_set_backend(mpu_sim_backend(sim));
+		i2c_bus = DEFAULT_I2C_BUS;
+	}
+
+	if (i2c_bus < 0)
+		return failed;
+
+	for (i = 0; i < num_rates; i++) {
+		if (mpu9150_init(i2c_bus, rates[i], DEFAULT_YAW_MIX_FACTOR)) {
+			printf("mpu9150_init() failed at %d Hz\n", rates[i]);
+			break;
+		}
+
+		// the bus does not care about the rate, time it once
+		if (i == 0)
+			bench_i2c(count, chunks, num_chunks);
+
+		bench_fifo(count, rates[i]);
+
+		mpu9150_exit();
+	}
+
+	if (sim) {
+		print_sim_stats(sim);
+		mpu9150_set_backend(NULL);
+		mpu_sim_destroy(sim);
+	}
+
+	return failed;
+}
+
+// Accepts 1,2,3 style lists, returns the number of entries or -1
+int parse_list(char *s, int *list, int min, int max)
+{
+	char *tok;
+	int n = 0;
+
+	for (tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+		if (n == MAX_LIST)
+			return -1;
+
+		list[n] = strtol(tok, NULL, 0);
+
+		if (list[n] < min || list[n] > max)
+			return -1;
+
+		n++;
+	}
+
+	return n;
+}
+
+int bench_alloc(bench_t *b, const char *stage, int count)
+{
+	memset(b, 0, sizeof(bench_t));
+
+	b->ns = (unsigned long long *)malloc(count * sizeof(unsigned long long));
+
+	if (!b->ns) {
+		perror("malloc");
+		return -1;
+	}
+
+	b->stage = stage;
+	b->items = 1;
+	b->unit = "samples";
+
+	return 0;
+}
+
+int cmp_ns(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+void print_header()
+{
+	printf("%-20s %-10s %7s %10s %10s %10s  %s\n",
+		"stage", "param", "calls", "p50 us", "p99 us", "max us", "throughput");
+}
+
+void bench_report(bench_t *b)
+{
+	unsigned long long total = 0;
+	double mean;
+	int i;
+
+	if (b->n > 0) {
+		for (i = 0; i < b->n; i++)
+			total += b->ns[i];
+
+		qsort(b->ns, b->n, sizeof(unsigned long long), cmp_ns);
+
+		mean = (double)total / b->n;
+
+		printf("%-20s %-10s %7d %10.2f %10.2f %10.2f  %0.0f %s/s\n",
+			b->stage, b->param, b->n,
+			b->ns[b->n / 2] / 1000.0,
+			b->ns[(b->n * 99) / 100] / 1000.0,
+			b->ns[b->n - 1] / 1000.0,
+			mean > 0.0 ? (b->items * 1.0e9) / mean : 0.0, b->unit);
+	}
+	else {
+		printf("%-20s %-10s %7d  no data\n", b->stage, b->param, 0);
+	}
+
+	free(b->ns);
+	b->ns = NULL;
+}
+
+// Level and slowly turning about z, with a little noise on every axis.
+// Enough for the filters to do their full work on every sample.
+void make_samples(mpudata_t *samples, int count, int sample_rate)
+{
+	unsigned long long period = 1000000000ULL / sample_rate;
+	unsigned int seed = 1;
+	int i, j;
+
+	memset(samples, 0, count * sizeof(mpudata_t));
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < 3; j++) {
+			samples[i].rawGyro[j] = (short)(rand_r(&seed) % 21 - 10);
+			samples[i].rawAccel[j] = (short)(rand_r(&seed) % 41 - 20);
+			samples[i].rawMag[j] = (short)(rand_r(&seed) % 5 - 2);
+		}
+
+		samples[i].rawGyro[VEC3_Z] += 16;
+		samples[i].rawAccel[VEC3_Z] += 16384;
+		samples[i].rawMag[VEC3_X] += 120;
+		samples[i].rawMag[VEC3_Y] += 40;
+		samples[i].rawMag[VEC3_Z] -= 300;
+
+		samples[i].rawQuat[QUAT_W] = 1L << 30;
+		samples[i].dmpTimestampNs = (i + 1) * period;
+		samples[i].magTimestampNs = samples[i].dmpTimestampNs;
+	}
+}
+
+void bench_cal(int count, int *chunks, int num_chunks)
+{
+	// a few degrees of misalignment and some scale, offsets on all axes
+	calmatrix_t cal = {
+		{ 66000, -1200, 800, 1100, 65200, -600, -900, 700, 65800 },
+		{ 120, -80, 200 }
+	};
+	short src[3][MAX_CHUNK];
+	short xyz[3][MAX_CHUNK];
+	unsigned int seed = 2;
+	unsigned long long start;
+	bench_t b;
+	int i, j;
+
+	for (i = 0; i < MAX_CHUNK; i++) {
+		for (j = 0; j < 3; j++)
+			src[j][i] = (short)(rand_r(&seed) % 8001 - 4000);
+	}
+
+	for (i = 0; i < num_chunks; i++) {
+		if (bench_alloc(&b, "cal_apply", count))
+			return;
+
+		sprintf(b.param, "batch %d", chunks[i]);
+		b.items = chunks[i];
+
+		for (j = 0; j < count; j++) {
+			memcpy(xyz, src, sizeof(xyz));
+
+			start = mono_ns();
+			mpu9150_cal_apply(&cal, chunks[i], xyz[0], xyz[1], xyz[2]);
+			b.ns[b.n++] = mono_ns() - start;
+		}
+
+		bench_report(&b);
+	}
+}
+
+// fusion_update() alone, fed what data_fusion() would hand it
+void bench_fusion(int count, int sample_rate)
+{
+	float gyro_scale = DEGREE_TO_RAD / 16.4f;
+	float accel_scale = GRAVITY_MSS / 16384.0f;
+	fusion_state_t fs;
+	fusion_input_t in;
+	mpudata_t *samples;
+	unsigned long long start;
+	bench_t b;
+	int id, i, j;
+
+	samples = (mpudata_t *)malloc(count * sizeof(mpudata_t));
+
+	if (!samples) {
+		perror("malloc");
+		return;
+	}
+
+	make_samples(samples, count, sample_rate);
+
+	memset(&in, 0, sizeof(in));
+	in.dt = 1.0f / sample_rate;
+
+	for (id = 0; id < FUSION_ENGINES; id++) {
+		if (fusion_init(&fs, id, 0.0f, DEFAULT_YAW_MIX_FACTOR))
+			continue;
+
+		if (bench_alloc(&b, fusion_engine(id)->name, count))
+			break;
+
+		sprintf(b.param, "%d Hz", sample_rate);
+
+		for (i = 0; i < count; i++) {
+			for (j = 0; j < 3; j++) {
+				in.gyro[j] = samples[i].rawGyro[j] * gyro_scale;
+				in.accel[j] = samples[i].rawAccel[j] * accel_scale;
+				in.mag[j] = samples[i].rawMag[j];
+			}
+
+			in.dmpQuat = samples[i].rawQuat;
+
+			start = mono_ns();
+			fusion_update(&fs, &in);
+			b.ns[b.n++] = mono_ns() - start;
+		}
+
+		bench_report(&b);
+	}
+
+	free(samples);
+}
+
+// calibrate_data() and data_fusion() together, as mpu9150_read() runs them
+void bench_replay(int count, int sample_rate)
+{
+	mpu9150_dev_t *dev;
+	mpudata_t *samples;
+	unsigned long long start;
+	char stage[24];
+	bench_t b;
+	int id, i;
+
+	samples = (mpudata_t *)malloc(count * sizeof(mpudata_t));
+
+	if (!samples) {
+		perror("malloc");
+		return;
+	}
+
+	make_samples(samples, count, sample_rate);
+
+	for (id = 0; id < FUSION_ENGINES; id++) {
+		dev = mpu9150_create(DEFAULT_I2C_BUS, MPU9150_ADDR_AD0_LOW);
+
+		if (!dev)
+			break;
+
+		mpu9150_dev_set_fusion(dev, id, 0.0f);
+
+		if (mpu9150_dev_replay_init(dev, sample_rate, DEFAULT_YAW_MIX_FACTOR,
+				DEGREE_TO_RAD / 16.4f, GRAVITY_MSS / 16384.0f)) {
+			mpu9150_destroy(dev);
+			break;
+		}
+
+		snprintf(stage, sizeof(stage), "cal+%s", fusion_engine(id)->name);
+
+		if (bench_alloc(&b, stage, count)) {
+			mpu9150_destroy(dev);
+			break;
+		}
+
+		sprintf(b.param, "%d Hz", sample_rate);
+
+		for (i = 0; i < count; i++) {
+			start = mono_ns();
+			mpu9150_dev_replay(dev, &samples[i]);
+			b.ns[b.n++] = mono_ns() - start;
+		}
+
+		bench_report(&b);
+
+		mpu9150_destroy(dev);
+	}
+
+	free(samples);
+}
+
+// Reads of FIFO_R_W do not auto-increment, so any length can be asked for.
+// The bytes are junk but the transfer is what the FIFO reads cost.
+// A lazy read, then the history doing the same work only when asked, for
+// one new sample and for a one second window lookup
+void bench_history(int count, int sample_rate)
+{
+	mpu9150_dev_t *dev;
+	mpudata_t *samples;
+	mpu_history_t hist;
+	unsigned long long start;
+	unsigned long first;
+	bench_t lazy, derive, window;
+	int i;
+
+	samples = (mpudata_t *)malloc(count * sizeof(mpudata_t));
+
+	if (!samples) {
+		perror("malloc");
+		return;
+	}
+
+	make_samples(samples, count, sample_rate);
+
+	dev = mpu9150_create(DEFAULT_I2C_BUS, MPU9150_ADDR_AD0_LOW);
+
+	if (!dev) {
+		free(samples);
+		return;
+	}
+
+	mpu9150_dev_set_lazy(dev, 1);
+
+	if (mpu9150_dev_replay_init(dev, sample_rate, DEFAULT_YAW_MIX_FACTOR,
+			DEGREE_TO_RAD / 16.4f, GRAVITY_MSS / 16384.0f)
+			|| mpu_history_init(&hist, sample_rate * 2)) {
+		mpu9150_destroy(dev);
+		free(samples);
+		return;
+	}
+
+	if (bench_alloc(&lazy, "lazy", count) == 0
+			&& bench_alloc(&derive, "hist derive", count) == 0
+			&& bench_alloc(&window, "hist window", count) == 0) {
+		sprintf(lazy.param, "%d Hz", sample_rate);
+		sprintf(derive.param, "%d Hz", sample_rate);
+		sprintf(window.param, "%d Hz", sample_rate);
+
+		for (i = 0; i < count; i++) {
+			start = mono_ns();
+			mpu9150_dev_replay(dev, &samples[i]);
+			lazy.ns[lazy.n++] = mono_ns() - start;
+
+			start = mono_ns();
+			mpu_history_add(&hist, &samples[i]);
+			mpu_history_derive(&hist, hist.head - 1, 1,
+					MPU_HISTORY_CAL_ACCEL | MPU_HISTORY_CAL_MAG | MPU_HISTORY_EULER);
+			derive.ns[derive.n++] = mono_ns() - start;
+
+			start = mono_ns();
+			mpu_history_window(&hist, 1000000000ULL, &first);
+			window.ns[window.n++] = mono_ns() - start;
+		}
+
+		bench_report(&lazy);
+		bench_report(&derive);
+		bench_report(&window);
+	}
+
+	mpu_history_free(&hist);
+	mpu9150_destroy(dev);
+	free(samples);
+}
+
+void bench_i2c(int count, int *chunks, int num_chunks)
+{
+	unsigned char data[MAX_CHUNK];
+	unsigned long long start;
+	int i, j, result;
+	bench_t b;
+
+	for (i = 0; i < num_chunks; i++) {
+		if (bench_alloc(&b, "linux_i2c_read", count))
+			return;
+
+		sprintf(b.param, "%d bytes", chunks[i]);
+		b.items = chunks[i];
+		b.unit = "bytes";
+
+		for (j = 0; j < count; j++) {
+			start = mono_ns();
+			result = linux_i2c_read(MPU9150_ADDR_AD0_LOW, MPU_FIFO_R_W, chunks[i], data);
+			b.ns[b.n++] = mono_ns() - start;
+
+			if (result) {
+				printf("linux_i2c_read() failed\n");
+				break;
+			}
+		}
+
+		bench_report(&b);
+	}
+
+	mpu_reset_fifo();
+}
+
+// Only calls that returned a packet are counted. Between packets we poll,
+// well inside one sample period, so the FIFO does not back up.
+void bench_fifo(int count, int sample_rate)
+{
+	unsigned char data[MAX_CHUNK];
+	unsigned char length, more;
+	short gyro[3], accel[3], sensors;
+	long quat[4];
+	unsigned long timestamp;
+	unsigned long long start, end, deadline;
+	long poll_us = 250000 / sample_rate;
+	int pass, result;
+	bench_t b;
+
+	if (dmp_get_packet_length(&length)) {
+		printf("dmp_get_packet_length() failed\n");
+		return;
+	}
+
+	for (pass = 0; pass < 2; pass++) {
+		if (bench_alloc(&b, pass ? "dmp_read_fifo" : "mpu_read_fifo_stream", count))
+			return;
+
+		sprintf(b.param, "%d Hz", sample_rate);
+		b.items = pass ? 1 : length;
+		b.unit = pass ? "packets" : "bytes";
+
+		mpu_reset_fifo();
+
+		// twice the time count packets should take, plus a second
+		deadline = mono_ns() + (2000000000ULL * count) / sample_rate + 1000000000ULL;
+
+		while (b.n < count && mono_ns() < deadline) {
+			more = 0;
+			start = mono_ns();
+
+			if (pass)
+				result = dmp_read_fifo(gyro, accel, quat, &timestamp, &sensors, &more);
+			else
+				result = mpu_read_fifo_stream(length, data, &more);
+
+			end = mono_ns();
+
+			if (result == 0)
+				b.ns[b.n++] = end - start;
+			else if (!more)
+				sleep_us(poll_us);
+		}
+
+		if (b.n < count && verbose)
+			printf("%s: %d of %d packets before the deadline\n", b.stage, b.n, count);
+
+		bench_report(&b);
+	}
+}
+
+// An array of num_devs models on their own buses, two to a bus. They wait
+// out the driver's delays so they all run on CLOCK_MONOTONIC like real
+// chips, each on its own phase. -1 when no set came in or one of them
+// spread over a sample period or more.
+int bench_array(int count, int sample_rate, int num_devs, const mpu_sim_config_t *cfg)
+{
+	mpu_sim_t *sims[MPU_ARRAY_MAX_DEVS];
+	int buses[MPU_ARRAY_MAX_DEVS];
+	int addrs[MPU_ARRAY_MAX_DEVS];
+	mpu_sim_config_t dev_cfg;
+	mpu_array_t *array = NULL;
+	int i, n, result = -1;
+
+	for (n = 0; n < num_devs; n++) {
+		dev_cfg = *cfg;
+		dev_cfg.seed = cfg->seed + n;
+		dev_cfg.real_time = 1;
+
+		sims[n] = mpu_sim_create(&dev_cfg);
+
+		if (!sims[n]) {
+			perror("mpu_sim_create");
+			break;
+		}
+
+		buses[n] = DEFAULT_I2C_BUS + n / 2;
+		addrs[n] = (n & 1) ? MPU9150_ADDR_AD0_HIGH : MPU9150_ADDR_AD0_LOW;
+	}
+
+	if (n == num_devs)
+		array = mpu_array_create(num_devs, buses, addrs);
+
+	if (array) {
+		for (i = 0; i < num_devs; i++)
+			mpu9150_dev_set_backend(mpu_array_dev(array, i), mpu_sim_backend(sims[i]));
+
+		result = run_array(array, count, sample_rate);
+
+		mpu_array_destroy(array);
+	}
+
+	for (i = 0; i < n; i++)
+		mpu_sim_destroy(sims[i]);
+
+	return result;
+}
+
+// The parallel init once, then count sets read through the array
+int run_array(mpu_array_t *array, int count, int sample_rate)
+{
+	mpudata_t out[MPU_ARRAY_MAX_DEVS];
+	mpu_array_stats_t stats;
+	unsigned long long start, period_ns;
+	int result;
+	bench_t b;
+
+	period_ns = 1000000000ULL / sample_rate;
+
+	if (bench_alloc(&b, "mpu_array_init", 1))
+		return -1;
+
+	sprintf(b.param, "%d imus", mpu_array_count(array));
+	b.items = mpu_array_count(array);
+	b.unit = "imus";
+
+	start = mono_ns();
+	result = mpu_array_init(array, sample_rate, DEFAULT_YAW_MIX_FACTOR);
+	b.ns[b.n++] = mono_ns() - start;
+
+	bench_report(&b);
+
+	if (result) {
+		printf("mpu_array_init() failed at %d Hz\n", sample_rate);
+		return -1;
+	}
+
+	if (mpu_array_start(array, 256)) {
+		printf("mpu_array_start() failed\n");
+		return -1;
+	}
+
+	if (bench_alloc(&b, "mpu_array_read", count) == 0) {
+		sprintf(b.param, "%d Hz", sample_rate);
+		b.items = mpu_array_count(array);
+		b.unit = "samples";
+
+		// a few periods without a set is a stall, give up
+		while (b.n < count) {
+			start = mono_ns();
+
+			if (mpu_array_read(array, out, NULL, 4000 / sample_rate + 100))
+				break;
+
+			b.ns[b.n++] = mono_ns() - start;
+		}
+
+		bench_report(&b);
+	}
+
+	mpu_array_stop(array);
+	mpu_array_get_stats(array, &stats);
+
+	printf("mpu_array: %lu sets, %lu skipped, %lu dropped, %lu read errors, "
+		"max skew %0.2f ms of a %0.2f ms period\n",
+		stats.sets, stats.skipped, stats.dropped, stats.read_errors,
+		stats.max_skew_ns / 1.0e6, period_ns / 1.0e6);
+
+	if (stats.sets == 0 || stats.max_skew_ns >= period_ns) {
+		printf("mpu_array: sets not lined up at %d Hz\n", sample_rate);
+		return -1;
+	}
+
+	return 0;
+}
+
+void print_sim_stats(mpu_sim_t *sim)
+{
+	mpu_sim_stats_t stats;
+
+	mpu_sim_get_stats(sim, &stats);
+
+	printf("\nsimulated: %lu transfers, %lu failed, %lu bytes, %lu samples, "
+		"%lu packets, %lu FIFO overflows, %lu compass samples\n",
+		stats.transfers, stats.failed, stats.bytes, stats.samples,
+		stats.packets, stats.overflows, stats.compass_samples);
+}
+
+unsigned long long mono_ns()
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (unsigned long long)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+void sleep_us(long us)
+{
+	struct timespec ts;
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+
+	nanosleep(&ts, NULL);
+}
@@ -54,7 +54,7 @@ void usage(char *argv_0)
 {
 	printf("\nUsage: %s <-a | -m> [options]\n", argv_0);
 	printf("  -b <i2c-bus>          The I2C bus number where the IMU is. The default is 1 for /dev/i2c-1.\n");
-	printf("  -s <sample-rate>      The IMU sample rate in Hz. Range 2-50, default 10.\n");
+	printf("  -s <sample-rate>      The IMU sample rate in Hz. Range 2-200, default 10.\n");
 	printf("  -a                    Accelerometer calibration\n");
     printf("  -m                    Magnetometer calibration\n");
     printf("                        Accel and mag modes are mutually exclusive, but one must be chosen.\n");
@@ -0,0 +1,344 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+
+#include "mpu9150.h"
+#include "mpu_log.h"
+#include "local_defaults.h"
+
+int set_cal(int mag, char *cal_file);
+void replay_loop(mpu_log_t *log, int realtime, int quiet);
+void print_csv(mpudata_t *mpu, unsigned long long start_ns);
+unsigned long long mono_ns();
+void register_sig_handler();
+void sigint_handler(int sig);
+
+int done;
+
+void usage(char *argv_0)
+{
+	printf("\nUsage: %s [options] <log-file>\n", argv_0);
+	printf("  -y <yaw-mix-factor>   Effect of mag yaw on fused yaw data, as for imu.\n");
+	printf("                           The default is 4.\n");
+	printf("  -f <fusion>           yawmix, madgwick, mahony or ekf. The default is yawmix.\n");
+	printf("  -g <gain>             Fusion gain, 0 for the engine default.\n");
+	printf("  -a <accelcal file>    Path to accelerometer calibration file. Default is ./accelcal.txt\n");
+	printf("  -m <magcal file>      Path to mag calibration file. Default is ./magcal.txt\n");
+	printf("  -r                    Replay in real time instead of as fast as possible\n");
+	printf("  -q                    No per sample output, only the summary\n");
+	printf("  -v                    Verbose messages\n");
+	printf("  -h                    Show this help\n");
+
+	printf("\nEach sample is printed as t,roll,pitch,yaw,qw,qx,qy,qz with t in seconds\n");
+	printf("from the start of the log and angles in degrees.\n");
+
+	printf("\nExample: %s -y10 imu.log > fused.csv\n\n", argv_0);
+
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, len;
+	int yaw_mix_factor = DEFAULT_YAW_MIX_FACTOR;
+	int fusion = FUSION_YAW_MIX;
+	float gain = 0.0f;
+	int realtime = 0;
+	int quiet = 0;
+	int verbose = 0;
+	char *mag_cal_file = NULL;
+	char *accel_cal_file = NULL;
+	mpu_log_t log;
+
+	while ((opt = getopt(argc, argv, "y:f:g:a:m:rqvh")) != -1) {
+		switch (opt) {
+		case 'y':
+			yaw_mix_factor = strtoul(optarg, NULL, 0);
+
+			if (errno == EINVAL)
+				usage(argv[0]);
+
+			if (yaw_mix_factor < 0 || yaw_mix_factor > 100)
+				usage(argv[0]);
+
+			break;
+
+		case 'f':
+			fusion = fusion_engine_id(optarg);
+
+			if (fusion < 0)
+				usage(argv[0]);
+
+			break;
+
+		case 'g':
+			gain = strtof(optarg, NULL);
+			break;
+
+		case 'a':
+			len = 1 + strlen(optarg);
+
+			accel_cal_file = (char *)malloc(len);
+
+			if (!accel_cal_file) {
+				perror("malloc");
+				exit(1);
+			}
+
+			strcpy(accel_cal_file, optarg);
+			break;
+
+		case 'm':
+			len = 1 + strlen(optarg);
+
+			mag_cal_file = (char *)malloc(len);
+
+			if (!mag_cal_file) {
+				perror("malloc");
+				exit(1);
+			}
+
+			strcpy(mag_cal_file, optarg);
+			break;
+
+		case 'r':
+			realtime = 1;
+			break;
+
+		case 'q':
+			quiet = 1;
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		case 'h':
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	if (mpu_log_open(&log, argv[optind]))
+		exit(1);
+
+	register_sig_handler();
+
+	mpu9150_set_debug(verbose);
+	mpu9150_set_raw_mode(log.header.flags & MPU_LOG_RAW_MODE);
+	mpu9150_set_fusion(fusion, gain);
+
+	if (mpu9150_replay_init(log.header.sampleRate, yaw_mix_factor,
+			log.header.gyroScale, log.header.accelScale)) {
+		mpu_log_close(&log);
+		exit(1);
+	}
+
+	set_cal(0, accel_cal_file);
+	set_cal(1, mag_cal_file);
+
+	if (accel_cal_file)
+		free(accel_cal_file);
+
+	if (mag_cal_file)
+		free(mag_cal_file);
+
+	if (verbose)
+		fprintf(stderr, "%s: %d Hz%s\n", argv[optind], log.header.sampleRate,
+			(log.header.flags & MPU_LOG_RAW_MODE) ? ", raw mode" : "");
+
+	replay_loop(&log, realtime, quiet);
+
+	mpu_log_close(&log);
+
+	return 0;
+}
+
+void replay_loop(mpu_log_t *log, int realtime, int quiet)
+{
+	unsigned long long first_ns = 0;
+	unsigned long long wall_start;
+	unsigned long long target;
+	unsigned long failed = 0;
+	struct timespec ts;
+	mpudata_t mpu;
+	double elapsed;
+
+	wall_start = mono_ns();
+
+	while (!done && mpu_log_read(log, &mpu) == 0) {
+		if (!first_ns)
+			first_ns = mpu.dmpTimestampNs;
+
+		// keep the recorded spacing, measured from the first sample
+		if (realtime && mpu.dmpTimestampNs > first_ns) {
+			target = wall_start + (mpu.dmpTimestampNs - first_ns);
+			ts.tv_sec = target / 1000000000ULL;
+			ts.tv_nsec = target % 1000000000ULL;
+
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !done)
+				;
+		}
+
+		if (mpu9150_replay(&mpu)) {
+			failed++;
+			continue;
+		}
+
+		if (!quiet)
+			print_csv(&mpu, first_ns);
+	}
+
+	elapsed = (mono_ns() - wall_start) / 1.0e9;
+
+	fprintf(stderr, "%lu samples, %lu not fused, %0.3f s", log->records, failed, elapsed);
+
+	if (elapsed > 0.0)
+		fprintf(stderr, ", %0.0f samples/s", log->records / elapsed);
+
+	fprintf(stderr, "\n");
+}
+
+void print_csv(mpudata_t *mpu, unsigned long long start_ns)
+{
+	printf("%0.6f,%0.2f,%0.2f,%0.2f,%0.4f,%0.4f,%0.4f,%0.4f\n",
+			(mpu->dmpTimestampNs - start_ns) / 1.0e9,
+			mpu->fusedEuler[VEC3_X] * RAD_TO_DEGREE,
+			mpu->fusedEuler[VEC3_Y] * RAD_TO_DEGREE,
+			mpu->fusedEuler[VEC3_Z] * RAD_TO_DEGREE,
+			mpu->fusedQuat[QUAT_W],
+			mpu->fusedQuat[QUAT_X],
+			mpu->fusedQuat[QUAT_Y],
+			mpu->fusedQuat[QUAT_Z]);
+}
+
+unsigned long long mono_ns()
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (unsigned long long)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+int set_cal(int mag, char *cal_file)
+{
+	int i;
+	FILE *f;
+	char buff[32];
+	long val[6];
+	caldata_t cal;
+
+	if (cal_file) {
+		f = fopen(cal_file, "r");
+		
+		if (!f) {
+			perror("open(<cal-file>)");
+			return -1;
+		}
+	}
+	else {
+		if (mag) {
+			f = fopen("./magcal.txt", "r");
+		
+			if (!f) {
+				fprintf(stderr, "Default magcal.txt not found\n");
+				return 0;
+			}
+		}
+		else {
+			f = fopen("./accelcal.txt", "r");
+		
+			if (!f) {
+				fprintf(stderr, "Default accelcal.txt not found\n");
+				return 0;
+			}
+		}		
+	}
+
+	memset(buff, 0, sizeof(buff));
+	
+	for (i = 0; i < 6; i++) {
+		if (!fgets(buff, 20, f)) {
+			fprintf(stderr, "Not enough lines in calibration file\n");
+			break;
+		}
+
+		val[i] = atoi(buff);
+
+		if (val[i] == 0) {
+			fprintf(stderr, "Invalid cal value: %s\n", buff);
+			break;
+		}
+	}
+
+	fclose(f);
+
+	if (i != 6) 
+		return -1;
+
+	cal.offset[0] = (short)((val[0] + val[1]) / 2);
+	cal.offset[1] = (short)((val[2] + val[3]) / 2);
+	cal.offset[2] = (short)((val[4] + val[5]) / 2);
+
+	cal.range[0] = (short)(val[1] - cal.offset[0]);
+	cal.range[1] = (short)(val[3] - cal.offset[1]);
+	cal.range[2] = (short)(val[5] - cal.offset[2]);
+	
+	if (mag) 
+		mpu9150_set_mag_cal(&cal);
+	else 
+		mpu9150_set_accel_cal(&cal);
+
+	return 0;
+}
+
+void register_sig_handler()
+{
+	struct sigaction sia;
+
+	bzero(&sia, sizeof sia);
+	sia.sa_handler = sigint_handler;
+
+	if (sigaction(SIGINT, &sia, NULL) < 0) {
+		perror("sigaction(SIGINT)");
+		exit(1);
+	} 
+}
+
+void sigint_handler(int sig)
+{
+	done = 1;
+}
@@ -0,0 +1,648 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <string.h>
+
+#include "fusion.h"
+
+#define GRAVITY_MSS			9.80665f
+
+#define MADGWICK_BETA		0.1f
+#define MAHONY_KP			1.0f
+
+// EKF noise, gain replaces the accel direction noise
+#define EKF_ACCEL_NOISE		0.05f
+#define EKF_MAG_NOISE		0.1f
+#define EKF_GYRO_NOISE		0.01f		// rad/s
+#define EKF_BIAS_NOISE		0.0001f		// rad/s^2
+#define EKF_INIT_ANGLE		0.1f		// rad
+#define EKF_INIT_BIAS		0.02f		// rad/s
+
+static int vectorNormalize(vector3d_t v)
+{
+	float length = sqrtf(v[VEC3_X] * v[VEC3_X] + v[VEC3_Y] * v[VEC3_Y] + v[VEC3_Z] * v[VEC3_Z]);
+
+	if (length == 0.0f)
+		return -1;
+
+	v[VEC3_X] /= length;
+	v[VEC3_Y] /= length;
+	v[VEC3_Z] /= length;
+
+	return 0;
+}
+
+// d = R(q) v, body to earth
+static void rotateToEarth(quaternion_t q, vector3d_t v, vector3d_t d)
+{
+	float w = q[QUAT_W], x = q[QUAT_X], y = q[QUAT_Y], z = q[QUAT_Z];
+
+	d[VEC3_X] = (1.0f - 2.0f * (y * y + z * z)) * v[VEC3_X] + 2.0f * (x * y - w * z) * v[VEC3_Y]
+				+ 2.0f * (x * z + w * y) * v[VEC3_Z];
+	d[VEC3_Y] = 2.0f * (x * y + w * z) * v[VEC3_X] + (1.0f - 2.0f * (x * x + z * z)) * v[VEC3_Y]
+				+ 2.0f * (y * z - w * x) * v[VEC3_Z];
+	d[VEC3_Z] = 2.0f * (x * z - w * y) * v[VEC3_X] + 2.0f * (y * z + w * x) * v[VEC3_Y]
+				+ (1.0f - 2.0f * (x * x + y * y)) * v[VEC3_Z];
+}
+
+// d = R(q)' v, earth to body
+static void rotateToBody(quaternion_t q, vector3d_t v, vector3d_t d)
+{
+	float w = q[QUAT_W], x = q[QUAT_X], y = q[QUAT_Y], z = q[QUAT_Z];
+
+	d[VEC3_X] = (1.0f - 2.0f * (y * y + z * z)) * v[VEC3_X] + 2.0f * (x * y + w * z) * v[VEC3_Y]
+				+ 2.0f * (x * z - w * y) * v[VEC3_Z];
+	d[VEC3_Y] = 2.0f * (x * y - w * z) * v[VEC3_X] + (1.0f - 2.0f * (x * x + z * z)) * v[VEC3_Y]
+				+ 2.0f * (y * z + w * x) * v[VEC3_Z];
+	d[VEC3_Z] = 2.0f * (x * z + w * y) * v[VEC3_X] + 2.0f * (y * z - w * x) * v[VEC3_Y]
+				+ (1.0f - 2.0f * (x * x + y * y)) * v[VEC3_Z];
+}
+
+// q += q * (0, w) * dt / 2
+static void integrateRate(quaternion_t q, vector3d_t w, float dt)
+{
+	quaternion_t rate;
+	quaternion_t dq;
+
+	rate[QUAT_W] = 0.0f;
+	rate[QUAT_X] = w[VEC3_X];
+	rate[QUAT_Y] = w[VEC3_Y];
+	rate[QUAT_Z] = w[VEC3_Z];
+
+	quaternionMultiply(q, rate, dq);
+
+	q[QUAT_W] += 0.5f * dq[QUAT_W] * dt;
+	q[QUAT_X] += 0.5f * dq[QUAT_X] * dt;
+	q[QUAT_Y] += 0.5f * dq[QUAT_Y] * dt;
+	q[QUAT_Z] += 0.5f * dq[QUAT_Z] * dt;
+
+	quaternionNormalize(q);
+}
+
+// The measured mag with its horizontal part swung onto earth x. This is
+// where the two filters below expect to see the field.
+static void magReference(quaternion_t q, vector3d_t mag, vector3d_t ref)
+{
+	vector3d_t h;
+
+	rotateToEarth(q, mag, h);
+
+	ref[VEC3_X] = sqrtf(h[VEC3_X] * h[VEC3_X] + h[VEC3_Y] * h[VEC3_Y]);
+	ref[VEC3_Y] = 0.0f;
+	ref[VEC3_Z] = h[VEC3_Z];
+}
+
+// Start from the measured tilt and heading instead of waiting for the
+// filter to converge from level
+static int initFromVectors(fusion_state_t *fs, vector3d_t accel, vector3d_t mag)
+{
+	vector3d_t north, west, up;
+	vector3d_t bodyX = { 1.0f, 0.0f, 0.0f };
+	float r[3][3];
+	float trace, s;
+	int i;
+
+	memcpy(up, accel, sizeof(up));
+
+	if (vectorNormalize(up))
+		return -1;
+
+	vector3CrossProduct(up, mag, west);
+
+	// without a heading body x points north
+	if (vectorNormalize(west)) {
+		vector3CrossProduct(up, bodyX, west);
+
+		if (vectorNormalize(west))
+			return -1;
+	}
+
+	vector3CrossProduct(west, up, north);
+
+	for (i = 0; i < 3; i++) {
+		r[0][i] = north[i];
+		r[1][i] = west[i];
+		r[2][i] = up[i];
+	}
+
+	trace = r[0][0] + r[1][1] + r[2][2];
+
+	if (trace > 0.0f) {
+		s = 2.0f * sqrtf(trace + 1.0f);
+		fs->q[QUAT_W] = s / 4.0f;
+		fs->q[QUAT_X] = (r[2][1] - r[1][2]) / s;
+		fs->q[QUAT_Y] = (r[0][2] - r[2][0]) / s;
+		fs->q[QUAT_Z] = (r[1][0] - r[0][1]) / s;
+	}
+	else if (r[0][0] > r[1][1] && r[0][0] > r[2][2]) {
+		s = 2.0f * sqrtf(1.0f + r[0][0] - r[1][1] - r[2][2]);
+		fs->q[QUAT_W] = (r[2][1] - r[1][2]) / s;
+		fs->q[QUAT_X] = s / 4.0f;
+		fs->q[QUAT_Y] = (r[0][1] + r[1][0]) / s;
+		fs->q[QUAT_Z] = (r[0][2] + r[2][0]) / s;
+	}
+	else if (r[1][1] > r[2][2]) {
+		s = 2.0f * sqrtf(1.0f + r[1][1] - r[0][0] - r[2][2]);
+		fs->q[QUAT_W] = (r[0][2] - r[2][0]) / s;
+		fs->q[QUAT_X] = (r[0][1] + r[1][0]) / s;
+		fs->q[QUAT_Y] = s / 4.0f;
+		fs->q[QUAT_Z] = (r[1][2] + r[2][1]) / s;
+	}
+	else {
+		s = 2.0f * sqrtf(1.0f + r[2][2] - r[0][0] - r[1][1]);
+		fs->q[QUAT_W] = (r[1][0] - r[0][1]) / s;
+		fs->q[QUAT_X] = (r[0][2] + r[2][0]) / s;
+		fs->q[QUAT_Y] = (r[1][2] + r[2][1]) / s;
+		fs->q[QUAT_Z] = s / 4.0f;
+	}
+
+	quaternionNormalize(fs->q);
+	fs->initialized = 1;
+
+	return 0;
+}
+
+static void resetCommon(fusion_state_t *fs)
+{
+	fs->q[QUAT_W] = 1.0f;
+	fs->q[QUAT_X] = 0.0f;
+	fs->q[QUAT_Y] = 0.0f;
+	fs->q[QUAT_Z] = 0.0f;
+
+	memset(fs->euler, 0, sizeof(fs->euler));
+
+	fs->initialized = 0;
+}
+
+//  Yaw-mix, the original DMP + compass complementary blend
+
+// The x and y of q * mag * q' for q = pitch * roll, written out. The z
+// isn't needed for the heading.
+static void tiltCompensate(vector3d_t mag, vector3d_t sinTilt, vector3d_t cosTilt, float *x, float *y)
+{
+	float rolledZ = sinTilt[VEC3_X] * mag[VEC3_Y] + cosTilt[VEC3_X] * mag[VEC3_Z];
+
+	*x = cosTilt[VEC3_Y] * mag[VEC3_X] + sinTilt[VEC3_Y] * rolledZ;
+	*y = cosTilt[VEC3_X] * mag[VEC3_Y] - sinTilt[VEC3_X] * mag[VEC3_Z];
+}
+
+static void yawMixReset(fusion_state_t *fs)
+{
+	resetCommon(fs);
+
+	fs->lastDMPYaw = 0.0f;
+	fs->lastYaw = 0.0f;
+}
+
+static int yawMixUpdate(fusion_state_t *fs, const fusion_input_t *in)
+{
+	quaternion_t dmpQuat;
+	vector3d_t sinTilt;
+	vector3d_t cosTilt;
+	vector3d_t mag;
+	float dmpYaw;
+	float magX, magY;
+	float deltaDMPYaw;
+	float deltaMagYaw;
+	float newMagYaw;
+	float newYaw;
+
+	if (!in->dmpQuat)
+		return -1;
+
+	dmpQuat[QUAT_W] = (float)in->dmpQuat[QUAT_W];
+	dmpQuat[QUAT_X] = (float)in->dmpQuat[QUAT_X];
+	dmpQuat[QUAT_Y] = (float)in->dmpQuat[QUAT_Y];
+	dmpQuat[QUAT_Z] = (float)in->dmpQuat[QUAT_Z];
+
+	quaternionNormalize(dmpQuat);
+
+	// the fused pitch is the DMP pitch negated, flip it once here
+	quaternionToTilt(dmpQuat, sinTilt, cosTilt);
+	sinTilt[VEC3_Y] = -sinTilt[VEC3_Y];
+
+	fs->euler[VEC3_X] = atan2f(sinTilt[VEC3_X], cosTilt[VEC3_X]);
+	fs->euler[VEC3_Y] = asinf(sinTilt[VEC3_Y]);
+
+	dmpYaw = atan2f(2.0f * (dmpQuat[QUAT_X] * dmpQuat[QUAT_Y] + dmpQuat[QUAT_W] * dmpQuat[QUAT_Z]),
+			1.0f - 2.0f * (dmpQuat[QUAT_Y] * dmpQuat[QUAT_Y] + dmpQuat[QUAT_Z] * dmpQuat[QUAT_Z]));
+
+	deltaDMPYaw = -dmpYaw + fs->lastDMPYaw;
+	fs->lastDMPYaw = dmpYaw;
+
+	// this blend was tuned on calibratedMag axes, undo the sensor frame
+	mag[VEC3_X] = in->mag[VEC3_X];
+	mag[VEC3_Y] = -in->mag[VEC3_Y];
+	mag[VEC3_Z] = -in->mag[VEC3_Z];
+
+	tiltCompensate(mag, sinTilt, cosTilt, &magX, &magY);
+
+	newMagYaw = -atan2f(magY, magX);
+
+	if (newMagYaw != newMagYaw)
+		return -1;
+
+	if (newMagYaw < 0.0f)
+		newMagYaw = TWO_PI + newMagYaw;
+
+	newYaw = fs->lastYaw + deltaDMPYaw;
+
+	if (newYaw > TWO_PI)
+		newYaw -= TWO_PI;
+	else if (newYaw < 0.0f)
+		newYaw += TWO_PI;
+
+	deltaMagYaw = newMagYaw - newYaw;
+
+	if (deltaMagYaw >= (float)M_PI)
+		deltaMagYaw -= TWO_PI;
+	else if (deltaMagYaw < -(float)M_PI)
+		deltaMagYaw += TWO_PI;
+
+	if (fs->mixFactor > 0)
+		newYaw += deltaMagYaw / fs->mixFactor;
+
+	if (newYaw > TWO_PI)
+		newYaw -= TWO_PI;
+	else if (newYaw < 0.0f)
+		newYaw += TWO_PI;
+
+	fs->lastYaw = newYaw;
+
+	if (newYaw > (float)M_PI)
+		newYaw -= TWO_PI;
+
+	fs->euler[VEC3_Z] = newYaw;
+
+	tiltYawToQuaternion(sinTilt, cosTilt, newYaw, fs->q);
+
+	return 0;
+}
+
+//  Madgwick, gradient descent on the accel and mag direction errors
+
+// grad += J' f for f = R(q)' ref - meas
+static void addGradient(quaternion_t q, vector3d_t ref, vector3d_t meas, quaternion_t grad)
+{
+	float w = q[QUAT_W], x = q[QUAT_X], y = q[QUAT_Y], z = q[QUAT_Z];
+	float dx = ref[VEC3_X], dy = ref[VEC3_Y], dz = ref[VEC3_Z];
+	vector3d_t f;
+
+	rotateToBody(q, ref, f);
+
+	f[VEC3_X] -= meas[VEC3_X];
+	f[VEC3_Y] -= meas[VEC3_Y];
+	f[VEC3_Z] -= meas[VEC3_Z];
+
+	grad[QUAT_W] += 2.0f * ((z * dy - y * dz) * f[VEC3_X] + (x * dz - z * dx) * f[VEC3_Y]
+					+ (y * dx - x * dy) * f[VEC3_Z]);
+	grad[QUAT_X] += 2.0f * ((y * dy + z * dz) * f[VEC3_X] + (y * dx - 2.0f * x * dy + w * dz) * f[VEC3_Y]
+					+ (z * dx - w * dy - 2.0f * x * dz) * f[VEC3_Z]);
+	grad[QUAT_Y] += 2.0f * ((x * dy - 2.0f * y * dx - w * dz) * f[VEC3_X] + (x * dx + z * dz) * f[VEC3_Y]
+					+ (w * dx + z * dy - 2.0f * y * dz) * f[VEC3_Z]);
+	grad[QUAT_Z] += 2.0f * ((w * dy - 2.0f * z * dx + x * dz) * f[VEC3_X]
+					+ (y * dz - w * dx - 2.0f * z * dy) * f[VEC3_Y] + (x * dx + y * dy) * f[VEC3_Z]);
+}
+
+static void madgwickReset(fusion_state_t *fs)
+{
+	resetCommon(fs);
+}
+
+static int madgwickUpdate(fusion_state_t *fs, const fusion_input_t *in)
+{
+	vector3d_t accel, mag, ref;
+	vector3d_t up = { 0.0f, 0.0f, 1.0f };
+	quaternion_t grad = { 0.0f, 0.0f, 0.0f, 0.0f };
+	quaternion_t rate;
+	quaternion_t dq;
+	vector3d_t gyro;
+	int haveMag;
+	int i;
+
+	memcpy(accel, in->accel, sizeof(accel));
+	memcpy(mag, in->mag, sizeof(mag));
+	memcpy(gyro, in->gyro, sizeof(gyro));
+
+	haveMag = !vectorNormalize(mag);
+
+	if (vectorNormalize(accel)) {
+		integrateRate(fs->q, gyro, in->dt);
+		return 0;
+	}
+
+	if (!fs->initialized)
+		return initFromVectors(fs, accel, mag);
+
+	addGradient(fs->q, up, accel, grad);
+
+	if (haveMag) {
+		magReference(fs->q, mag, ref);
+		addGradient(fs->q, ref, mag, grad);
+	}
+
+	quaternionNormalize(grad);
+
+	// rate from the gyro less a step down the gradient
+	rate[QUAT_W] = 0.0f;
+	rate[QUAT_X] = gyro[VEC3_X];
+	rate[QUAT_Y] = gyro[VEC3_Y];
+	rate[QUAT_Z] = gyro[VEC3_Z];
+	quaternionMultiply(fs->q, rate, dq);
+
+	for (i = 0; i < 4; i++)
+		fs->q[i] += (0.5f * dq[i] - fs->gain * grad[i]) * in->dt;
+
+	quaternionNormalize(fs->q);
+
+	return 0;
+}
+
+//  Mahony, PI feedback of the accel and mag direction errors into the rate
+
+static void mahonyReset(fusion_state_t *fs)
+{
+	resetCommon(fs);
+	memset(fs->integral, 0, sizeof(fs->integral));
+}
+
+static int mahonyUpdate(fusion_state_t *fs, const fusion_input_t *in)
+{
+	vector3d_t accel, mag, ref;
+	vector3d_t up = { 0.0f, 0.0f, 1.0f };
+	vector3d_t estimate, cross;
+	vector3d_t error = { 0.0f, 0.0f, 0.0f };
+	vector3d_t rate;
+	float ki = fs->gain / 20.0f;
+	int i;
+
+	memcpy(accel, in->accel, sizeof(accel));
+	memcpy(mag, in->mag, sizeof(mag));
+	memcpy(rate, in->gyro, sizeof(rate));
+
+	if (!vectorNormalize(accel)) {
+		if (!fs->initialized)
+			return initFromVectors(fs, accel, mag);
+
+		rotateToBody(fs->q, up, estimate);
+		vector3CrossProduct(accel, estimate, error);
+
+		if (!vectorNormalize(mag)) {
+			magReference(fs->q, mag, ref);
+			rotateToBody(fs->q, ref, estimate);
+			vector3CrossProduct(mag, estimate, cross);
+
+			for (i = 0; i < 3; i++)
+				error[i] += cross[i];
+		}
+
+		for (i = 0; i < 3; i++) {
+			fs->integral[i] += ki * error[i] * in->dt;
+			rate[i] += fs->gain * error[i] + fs->integral[i];
+		}
+	}
+
+	integrateRate(fs->q, rate, in->dt);
+
+	return 0;
+}
+
+//  EKF on the attitude error and gyro bias, the quaternion is carried
+//  outside the state and corrected after each update
+
+static void ekfReset(fusion_state_t *fs)
+{
+	int i;
+
+	resetCommon(fs);
+	memset(fs->bias, 0, sizeof(fs->bias));
+	memset(fs->P, 0, sizeof(fs->P));
+
+	for (i = 0; i < 3; i++) {
+		fs->P[i * 6 + i] = EKF_INIT_ANGLE * EKF_INIT_ANGLE;
+		fs->P[(i + 3) * 6 + i + 3] = EKF_INIT_BIAS * EKF_INIT_BIAS;
+	}
+}
+
+// P = F P F' + Q for F = [I - [w x] dt, -I dt; 0, I]
+static void ekfPredict(fusion_state_t *fs, vector3d_t w, float dt)
+{
+	float F[36];
+	float FP[36];
+	float sum;
+	int i, j, k;
+
+	memset(F, 0, sizeof(F));
+
+	for (i = 0; i < 6; i++)
+		F[i * 6 + i] = 1.0f;
+
+	F[0 * 6 + 1] = w[VEC3_Z] * dt;
+	F[0 * 6 + 2] = -w[VEC3_Y] * dt;
+	F[1 * 6 + 0] = -w[VEC3_Z] * dt;
+	F[1 * 6 + 2] = w[VEC3_X] * dt;
+	F[2 * 6 + 0] = w[VEC3_Y] * dt;
+	F[2 * 6 + 1] = -w[VEC3_X] * dt;
+
+	for (i = 0; i < 3; i++)
+		F[i * 6 + i + 3] = -dt;
+
+	for (i = 0; i < 6; i++) {
+		for (j = 0; j < 6; j++) {
+			for (k = 0, sum = 0.0f; k < 6; k++)
+				sum += F[i * 6 + k] * fs->P[k * 6 + j];
+
+			FP[i * 6 + j] = sum;
+		}
+	}
+
+	for (i = 0; i < 6; i++) {
+		for (j = 0; j < 6; j++) {
+			for (k = 0, sum = 0.0f; k < 6; k++)
+				sum += FP[i * 6 + k] * F[j * 6 + k];
+
+			fs->P[i * 6 + j] = sum;
+		}
+	}
+
+	for (i = 0; i < 3; i++) {
+		fs->P[i * 6 + i] += EKF_GYRO_NOISE * EKF_GYRO_NOISE * dt;
+		fs->P[(i + 3) * 6 + i + 3] += EKF_BIAS_NOISE * EKF_BIAS_NOISE * dt;
+	}
+}
+
+// Three scalar updates for z = R(q)' ref, H = [[h x], 0]. Scalar updates
+// with a diagonal R need no matrix inverse.
+static void ekfObserve(fusion_state_t *fs, vector3d_t ref, vector3d_t meas, float noise, float *dx)
+{
+	vector3d_t h;
+	float H[3][3];
+	float PHt[6];
+	float innovation, s;
+	int i, j, k;
+
+	rotateToBody(fs->q, ref, h);
+
+	H[0][0] = 0.0f;			H[0][1] = -h[VEC3_Z];	H[0][2] = h[VEC3_Y];
+	H[1][0] = h[VEC3_Z];	H[1][1] = 0.0f;			H[1][2] = -h[VEC3_X];
+	H[2][0] = -h[VEC3_Y];	H[2][1] = h[VEC3_X];	H[2][2] = 0.0f;
+
+	for (k = 0; k < 3; k++) {
+		innovation = meas[k] - h[k];
+		s = noise * noise;
+
+		for (i = 0; i < 6; i++) {
+			PHt[i] = 0.0f;
+
+			for (j = 0; j < 3; j++)
+				PHt[i] += fs->P[i * 6 + j] * H[k][j];
+		}
+
+		for (j = 0; j < 3; j++) {
+			s += H[k][j] * PHt[j];
+			innovation -= H[k][j] * dx[j];
+		}
+
+		for (i = 0; i < 6; i++)
+			dx[i] += PHt[i] / s * innovation;
+
+		for (i = 0; i < 6; i++)
+			for (j = 0; j < 6; j++)
+				fs->P[i * 6 + j] -= PHt[i] * PHt[j] / s;
+	}
+}
+
+static int ekfUpdate(fusion_state_t *fs, const fusion_input_t *in)
+{
+	vector3d_t accel, mag, ref;
+	vector3d_t up = { 0.0f, 0.0f, 1.0f };
+	vector3d_t rate;
+	quaternion_t dq, q;
+	float dx[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+	float accelNoise;
+	int haveAccel, haveMag;
+	int i;
+
+	memcpy(accel, in->accel, sizeof(accel));
+	memcpy(mag, in->mag, sizeof(mag));
+
+	// off 1 g means acceleration other than gravity, trust it less
+	accelNoise = sqrtf(accel[VEC3_X] * accel[VEC3_X] + accel[VEC3_Y] * accel[VEC3_Y]
+			+ accel[VEC3_Z] * accel[VEC3_Z]);
+	accelNoise = fs->gain * (1.0f + 10.0f * fabsf(accelNoise / GRAVITY_MSS - 1.0f));
+
+	haveAccel = !vectorNormalize(accel);
+	haveMag = !vectorNormalize(mag);
+
+	if (!fs->initialized && haveAccel)
+		return initFromVectors(fs, accel, mag);
+
+	for (i = 0; i < 3; i++)
+		rate[i] = in->gyro[i] - fs->bias[i];
+
+	integrateRate(fs->q, rate, in->dt);
+	ekfPredict(fs, rate, in->dt);
+
+	if (haveAccel)
+		ekfObserve(fs, up, accel, accelNoise, dx);
+
+	if (haveMag) {
+		magReference(fs->q, mag, ref);
+		ekfObserve(fs, ref, mag, EKF_MAG_NOISE, dx);
+	}
+
+	// fold the error back into the quaternion and the bias
+	dq[QUAT_W] = 1.0f;
+	dq[QUAT_X] = dx[0] / 2.0f;
+	dq[QUAT_Y] = dx[1] / 2.0f;
+	dq[QUAT_Z] = dx[2] / 2.0f;
+
+	quaternionMultiply(fs->q, dq, q);
+	memcpy(fs->q, q, sizeof(q));
+	quaternionNormalize(fs->q);
+
+	for (i = 0; i < 3; i++)
+		fs->bias[i] += dx[i + 3];
+
+	return 0;
+}
+
+static const fusion_engine_t engines[FUSION_ENGINES] = {
+	{ "yawmix", yawMixReset, yawMixUpdate },
+	{ "madgwick", madgwickReset, madgwickUpdate },
+	{ "mahony", mahonyReset, mahonyUpdate },
+	{ "ekf", ekfReset, ekfUpdate }
+};
+
+static const float defaultGain[FUSION_ENGINES] = {
+	0.0f, MADGWICK_BETA, MAHONY_KP, EKF_ACCEL_NOISE
+};
+
+const fusion_engine_t *fusion_engine(int id)
+{
+	if (id < 0 || id >= FUSION_ENGINES)
+		return NULL;
+
+	return &engines[id];
+}
+
+int fusion_engine_id(const char *name)
+{
+	int i;
+
+	for (i = 0; i < FUSION_ENGINES; i++) {
+		if (!strcmp(name, engines[i].name))
+			return i;
+	}
+
+	return -1;
+}
+
+int fusion_init(fusion_state_t *fs, int id, float gain, int mixFactor)
+{
+	memset(fs, 0, sizeof(fusion_state_t));
+
+	fs->engine = fusion_engine(id);
+
+	if (!fs->engine)
+		return -1;
+
+	fs->gain = gain > 0.0f ? gain : defaultGain[id];
+	fs->mixFactor = mixFactor;
+
+	fs->engine->reset(fs);
+
+	return 0;
+}
+
+int fusion_update(fusion_state_t *fs, const fusion_input_t *in)
+{
+	if (fs->engine->update(fs, in))
+		return -1;
+
+	// yaw-mix has its own Euler angles, the rest come from q
+	if (fs->engine != &engines[FUSION_YAW_MIX])
+		quaternionToEuler(fs->q, fs->euler);
+
+	return 0;
+}
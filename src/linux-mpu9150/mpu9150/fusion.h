@@ -0,0 +1,95 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef MPU_FUSION_H
+#define MPU_FUSION_H
+
+#include "quaternion.h"
+
+// Orientation filters behind one interface. Every engine but yaw-mix
+// works in the MPU-9150 sensor frame from gyro, accel and mag alone, so
+// it runs the same on DMP packets or raw mode samples. The result is the
+// body to earth rotation with earth x at magnetic north and z up.
+
+#define FUSION_YAW_MIX		0	// DMP 6-axis quaternion, mag yaw blended in
+#define FUSION_MADGWICK		1	// gradient descent, gain is beta
+#define FUSION_MAHONY		2	// PI on the vector error, gain is Kp
+#define FUSION_EKF			3	// 6 state multiplicative EKF with gyro bias
+#define FUSION_ENGINES		4
+
+typedef struct {
+	// seconds since the last update
+	float dt;
+
+	// rad/s
+	vector3d_t gyro;
+
+	// m/s^2, the EKF trusts it less the further it is from 1 g
+	vector3d_t accel;
+
+	// only the direction is used, all zero when there is no reading
+	vector3d_t mag;
+
+	// q30 from the DMP, NULL without it
+	const long *dmpQuat;
+} fusion_input_t;
+
+typedef struct fusion_state_s fusion_state_t;
+
+typedef struct {
+	const char *name;
+	void (*reset)(fusion_state_t *fs);
+	int (*update)(fusion_state_t *fs, const fusion_input_t *in);
+} fusion_engine_t;
+
+struct fusion_state_s {
+	const fusion_engine_t *engine;
+	float gain;
+	int initialized;
+
+	quaternion_t q;
+	vector3d_t euler;
+
+	// yaw-mix
+	int mixFactor;
+	float lastDMPYaw;
+	float lastYaw;
+
+	// Mahony
+	vector3d_t integral;
+
+	// EKF, P is 6x6 row major over attitude error and gyro bias
+	vector3d_t bias;
+	float P[36];
+};
+
+// NULL or -1 for an unknown engine
+const fusion_engine_t *fusion_engine(int id);
+int fusion_engine_id(const char *name);
+
+// gain <= 0 picks the engine default
+int fusion_init(fusion_state_t *fs, int id, float gain, int mixFactor);
+int fusion_update(fusion_state_t *fs, const fusion_input_t *in);
+
+#endif /* MPU_FUSION_H */
+
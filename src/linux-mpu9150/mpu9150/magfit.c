@@ -0,0 +1,424 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#include "mpu9150.h"
+#include "magfit.h"
+
+// Readings are scaled down into the fit to keep its terms near 1
+#define MAGFIT_SCALE		(1.0 / 256.0)
+
+// Starting covariance, large as nothing is known yet
+#define MAGFIT_P0			1.0e4
+
+// Forgetting stops while the covariance is this big. It grows without new
+// directions coming in (sensor sitting at one heading) and would blow up.
+#define MAGFIT_MAX_TRACE	(MAGFIT_PARAMS * MAGFIT_P0)
+
+// Weight of the newest reading in fit->error
+#define MAGFIT_ERROR_GAIN	0.01
+
+// The fit has to explain readings to about this, as the rms error over
+// the squared radius it ends up with
+#define MAGFIT_MAX_ERROR	0.05
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size;
+	float matrix[9];
+	int16_t offset[3];
+	uint16_t reserved;
+	uint32_t check;
+} magfit_cache_t;
+
+static double regressors(const short *raw, double *phi);
+static int invert3(const double *m, double *inv);
+static void eigen3(const double *m, double *val, double *vec);
+static uint32_t cache_check(const magfit_cache_t *cache);
+
+void magfit_init(magfit_t *fit, float min_step, float forget)
+{
+	int i;
+
+	memset(fit, 0, sizeof(magfit_t));
+
+	for (i = 0; i < MAGFIT_PARAMS; i++)
+		fit->P[i * MAGFIT_PARAMS + i] = MAGFIT_P0;
+
+	fit->min_step = min_step > 0.0f ? min_step : 0.0f;
+
+	if (forget <= 0.0f || forget > 1.0f)
+		forget = MAGFIT_DEFAULT_FORGET;
+
+	fit->forget = forget;
+}
+
+int magfit_add(magfit_t *fit, const short *raw)
+{
+	double phi[MAGFIT_PARAMS], Pphi[MAGFIT_PARAMS];
+	double den, err, forget, trace;
+	float dx, dy, dz;
+	int i, j;
+
+	if (fit->samples > 0) {
+		dx = raw[0] - fit->last[0];
+		dy = raw[1] - fit->last[1];
+		dz = raw[2] - fit->last[2];
+
+		if (dx * dx + dy * dy + dz * dz < fit->min_step * fit->min_step)
+			return 0;
+	}
+
+	err = regressors(raw, phi);
+
+	den = 0.0;
+	trace = 0.0;
+
+	for (i = 0; i < MAGFIT_PARAMS; i++) {
+		Pphi[i] = 0.0;
+
+		for (j = 0; j < MAGFIT_PARAMS; j++)
+			Pphi[i] += fit->P[i * MAGFIT_PARAMS + j] * phi[j];
+
+		den += phi[i] * Pphi[i];
+		err -= phi[i] * fit->theta[i];
+		trace += fit->P[i * MAGFIT_PARAMS + i];
+	}
+
+	forget = trace < MAGFIT_MAX_TRACE ? fit->forget : 1.0;
+	den += forget;
+
+	for (i = 0; i < MAGFIT_PARAMS; i++)
+		fit->theta[i] += Pphi[i] * err / den;
+
+	// P = (P - P.phi.phi'.P / den) / forget, it stays symmetric
+	for (i = 0; i < MAGFIT_PARAMS; i++) {
+		for (j = 0; j < MAGFIT_PARAMS; j++) {
+			fit->P[i * MAGFIT_PARAMS + j] -= Pphi[i] * Pphi[j] / den;
+			fit->P[i * MAGFIT_PARAMS + j] /= forget;
+		}
+	}
+
+	fit->error += MAGFIT_ERROR_GAIN * (err * err - fit->error);
+
+	memcpy(fit->last, raw, sizeof(fit->last));
+	fit->samples++;
+
+	return 1;
+}
+
+int magfit_solve(magfit_t *fit, float *matrix, short *offset, float *radius)
+{
+	double M[9], Minv[9], val[3], vec[9], centre[3];
+	double k, r, rmin, rmax, rmean, w;
+	const double *t = fit->theta;
+	int i, j, n;
+
+	if (fit->samples < MAGFIT_MIN_SAMPLES)
+		return -1;
+
+	M[0] = 1.0 - t[0] - t[1];
+	M[4] = 1.0 - t[0] + 2.0 * t[1];
+	M[8] = 1.0 + 2.0 * t[0] - t[1];
+	M[1] = M[3] = -t[2];
+	M[2] = M[6] = -t[3];
+	M[5] = M[7] = -t[4];
+
+	if (invert3(M, Minv))
+		return -1;
+
+	// centre = M^-1 (g, h, i), then (p - centre)' M (p - centre) = k
+	for (i = 0; i < 3; i++)
+		centre[i] = Minv[i * 3] * t[5] + Minv[i * 3 + 1] * t[6] + Minv[i * 3 + 2] * t[7];
+
+	k = t[8];
+
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 3; j++)
+			k += centre[i] * M[i * 3 + j] * centre[j];
+
+	if (k <= 0.0 || fit->error > MAGFIT_MAX_ERROR * MAGFIT_MAX_ERROR * k * k)
+		return -1;
+
+	for (i = 0; i < 9; i++)
+		M[i] /= k;
+
+	// the semi axes are 1 / sqrt of the eigenvalues, all of them real
+	eigen3(M, val, vec);
+
+	rmin = rmax = 0.0;
+	rmean = 1.0;
+
+	for (i = 0; i < 3; i++) {
+		if (val[i] <= 0.0)
+			return -1;
+
+		r = 1.0 / sqrt(val[i]);
+
+		if (i == 0 || r < rmin)
+			rmin = r;
+
+		if (i == 0 || r > rmax)
+			rmax = r;
+
+		rmean *= r;
+	}
+
+	if (rmax > MAGFIT_MAX_AXIS_RATIO * rmin)
+		return -1;
+
+	rmean = cbrt(rmean);
+
+	for (i = 0; i < 3; i++) {
+		centre[i] /= MAGFIT_SCALE;
+
+		if (fabs(centre[i]) > MAG_SENSOR_RANGE)
+			return -1;
+	}
+
+	// R diag(rmean / r) R', stretching each axis onto the mean radius
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			w = 0.0;
+
+			for (n = 0; n < 3; n++)
+				w += vec[i * 3 + n] * rmean * sqrt(val[n]) * vec[j * 3 + n];
+
+			matrix[i * 3 + j] = (float)w;
+		}
+
+		offset[i] = (short)lround(centre[i]);
+	}
+
+	if (radius)
+		*radius = (float)(rmean / MAGFIT_SCALE);
+
+	return 0;
+}
+
+int magfit_save(const char *path, const float *matrix, const short *offset)
+{
+	magfit_cache_t cache;
+	char tmp[512];
+	FILE *f;
+	int i;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		return -1;
+
+	memset(&cache, 0, sizeof(cache));
+
+	cache.magic = MAGFIT_CACHE_MAGIC;
+	cache.version = MAGFIT_CACHE_VERSION;
+	cache.size = sizeof(cache);
+
+	for (i = 0; i < 9; i++)
+		cache.matrix[i] = matrix[i];
+
+	for (i = 0; i < 3; i++)
+		cache.offset[i] = offset[i];
+
+	cache.check = cache_check(&cache);
+
+	f = fopen(tmp, "wb");
+
+	if (!f) {
+		perror("fopen(magfit cache)");
+		return -1;
+	}
+
+	if (fwrite(&cache, sizeof(cache), 1, f) != 1) {
+		perror("fwrite(magfit cache)");
+		fclose(f);
+		remove(tmp);
+		return -1;
+	}
+
+	if (fclose(f)) {
+		perror("fclose(magfit cache)");
+		remove(tmp);
+		return -1;
+	}
+
+	if (rename(tmp, path)) {
+		perror("rename(magfit cache)");
+		remove(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+int magfit_load(const char *path, float *matrix, short *offset)
+{
+	magfit_cache_t cache;
+	FILE *f;
+	int i, n;
+
+	f = fopen(path, "rb");
+
+	if (!f)
+		return -1;
+
+	n = fread(&cache, sizeof(cache), 1, f);
+	fclose(f);
+
+	if (n != 1 || cache.magic != MAGFIT_CACHE_MAGIC || cache.version != MAGFIT_CACHE_VERSION
+			|| cache.size != sizeof(cache) || cache.check != cache_check(&cache)) {
+		printf("Ignoring bad mag cal cache %s\n", path);
+		return -1;
+	}
+
+	for (i = 0; i < 9; i++) {
+		if (!isfinite(cache.matrix[i])) {
+			printf("Ignoring bad mag cal cache %s\n", path);
+			return -1;
+		}
+
+		matrix[i] = cache.matrix[i];
+	}
+
+	for (i = 0; i < 3; i++)
+		offset[i] = cache.offset[i];
+
+	return 0;
+}
+
+// x^2 + y^2 - 2z^2, x^2 - 2y^2 + z^2, 2xy, 2xz, 2yz, 2x, 2y, 2z, 1 and
+// the target x^2 + y^2 + z^2 returned
+double regressors(const short *raw, double *phi)
+{
+	double x = raw[0] * MAGFIT_SCALE;
+	double y = raw[1] * MAGFIT_SCALE;
+	double z = raw[2] * MAGFIT_SCALE;
+
+	phi[0] = x * x + y * y - 2.0 * z * z;
+	phi[1] = x * x - 2.0 * y * y + z * z;
+	phi[2] = 2.0 * x * y;
+	phi[3] = 2.0 * x * z;
+	phi[4] = 2.0 * y * z;
+	phi[5] = 2.0 * x;
+	phi[6] = 2.0 * y;
+	phi[7] = 2.0 * z;
+	phi[8] = 1.0;
+
+	return x * x + y * y + z * z;
+}
+
+int invert3(const double *m, double *inv)
+{
+	double det;
+	int i;
+
+	inv[0] = m[4] * m[8] - m[5] * m[7];
+	inv[1] = m[2] * m[7] - m[1] * m[8];
+	inv[2] = m[1] * m[5] - m[2] * m[4];
+	inv[3] = m[5] * m[6] - m[3] * m[8];
+	inv[4] = m[0] * m[8] - m[2] * m[6];
+	inv[5] = m[2] * m[3] - m[0] * m[5];
+	inv[6] = m[3] * m[7] - m[4] * m[6];
+	inv[7] = m[1] * m[6] - m[0] * m[7];
+	inv[8] = m[0] * m[4] - m[1] * m[3];
+
+	det = m[0] * inv[0] + m[1] * inv[3] + m[2] * inv[6];
+
+	if (fabs(det) < 1.0e-12)
+		return -1;
+
+	for (i = 0; i < 9; i++)
+		inv[i] /= det;
+
+	return 0;
+}
+
+// Jacobi rotations on a symmetric 3x3, the eigenvectors end up in the
+// columns of vec
+void eigen3(const double *m, double *val, double *vec)
+{
+	double a[9], c, s, t, theta, tmp;
+	int sweep, p, q, r, i;
+
+	memcpy(a, m, sizeof(a));
+	memset(vec, 0, 9 * sizeof(double));
+	vec[0] = vec[4] = vec[8] = 1.0;
+
+	for (sweep = 0; sweep < 16; sweep++) {
+		if (fabs(a[1]) + fabs(a[2]) + fabs(a[5]) < 1.0e-15)
+			break;
+
+		for (p = 0; p < 2; p++) {
+			for (q = p + 1; q < 3; q++) {
+				if (a[p * 3 + q] == 0.0)
+					continue;
+
+				theta = (a[q * 3 + q] - a[p * 3 + p]) / (2.0 * a[p * 3 + q]);
+				t = (theta >= 0.0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+				c = 1.0 / sqrt(t * t + 1.0);
+				s = t * c;
+
+				// a = J' a J, one column then one row
+				for (r = 0; r < 3; r++) {
+					tmp = a[r * 3 + p];
+					a[r * 3 + p] = c * tmp - s * a[r * 3 + q];
+					a[r * 3 + q] = s * tmp + c * a[r * 3 + q];
+				}
+
+				for (r = 0; r < 3; r++) {
+					tmp = a[p * 3 + r];
+					a[p * 3 + r] = c * tmp - s * a[q * 3 + r];
+					a[q * 3 + r] = s * tmp + c * a[q * 3 + r];
+				}
+
+				for (r = 0; r < 3; r++) {
+					tmp = vec[r * 3 + p];
+					vec[r * 3 + p] = c * tmp - s * vec[r * 3 + q];
+					vec[r * 3 + q] = s * tmp + c * vec[r * 3 + q];
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < 3; i++)
+		val[i] = a[i * 3 + i];
+}
+
+uint32_t cache_check(const magfit_cache_t *cache)
+{
+	const unsigned char *p = (const unsigned char *)cache;
+	uint32_t a = 1, b = 0;
+	unsigned int i;
+
+	// Adler-32 over everything before the check itself
+	for (i = 0; i < offsetof(magfit_cache_t, check); i++) {
+		a = (a + p[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+
+	return (b << 16) | a;
+}
@@ -0,0 +1,85 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef MAGFIT_H
+#define MAGFIT_H
+
+// Online hard and soft iron fit for the mag, an alternative to imucal and
+// magcal.txt. Raw readings go into a recursive least squares fit of the
+// general ellipsoid, with the trace of its quadratic part held at 3
+//
+//   x^2 + y^2 + z^2 = u (x^2 + y^2 - 2z^2) + v (x^2 - 2y^2 + z^2)
+//       + 2d xy + 2e xz + 2f yz + 2g x + 2h y + 2i z + j
+//
+// which stays well conditioned wherever the hard iron offset puts the
+// centre and takes constant memory however long it runs. magfit_solve() turns the
+// fit into the offset and matrix mpu9150_set_mag_cal_matrix() wants, mapping
+// the ellipsoid back onto a sphere of the same mean radius.
+
+#define MAGFIT_PARAMS		9
+
+// Readings closer than this to the last one taken are skipped, so that
+// sitting still does not swamp the fit with one point
+#define MAGFIT_DEFAULT_MIN_STEP		8.0f
+
+// Per accepted reading, old readings fade out over roughly 1 / (1 - forget)
+#define MAGFIT_DEFAULT_FORGET		0.999f
+
+// magfit_solve() refuses fits from fewer readings or with a worse axis
+// ratio than this
+#define MAGFIT_MIN_SAMPLES		100
+#define MAGFIT_MAX_AXIS_RATIO		2.0f
+
+typedef struct {
+	double theta[MAGFIT_PARAMS];
+	double P[MAGFIT_PARAMS * MAGFIT_PARAMS];
+
+	float min_step;
+	double forget;
+
+	short last[3];
+	unsigned long samples;
+
+	// running mean square of the a priori error, in the fit's units
+	double error;
+} magfit_t;
+
+void magfit_init(magfit_t *fit, float min_step, float forget);
+
+// Feed a rawMag reading, 1 if it was used and 0 if it was skipped
+int magfit_add(magfit_t *fit, const short *raw);
+
+// 0 and matrix[9] and offset[3] for mpu9150_set_mag_cal_matrix() if the fit
+// is good enough to use, -1 otherwise. radius is the mean field in LSB and
+// may be NULL.
+int magfit_solve(magfit_t *fit, float *matrix, short *offset, float *radius);
+
+// Binary cache of a solved calibration, so a restart does not have to fit
+// again. magfit_save() replaces the file whole or not at all.
+#define MAGFIT_CACHE_MAGIC		0x4355504D	// "MPUC"
+#define MAGFIT_CACHE_VERSION	1
+
+int magfit_save(const char *path, const float *matrix, const short *offset);
+int magfit_load(const char *path, float *matrix, short *offset);
+
+#endif /* MAGFIT_H */
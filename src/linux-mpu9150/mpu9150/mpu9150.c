@@ -22,6 +22,7 @@
 //  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "linux_glue.h"
@@ -29,39 +30,293 @@
 #include "inv_mpu_dmp_motion_driver.h"
 #include "mpu9150.h"
 
-static int data_ready();
-static void calibrate_data(mpudata_t *mpu);
-static void tilt_compensate(quaternion_t magQ, quaternion_t unfusedQ);
-static int data_fusion(mpudata_t *mpu);
+// the FIFO is 1024 bytes on the MPU-6050/9150
+#define MAX_FIFO_BYTES 1024
+
+// periods a batched wakeup may run late before the FIFO overflows
+#define BATCH_FIFO_SLACK 4
+
+// samples per pass through the batch calibration kernel
+#define CAL_CHUNK 32
+
+// The counters have a single writer, the thread reading the device. Relaxed
+// atomic loads and stores are enough for another thread to snapshot them.
+#define STAT_ADD(c, n)	__atomic_store_n(&(c), (c) + (n), __ATOMIC_RELAXED)
+#define STAT_GET(c)		__atomic_load_n(&(c), __ATOMIC_RELAXED)
+
+static void select_dev(mpu9150_dev_t *dev);
+static int data_ready(mpu9150_dev_t *dev);
+static int wait_data(mpu9150_dev_t *dev);
+static int wait_batch(mpu9150_dev_t *dev);
+static void build_cal_matrix(calmatrix_t *cal, const calmatrix_t *remap, short *range, long full_range);
+static void build_accel_cal(mpu9150_dev_t *dev);
+static void set_rate_state(mpu9150_dev_t *dev, int sample_rate, int compass_rate);
+static void calibrate_data(mpu9150_dev_t *dev, mpudata_t *mpu);
+static void calibrate_batch(mpu9150_dev_t *dev, mpudata_t *out, int n);
+static void clear_derived(mpudata_t *mpu);
+static int data_fusion(mpu9150_dev_t *dev, mpudata_t *mpu);
+static void init_progress(mpu9150_dev_t *dev, const char *s);
+static void cache_mag(mpu9150_dev_t *dev, mpudata_t *mpu);
+static int update_mag(mpu9150_dev_t *dev, mpudata_t *mpu, int packets);
+static unsigned long long fifo_ref_time(mpu9150_dev_t *dev, int waited);
+static unsigned long long packet_time(mpu9150_dev_t *dev, unsigned long long ref_ns,
+		int age, int skipped);
+static void read_begin(mpu9150_dev_t *dev);
+static int run_self_test(mpu9150_dev_t *dev, int load);
+static int load_step(void *ctx);
+static void fold_mag_matrix(calmatrix_t *cal, const float *matrix, const short *offset);
+static void time_stage(mpu9150_timer_t *t, unsigned long long start_ns);
+static void copy_timer(mpu9150_timer_t *dst, mpu9150_timer_t *src);
 static unsigned short inv_row_2_scale(const signed char *row);
 static unsigned short inv_orientation_matrix_to_scalar(const signed char *mtx);
 
-int debug_on;
-int yaw_mixing_factor;
+struct mpu9150_dev_s {
+	int i2c_bus;
+
+	// NULL selects the eMPL and glue built-in state, as default_dev does
+	struct gyro_state_s *mpu_state;
+	struct dmp_s *dmp_state;
+	struct linux_glue_s *glue;
+
+	int int_pin;
+	int int_timeout_ms;
+
+	// nominal DMP packet spacing and the time given to the last packet
+	unsigned long long period_ns;
+	unsigned long long last_packet_ns;
+
+	// packets left in the FIFO by the last mpu9150_dev_read_batch()
+	int pending_packets;
+
+	// DMP packets collected in the FIFO between wakeups, see
+	// mpu9150_set_batch(), and when the next wakeup is due
+	int batch_packets;
+	unsigned long long batch_ns;
+	unsigned long long next_wake_ns;
+
+	// compass rate asked for (0 = auto) and DMP packets between reads
+	int compass_rate;
+	int sample_rate;
+	int mag_interval;
+	int packets_since_mag;
+
+	// last good compass reading, reused until the next one is due
+	int mag_valid;
+	short last_mag[3];
+	unsigned long last_mag_ms;
+	unsigned long long last_mag_ns;
+
+	// packets drained by the last mpu9150_dev_read_dmp()
+	int last_packets;
+
+	// no DMP, samples come straight from the output registers
+	int raw_mode;
+
+	// bank sized firmware upload, skipping banks that are already loaded
+	int fast_boot;
+	int verify_firmware;
+
+	// mpu9150_set_self_test(), the result mask (-1 not run) and biases.
+	// fw_offset and fw_result track the upload done in its delays.
+	int self_test;
+	int st_result;
+	long st_gyro[3];
+	long st_accel[3];
+	unsigned short fw_offset;
+	int fw_result;
+
+	// orientation filter, see fusion.h
+	int fusion_id;
+	float fusion_gain;
+	fusion_state_t fusion;
+	unsigned long long last_fusion_ns;
+
+	// rawGyro to rad/s and uncalibrated rawAccel to m/s^2
+	float gyro_si;
+	float accel_si;
+
+	// fed from a log by mpu9150_dev_replay(), there is no hardware
+	int replay;
+
+	// raw fields only, see mpu9150_set_lazy()
+	int lazy;
+
+	int use_accel_cal;
+	caldata_t accel_cal_data;
 
-int use_accel_cal;
-caldata_t accel_cal_data;
+	// LSB per g when accel_cal_data was set, its ranges are readings at
+	// 1g on that scale. 0 in replay, the range never changes.
+	unsigned short accel_cal_sens;
 
-int use_mag_cal;
-caldata_t mag_cal_data;
+	// mpu9150_set_lpf() value, 0 follows the sample rate
+	int lpf;
+
+	int use_mag_cal;
+	caldata_t mag_cal_data;
+
+	// mag_cal_matrix came from mpu9150_dev_set_mag_cal_matrix()
+	int use_mag_cal_matrix;
+
+	// the range scaling and the axis remap, see build_cal_matrix()
+	calmatrix_t accel_cal_matrix;
+	calmatrix_t mag_cal_matrix;
+
+	// mpu9150_dev_update_mag_cal_matrix() leaves a matrix here for the
+	// reading thread, which copies it over mag_cal_matrix and clears the flag
+	calmatrix_t mag_cal_next;
+	int mag_cal_pending;
+
+	// the counters kept here, mpu9150_dev_get_stats() adds the eMPL and glue ones
+	mpu9150_stats_t stats;
+
+	// bumped by mpu9150_dev_get_stats() to ask the reading thread to
+	// clear the timer maxima, which it does when it sees a new value
+	unsigned int max_epoch;
+	unsigned int max_epoch_seen;
+};
+
+static const calmatrix_t accel_cal_identity = ACCEL_CAL_IDENTITY;
+static const calmatrix_t mag_cal_identity = MAG_CAL_IDENTITY;
+
+int debug_on;
+
+// used by the single device API
+static mpu9150_dev_t default_dev = {
+	.i2c_bus = 1,
+	.int_pin = -1,
+	.accel_cal_matrix = ACCEL_CAL_IDENTITY,
+	.mag_cal_matrix = MAG_CAL_IDENTITY
+};
 
 void mpu9150_set_debug(int on)
 {
 	debug_on = on;
 }
 
-int mpu9150_init(int i2c_bus, int sample_rate, int mix_factor)
+// Point the eMPL driver and the glue at this device for the calling thread
+void select_dev(mpu9150_dev_t *dev)
 {
-	signed char gyro_orientation[9] = { 1, 0, 0,
-                                        0, 1, 0,
-                                        0, 0, 1 };
+	mpu_state_select(dev->mpu_state);
+	dmp_state_select(dev->dmp_state);
+	linux_glue_select(dev->glue);
+}
+
+void mpu9150_dev_set_int_pin(mpu9150_dev_t *dev, int pin)
+{
+	dev->int_pin = pin;
+}
+
+void mpu9150_dev_set_compass_rate(mpu9150_dev_t *dev, int rate)
+{
+	dev->compass_rate = rate;
+}
+
+void mpu9150_dev_set_fast_boot(mpu9150_dev_t *dev, int on, int verify)
+{
+	dev->fast_boot = on;
+	dev->verify_firmware = verify;
+}
+
+void mpu9150_dev_set_self_test(mpu9150_dev_t *dev, int on)
+{
+	dev->self_test = on;
+	dev->st_result = -1;
+}
+
+void mpu9150_dev_set_raw_mode(mpu9150_dev_t *dev, int on)
+{
+	dev->raw_mode = on;
+}
+
+void mpu9150_dev_set_backend(mpu9150_dev_t *dev, const struct linux_glue_backend_s *backend)
+{
+	linux_glue_set_backend(dev->glue, backend);
+}
+
+void mpu9150_dev_set_i2c_retry(mpu9150_dev_t *dev, int retries, unsigned int backoff_us)
+{
+	select_dev(dev);
+	linux_set_i2c_retry(retries, backoff_us);
+}
+
+void mpu9150_dev_set_fusion(mpu9150_dev_t *dev, int engine, float gain)
+{
+	dev->fusion_id = engine;
+	dev->fusion_gain = gain;
+}
+
+void mpu9150_dev_set_lazy(mpu9150_dev_t *dev, int on)
+{
+	dev->lazy = on;
+}
+
+void mpu9150_dev_set_batch(mpu9150_dev_t *dev, int packets)
+{
+	dev->batch_packets = packets > 1 ? packets : 0;
+}
+
+mpu9150_dev_t *mpu9150_create(int i2c_bus, int addr)
+{
+	mpu9150_dev_t *dev;
 
 	if (i2c_bus < MIN_I2C_BUS || i2c_bus > MAX_I2C_BUS) {
 		printf("Invalid I2C bus %d\n", i2c_bus);
-		return -1;
+		return NULL;
+	}
+
+	if (addr != MPU9150_ADDR_AD0_LOW && addr != MPU9150_ADDR_AD0_HIGH) {
+		printf("Invalid MPU-9150 address 0x%02X\n", addr);
+		return NULL;
+	}
+
+	dev = (mpu9150_dev_t *)calloc(1, sizeof(mpu9150_dev_t));
+
+	if (!dev)
+		return NULL;
+
+	dev->i2c_bus = i2c_bus;
+	dev->int_pin = -1;
+	dev->accel_cal_matrix = accel_cal_identity;
+	dev->mag_cal_matrix = mag_cal_identity;
+
+	dev->mpu_state = mpu_state_create(addr);
+	dev->dmp_state = dmp_state_create();
+	dev->glue = linux_glue_create(i2c_bus);
+
+	if (!dev->mpu_state || !dev->dmp_state || !dev->glue) {
+		mpu9150_destroy(dev);
+		return NULL;
 	}
 
-	if (sample_rate < MIN_SAMPLE_RATE || sample_rate > MAX_SAMPLE_RATE) {
+	return dev;
+}
+
+void mpu9150_destroy(mpu9150_dev_t *dev)
+{
+	if (!dev || dev == &default_dev)
+		return;
+
+	// the destroy calls fall back to the defaults if dev was selected
+	linux_glue_destroy(dev->glue);
+	dmp_state_destroy(dev->dmp_state);
+	mpu_state_destroy(dev->mpu_state);
+
+	free(dev);
+}
+
+int mpu9150_dev_init(mpu9150_dev_t *dev, int sample_rate, int mix_factor)
+{
+	struct int_param_s int_param;
+	int compass_rate, int_pin, result;
+	unsigned char packet_length;
+	float gyro_sens;
+	unsigned short accel_sens;
+	signed char gyro_orientation[9] = { 1, 0, 0,
+                                        0, 1, 0,
+                                        0, 0, 1 };
+
+	if (sample_rate < MIN_SAMPLE_RATE
+			|| sample_rate > (dev->raw_mode ? MAX_RAW_SAMPLE_RATE : MAX_SAMPLE_RATE)) {
 		printf("Invalid sample rate %d\n", sample_rate);
 		return -1;
 	}
@@ -71,68 +326,127 @@ int mpu9150_init(int i2c_bus, int sample_rate, int mix_factor)
 		return -1;
 	}
 
-	yaw_mixing_factor = mix_factor;
+	compass_rate = dev->compass_rate;
 
-	linux_set_i2c_bus(i2c_bus);
+	if (compass_rate == 0)
+		compass_rate = min(sample_rate, MAX_COMPASS_RATE);
 
-	printf("\nInitializing IMU .");
-	fflush(stdout);
+	if (compass_rate < 1 || compass_rate > MAX_COMPASS_RATE || compass_rate > sample_rate) {
+		printf("Invalid compass rate %d\n", compass_rate);
+		return -1;
+	}
+
+	// the I2C master delay is 5 bits, at most 32 samples between reads
+	if (dev->raw_mode && sample_rate / compass_rate > 32) {
+		printf("Compass rate %d too low for sample rate %d\n", compass_rate, sample_rate);
+		return -1;
+	}
+
+	if (dev->raw_mode && dev->batch_packets) {
+		printf("Batching needs the DMP FIFO, not raw mode\n");
+		return -1;
+	}
+
+	if (fusion_init(&dev->fusion, dev->fusion_id, dev->fusion_gain, mix_factor)) {
+		printf("Invalid fusion engine %d\n", dev->fusion_id);
+		return -1;
+	}
 
-	if (mpu_init(NULL)) {
+	dev->last_fusion_ns = 0;
+	dev->mag_valid = 0;
+	dev->lpf = 0;
+
+	set_rate_state(dev, sample_rate, compass_rate);
+
+	select_dev(dev);
+	linux_set_i2c_bus(dev->i2c_bus);
+
+	init_progress(dev, "\nInitializing IMU .");
+
+	// a batch is collected on a timer, an edge per packet would only wake us
+	int_pin = dev->batch_packets ? -1 : dev->int_pin;
+	int_param.pin = int_pin;
+
+	if (mpu_init(int_pin < 0 ? NULL : &int_param)) {
 		printf("\nmpu_init() failed\n");
 		return -1;
 	}
 
-	printf(".");
-	fflush(stdout);
+	init_progress(dev, ".");
 
 	if (mpu_set_sensors(INV_XYZ_GYRO | INV_XYZ_ACCEL | INV_XYZ_COMPASS)) {
 		printf("\nmpu_set_sensors() failed\n");
 		return -1;
 	}
 
-	printf(".");
-	fflush(stdout);
+	init_progress(dev, ".");
 
-	if (mpu_configure_fifo(INV_XYZ_GYRO | INV_XYZ_ACCEL)) {
+	// raw mode reads the output registers, the FIFO would only overflow
+	if (mpu_configure_fifo(dev->raw_mode ? 0 : INV_XYZ_GYRO | INV_XYZ_ACCEL)) {
 		printf("\nmpu_configure_fifo() failed\n");
 		return -1;
 	}
 
-	printf(".");
-	fflush(stdout);
+	init_progress(dev, ".");
 	
 	if (mpu_set_sample_rate(sample_rate)) {
 		printf("\nmpu_set_sample_rate() failed\n");
 		return -1;
 	}
 
-	printf(".");
-	fflush(stdout);
+	init_progress(dev, ".");
 
-	if (mpu_set_compass_sample_rate(sample_rate)) {
+	if (mpu_set_compass_sample_rate(compass_rate)) {
 		printf("\nmpu_set_compass_sample_rate() failed\n");
 		return -1;
 	}
 
-	printf(".");
-	fflush(stdout);
+	init_progress(dev, ".");
+
+	if (mpu_get_gyro_sens(&gyro_sens) || mpu_get_accel_sens(&accel_sens)) {
+		printf("\nmpu_get_gyro_sens() or mpu_get_accel_sens() failed\n");
+		return -1;
+	}
+
+	dev->gyro_si = DEGREE_TO_RAD / gyro_sens;
+	dev->accel_si = GRAVITY_MSS / accel_sens;
+
+	dev->st_result = -1;
+
+	if (dev->raw_mode) {
+		if (dev->self_test && run_self_test(dev, 0))
+			return -1;
+
+		if (mpu_set_data_ready_int(1)) {
+			printf("\nmpu_set_data_ready_int(1) failed\n");
+			return -1;
+		}
+
+		init_progress(dev, " done\n\n");
+
+		return 0;
+	}
 
-	if (dmp_load_motion_driver_firmware()) {
+	if (dev->self_test)
+		result = run_self_test(dev, 1);
+	else if (dev->fast_boot)
+		result = dmp_load_motion_driver_firmware_fast(dev->verify_firmware);
+	else
+		result = dmp_load_motion_driver_firmware();
+
+	if (result) {
 		printf("\ndmp_load_motion_driver_firmware() failed\n");
 		return -1;
 	}
 
-	printf(".");
-	fflush(stdout);
+	init_progress(dev, ".");
 
 	if (dmp_set_orientation(inv_orientation_matrix_to_scalar(gyro_orientation))) {
 		printf("\ndmp_set_orientation() failed\n");
 		return -1;
 	}
 
-	printf(".");
-	fflush(stdout);
+	init_progress(dev, ".");
 
   	if (dmp_enable_feature(DMP_FEATURE_6X_LP_QUAT | DMP_FEATURE_SEND_RAW_ACCEL 
 						| DMP_FEATURE_SEND_CAL_GYRO | DMP_FEATURE_GYRO_CAL)) {
@@ -140,289 +454,1499 @@ int mpu9150_init(int i2c_bus, int sample_rate, int mix_factor)
 		return -1;
 	}
 
-	printf(".");
-	fflush(stdout);
+	init_progress(dev, ".");
+
+	dmp_get_packet_length(&packet_length);
+
+	if (dev->batch_packets > MAX_FIFO_BYTES / packet_length - BATCH_FIFO_SLACK) {
+		printf("\nBatch of %d packets does not fit the FIFO, at most %d\n",
+				dev->batch_packets, MAX_FIFO_BYTES / packet_length - BATCH_FIFO_SLACK);
+		return -1;
+	}
  
 	if (dmp_set_fifo_rate(sample_rate)) {
 		printf("\ndmp_set_fifo_rate() failed\n");
 		return -1;
 	}
 
-	printf(".");
-	fflush(stdout);
+	init_progress(dev, ".");
 
 	if (mpu_set_dmp_state(1)) {
 		printf("\nmpu_set_dmp_state(1) failed\n");
 		return -1;
 	}
 
-	printf(" done\n\n");
+	init_progress(dev, " done\n\n");
 
 	return 0;
 }
 
-void mpu9150_exit()
+void mpu9150_dev_exit(mpu9150_dev_t *dev)
 {
+	select_dev(dev);
+
 	// turn off the DMP on exit 
 	if (mpu_set_dmp_state(0))
 		printf("mpu_set_dmp_state(0) failed\n");
 
+	linux_int_close();
+
 	// TODO: Should turn off the sensors too
 }
 
-void mpu9150_set_accel_cal(caldata_t *cal)
+int mpu9150_dev_set_sample_rate(mpu9150_dev_t *dev, int sample_rate)
 {
-	int i;
-	long bias[3];
+	int compass_rate;
 
-	if (!cal) {
-		use_accel_cal = 0;
-		return;
+	if (dev->replay || !dev->sample_rate)
+		return -1;
+
+	if (sample_rate < MIN_SAMPLE_RATE
+			|| sample_rate > (dev->raw_mode ? MAX_RAW_SAMPLE_RATE : MAX_SAMPLE_RATE)) {
+		printf("Invalid sample rate %d\n", sample_rate);
+		return -1;
 	}
 
-	memcpy(&accel_cal_data, cal, sizeof(caldata_t));
+	// an explicit compass rate gives way to the new sample rate
+	compass_rate = dev->compass_rate;
 
-	for (i = 0; i < 3; i++) {
-		if (accel_cal_data.range[i] < 1)
-			accel_cal_data.range[i] = 1;
-		else if (accel_cal_data.range[i] > ACCEL_SENSOR_RANGE)
-			accel_cal_data.range[i] = ACCEL_SENSOR_RANGE;
+	if (compass_rate == 0 || compass_rate > sample_rate)
+		compass_rate = min(sample_rate, MAX_COMPASS_RATE);
 
-		bias[i] = -accel_cal_data.offset[i];
-	}
+	if (dev->raw_mode && sample_rate / compass_rate > 32)
+		compass_rate = (sample_rate + 31) / 32;
 
-	if (debug_on) {
-		printf("\naccel cal (range : offset)\n");
+	select_dev(dev);
 
-		for (i = 0; i < 3; i++)
-			printf("%d : %d\n", accel_cal_data.range[i], accel_cal_data.offset[i]);
+	// The DMP holds the chip at its own 200 Hz and divides that down
+	// for the FIFO, the firmware stays loaded. Raw mode samples at the
+	// rate itself, which also moves the LPF to half of it.
+	if (dev->raw_mode) {
+		if (mpu_set_sample_rate(sample_rate))
+			return -1;
+
+		if (dev->lpf && mpu_set_lpf(dev->lpf))
+			return -1;
+	}
+	else if (dmp_set_fifo_rate(sample_rate)) {
+		return -1;
 	}
 
-	mpu_set_accel_bias(bias);
+	if (mpu_set_compass_sample_rate(compass_rate))
+		return -1;
 
-	use_accel_cal = 1;
-}
+	// packets at the old rate would get the new spacing
+	if (!dev->raw_mode && mpu_reset_fifo())
+		return -1;
 
-void mpu9150_set_mag_cal(caldata_t *cal)
-{
-	int i;
+	set_rate_state(dev, sample_rate, compass_rate);
 
-	if (!cal) {
-		use_mag_cal = 0;
-		return;
-	}
+	return 0;
+}
 
-	memcpy(&mag_cal_data, cal, sizeof(caldata_t));
+int mpu9150_dev_set_gyro_fsr(mpu9150_dev_t *dev, int dps)
+{
+	float gyro_sens;
 
-	for (i = 0; i < 3; i++) {
-		if (mag_cal_data.range[i] < 1)
-			mag_cal_data.range[i] = 1;
-		else if (mag_cal_data.range[i] > MAG_SENSOR_RANGE)
-			mag_cal_data.range[i] = MAG_SENSOR_RANGE;
+	if (dev->replay || !dev->sample_rate)
+		return -1;
 
-		if (mag_cal_data.offset[i] < -MAG_SENSOR_RANGE)
-			mag_cal_data.offset[i] = -MAG_SENSOR_RANGE;
-		else if (mag_cal_data.offset[i] > MAG_SENSOR_RANGE)
-			mag_cal_data.offset[i] = MAG_SENSOR_RANGE;
+	// the DMP quaternion is worked out for the range mpu_init() set
+	if (!dev->raw_mode) {
+		printf("Gyro full scale range changes need raw mode\n");
+		return -1;
 	}
 
-	if (debug_on) {
-		printf("\nmag cal (range : offset)\n");
+	select_dev(dev);
 
-		for (i = 0; i < 3; i++)
-			printf("%d : %d\n", mag_cal_data.range[i], mag_cal_data.offset[i]);
+	if (mpu_set_gyro_fsr(dps) || mpu_get_gyro_sens(&gyro_sens)) {
+		printf("Invalid gyro full scale range %d\n", dps);
+		return -1;
 	}
 
-	use_mag_cal = 1;
+	dev->gyro_si = DEGREE_TO_RAD / gyro_sens;
+
+	return 0;
 }
 
-int mpu9150_read_dmp(mpudata_t *mpu)
+int mpu9150_dev_set_accel_fsr(mpu9150_dev_t *dev, int g)
 {
-	short sensors;
-	unsigned char more;
+	unsigned short accel_sens;
 
-	if (!data_ready())
+	if (dev->replay || !dev->sample_rate)
 		return -1;
 
-	if (dmp_read_fifo(mpu->rawGyro, mpu->rawAccel, mpu->rawQuat, &mpu->dmpTimestamp, &sensors, &more) < 0) {
-		printf("dmp_read_fifo() failed\n");
+	if (!dev->raw_mode) {
+		printf("Accel full scale range changes need raw mode\n");
 		return -1;
 	}
 
-	while (more) {
-		// Fell behind, reading again
-		if (dmp_read_fifo(mpu->rawGyro, mpu->rawAccel, mpu->rawQuat, &mpu->dmpTimestamp, &sensors, &more) < 0) {
-			printf("dmp_read_fifo() failed\n");
-			return -1;
-		}
-	}
-
-	return 0;
-}
+	select_dev(dev);
 
-int mpu9150_read_mag(mpudata_t *mpu)
-{
-	if (mpu_get_compass_reg(mpu->rawMag, &mpu->magTimestamp) < 0) {
-		printf("mpu_get_compass_reg() failed\n");
+	if (mpu_set_accel_fsr(g) || mpu_get_accel_sens(&accel_sens)) {
+		printf("Invalid accel full scale range %d\n", g);
 		return -1;
 	}
 
+	dev->accel_si = GRAVITY_MSS / accel_sens;
+
+	// calibratedAccel keeps its scale, the offset registers don't move
+	if (dev->use_accel_cal)
+		build_accel_cal(dev);
+
 	return 0;
 }
 
-int mpu9150_read(mpudata_t *mpu)
+int mpu9150_dev_set_lpf(mpu9150_dev_t *dev, int hz)
 {
-	if (mpu9150_read_dmp(mpu) != 0)
+	if (dev->replay || !dev->sample_rate || hz < 0)
 		return -1;
 
-	if (mpu9150_read_mag(mpu) != 0)
+	select_dev(dev);
+
+	// what mpu_set_sample_rate() picks, the DMP keeps the chip at 200 Hz
+	if (mpu_set_lpf(hz ? hz : (dev->raw_mode ? dev->sample_rate : 200) / 2))
 		return -1;
 
-	calibrate_data(mpu);
+	dev->lpf = hz;
 
-	return data_fusion(mpu);
+	return 0;
 }
 
-int data_ready()
+int mpu9150_dev_set_yaw_mix(mpu9150_dev_t *dev, int mix_factor)
 {
-	short status;
-
-	if (mpu_get_int_status(&status) < 0) {
-		printf("mpu_get_int_status() failed\n");
-		return 0;
+	if (mix_factor < 0 || mix_factor > 100) {
+		printf("Invalid mag mixing factor %d\n", mix_factor);
+		return -1;
 	}
 
-	// debug
-	//if (status != 0x0103)
-	//	fprintf(stderr, "%04X\n", status);
+	// only yaw-mix reads it, the other engines keep their state
+	dev->fusion.mixFactor = mix_factor;
 
-	return (status == (MPU_INT_STATUS_DATA_READY | MPU_INT_STATUS_DMP | MPU_INT_STATUS_DMP_0));
+	return 0;
 }
 
-void calibrate_data(mpudata_t *mpu)
+void mpu9150_dev_set_accel_cal(mpu9150_dev_t *dev, caldata_t *cal)
 {
-	if (use_mag_cal) {
-      mpu->calibratedMag[VEC3_Y] = -(short)(((long)(mpu->rawMag[VEC3_X] - mag_cal_data.offset[VEC3_X])
-			* (long)MAG_SENSOR_RANGE) / (long)mag_cal_data.range[VEC3_X]);
+	int i;
+	long bias[3];
+
+	if (!cal) {
+		dev->use_accel_cal = 0;
+		dev->accel_cal_matrix = accel_cal_identity;
+		return;
+	}
 
-      mpu->calibratedMag[VEC3_X] = (short)(((long)(mpu->rawMag[VEC3_Y] - mag_cal_data.offset[VEC3_Y])
-			* (long)MAG_SENSOR_RANGE) / (long)mag_cal_data.range[VEC3_Y]);
+	memcpy(&dev->accel_cal_data, cal, sizeof(caldata_t));
+
+	for (i = 0; i < 3; i++) {
+		if (dev->accel_cal_data.range[i] < 1)
+			dev->accel_cal_data.range[i] = 1;
+		else if (dev->accel_cal_data.range[i] > ACCEL_SENSOR_RANGE)
+			dev->accel_cal_data.range[i] = ACCEL_SENSOR_RANGE;
 
-      mpu->calibratedMag[VEC3_Z] = (short)(((long)(mpu->rawMag[VEC3_Z] - mag_cal_data.offset[VEC3_Z])
-			* (long)MAG_SENSOR_RANGE) / (long)mag_cal_data.range[VEC3_Z]);
+		bias[i] = -dev->accel_cal_data.offset[i];
 	}
-	else {
-		mpu->calibratedMag[VEC3_Y] = -mpu->rawMag[VEC3_X];
-		mpu->calibratedMag[VEC3_X] = mpu->rawMag[VEC3_Y];
-		mpu->calibratedMag[VEC3_Z] = mpu->rawMag[VEC3_Z];
+
+	if (debug_on) {
+		printf("\naccel cal (range : offset)\n");
+
+		for (i = 0; i < 3; i++)
+			printf("%d : %d\n", dev->accel_cal_data.range[i], dev->accel_cal_data.offset[i]);
 	}
 
-	if (use_accel_cal) {
-      mpu->calibratedAccel[VEC3_X] = -(short)(((long)mpu->rawAccel[VEC3_X] * (long)ACCEL_SENSOR_RANGE)
-			/ (long)accel_cal_data.range[VEC3_X]);
+	dev->accel_cal_sens = 0;
 
-      mpu->calibratedAccel[VEC3_Y] = (short)(((long)mpu->rawAccel[VEC3_Y] * (long)ACCEL_SENSOR_RANGE)
-			/ (long)accel_cal_data.range[VEC3_Y]);
+	// a recording already has the sensor's bias applied
+	if (!dev->replay) {
+		select_dev(dev);
+		mpu_set_accel_bias(bias);
 
-      mpu->calibratedAccel[VEC3_Z] = (short)(((long)mpu->rawAccel[VEC3_Z] * (long)ACCEL_SENSOR_RANGE)
-			/ (long)accel_cal_data.range[VEC3_Z]);
-	}
-	else {
-		mpu->calibratedAccel[VEC3_X] = -mpu->rawAccel[VEC3_X];
-		mpu->calibratedAccel[VEC3_Y] = mpu->rawAccel[VEC3_Y];
-		mpu->calibratedAccel[VEC3_Z] = mpu->rawAccel[VEC3_Z];
+		if (mpu_get_accel_sens(&dev->accel_cal_sens))
+			dev->accel_cal_sens = 0;
 	}
+
+	build_accel_cal(dev);
+
+	dev->use_accel_cal = 1;
 }
 
-void tilt_compensate(quaternion_t magQ, quaternion_t unfusedQ)
+void mpu9150_dev_set_mag_cal(mpu9150_dev_t *dev, caldata_t *cal)
 {
-	quaternion_t unfusedConjugateQ;
-	quaternion_t tempQ;
+	int i;
+
+	if (!cal) {
+		dev->use_mag_cal = 0;
+		dev->use_mag_cal_matrix = 0;
+		dev->mag_cal_matrix = mag_cal_identity;
+		return;
+	}
+
+	memcpy(&dev->mag_cal_data, cal, sizeof(caldata_t));
 
-	quaternionConjugate(unfusedQ, unfusedConjugateQ);
-	quaternionMultiply(magQ, unfusedConjugateQ, tempQ);
-	quaternionMultiply(unfusedQ, tempQ, magQ);
+	for (i = 0; i < 3; i++) {
+		if (dev->mag_cal_data.range[i] < 1)
+			dev->mag_cal_data.range[i] = 1;
+		else if (dev->mag_cal_data.range[i] > MAG_SENSOR_RANGE)
+			dev->mag_cal_data.range[i] = MAG_SENSOR_RANGE;
+
+		if (dev->mag_cal_data.offset[i] < -MAG_SENSOR_RANGE)
+			dev->mag_cal_data.offset[i] = -MAG_SENSOR_RANGE;
+		else if (dev->mag_cal_data.offset[i] > MAG_SENSOR_RANGE)
+			dev->mag_cal_data.offset[i] = MAG_SENSOR_RANGE;
+	}
+
+	if (debug_on) {
+		printf("\nmag cal (range : offset)\n");
+
+		for (i = 0; i < 3; i++)
+			printf("%d : %d\n", dev->mag_cal_data.range[i], dev->mag_cal_data.offset[i]);
+	}
+
+	build_cal_matrix(&dev->mag_cal_matrix, &mag_cal_identity,
+			dev->mag_cal_data.range, MAG_SENSOR_RANGE);
+	memcpy(dev->mag_cal_matrix.offset, dev->mag_cal_data.offset, sizeof(dev->mag_cal_matrix.offset));
+
+	dev->use_mag_cal_matrix = 0;
+	dev->use_mag_cal = 1;
 }
 
-int data_fusion(mpudata_t *mpu)
+void mpu9150_dev_set_mag_cal_matrix(mpu9150_dev_t *dev, const float *matrix, const short *offset)
 {
-	quaternion_t dmpQuat;
-	vector3d_t dmpEuler;
-	quaternion_t magQuat;
-	quaternion_t unfusedQuat;
-	float deltaDMPYaw;
-	float deltaMagYaw;
-	float newMagYaw;
-	float newYaw;
-	
-	dmpQuat[QUAT_W] = (float)mpu->rawQuat[QUAT_W];
-	dmpQuat[QUAT_X] = (float)mpu->rawQuat[QUAT_X];
-	dmpQuat[QUAT_Y] = (float)mpu->rawQuat[QUAT_Y];
-	dmpQuat[QUAT_Z] = (float)mpu->rawQuat[QUAT_Z];
-
-	quaternionNormalize(dmpQuat);	
-	quaternionToEuler(dmpQuat, dmpEuler);
+	int i;
 
-	mpu->fusedEuler[VEC3_X] = dmpEuler[VEC3_X];
-	mpu->fusedEuler[VEC3_Y] = -dmpEuler[VEC3_Y];
-	mpu->fusedEuler[VEC3_Z] = 0;
+	if (!matrix) {
+		mpu9150_dev_set_mag_cal(dev, NULL);
+		return;
+	}
 
-	eulerToQuaternion(mpu->fusedEuler, unfusedQuat);
+	fold_mag_matrix(&dev->mag_cal_matrix, matrix, offset);
 
-	deltaDMPYaw = -dmpEuler[VEC3_Z] + mpu->lastDMPYaw;
-	mpu->lastDMPYaw = dmpEuler[VEC3_Z];
+	if (debug_on) {
+		printf("\nmag cal matrix : offset\n");
 
-	magQuat[QUAT_W] = 0;
-	magQuat[QUAT_X] = mpu->calibratedMag[VEC3_X];
-  	magQuat[QUAT_Y] = mpu->calibratedMag[VEC3_Y];
-  	magQuat[QUAT_Z] = mpu->calibratedMag[VEC3_Z];
+		for (i = 0; i < 3; i++)
+			printf("%f %f %f : %d\n", matrix[i * 3], matrix[i * 3 + 1], matrix[i * 3 + 2],
+				dev->mag_cal_matrix.offset[i]);
+	}
 
-	tilt_compensate(magQuat, unfusedQuat);
+	dev->use_mag_cal_matrix = 1;
+	dev->use_mag_cal = 1;
+}
 
-	newMagYaw = -atan2f(magQuat[QUAT_Y], magQuat[QUAT_X]);
+int mpu9150_dev_update_mag_cal_matrix(mpu9150_dev_t *dev, const float *matrix, const short *offset)
+{
+	if (!matrix)
+		return -1;
 
-	if (newMagYaw != newMagYaw) {
-		printf("newMagYaw NAN\n");
+	// the last one has not been picked up yet
+	if (__atomic_load_n(&dev->mag_cal_pending, __ATOMIC_ACQUIRE))
 		return -1;
-	}
 
-	if (newMagYaw < 0.0f)
-		newMagYaw = TWO_PI + newMagYaw;
+	fold_mag_matrix(&dev->mag_cal_next, matrix, offset);
 
-	newYaw = mpu->lastYaw + deltaDMPYaw;
+	__atomic_store_n(&dev->mag_cal_pending, 1, __ATOMIC_RELEASE);
 
-	if (newYaw > TWO_PI)
-		newYaw -= TWO_PI;
-	else if (newYaw < 0.0f)
-		newYaw += TWO_PI;
-	 
-	deltaMagYaw = newMagYaw - newYaw;
-	
-	if (deltaMagYaw >= (float)M_PI)
-		deltaMagYaw -= TWO_PI;
-	else if (deltaMagYaw < -(float)M_PI)
-		deltaMagYaw += TWO_PI;
+	return 0;
+}
 
-	if (yaw_mixing_factor > 0)
-		newYaw += deltaMagYaw / yaw_mixing_factor;
+void mpu9150_dev_get_cal_matrix(mpu9150_dev_t *dev, calmatrix_t *accel, calmatrix_t *mag)
+{
+	*accel = dev->accel_cal_matrix;
+	*mag = dev->mag_cal_matrix;
+}
 
-	if (newYaw > TWO_PI)
-		newYaw -= TWO_PI;
-	else if (newYaw < 0.0f)
-		newYaw += TWO_PI;
+int mpu9150_dev_get_gyro_bias(mpu9150_dev_t *dev, long *bias)
+{
+	if (dev->raw_mode || dev->replay)
+		return -1;
 
-	mpu->lastYaw = newYaw;
+	select_dev(dev);
 
-	if (newYaw > (float)M_PI)
-		newYaw -= TWO_PI;
+	return dmp_get_gyro_bias(bias);
+}
 
-	mpu->fusedEuler[VEC3_Z] = newYaw;
+int mpu9150_dev_get_self_test(mpu9150_dev_t *dev, long *gyro, long *accel)
+{
+	if (!dev->self_test || dev->st_result < 0)
+		return -1;
 
-	eulerToQuaternion(mpu->fusedEuler, mpu->fusedQuat);
+	if (gyro)
+		memcpy(gyro, dev->st_gyro, sizeof(dev->st_gyro));
+
+	if (accel)
+		memcpy(accel, dev->st_accel, sizeof(dev->st_accel));
+
+	return dev->st_result;
+}
+
+int mpu9150_dev_reg_snapshot(mpu9150_dev_t *dev, unsigned char *regs)
+{
+	if (dev->replay)
+		return -1;
+
+	select_dev(dev);
+
+	if (mpu_reg_snapshot(regs))
+		return -1;
+
+	return mpu_get_num_reg();
+}
+
+int mpu9150_dev_set_gyro_bias(mpu9150_dev_t *dev, const long *bias)
+{
+	long b[3];
+
+	if (dev->raw_mode || dev->replay)
+		return -1;
+
+	memcpy(b, bias, sizeof(b));
+
+	if (debug_on)
+		printf("\ngyro bias %ld %ld %ld\n", b[0], b[1], b[2]);
+
+	select_dev(dev);
+
+	return dmp_set_gyro_bias(b);
+}
+
+int mpu9150_dev_get_si_scale(mpu9150_dev_t *dev, float *gyro, float *accel, float *mag)
+{
+	float gyro_sens;
+	unsigned short accel_sens;
+
+	select_dev(dev);
+
+	if (mpu_get_gyro_sens(&gyro_sens) || mpu_get_accel_sens(&accel_sens))
+		return -1;
+
+	*gyro = DEGREE_TO_RAD / gyro_sens;
+
+	// the accel cal range is the raw reading at 1g
+	if (dev->use_accel_cal)
+		*accel = GRAVITY_MSS / ACCEL_SENSOR_RANGE;
+	else
+		*accel = GRAVITY_MSS / accel_sens;
+
+	// calibrate_data() swaps the X and Y mag axes
+	if (dev->use_mag_cal_matrix) {
+		mag[VEC3_X] = MAG_TESLA_PER_LSB;
+		mag[VEC3_Y] = MAG_TESLA_PER_LSB;
+		mag[VEC3_Z] = MAG_TESLA_PER_LSB;
+	}
+	else if (dev->use_mag_cal) {
+		mag[VEC3_X] = MAG_TESLA_PER_LSB * dev->mag_cal_data.range[VEC3_Y] / MAG_SENSOR_RANGE;
+		mag[VEC3_Y] = MAG_TESLA_PER_LSB * dev->mag_cal_data.range[VEC3_X] / MAG_SENSOR_RANGE;
+		mag[VEC3_Z] = MAG_TESLA_PER_LSB * dev->mag_cal_data.range[VEC3_Z] / MAG_SENSOR_RANGE;
+	}
+	else {
+		mag[VEC3_X] = MAG_TESLA_PER_LSB;
+		mag[VEC3_Y] = MAG_TESLA_PER_LSB;
+		mag[VEC3_Z] = MAG_TESLA_PER_LSB;
+	}
+
+	return 0;
+}
+
+int mpu9150_dev_read_dmp(mpu9150_dev_t *dev, mpudata_t *mpu)
+{
+	unsigned char fifo_data[MAX_FIFO_BYTES];
+	unsigned char packet_length, more;
+	unsigned short packets;
+	unsigned long long ref_ns, start_ns;
+	short sensors;
+	int skipped;
+
+	read_begin(dev);
+
+	select_dev(dev);
+
+	if (!wait_data(dev))
+		return -1;
+
+	dmp_get_packet_length(&packet_length);
+
+	if (packet_length == 0)
+		return -1;
+
+	ref_ns = fifo_ref_time(dev, 1);
+	linux_get_ns(&start_ns);
+	skipped = -1;
+	dev->last_packets = 0;
+
+	// Fell behind if more is set, keep draining and only parse the newest
+	do {
+		if (dmp_read_fifo_burst(fifo_data, sizeof(fifo_data) / packet_length,
+				&packets, &mpu->dmpTimestamp, &more) < 0) {
+			STAT_ADD(dev->stats.read_errors, 1);
+
+			if (debug_on)
+				printf("dmp_read_fifo_burst() failed\n");
+
+			return -1;
+		}
+
+		skipped += packets;
+		dev->last_packets += packets;
+
+		// whatever arrived while draining is newer than the interrupt
+		if (more)
+			linux_get_ns(&ref_ns);
+	} while (more);
+
+	time_stage(&dev->stats.read_time, start_ns);
+
+	dev->pending_packets = 0;
+	STAT_ADD(dev->stats.packets_dropped, skipped);
+
+	mpu->dmpTimestampNs = packet_time(dev, ref_ns, 0, skipped);
+	mpu->dmpTimestamp = (unsigned long)(mpu->dmpTimestampNs / 1000000ULL);
+
+	if (dmp_parse_packet(fifo_data + (packets - 1) * packet_length, 
+			mpu->rawGyro, mpu->rawAccel, mpu->rawQuat, &sensors) < 0) {
+		STAT_ADD(dev->stats.corrupt_packets, 1);
+
+		if (debug_on)
+			printf("dmp_parse_packet() failed\n");
+
+		return -1;
+	}
+
+	return 0;
+}
+
+int mpu9150_dev_read_batch(mpu9150_dev_t *dev, mpudata_t *out, int max, int *n)
+{
+	unsigned char fifo_data[MAX_FIFO_BYTES];
+	unsigned char packet_length, more;
+	unsigned short packets, max_packets;
+	unsigned long timestamp;
+	unsigned long long ref_ns, start_ns;
+	short sensors;
+	int i, count, waited;
+
+	read_begin(dev);
+
+	if (!n)
+		return -1;
+
+	*n = 0;
+
+	if (!out || max < 1)
+		return -1;
+
+	// one sample per data ready interrupt, there is no FIFO to drain
+	if (dev->raw_mode) {
+		if (mpu9150_dev_read_raw(dev, &out[0]))
+			return -1;
+
+		*n = 1;
+
+		return 0;
+	}
+
+	select_dev(dev);
+
+	// a previous call left packets behind, no need to wait for them
+	waited = (dev->pending_packets == 0);
+
+	if (waited && !wait_data(dev))
+		return -1;
+
+	dmp_get_packet_length(&packet_length);
+
+	if (packet_length == 0)
+		return -1;
+
+	max_packets = sizeof(fifo_data) / packet_length;
+
+	if (max < max_packets)
+		max_packets = max;
+
+	ref_ns = fifo_ref_time(dev, waited);
+	linux_get_ns(&start_ns);
+
+	if (dmp_read_fifo_burst(fifo_data, max_packets, &packets, &timestamp, &more) < 0) {
+		dev->pending_packets = 0;
+		STAT_ADD(dev->stats.read_errors, 1);
+
+		if (debug_on)
+			printf("dmp_read_fifo_burst() failed\n");
+
+		return -1;
+	}
+
+	time_stage(&dev->stats.read_time, start_ns);
+
+	dev->pending_packets = more;
+
+	for (i = 0; i < packets; i++) {
+		// a corrupt packet resets the FIFO, the rest of the burst is garbage
+		if (dmp_parse_packet(fifo_data + i * packet_length, out[i].rawGyro, 
+				out[i].rawAccel, out[i].rawQuat, &sensors) < 0) {
+			dev->pending_packets = 0;
+			STAT_ADD(dev->stats.corrupt_packets, 1);
+			STAT_ADD(dev->stats.packets_dropped, packets - i - 1);
+			break;
+		}
+
+		// the newest packet in the FIFO is the one at ref_ns
+		out[i].dmpTimestampNs = packet_time(dev, ref_ns, packets + more - 1 - i, 0);
+		out[i].dmpTimestamp = (unsigned long)(out[i].dmpTimestampNs / 1000000ULL);
+	}
+
+	packets = i;
+
+	if (packets == 0)
+		return -1;
+
+	// the compass is read at most once per wakeup, share it across the batch
+	if (update_mag(dev, &out[0], packets) != 0)
+		return -1;
+
+	if (!dev->lazy)
+		calibrate_batch(dev, out, packets);
+
+	for (i = 0, count = 0; i < packets; i++) {
+		if (count != i) {
+			memcpy(out[count].rawGyro, out[i].rawGyro, sizeof(out[i].rawGyro));
+			memcpy(out[count].rawAccel, out[i].rawAccel, sizeof(out[i].rawAccel));
+			memcpy(out[count].rawQuat, out[i].rawQuat, sizeof(out[i].rawQuat));
+			memcpy(out[count].calibratedAccel, out[i].calibratedAccel, sizeof(out[i].calibratedAccel));
+			out[count].dmpTimestamp = out[i].dmpTimestamp;
+			out[count].dmpTimestampNs = out[i].dmpTimestampNs;
+		}
+
+		if (count != 0) {
+			memcpy(out[count].rawMag, out[0].rawMag, sizeof(out[0].rawMag));
+			memcpy(out[count].calibratedMag, out[0].calibratedMag, sizeof(out[0].calibratedMag));
+			out[count].magTimestamp = out[0].magTimestamp;
+			out[count].magTimestampNs = out[0].magTimestampNs;
+		}
+
+		if (dev->lazy)
+			clear_derived(&out[count++]);
+		else if (data_fusion(dev, &out[count]) == 0)
+			count++;
+	}
+
+	*n = count;
+	STAT_ADD(dev->stats.samples, count);
+
+	return count ? 0 : -1;
+}
+
+int mpu9150_dev_read_raw(mpu9150_dev_t *dev, mpudata_t *mpu)
+{
+	unsigned long long ns, start_ns;
+	unsigned char compass_ok;
+	int mag_due;
+
+	read_begin(dev);
+
+	if (!dev->raw_mode)
+		return -1;
+
+	select_dev(dev);
+
+	if (!wait_data(dev))
+		return -1;
+
+	ns = fifo_ref_time(dev, 1);
+
+	// the compass mirror is in the burst anyway, only decode it when due
+	dev->packets_since_mag++;
+	mag_due = !dev->mag_valid || dev->packets_since_mag >= dev->mag_interval;
+
+	linux_get_ns(&start_ns);
+
+	if (mpu_get_sensor_reg(mpu->rawGyro, mpu->rawAccel, &mpu->temperature,
+			mag_due ? mpu->rawMag : NULL, &compass_ok) < 0) {
+		STAT_ADD(dev->stats.read_errors, 1);
+
+		if (debug_on)
+			printf("mpu_get_sensor_reg() failed\n");
+
+		return -1;
+	}
+
+	time_stage(&dev->stats.read_time, start_ns);
+
+	// no FIFO depth to go on, the sample is at the edge or the read
+	if (ns <= dev->last_packet_ns)
+		ns = dev->last_packet_ns + 1;
+
+	dev->last_packet_ns = ns;
+	mpu->dmpTimestampNs = ns;
+	mpu->dmpTimestamp = (unsigned long)(ns / 1000000ULL);
+
+	if (mag_due && !compass_ok)
+		STAT_ADD(dev->stats.compass_not_ready, 1);
+
+	if (compass_ok) {
+		mpu->magTimestamp = mpu->dmpTimestamp;
+		cache_mag(dev, mpu);
+	}
+	else if (dev->mag_valid) {
+		memcpy(mpu->rawMag, dev->last_mag, sizeof(mpu->rawMag));
+		mpu->magTimestamp = dev->last_mag_ms;
+		mpu->magTimestampNs = dev->last_mag_ns;
+	}
+	else {
+		return -1;
+	}
+
+	memset(mpu->rawQuat, 0, sizeof(mpu->rawQuat));
+
+	if (dev->lazy) {
+		clear_derived(mpu);
+		STAT_ADD(dev->stats.samples, 1);
+		return 0;
+	}
+
+	calibrate_data(dev, mpu);
+
+	// yaw-mix needs the DMP quaternion, the other engines run on the raw data
+	if (dev->fusion_id != FUSION_YAW_MIX) {
+		if (data_fusion(dev, mpu))
+			return -1;
+	}
+	else {
+		memset(mpu->fusedQuat, 0, sizeof(mpu->fusedQuat));
+		memset(mpu->fusedEuler, 0, sizeof(mpu->fusedEuler));
+	}
+
+	STAT_ADD(dev->stats.samples, 1);
+
+	return 0;
+}
+
+void mpu9150_dev_get_stats(mpu9150_dev_t *dev, mpu9150_stats_t *stats, int reset_max)
+{
+	struct mpu_stats_s mpu_stats;
+	struct linux_glue_stats_s glue_stats;
+
+	memset(stats, 0, sizeof(mpu9150_stats_t));
+
+	stats->fifo_overflows = STAT_GET(dev->stats.fifo_overflows);
+	stats->samples = STAT_GET(dev->stats.samples);
+	stats->read_errors = STAT_GET(dev->stats.read_errors);
+	stats->packets_dropped = STAT_GET(dev->stats.packets_dropped);
+	stats->corrupt_packets = STAT_GET(dev->stats.corrupt_packets);
+	stats->compass_not_ready = STAT_GET(dev->stats.compass_not_ready);
+	stats->compass_errors = STAT_GET(dev->stats.compass_errors);
+	stats->fusion_errors = STAT_GET(dev->stats.fusion_errors);
+
+	copy_timer(&stats->read_time, &dev->stats.read_time);
+	copy_timer(&stats->compass_time, &dev->stats.compass_time);
+	copy_timer(&stats->calibrate_time, &dev->stats.calibrate_time);
+	copy_timer(&stats->fusion_time, &dev->stats.fusion_time);
+
+	// only the reading thread writes the timers, it clears them on its next read
+	if (reset_max)
+		__atomic_fetch_add(&dev->max_epoch, 1, __ATOMIC_RELAXED);
+
+	// a replay never selected the driver state, it has nothing to add
+	if (dev->replay)
+		return;
+
+	select_dev(dev);
+
+	if (mpu_get_stats(&mpu_stats) == 0) {
+		stats->fifo_resets = mpu_stats.fifo_resets;
+		stats->fifo_overflows += mpu_stats.fifo_overflows;
+	}
+
+	linux_glue_get_stats(dev->glue, &glue_stats);
+
+	stats->i2c_transfers = glue_stats.transfers;
+	stats->i2c_bytes = glue_stats.bytes;
+	stats->i2c_errors = glue_stats.errors;
+	stats->i2c_retries = glue_stats.retries;
+	stats->i2c_retry_sleeps = glue_stats.retry_sleeps;
+}
+
+void mpu9150_dev_get_raw_scale(mpu9150_dev_t *dev, float *gyro, float *accel)
+{
+	*gyro = dev->gyro_si;
+	*accel = dev->accel_si;
+}
+
+int mpu9150_dev_replay_init(mpu9150_dev_t *dev, int sample_rate, int mix_factor,
+		float gyro_scale, float accel_scale)
+{
+	if (sample_rate < MIN_SAMPLE_RATE || sample_rate > MAX_RAW_SAMPLE_RATE) {
+		printf("Invalid sample rate %d\n", sample_rate);
+		return -1;
+	}
+
+	if (fusion_init(&dev->fusion, dev->fusion_id, dev->fusion_gain, mix_factor)) {
+		printf("Invalid fusion engine %d\n", dev->fusion_id);
+		return -1;
+	}
+
+	dev->period_ns = 1000000000ULL / sample_rate;
+	dev->last_fusion_ns = 0;
+	dev->gyro_si = gyro_scale;
+	dev->accel_si = accel_scale;
+	dev->replay = 1;
+
+	return 0;
+}
+
+int mpu9150_dev_replay(mpu9150_dev_t *dev, mpudata_t *mpu)
+{
+	if (!dev->replay)
+		return -1;
+
+	read_begin(dev);
+
+	if (dev->lazy) {
+		clear_derived(mpu);
+		return 0;
+	}
+
+	calibrate_data(dev, mpu);
+
+	if (dev->raw_mode && dev->fusion_id == FUSION_YAW_MIX) {
+		memset(mpu->fusedQuat, 0, sizeof(mpu->fusedQuat));
+		memset(mpu->fusedEuler, 0, sizeof(mpu->fusedEuler));
+		return 0;
+	}
+
+	return data_fusion(dev, mpu);
+}
+
+int mpu9150_dev_read_mag(mpu9150_dev_t *dev, mpudata_t *mpu)
+{
+	select_dev(dev);
+
+	if (mpu_get_compass_reg(mpu->rawMag, &mpu->magTimestamp) < 0) {
+		STAT_ADD(dev->stats.compass_errors, 1);
+
+		if (debug_on)
+			printf("mpu_get_compass_reg() failed\n");
+
+		return -1;
+	}
+
+	cache_mag(dev, mpu);
+
+	return 0;
+}
+
+int mpu9150_dev_read(mpu9150_dev_t *dev, mpudata_t *mpu)
+{
+	if (dev->raw_mode)
+		return mpu9150_dev_read_raw(dev, mpu);
+
+	if (mpu9150_dev_read_dmp(dev, mpu) != 0)
+		return -1;
+
+	if (update_mag(dev, mpu, dev->last_packets) != 0)
+		return -1;
+
+	if (dev->lazy) {
+		clear_derived(mpu);
+	}
+	else {
+		calibrate_data(dev, mpu);
+
+		if (data_fusion(dev, mpu))
+			return -1;
+	}
+
+	STAT_ADD(dev->stats.samples, 1);
+
+	return 0;
+}
+
+// The single device API, kept for imu, imucal and existing callers
+
+void mpu9150_set_int_pin(int pin)
+{
+	mpu9150_dev_set_int_pin(&default_dev, pin);
+}
+
+void mpu9150_set_compass_rate(int rate)
+{
+	mpu9150_dev_set_compass_rate(&default_dev, rate);
+}
+
+void mpu9150_set_fast_boot(int on, int verify)
+{
+	mpu9150_dev_set_fast_boot(&default_dev, on, verify);
+}
+
+void mpu9150_set_self_test(int on)
+{
+	mpu9150_dev_set_self_test(&default_dev, on);
+}
+
+int mpu9150_get_self_test(long *gyro, long *accel)
+{
+	return mpu9150_dev_get_self_test(&default_dev, gyro, accel);
+}
+
+int mpu9150_reg_snapshot(unsigned char *regs)
+{
+	return mpu9150_dev_reg_snapshot(&default_dev, regs);
+}
+
+void mpu9150_set_raw_mode(int on)
+{
+	mpu9150_dev_set_raw_mode(&default_dev, on);
+}
+
+void mpu9150_set_backend(const struct linux_glue_backend_s *backend)
+{
+	mpu9150_dev_set_backend(&default_dev, backend);
+}
+
+void mpu9150_set_i2c_retry(int retries, unsigned int backoff_us)
+{
+	mpu9150_dev_set_i2c_retry(&default_dev, retries, backoff_us);
+}
+
+void mpu9150_set_lazy(int on)
+{
+	mpu9150_dev_set_lazy(&default_dev, on);
+}
+
+void mpu9150_set_batch(int packets)
+{
+	mpu9150_dev_set_batch(&default_dev, packets);
+}
+
+int mpu9150_set_sample_rate(int sample_rate)
+{
+	return mpu9150_dev_set_sample_rate(&default_dev, sample_rate);
+}
+
+int mpu9150_set_gyro_fsr(int dps)
+{
+	return mpu9150_dev_set_gyro_fsr(&default_dev, dps);
+}
+
+int mpu9150_set_accel_fsr(int g)
+{
+	return mpu9150_dev_set_accel_fsr(&default_dev, g);
+}
+
+int mpu9150_set_lpf(int hz)
+{
+	return mpu9150_dev_set_lpf(&default_dev, hz);
+}
+
+int mpu9150_set_yaw_mix(int mix_factor)
+{
+	return mpu9150_dev_set_yaw_mix(&default_dev, mix_factor);
+}
+
+void mpu9150_get_cal_matrix(calmatrix_t *accel, calmatrix_t *mag)
+{
+	mpu9150_dev_get_cal_matrix(&default_dev, accel, mag);
+}
+
+void mpu9150_set_fusion(int engine, float gain)
+{
+	mpu9150_dev_set_fusion(&default_dev, engine, gain);
+}
+
+int mpu9150_read_raw(mpudata_t *mpu)
+{
+	return mpu9150_dev_read_raw(&default_dev, mpu);
+}
+
+int mpu9150_init(int i2c_bus, int sample_rate, int mix_factor)
+{
+	if (i2c_bus < MIN_I2C_BUS || i2c_bus > MAX_I2C_BUS) {
+		printf("Invalid I2C bus %d\n", i2c_bus);
+		return -1;
+	}
+
+	default_dev.i2c_bus = i2c_bus;
+
+	return mpu9150_dev_init(&default_dev, sample_rate, mix_factor);
+}
+
+void mpu9150_exit()
+{
+	mpu9150_dev_exit(&default_dev);
+}
+
+int mpu9150_read(mpudata_t *mpu)
+{
+	return mpu9150_dev_read(&default_dev, mpu);
+}
+
+int mpu9150_read_dmp(mpudata_t *mpu)
+{
+	return mpu9150_dev_read_dmp(&default_dev, mpu);
+}
+
+int mpu9150_read_batch(mpudata_t *out, int max, int *n)
+{
+	return mpu9150_dev_read_batch(&default_dev, out, max, n);
+}
+
+int mpu9150_read_mag(mpudata_t *mpu)
+{
+	return mpu9150_dev_read_mag(&default_dev, mpu);
+}
+
+void mpu9150_set_accel_cal(caldata_t *cal)
+{
+	mpu9150_dev_set_accel_cal(&default_dev, cal);
+}
+
+void mpu9150_set_mag_cal(caldata_t *cal)
+{
+	mpu9150_dev_set_mag_cal(&default_dev, cal);
+}
+
+void mpu9150_set_mag_cal_matrix(const float *matrix, const short *offset)
+{
+	mpu9150_dev_set_mag_cal_matrix(&default_dev, matrix, offset);
+}
+
+int mpu9150_update_mag_cal_matrix(const float *matrix, const short *offset)
+{
+	return mpu9150_dev_update_mag_cal_matrix(&default_dev, matrix, offset);
+}
+
+int mpu9150_get_gyro_bias(long *bias)
+{
+	return mpu9150_dev_get_gyro_bias(&default_dev, bias);
+}
+
+int mpu9150_set_gyro_bias(const long *bias)
+{
+	return mpu9150_dev_set_gyro_bias(&default_dev, bias);
+}
+
+int mpu9150_get_si_scale(float *gyro, float *accel, float *mag)
+{
+	return mpu9150_dev_get_si_scale(&default_dev, gyro, accel, mag);
+}
+
+void mpu9150_get_raw_scale(float *gyro, float *accel)
+{
+	mpu9150_dev_get_raw_scale(&default_dev, gyro, accel);
+}
+
+int mpu9150_replay_init(int sample_rate, int mix_factor, float gyro_scale, float accel_scale)
+{
+	return mpu9150_dev_replay_init(&default_dev, sample_rate, mix_factor, gyro_scale, accel_scale);
+}
+
+int mpu9150_replay(mpudata_t *mpu)
+{
+	return mpu9150_dev_replay(&default_dev, mpu);
+}
+
+void mpu9150_get_stats(mpu9150_stats_t *stats, int reset_max)
+{
+	mpu9150_dev_get_stats(&default_dev, stats, reset_max);
+}
+
+// mpu_run_self_test() spends most of its ~1 s waiting for the sensors to
+// settle and can't sample meanwhile. With load the DMP firmware goes up a
+// bank at a time in those waits, see linux_set_idle_work(), and whatever
+// is left after it returns. Returns the upload result, the self-test one
+// is kept for mpu9150_get_self_test().
+int run_self_test(mpu9150_dev_t *dev, int load)
+{
+	dev->fw_offset = 0;
+	dev->fw_result = load;
+
+	if (load)
+		linux_set_idle_work(load_step, dev);
+
+	dev->st_result = mpu_run_self_test(dev->st_gyro, dev->st_accel);
+
+	linux_set_idle_work(NULL, NULL);
+
+	if (debug_on && load)
+		printf("\nself-test 0x%02X, %u firmware bytes loaded during it\n",
+			dev->st_result, dev->fw_offset);
+
+	while (dev->fw_result > 0)
+		load_step(dev);
+
+	return dev->fw_result;
+}
+
+// The slow upload verifies as it goes, keep that without fast boot
+int load_step(void *ctx)
+{
+	mpu9150_dev_t *dev = (mpu9150_dev_t *)ctx;
+
+	dev->fw_result = dmp_load_motion_driver_firmware_step(
+		dev->verify_firmware || !dev->fast_boot, &dev->fw_offset);
+
+	return dev->fw_result;
+}
+
+// The progress dots are skipped in fast boot, flushing stdout isn't free
+void init_progress(mpu9150_dev_t *dev, const char *s)
+{
+	if (dev->fast_boot)
+		return;
+
+	printf("%s", s);
+	fflush(stdout);
+}
+
+// Keep a fresh compass reading for the samples until the next one
+void cache_mag(mpu9150_dev_t *dev, mpudata_t *mpu)
+{
+	linux_get_ns(&mpu->magTimestampNs);
+
+	memcpy(dev->last_mag, mpu->rawMag, sizeof(dev->last_mag));
+	dev->last_mag_ms = mpu->magTimestamp;
+	dev->last_mag_ns = mpu->magTimestampNs;
+	dev->mag_valid = 1;
+	dev->packets_since_mag = 0;
+}
+
+// Read the compass only once a new measurement is due, packets being the
+// DMP packets since the last call. In between, and when the AK8975 has
+// not finished a measurement yet, mpu gets the last good reading.
+int update_mag(mpu9150_dev_t *dev, mpudata_t *mpu, int packets)
+{
+	unsigned long long start_ns;
+	int result;
+
+	dev->packets_since_mag += packets;
+
+	if (!dev->mag_valid || dev->packets_since_mag >= dev->mag_interval) {
+		linux_get_ns(&start_ns);
+		result = mpu_get_compass_reg(mpu->rawMag, &mpu->magTimestamp);
+		time_stage(&dev->stats.compass_time, start_ns);
+
+		if (result == 0) {
+			cache_mag(dev, mpu);
+			return 0;
+		}
+
+		// -2 is data not ready, anything else is a real failure
+		if (result == -2) {
+			STAT_ADD(dev->stats.compass_not_ready, 1);
+		}
+		else {
+			STAT_ADD(dev->stats.compass_errors, 1);
+
+			if (debug_on)
+				printf("mpu_get_compass_reg() failed\n");
+		}
+
+		if (!dev->mag_valid)
+			return -1;
+	}
+
+	memcpy(mpu->rawMag, dev->last_mag, sizeof(mpu->rawMag));
+	mpu->magTimestamp = dev->last_mag_ms;
+	mpu->magTimestampNs = dev->last_mag_ns;
+
+	return 0;
+}
+
+// Time the newest packet in the FIFO was produced. With the INT pin and a
+// wait this read, that is the edge. Otherwise it's the time of the read,
+// which is late by up to a period and gets pulled in by packet_time().
+unsigned long long fifo_ref_time(mpu9150_dev_t *dev, int waited)
+{
+	unsigned long long ns;
+
+	if (waited && linux_int_enabled())
+		return linux_int_time_ns();
+
+	linux_get_ns(&ns);
+
+	return ns;
+}
+
+// Time of a packet that had age newer packets behind it in the FIFO at
+// ref_ns, with skipped packets dropped since the last one stamped. Host
+// side times can only be late, so a packet is never placed later than one
+// nominal period after the last, plus some slack for the DMP clock being
+// slower than nominal. Gaps after a FIFO reset start over from ref_ns.
+unsigned long long packet_time(mpu9150_dev_t *dev, unsigned long long ref_ns,
+		int age, int skipped)
+{
+	unsigned long long ns, predicted;
+
+	ns = ref_ns - age * dev->period_ns;
+
+	if (dev->last_packet_ns && ns > dev->last_packet_ns
+			&& ns - dev->last_packet_ns < (skipped + 4) * dev->period_ns) {
+		predicted = dev->last_packet_ns + (skipped + 1) * (dev->period_ns + dev->period_ns / 64);
+
+		if (ns > predicted)
+			ns = predicted;
+	}
+
+	if (ns <= dev->last_packet_ns)
+		ns = dev->last_packet_ns + 1;
+
+	dev->last_packet_ns = ns;
+
+	return ns;
+}
+
+int wait_data(mpu9150_dev_t *dev)
+{
+	if (dev->batch_packets)
+		return wait_batch(dev);
+
+	// with the INT pin wired up, the DMP tells us when a packet is queued
+	if (linux_int_enabled())
+		return linux_wait_int(dev->int_timeout_ms) > 0;
+
+	return data_ready(dev);
+}
+
+// Everything that follows the sample rate and compass rate. The next
+// packet is not held against the old spacing.
+void set_rate_state(mpu9150_dev_t *dev, int sample_rate, int compass_rate)
+{
+	dev->sample_rate = sample_rate;
+	dev->mag_interval = sample_rate / compass_rate;
+	dev->packets_since_mag = 0;
+
+	// allow a couple of missed interrupts before giving up on a read
+	dev->int_timeout_ms = 2 * (1000 / sample_rate) + 10;
+
+	dev->period_ns = 1000000000ULL / sample_rate;
+	dev->last_packet_ns = 0;
+	dev->pending_packets = 0;
+
+	dev->batch_ns = dev->batch_packets * dev->period_ns;
+	dev->next_wake_ns = 0;
+}
+
+// Sleep out the rest of the batch, on a fixed schedule so the wakeups
+// don't drift. A caller more than a batch late reads at once, the FIFO
+// is close to full, and starts the schedule over. The burst read that follows finds
+// overflows itself, there is no interrupt status to look at.
+int wait_batch(mpu9150_dev_t *dev)
+{
+	unsigned long long now;
+
+	if (linux_get_ns(&now))
+		return 0;
+
+	if (dev->next_wake_ns && now >= dev->next_wake_ns + dev->batch_ns) {
+		dev->next_wake_ns = now + dev->batch_ns;
+		return 1;
+	}
+
+	if (dev->next_wake_ns == 0)
+		dev->next_wake_ns = now + dev->batch_ns;
+
+	if (linux_sleep_until_ns(dev->next_wake_ns))
+		return 0;
+
+	dev->next_wake_ns += dev->batch_ns;
+
+	return 1;
+}
+
+int data_ready(mpu9150_dev_t *dev)
+{
+	short status;
+
+	if (mpu_get_int_status(&status) < 0) {
+		STAT_ADD(dev->stats.read_errors, 1);
+
+		if (debug_on)
+			printf("mpu_get_int_status() failed\n");
+
+		return 0;
+	}
+
+	// debug
+	//if (status != 0x0103)
+	//	fprintf(stderr, "%04X\n", status);
+
+	if (dev->raw_mode)
+		return (status & MPU_INT_STATUS_DATA_READY) != 0;
+
+	// Reading the status cleared the overflow bit, so the FIFO read would
+	// not see it. A full FIFO also sets it again on every sample, which
+	// would never compare equal below.
+	if (status & MPU_INT_STATUS_FIFO_OVERFLOW) {
+		STAT_ADD(dev->stats.fifo_overflows, 1);
+		mpu_reset_fifo();
+		return 0;
+	}
+
+	return (status == (MPU_INT_STATUS_DATA_READY | MPU_INT_STATUS_DMP | MPU_INT_STATUS_DMP_0));
+}
+
+// Scale each raw axis so range reads as full_range, then remap. The
+// divisions happen here, once, rather than per sample.
+void build_cal_matrix(calmatrix_t *cal, const calmatrix_t *remap, short *range, long full_range)
+{
+	long long scale;
+	int i, j;
+
+	for (j = 0; j < 3; j++) {
+		scale = (((long long)full_range << 16) + range[j] / 2) / range[j];
+
+		for (i = 0; i < 3; i++)
+			cal->m[i * 3 + j] = (long)((remap->m[i * 3 + j] / CAL_ONE) * scale);
+	}
+
+	memset(cal->offset, 0, sizeof(cal->offset));
+}
+
+// The offset is taken out in the sensor by the accel bias, only the ranges
+// go in, moved to the full scale range in use now
+void build_accel_cal(mpu9150_dev_t *dev)
+{
+	unsigned short accel_sens;
+	short range[3];
+	long r;
+	int i;
+
+	memcpy(range, dev->accel_cal_data.range, sizeof(range));
+
+	if (dev->accel_cal_sens && mpu_get_accel_sens(&accel_sens) == 0
+			&& accel_sens != dev->accel_cal_sens) {
+		for (i = 0; i < 3; i++) {
+			r = (long)range[i] * accel_sens / dev->accel_cal_sens;
+			range[i] = r < 1 ? 1 : (r > 32767 ? 32767 : r);
+		}
+	}
+
+	build_cal_matrix(&dev->accel_cal_matrix, &accel_cal_identity, range, ACCEL_SENSOR_RANGE);
+}
+
+static short cal_clamp(long long v)
+{
+	v = (v + (CAL_ONE / 2)) >> 16;
+
+	if (v > 32767)
+		return 32767;
+
+	if (v < -32768)
+		return -32768;
+
+	return (short)v;
+}
+
+void mpu9150_cal_apply(const calmatrix_t *cal, int n, short *x, short *y, short *z)
+{
+	const long *m = cal->m;
+	long dx, dy, dz;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		dx = x[i] - cal->offset[VEC3_X];
+		dy = y[i] - cal->offset[VEC3_Y];
+		dz = z[i] - cal->offset[VEC3_Z];
+
+		x[i] = cal_clamp((long long)m[0] * dx + (long long)m[1] * dy + (long long)m[2] * dz);
+		y[i] = cal_clamp((long long)m[3] * dx + (long long)m[4] * dy + (long long)m[5] * dz);
+		z[i] = cal_clamp((long long)m[6] * dx + (long long)m[7] * dy + (long long)m[8] * dz);
+	}
+}
+
+void calibrate_data(mpu9150_dev_t *dev, mpudata_t *mpu)
+{
+	unsigned long long start_ns;
+
+	linux_get_ns(&start_ns);
+
+	memcpy(mpu->calibratedMag, mpu->rawMag, sizeof(mpu->calibratedMag));
+	mpu9150_cal_apply(&dev->mag_cal_matrix, 1, &mpu->calibratedMag[VEC3_X],
+			&mpu->calibratedMag[VEC3_Y], &mpu->calibratedMag[VEC3_Z]);
+
+	memcpy(mpu->calibratedAccel, mpu->rawAccel, sizeof(mpu->calibratedAccel));
+	mpu9150_cal_apply(&dev->accel_cal_matrix, 1, &mpu->calibratedAccel[VEC3_X],
+			&mpu->calibratedAccel[VEC3_Y], &mpu->calibratedAccel[VEC3_Z]);
+
+	time_stage(&dev->stats.calibrate_time, start_ns);
+}
+
+// A batch shares one compass reading, so the mag is done once and the
+// accel goes through the kernel an axis array at a time
+void calibrate_batch(mpu9150_dev_t *dev, mpudata_t *out, int n)
+{
+	short x[CAL_CHUNK], y[CAL_CHUNK], z[CAL_CHUNK];
+	unsigned long long start_ns;
+	int i, j, count;
+
+	linux_get_ns(&start_ns);
+
+	memcpy(out[0].calibratedMag, out[0].rawMag, sizeof(out[0].calibratedMag));
+	mpu9150_cal_apply(&dev->mag_cal_matrix, 1, &out[0].calibratedMag[VEC3_X],
+			&out[0].calibratedMag[VEC3_Y], &out[0].calibratedMag[VEC3_Z]);
+
+	for (i = 1; i < n; i++)
+		memcpy(out[i].calibratedMag, out[0].calibratedMag, sizeof(out[0].calibratedMag));
+
+	for (i = 0; i < n; i += CAL_CHUNK) {
+		count = n - i < CAL_CHUNK ? n - i : CAL_CHUNK;
+
+		for (j = 0; j < count; j++) {
+			x[j] = out[i + j].rawAccel[VEC3_X];
+			y[j] = out[i + j].rawAccel[VEC3_Y];
+			z[j] = out[i + j].rawAccel[VEC3_Z];
+		}
+
+		mpu9150_cal_apply(&dev->accel_cal_matrix, count, x, y, z);
+
+		for (j = 0; j < count; j++) {
+			out[i + j].calibratedAccel[VEC3_X] = x[j];
+			out[i + j].calibratedAccel[VEC3_Y] = y[j];
+			out[i + j].calibratedAccel[VEC3_Z] = z[j];
+		}
+	}
+
+	time_stage(&dev->stats.calibrate_time, start_ns);
+}
+
+// mpu9150_set_lazy() leaves these to the caller
+void clear_derived(mpudata_t *mpu)
+{
+	memset(mpu->calibratedAccel, 0, sizeof(mpu->calibratedAccel));
+	memset(mpu->calibratedMag, 0, sizeof(mpu->calibratedMag));
+	memset(mpu->fusedQuat, 0, sizeof(mpu->fusedQuat));
+	memset(mpu->fusedEuler, 0, sizeof(mpu->fusedEuler));
+	mpu->lastDMPYaw = 0.0f;
+	mpu->lastYaw = 0.0f;
+}
+
+// Hand the sample to the fusion engine in the sensor frame and SI units
+int data_fusion(mpu9150_dev_t *dev, mpudata_t *mpu)
+{
+	fusion_input_t in;
+	unsigned long long ns = mpu->dmpTimestampNs;
+	unsigned long long start_ns;
+	float accel_si;
+	int i, result;
+
+	linux_get_ns(&start_ns);
+
+	// a gap or the first sample integrates over one nominal period
+	if (dev->last_fusion_ns && ns > dev->last_fusion_ns
+			&& ns - dev->last_fusion_ns < 10 * dev->period_ns)
+		in.dt = (float)(ns - dev->last_fusion_ns) / 1.0e9f;
+	else
+		in.dt = (float)dev->period_ns / 1.0e9f;
+
+	dev->last_fusion_ns = ns;
+
+	accel_si = dev->use_accel_cal ? GRAVITY_MSS / ACCEL_SENSOR_RANGE : dev->accel_si;
+
+	for (i = 0; i < 3; i++)
+		in.gyro[i] = mpu->rawGyro[i] * dev->gyro_si;
+
+	// undo the calibrated axes, calibrate_data() flips accel X and puts
+	// the mag in AK8975 axes with X and Y swapped
+	in.accel[VEC3_X] = -mpu->calibratedAccel[VEC3_X] * accel_si;
+	in.accel[VEC3_Y] = mpu->calibratedAccel[VEC3_Y] * accel_si;
+	in.accel[VEC3_Z] = mpu->calibratedAccel[VEC3_Z] * accel_si;
+
+	in.mag[VEC3_X] = mpu->calibratedMag[VEC3_X];
+	in.mag[VEC3_Y] = -mpu->calibratedMag[VEC3_Y];
+	in.mag[VEC3_Z] = -mpu->calibratedMag[VEC3_Z];
+
+	in.dmpQuat = dev->raw_mode ? NULL : mpu->rawQuat;
+
+	result = fusion_update(&dev->fusion, &in);
+
+	time_stage(&dev->stats.fusion_time, start_ns);
+
+	if (result) {
+		STAT_ADD(dev->stats.fusion_errors, 1);
+
+		if (debug_on)
+			printf("%s fusion update failed\n", dev->fusion.engine->name);
+
+		return -1;
+	}
+
+	memcpy(mpu->fusedQuat, dev->fusion.q, sizeof(mpu->fusedQuat));
+	memcpy(mpu->fusedEuler, dev->fusion.euler, sizeof(mpu->fusedEuler));
+
+	mpu->lastDMPYaw = dev->fusion.lastDMPYaw;
+	mpu->lastYaw = dev->fusion.lastYaw;
 
 	return 0;
 }
 
+// Called by the reading thread at the top of each read
+void read_begin(mpu9150_dev_t *dev)
+{
+	unsigned int epoch;
+
+	if (__atomic_load_n(&dev->mag_cal_pending, __ATOMIC_ACQUIRE)) {
+		dev->mag_cal_matrix = dev->mag_cal_next;
+		dev->use_mag_cal_matrix = 1;
+		dev->use_mag_cal = 1;
+
+		__atomic_store_n(&dev->mag_cal_pending, 0, __ATOMIC_RELEASE);
+	}
+
+	epoch = __atomic_load_n(&dev->max_epoch, __ATOMIC_RELAXED);
+
+	if (epoch == dev->max_epoch_seen)
+		return;
+
+	dev->max_epoch_seen = epoch;
+
+	__atomic_store_n(&dev->stats.read_time.max_ns, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&dev->stats.compass_time.max_ns, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&dev->stats.calibrate_time.max_ns, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&dev->stats.fusion_time.max_ns, 0, __ATOMIC_RELAXED);
+}
+
+// The matrix is in AK8975 axes, fold the axis remap in. It has one +-1 per row.
+void fold_mag_matrix(calmatrix_t *cal, const float *matrix, const short *offset)
+{
+	const long *remap = mag_cal_identity.m;
+	float sum;
+	int i, j, k;
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			sum = 0.0f;
+
+			for (k = 0; k < 3; k++)
+				sum += (float)(remap[i * 3 + k] / CAL_ONE) * matrix[k * 3 + j];
+
+			cal->m[i * 3 + j] = (long)lroundf(sum * CAL_ONE);
+		}
+
+		cal->offset[i] = offset ? offset[i] : 0;
+	}
+}
+
+void time_stage(mpu9150_timer_t *t, unsigned long long start_ns)
+{
+	unsigned long long ns;
+
+	linux_get_ns(&ns);
+	ns -= start_ns;
+
+	STAT_ADD(t->count, 1);
+	STAT_ADD(t->total_ns, ns);
+
+	if (ns > t->max_ns)
+		__atomic_store_n(&t->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+void copy_timer(mpu9150_timer_t *dst, mpu9150_timer_t *src)
+{
+	dst->count = STAT_GET(src->count);
+	dst->total_ns = STAT_GET(src->total_ns);
+	dst->max_ns = STAT_GET(src->max_ns);
+}
+
 /* These next two functions convert the orientation matrix (see
  * gyro_orientation) to a scalar representation for use by the DMP.
  * NOTE: These functions are borrowed from InvenSense's MPL.
@@ -25,35 +25,72 @@
 #define MPU9150_H
 
 #include "quaternion.h"
+#include "fusion.h"
 
 #define MAG_SENSOR_RANGE 	4096
 #define ACCEL_SENSOR_RANGE 	32000
 
+// AK8975 output after the fuse ROM sensitivity adjustment
+#define MAG_TESLA_PER_LSB	0.3e-6f
+#define GRAVITY_MSS			9.80665f
+
 // Somewhat arbitrary limits here. The values are samples per second.
 // The MIN comes from the way we are timing our loop in imu and imucal.
 // That's easily worked around, but no one probably cares.
-// The MAX comes from the compass. This could be avoided with separate
-// sample rates for the compass and the accel/gyros which can handle 
-// faster sampling rates. This is a TODO item to see if it's useful. 
+// The MAX is the DMP output rate limit. The compass is sampled at its own,
+// lower rate and the last reading is reused in between.
 // There are some practical limits on the speed that come from a 'userland'
 // implementation like this as opposed to a kernel or 'bare-metal' driver.
 #define MIN_SAMPLE_RATE 2
-#define MAX_SAMPLE_RATE 100
+#define MAX_SAMPLE_RATE 200
+
+// Raw mode skips the DMP, the gyro output rate with the DLPF on is 1 kHz
+#define MAX_RAW_SAMPLE_RATE 1000
+
+// The AK8975 measurement time limits it to 100 Hz
+#define MAX_COMPASS_RATE 100
+
+// Registers in a mpu9150_reg_snapshot(), the MPU-6500 family has 128
+#define MPU9150_NUM_REGS 128
 
 typedef struct {
 	short offset[3];
 	short range[3];
 } caldata_t;
 
+// out = m * (in - offset), m row major in Q16. Built once when the
+// calibration is set so the per-sample work is multiply-adds only.
+typedef struct {
+	long m[9];
+	short offset[3];
+} calmatrix_t;
+
+#define CAL_ONE		(1L << 16)
+
+// No calibration set: calibratedAccel x = -raw x, calibratedMag x = raw y
+// and y = -raw x
+#define ACCEL_CAL_IDENTITY	{ { -CAL_ONE, 0, 0, 0, CAL_ONE, 0, 0, 0, CAL_ONE }, { 0, 0, 0 } }
+#define MAG_CAL_IDENTITY	{ { 0, CAL_ONE, 0, -CAL_ONE, 0, 0, 0, 0, CAL_ONE }, { 0, 0, 0 } }
+
 typedef struct {
 	short rawGyro[3];
 	short rawAccel[3];
 	long rawQuat[4];
 	unsigned long dmpTimestamp;
 
+	// CLOCK_MONOTONIC ns when the sample was taken, rebuilt from the
+	// interrupt edge, the sample rate and the FIFO depth
+	unsigned long long dmpTimestampNs;
+
 	short rawMag[3];
 	unsigned long magTimestamp;
 
+	// CLOCK_MONOTONIC ns when the compass was read
+	unsigned long long magTimestampNs;
+
+	// degrees C in q16, raw mode only
+	long temperature;
+
 	short calibratedAccel[3];
 	short calibratedMag[3];
 
@@ -64,15 +101,261 @@ typedef struct {
 	float lastYaw;
 } mpudata_t;
 
+// Calls through one stage of the read pipeline and the time they took
+typedef struct {
+	unsigned long count;
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+} mpu9150_timer_t;
+
+// Counters since init, see mpu9150_get_stats()
+typedef struct {
+	// every register access, retries are extra attempts after a short or
+	// failed read and retry_sleeps those that backed off first, see
+	// linux_set_i2c_retry()
+	unsigned long i2c_transfers;
+	unsigned long i2c_bytes;
+	unsigned long i2c_errors;
+	unsigned long i2c_retries;
+	unsigned long i2c_retry_sleeps;
+
+	unsigned long fifo_resets;
+	unsigned long fifo_overflows;
+
+	// samples returned, failed reads (not counting no data yet), packets
+	// drained but never returned and packets that failed to parse
+	unsigned long samples;
+	unsigned long read_errors;
+	unsigned long packets_dropped;
+	unsigned long corrupt_packets;
+
+	// the AK8975 had no new measurement when one was due, or the read failed
+	unsigned long compass_not_ready;
+	unsigned long compass_errors;
+
+	unsigned long fusion_errors;
+
+	// FIFO drain or register burst, compass read, calibration, fusion
+	mpu9150_timer_t read_time;
+	mpu9150_timer_t compass_time;
+	mpu9150_timer_t calibrate_time;
+	mpu9150_timer_t fusion_time;
+} mpu9150_stats_t;
+
+
+// 7-bit slave address selected by the AD0 pin
+#define MPU9150_ADDR_AD0_LOW	0x68
+#define MPU9150_ADDR_AD0_HIGH	0x69
+
+// One MPU-9150 with its own bus handle, driver state and calibration.
+// The mpu9150_dev_* calls below mirror the single device API. Different
+// devices can be used from different threads at the same time, one device
+// should only be used by one thread at a time.
+typedef struct mpu9150_dev_s mpu9150_dev_t;
+
+// see linux_glue.h
+struct linux_glue_backend_s;
+
+mpu9150_dev_t *mpu9150_create(int i2c_bus, int addr);
+void mpu9150_destroy(mpu9150_dev_t *dev);
+
+void mpu9150_dev_set_int_pin(mpu9150_dev_t *dev, int pin);
+void mpu9150_dev_set_compass_rate(mpu9150_dev_t *dev, int rate);
+void mpu9150_dev_set_fast_boot(mpu9150_dev_t *dev, int on, int verify);
+void mpu9150_dev_set_self_test(mpu9150_dev_t *dev, int on);
+void mpu9150_dev_set_raw_mode(mpu9150_dev_t *dev, int on);
+void mpu9150_dev_set_backend(mpu9150_dev_t *dev, const struct linux_glue_backend_s *backend);
+void mpu9150_dev_set_i2c_retry(mpu9150_dev_t *dev, int retries, unsigned int backoff_us);
+void mpu9150_dev_set_fusion(mpu9150_dev_t *dev, int engine, float gain);
+void mpu9150_dev_set_lazy(mpu9150_dev_t *dev, int on);
+void mpu9150_dev_set_batch(mpu9150_dev_t *dev, int packets);
+int mpu9150_dev_init(mpu9150_dev_t *dev, int sample_rate, int yaw_mixing_factor);
+void mpu9150_dev_exit(mpu9150_dev_t *dev);
+int mpu9150_dev_set_sample_rate(mpu9150_dev_t *dev, int sample_rate);
+int mpu9150_dev_set_gyro_fsr(mpu9150_dev_t *dev, int dps);
+int mpu9150_dev_set_accel_fsr(mpu9150_dev_t *dev, int g);
+int mpu9150_dev_set_lpf(mpu9150_dev_t *dev, int hz);
+int mpu9150_dev_set_yaw_mix(mpu9150_dev_t *dev, int mix_factor);
+int mpu9150_dev_read(mpu9150_dev_t *dev, mpudata_t *mpu);
+int mpu9150_dev_read_dmp(mpu9150_dev_t *dev, mpudata_t *mpu);
+int mpu9150_dev_read_batch(mpu9150_dev_t *dev, mpudata_t *out, int max, int *n);
+int mpu9150_dev_read_raw(mpu9150_dev_t *dev, mpudata_t *mpu);
+int mpu9150_dev_read_mag(mpu9150_dev_t *dev, mpudata_t *mpu);
+void mpu9150_dev_set_accel_cal(mpu9150_dev_t *dev, caldata_t *cal);
+void mpu9150_dev_set_mag_cal(mpu9150_dev_t *dev, caldata_t *cal);
+void mpu9150_dev_set_mag_cal_matrix(mpu9150_dev_t *dev, const float *matrix, const short *offset);
+int mpu9150_dev_update_mag_cal_matrix(mpu9150_dev_t *dev, const float *matrix, const short *offset);
+void mpu9150_dev_get_cal_matrix(mpu9150_dev_t *dev, calmatrix_t *accel, calmatrix_t *mag);
+int mpu9150_dev_get_gyro_bias(mpu9150_dev_t *dev, long *bias);
+int mpu9150_dev_set_gyro_bias(mpu9150_dev_t *dev, const long *bias);
+int mpu9150_dev_get_self_test(mpu9150_dev_t *dev, long *gyro, long *accel);
+int mpu9150_dev_reg_snapshot(mpu9150_dev_t *dev, unsigned char *regs);
+int mpu9150_dev_get_si_scale(mpu9150_dev_t *dev, float *gyro, float *accel, float *mag);
+void mpu9150_dev_get_raw_scale(mpu9150_dev_t *dev, float *gyro, float *accel);
+int mpu9150_dev_replay_init(mpu9150_dev_t *dev, int sample_rate, int mix_factor,
+		float gyro_scale, float accel_scale);
+int mpu9150_dev_replay(mpu9150_dev_t *dev, mpudata_t *mpu);
+void mpu9150_dev_get_stats(mpu9150_dev_t *dev, mpu9150_stats_t *stats, int reset_max);
+
+// The single device API works on a built-in device at 0x68
 
 void mpu9150_set_debug(int on);
+
+// Call before mpu9150_init() to wait on the MPU INT pin, routed to this
+// GPIO, instead of polling the interrupt status. pin < 0 polls (default).
+// mpu9150_read() then blocks until the DMP signals a new packet.
+void mpu9150_set_int_pin(int pin);
+
+// Call before mpu9150_init() to sample the compass slower than the
+// accel/gyros. 0 (default) uses the sample rate, capped at MAX_COMPASS_RATE.
+// Samples in between carry the last compass reading.
+void mpu9150_set_compass_rate(int rate);
+
+// Call before mpu9150_init() to upload the DMP firmware a bank at a time,
+// without the progress output. Off by default. The data banks are always
+// written. Code banks that still hold the image from a previous run only
+// get the words the DMP configuration patches put back. verify reads the
+// image back once at the end.
+void mpu9150_set_fast_boot(int on, int verify);
+
+// Call before mpu9150_init() to run the factory self-test during init,
+// with the board face up or face down and still. The chip can't sample
+// while it runs, so the DMP firmware is uploaded in its settling delays
+// and the test costs little more than the upload on its own.
+void mpu9150_set_self_test(int on);
+
+// The self-test result, bit 0 gyro, bit 1 accel and bit 2 compass set when
+// they passed, and the gyro (dps) and accel (g) biases it measured in q16.
+// Either pointer can be NULL. -1 if it did not run.
+int mpu9150_get_self_test(long *gyro, long *accel);
+
+// Every register in one bus transaction, for diagnostics. regs holds
+// MPU9150_NUM_REGS, the ones that clear on read or pop the FIFO or DMP
+// memory read as 0. Returns the number read or -1. Not while reads are
+// running on another thread.
+int mpu9150_reg_snapshot(unsigned char *regs);
+
+// Call before mpu9150_init() to leave the DMP off and read accel, temp,
+// gyro and the compass mirror in one register burst per sample, at up to
+// MAX_RAW_SAMPLE_RATE. rawQuat is zero, and so are the fused fields with
+// the yaw-mix engine. mpu9150_read() and mpu9150_read_batch() switch over to
+// mpu9150_read_raw(), one sample per data ready interrupt.
+void mpu9150_set_raw_mode(int on);
+int mpu9150_read_raw(mpudata_t *mpu);
+
+// Call before mpu9150_init() to talk to something other than /dev/i2c-N,
+// such as the simulator in mpu_sim.h. NULL goes back to the real bus.
+void mpu9150_set_backend(const struct linux_glue_backend_s *backend);
+
+// Short or failed register reads are retried this many times, the first
+// after backoff_us and doubling, see linux_set_i2c_retry(). Only this
+// device's bus state changes.
+void mpu9150_set_i2c_retry(int retries, unsigned int backoff_us);
+
+// Call before mpu9150_init() to pick the orientation filter, one of the
+// FUSION_ engines in fusion.h, gain <= 0 for its default. FUSION_YAW_MIX
+// (default) uses the mpu9150_init() mix factor and needs the DMP, the
+// others also fill fusedQuat and fusedEuler in raw mode.
+void mpu9150_set_fusion(int engine, float gain);
+
+// Reads fill in the raw fields and timestamps only, the calibrated and
+// fused ones are zero and no fusion runs. For consumers that want the raw
+// data, or work the rest out themselves when needed with mpu_history.h.
+void mpu9150_set_lazy(int on);
+
+// Call before mpu9150_init() to let the FIFO collect this many DMP packets
+// between wakeups, for hosts where waking every sample costs more power
+// than the latency is worth. The MPU-9150 has no FIFO watermark interrupt,
+// so reads sleep on a timer for packets sample periods and then drain
+// the FIFO in one burst, and the INT pin is left alone. Use
+// mpu9150_read_batch() to get every packet. Each sample keeps its own
+// timestamp, they are just handed over up to packets periods late.
+// 0 or 1 reads every packet as it comes (default). At most the 1 kB FIFO
+// less a few packets of slack, 32 with the default features. Not in raw mode.
+void mpu9150_set_batch(int packets);
+
 int mpu9150_init(int i2c_bus, int sample_rate, int yaw_mixing_factor);
 void mpu9150_exit();
 int mpu9150_read(mpudata_t *mpu);
 int mpu9150_read_dmp(mpudata_t *mpu);
+
+// Drain the DMP FIFO in one I2C burst and return every packet, oldest
+// first, each calibrated and fused like mpu9150_read(). Up to max samples
+// are stored in out and *n is set to the number returned. Packets that did
+// not fit stay queued and are returned by the next call without waiting.
+int mpu9150_read_batch(mpudata_t *out, int max, int *n);
 int mpu9150_read_mag(mpudata_t *mpu);
 void mpu9150_set_accel_cal(caldata_t *cal);
 void mpu9150_set_mag_cal(caldata_t *cal);
 
+// Hard and soft iron correction, replacing mpu9150_set_mag_cal(). matrix is
+// 3x3 row major and maps rawMag - offset to the corrected field, both in
+// AK8975 axes and LSB. The library still swaps X and Y after it.
+// NULL matrix turns mag calibration off.
+void mpu9150_set_mag_cal_matrix(const float *matrix, const short *offset);
+
+// The same from another thread while reads are running, e.g. an online fit
+// (see magfit.h). The reading thread swaps the matrix in whole at the top
+// of its next read. -1 if the previous update has not been taken yet.
+int mpu9150_update_mag_cal_matrix(const float *matrix, const short *offset);
+
+// The matrices calibratedAccel and calibratedMag come from, for
+// mpu9150_cal_apply(). Call from the reading thread, a pending
+// mpu9150_update_mag_cal_matrix() shows up after the next read.
+void mpu9150_get_cal_matrix(calmatrix_t *accel, calmatrix_t *mag);
+
+// Calibrate n samples in place, one array per axis
+void mpu9150_cal_apply(const calmatrix_t *cal, int n, short *x, short *y, short *z);
+
+// The gyro bias the DMP has converged to, in q16 dps. Save it before
+// mpu9150_exit() and hand it back after the next mpu9150_init(), so the
+// DMP starts from it instead of relearning it while yaw drifts. The DMP
+// keeps refining it either way. Call them from the reading thread. Both
+// are -1 in raw mode, there is no DMP.
+int mpu9150_get_gyro_bias(long *bias);
+int mpu9150_set_gyro_bias(const long *bias);
+
+// Conversion factors from mpudata_t units to SI, valid for the current
+// full scale ranges and calibration. gyro is rad/s per LSB of rawGyro,
+// accel is m/s^2 per LSB of calibratedAccel and mag[3] is tesla per LSB
+// of each calibratedMag axis. Call again after changing calibration.
+int mpu9150_get_si_scale(float *gyro, float *accel, float *mag);
+
+// rawGyro to rad/s and uncalibrated rawAccel to m/s^2, for mpu_log headers
+void mpu9150_get_raw_scale(float *gyro, float *accel);
+
+// Changes after mpu9150_init(), without loading the DMP firmware again.
+// Call them from the reading thread between reads. A new sample rate
+// goes to the DMP FIFO divider, or the sample rate divider in raw mode,
+// and the compass rate follows it, an explicit one only when it has to.
+// The FIFO is reset, so the packets queued at the old rate are lost. In
+// raw mode the rate moves the LPF to half of it, unless mpu9150_set_lpf()
+// asked for a fixed cut off. The full scale ranges can only change in raw
+// mode, the DMP quaternion counts on the ranges mpu_init() sets. Accel
+// calibration is carried over, call mpu9150_get_si_scale() again after.
+// hz 0 puts the LPF back to half the sample rate. The mixing factor only
+// matters to FUSION_YAW_MIX.
+int mpu9150_set_sample_rate(int sample_rate);
+int mpu9150_set_gyro_fsr(int dps);
+int mpu9150_set_accel_fsr(int g);
+int mpu9150_set_lpf(int hz);
+int mpu9150_set_yaw_mix(int mix_factor);
+
+// Offline processing of recorded samples, no hardware is touched. Instead
+// of mpu9150_init() call mpu9150_replay_init() with the scales from the
+// log header, after mpu9150_set_raw_mode() and mpu9150_set_fusion() to
+// match the recording. Then mpu9150_replay() runs each sample's raw fields
+// through calibration and fusion as mpu9150_read() would have. Accel
+// offsets were already applied by the sensor, only the ranges take effect.
+int mpu9150_replay_init(int sample_rate, int mix_factor, float gyro_scale, float accel_scale);
+int mpu9150_replay(mpudata_t *mpu);
+
+// Copy the counters and stage timers. Call it from the thread reading the
+// device or from one other thread, such as a diagnostics publisher. The
+// copy is made with atomic loads and can be a sample behind. reset_max asks
+// the reading thread to zero the max_ns of each timer at the start of its
+// next read. The next call then reports the worst case since about this one.
+void mpu9150_get_stats(mpu9150_stats_t *stats, int reset_max);
+
 #endif /* MPU9150_H */
 
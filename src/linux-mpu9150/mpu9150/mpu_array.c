@@ -0,0 +1,453 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "linux_glue.h"
+#include "mpu_ring.h"
+#include "mpu_array.h"
+
+typedef struct {
+	struct mpu_array_s *array;
+	int i2c_bus;
+
+	// indices into the array's devices, in the order they were given
+	int dev[MPU_ARRAY_MAX_DEVS];
+	int count;
+
+	pthread_t thread;
+	int running;
+} mpu_array_bus_t;
+
+struct mpu_array_s {
+	int count;
+	mpu9150_dev_t *dev[MPU_ARRAY_MAX_DEVS];
+	int inited[MPU_ARRAY_MAX_DEVS];
+	int failed[MPU_ARRAY_MAX_DEVS];
+
+	mpu_array_bus_t bus[MPU_ARRAY_MAX_DEVS];
+	int num_buses;
+
+	int sample_rate;
+	int mix_factor;
+	unsigned long long period_ns;
+
+	// each bus thread pushes to the rings of its devices and posts sem
+	mpu_ring_t ring[MPU_ARRAY_MAX_DEVS];
+	sem_t sem;
+	int started;
+	int stop;
+
+	// mpu_array_read() side, the oldest sample of each device not yet
+	// returned, valid when held
+	mpudata_t cur[MPU_ARRAY_MAX_DEVS];
+	int held[MPU_ARRAY_MAX_DEVS];
+
+	unsigned long sets;
+	unsigned long skipped;
+	unsigned long long max_skew_ns;
+};
+
+static void *init_bus(void *arg);
+static void *read_bus(void *arg);
+static int align(mpu_array_t *array, mpudata_t *out, unsigned long long *t_ns);
+
+mpu_array_t *mpu_array_create(int n, const int *i2c_bus, const int *addr)
+{
+	mpu_array_t *array;
+	int i, j;
+
+	if (n < 1 || n > MPU_ARRAY_MAX_DEVS || !i2c_bus || !addr) {
+		printf("Invalid MPU-9150 array of %d\n", n);
+		return NULL;
+	}
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < i; j++) {
+			if (i2c_bus[i] == i2c_bus[j] && addr[i] == addr[j]) {
+				printf("MPU-9150 0x%02X on bus %d given twice\n", addr[i], i2c_bus[i]);
+				return NULL;
+			}
+		}
+	}
+
+	array = (mpu_array_t *)calloc(1, sizeof(mpu_array_t));
+
+	if (!array)
+		return NULL;
+
+	for (i = 0; i < n; i++) {
+		array->dev[i] = mpu9150_create(i2c_bus[i], addr[i]);
+
+		if (!array->dev[i]) {
+			mpu_array_destroy(array);
+			return NULL;
+		}
+
+		array->count++;
+
+		for (j = 0; j < array->num_buses; j++) {
+			if (array->bus[j].i2c_bus == i2c_bus[i])
+				break;
+		}
+
+		if (j == array->num_buses) {
+			array->bus[j].array = array;
+			array->bus[j].i2c_bus = i2c_bus[i];
+			array->num_buses++;
+		}
+
+		array->bus[j].dev[array->bus[j].count++] = i;
+	}
+
+	return array;
+}
+
+void mpu_array_destroy(mpu_array_t *array)
+{
+	int i;
+
+	if (!array)
+		return;
+
+	mpu_array_stop(array);
+
+	for (i = 0; i < array->count; i++) {
+		if (array->inited[i])
+			mpu9150_dev_exit(array->dev[i]);
+
+		mpu9150_destroy(array->dev[i]);
+	}
+
+	free(array);
+}
+
+int mpu_array_count(mpu_array_t *array)
+{
+	return array->count;
+}
+
+mpu9150_dev_t *mpu_array_dev(mpu_array_t *array, int i)
+{
+	if (i < 0 || i >= array->count)
+		return NULL;
+
+	return array->dev[i];
+}
+
+int mpu_array_init(mpu_array_t *array, int sample_rate, int mix_factor)
+{
+	int i, result;
+
+	if (array->started)
+		return -1;
+
+	array->sample_rate = sample_rate;
+	array->mix_factor = mix_factor;
+	array->period_ns = sample_rate > 0 ? 1000000000ULL / sample_rate : 0;
+
+	for (i = 0; i < array->count; i++) {
+		mpu9150_dev_set_int_pin(array->dev[i], -1);
+		mpu9150_dev_set_batch(array->dev[i], 0);
+		array->failed[i] = 0;
+	}
+
+	// a bus without a thread is brought up on this one after the others started
+	for (i = 0; i < array->num_buses; i++)
+		array->bus[i].running = (pthread_create(&array->bus[i].thread, NULL,
+			init_bus, &array->bus[i]) == 0);
+
+	for (i = 0; i < array->num_buses; i++) {
+		if (!array->bus[i].running)
+			init_bus(&array->bus[i]);
+	}
+
+	for (i = 0; i < array->num_buses; i++) {
+		if (array->bus[i].running)
+			pthread_join(array->bus[i].thread, NULL);
+
+		array->bus[i].running = 0;
+	}
+
+	for (i = 0, result = 0; i < array->count; i++) {
+		if (array->failed[i]) {
+			printf("MPU-9150 %d of the array failed to initialize\n", i);
+			result = -1;
+		}
+	}
+
+	return result;
+}
+
+int mpu_array_failed(mpu_array_t *array, int i)
+{
+	if (i < 0 || i >= array->count)
+		return -1;
+
+	return array->failed[i];
+}
+
+int mpu_array_start(mpu_array_t *array, int ring_size)
+{
+	int i;
+
+	if (array->started || array->period_ns == 0)
+		return -1;
+
+	for (i = 0; i < array->count; i++) {
+		if (!array->inited[i])
+			return -1;
+	}
+
+	for (i = 0; i < array->count; i++) {
+		if (mpu_ring_init(&array->ring[i], ring_size)) {
+			while (--i >= 0)
+				mpu_ring_free(&array->ring[i]);
+
+			return -1;
+		}
+
+		array->held[i] = 0;
+	}
+
+	sem_init(&array->sem, 0, 0);
+	array->stop = 0;
+	array->started = 1;
+
+	for (i = 0; i < array->num_buses; i++) {
+		if (pthread_create(&array->bus[i].thread, NULL, read_bus, &array->bus[i])) {
+			printf("Could not start the reading thread for bus %d\n", array->bus[i].i2c_bus);
+			mpu_array_stop(array);
+			return -1;
+		}
+
+		array->bus[i].running = 1;
+	}
+
+	return 0;
+}
+
+void mpu_array_stop(mpu_array_t *array)
+{
+	int i;
+
+	if (!array->started)
+		return;
+
+	__atomic_store_n(&array->stop, 1, __ATOMIC_RELAXED);
+
+	for (i = 0; i < array->num_buses; i++) {
+		if (array->bus[i].running)
+			pthread_join(array->bus[i].thread, NULL);
+
+		array->bus[i].running = 0;
+	}
+
+	for (i = 0; i < array->count; i++)
+		mpu_ring_free(&array->ring[i]);
+
+	sem_destroy(&array->sem);
+	array->started = 0;
+}
+
+int mpu_array_read(mpu_array_t *array, mpudata_t *out, unsigned long long *t_ns,
+		int timeout_ms)
+{
+	struct timespec timeout;
+
+	if (!array->started || !out)
+		return -1;
+
+	if (align(array, out, t_ns) == 0)
+		return 0;
+
+	clock_gettime(CLOCK_REALTIME, &timeout);
+
+	timeout.tv_sec += timeout_ms / 1000;
+	timeout.tv_nsec += (timeout_ms % 1000) * 1000000L;
+
+	if (timeout.tv_nsec >= 1000000000L) {
+		timeout.tv_nsec -= 1000000000L;
+		timeout.tv_sec++;
+	}
+
+	// every post is at least one more sample, not always a whole set
+	while (sem_timedwait(&array->sem, &timeout) == 0 || errno == EINTR) {
+		if (align(array, out, t_ns) == 0)
+			return 0;
+	}
+
+	return align(array, out, t_ns);
+}
+
+void mpu_array_get_stats(mpu_array_t *array, mpu_array_stats_t *stats)
+{
+	mpu9150_stats_t dev_stats;
+	int i;
+
+	memset(stats, 0, sizeof(mpu_array_stats_t));
+
+	stats->sets = array->sets;
+	stats->skipped = array->skipped;
+	stats->max_skew_ns = array->max_skew_ns;
+
+	for (i = 0; i < array->count; i++) {
+		if (array->started)
+			stats->dropped += mpu_ring_dropped(&array->ring[i]);
+
+		mpu9150_dev_get_stats(array->dev[i], &dev_stats, 0);
+		stats->read_errors += dev_stats.read_errors;
+	}
+
+	array->max_skew_ns = 0;
+}
+
+// The devices on one bus share it, so they go one after another
+void *init_bus(void *arg)
+{
+	mpu_array_bus_t *bus = (mpu_array_bus_t *)arg;
+	mpu_array_t *array = bus->array;
+	int i, k;
+
+	for (k = 0; k < bus->count; k++) {
+		i = bus->dev[k];
+
+		if (mpu9150_dev_init(array->dev[i], array->sample_rate, array->mix_factor))
+			array->failed[i] = 1;
+		else
+			array->inited[i] = 1;
+	}
+
+	return NULL;
+}
+
+// Drain every device on the bus once a sample period. Each has a FIFO, so
+// being a little late only means a longer burst. Raw mode has none, a
+// sample missed while the thread was late is gone.
+void *read_bus(void *arg)
+{
+	mpu_array_bus_t *bus = (mpu_array_bus_t *)arg;
+	mpu_array_t *array = bus->array;
+	mpudata_t batch[MPU_ARRAY_BATCH];
+	unsigned long long next_ns, now_ns;
+	int i, j, k, n, pushed;
+
+	linux_get_ns(&next_ns);
+
+	while (!__atomic_load_n(&array->stop, __ATOMIC_RELAXED)) {
+		pushed = 0;
+
+		for (k = 0; k < bus->count; k++) {
+			i = bus->dev[k];
+
+			if (mpu9150_dev_read_batch(array->dev[i], batch, MPU_ARRAY_BATCH, &n))
+				continue;
+
+			for (j = 0; j < n; j++) {
+				if (mpu_ring_push(&array->ring[i], &batch[j]) == 0)
+					pushed++;
+			}
+		}
+
+		if (pushed)
+			sem_post(&array->sem);
+
+		next_ns += array->period_ns;
+
+		if (linux_get_ns(&now_ns))
+			continue;
+
+		// a stall longer than a period, restart the schedule from here
+		if (now_ns > next_ns + array->period_ns) {
+			next_ns = now_ns;
+			continue;
+		}
+
+		linux_sleep_until_ns(next_ns);
+	}
+
+	return NULL;
+}
+
+// The newest of the oldest samples sets the time, every device moves up to
+// its sample less than a period before it. The chips sample on their own
+// phase, a narrower window would not always hold one from each. One that
+// is still behind after its ring ran dry keeps its place for the next call.
+int align(mpu_array_t *array, mpudata_t *out, unsigned long long *t_ns)
+{
+	unsigned long long t, lo;
+	int i, moved;
+
+	for (i = 0; i < array->count; i++) {
+		if (array->held[i])
+			continue;
+
+		if (mpu_ring_pop(&array->ring[i], &array->cur[i]))
+			return -1;
+
+		array->held[i] = 1;
+	}
+
+	do {
+		moved = 0;
+
+		for (i = 0, t = 0; i < array->count; i++) {
+			if (array->cur[i].dmpTimestampNs > t)
+				t = array->cur[i].dmpTimestampNs;
+		}
+
+		for (i = 0; i < array->count; i++) {
+			while (array->cur[i].dmpTimestampNs + array->period_ns <= t) {
+				if (mpu_ring_pop(&array->ring[i], &array->cur[i]))
+					return -1;
+
+				array->skipped++;
+				moved = 1;
+			}
+		}
+	} while (moved);
+
+	for (i = 0, lo = t; i < array->count; i++) {
+		if (array->cur[i].dmpTimestampNs < lo)
+			lo = array->cur[i].dmpTimestampNs;
+
+		memcpy(&out[i], &array->cur[i], sizeof(mpudata_t));
+		array->held[i] = 0;
+	}
+
+	if (t - lo > array->max_skew_ns)
+		array->max_skew_ns = t - lo;
+
+	array->sets++;
+
+	if (t_ns)
+		*t_ns = t;
+
+	return 0;
+}
@@ -0,0 +1,94 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef MPU_ARRAY_H
+#define MPU_ARRAY_H
+
+#include "mpu9150.h"
+
+// An array of MPU-9150s spread over several I2C buses, e.g. 4 buses with
+// one at each address. mpu_array_init() brings the buses up in parallel,
+// one thread per bus and the devices on a bus one after another, so the
+// startup costs about as much as the busiest bus and not the sum of all
+// the devices. mpu_array_start() then reads every bus on its own thread
+// into a ring per device and mpu_array_read() hands back one sample per
+// device at a time, lined up on their timestamps.
+//
+// The chips are not synchronized, each samples on its own phase and drifts
+// with its own oscillator. A set takes the newest of the devices' oldest
+// samples and from every other device the one less than a sample period
+// before it, so max_skew_ns stays under a period. Samples passed over to
+// stay lined up, after a stall or as the clocks drift, count in skipped.
+
+#define MPU_ARRAY_MAX_DEVS		16
+
+// packets drained from one device per pass of its bus thread
+#define MPU_ARRAY_BATCH			32
+
+typedef struct mpu_array_s mpu_array_t;
+
+typedef struct {
+	// aligned sets returned by mpu_array_read()
+	unsigned long sets;
+
+	// samples left out of a set to keep the devices lined up
+	unsigned long skipped;
+
+	// samples lost to a full ring, read errors seen by the bus threads
+	unsigned long dropped;
+	unsigned long read_errors;
+
+	// widest spread of timestamps within one set since the last call
+	unsigned long long max_skew_ns;
+} mpu_array_stats_t;
+
+// Device i is at addr[i] on /dev/i2c-i2c_bus[i]. The devices are created
+// here and can be set up with the mpu9150_dev_set_ calls on
+// mpu_array_dev() before mpu_array_init(). The bus threads poll, so the
+// INT pin and batch settings are not used.
+mpu_array_t *mpu_array_create(int n, const int *i2c_bus, const int *addr);
+void mpu_array_destroy(mpu_array_t *array);
+
+int mpu_array_count(mpu_array_t *array);
+mpu9150_dev_t *mpu_array_dev(mpu_array_t *array, int i);
+
+// mpu9150_dev_init() for every device, the buses in parallel. -1 if any
+// device failed, mpu_array_failed() tells which.
+int mpu_array_init(mpu_array_t *array, int sample_rate, int yaw_mixing_factor);
+int mpu_array_failed(mpu_array_t *array, int i);
+
+// One reading thread per bus, with room for ring_size samples per device
+// waiting for mpu_array_read(). The devices must not be used directly
+// until mpu_array_stop().
+int mpu_array_start(mpu_array_t *array, int ring_size);
+void mpu_array_stop(mpu_array_t *array);
+
+// One sample per device into out[0] to out[count - 1], waiting up to
+// timeout_ms for them. t_ns, if not NULL, gets the newest timestamp of the
+// set. -1 on timeout. Call from one thread only.
+int mpu_array_read(mpu_array_t *array, mpudata_t *out, unsigned long long *t_ns,
+		int timeout_ms);
+
+void mpu_array_get_stats(mpu_array_t *array, mpu_array_stats_t *stats);
+
+#endif /* MPU_ARRAY_H */
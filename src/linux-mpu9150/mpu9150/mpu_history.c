@@ -0,0 +1,291 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpu_history.h"
+
+#define HISTORY_CAL_FLAGS	(MPU_HISTORY_CAL_ACCEL | MPU_HISTORY_CAL_MAG)
+
+static unsigned char *carve(unsigned char **p, size_t bytes);
+static void derive_run(mpu_history_t *hist, unsigned int slot, unsigned int n, int flags);
+static void scale_run(float *out, const short *in, unsigned int n, float scale);
+static void derive_euler(mpu_history_t *hist, unsigned int slot);
+
+int mpu_history_init(mpu_history_t *hist, unsigned int size)
+{
+	static const calmatrix_t accel_identity = ACCEL_CAL_IDENTITY;
+	static const calmatrix_t mag_identity = MAG_CAL_IDENTITY;
+	unsigned int n;
+	size_t per_sample, bytes;
+	unsigned char *p;
+	int i;
+
+	memset(hist, 0, sizeof(mpu_history_t));
+
+	if (size < 2 || size > 0x80000000U)
+		return -1;
+
+	for (n = 1; n < size; n <<= 1)
+		;
+
+	// 2 timestamps, 9 raw shorts, 4 longs, the flags, 6 shorts and 12 floats,
+	// each of the 38 arrays padded out to a cache line
+	per_sample = 2 * sizeof(unsigned long long) + 9 * sizeof(short) + 4 * sizeof(long)
+			+ 1 + 6 * sizeof(short) + 12 * sizeof(float);
+	bytes = (size_t)n * per_sample + 38 * MPU_HISTORY_ALIGN;
+
+	if (posix_memalign(&hist->block, MPU_HISTORY_ALIGN, bytes))
+		return -1;
+
+	p = (unsigned char *)hist->block;
+
+	hist->timestampNs = (unsigned long long *)carve(&p, n * sizeof(unsigned long long));
+	hist->magTimestampNs = (unsigned long long *)carve(&p, n * sizeof(unsigned long long));
+
+	for (i = 0; i < 3; i++) {
+		hist->gyro[i] = (short *)carve(&p, n * sizeof(short));
+		hist->accel[i] = (short *)carve(&p, n * sizeof(short));
+		hist->mag[i] = (short *)carve(&p, n * sizeof(short));
+		hist->cal_accel[i] = (short *)carve(&p, n * sizeof(short));
+		hist->cal_mag[i] = (short *)carve(&p, n * sizeof(short));
+		hist->euler[i] = (float *)carve(&p, n * sizeof(float));
+		hist->gyro_si[i] = (float *)carve(&p, n * sizeof(float));
+		hist->accel_si[i] = (float *)carve(&p, n * sizeof(float));
+		hist->mag_si[i] = (float *)carve(&p, n * sizeof(float));
+	}
+
+	for (i = 0; i < 4; i++)
+		hist->quat[i] = (long *)carve(&p, n * sizeof(long));
+
+	hist->derived = carve(&p, n);
+	memset(hist->derived, 0, n);
+
+	hist->mask = n - 1;
+	hist->accel_cal = accel_identity;
+	hist->mag_cal = mag_identity;
+
+	return 0;
+}
+
+void mpu_history_free(mpu_history_t *hist)
+{
+	free(hist->block);
+	memset(hist, 0, sizeof(mpu_history_t));
+}
+
+void mpu_history_add(mpu_history_t *hist, const mpudata_t *mpu)
+{
+	unsigned int s = mpu_history_slot(hist, hist->head);
+	int i;
+
+	hist->timestampNs[s] = mpu->dmpTimestampNs;
+	hist->magTimestampNs[s] = mpu->magTimestampNs;
+
+	for (i = 0; i < 3; i++) {
+		hist->gyro[i][s] = mpu->rawGyro[i];
+		hist->accel[i][s] = mpu->rawAccel[i];
+		hist->mag[i][s] = mpu->rawMag[i];
+	}
+
+	for (i = 0; i < 4; i++)
+		hist->quat[i][s] = mpu->rawQuat[i];
+
+	hist->derived[s] = 0;
+	hist->head++;
+}
+
+void mpu_history_set_cal(mpu_history_t *hist, const calmatrix_t *accel, const calmatrix_t *mag)
+{
+	unsigned int i;
+
+	hist->accel_cal = *accel;
+	hist->mag_cal = *mag;
+
+	for (i = 0; i <= hist->mask; i++)
+		hist->derived[i] &= ~(HISTORY_CAL_FLAGS | MPU_HISTORY_SI);
+}
+
+void mpu_history_set_si_scale(mpu_history_t *hist, float gyro, float accel, const float *mag)
+{
+	unsigned int i;
+
+	hist->gyro_scale = gyro;
+	hist->accel_scale = accel;
+	memcpy(hist->mag_scale, mag, sizeof(hist->mag_scale));
+
+	for (i = 0; i <= hist->mask; i++)
+		hist->derived[i] &= ~MPU_HISTORY_SI;
+}
+
+unsigned int mpu_history_count(mpu_history_t *hist)
+{
+	return hist->head > hist->mask ? hist->mask + 1 : (unsigned int)hist->head;
+}
+
+unsigned int mpu_history_window(mpu_history_t *hist, unsigned long long ns, unsigned long *first)
+{
+	unsigned long lo, hi, mid;
+	unsigned long long newest, from;
+
+	*first = hist->head;
+
+	if (hist->head == 0)
+		return 0;
+
+	newest = hist->timestampNs[mpu_history_slot(hist, hist->head - 1)];
+	from = newest > ns ? newest - ns : 0;
+
+	// timestamps only go up, find the first one inside the window
+	lo = hist->head - mpu_history_count(hist);
+	hi = hist->head - 1;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (hist->timestampNs[mpu_history_slot(hist, mid)] < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*first = lo;
+
+	return (unsigned int)(hist->head - lo);
+}
+
+int mpu_history_derive(mpu_history_t *hist, unsigned long first, unsigned int n, int flags)
+{
+	unsigned int s, run, end;
+	unsigned long i;
+
+	if (first < hist->head - mpu_history_count(hist) || n > hist->head - first)
+		return -1;
+
+	// accel_si and mag_si scale the calibrated values
+	if (flags & MPU_HISTORY_SI)
+		flags |= HISTORY_CAL_FLAGS;
+
+	// runs of slots missing something, cut where the arrays wrap
+	for (i = first; i < first + n; i += run) {
+		s = mpu_history_slot(hist, i);
+
+		if ((hist->derived[s] & flags) == flags) {
+			run = 1;
+			continue;
+		}
+
+		end = s + 1;
+
+		while (end <= hist->mask && i + (end - s) < first + n
+				&& (hist->derived[end] & flags) != flags)
+			end++;
+
+		run = end - s;
+
+		derive_run(hist, s, run, flags);
+	}
+
+	return 0;
+}
+
+unsigned char *carve(unsigned char **p, size_t bytes)
+{
+	unsigned char *a = *p;
+
+	*p += (bytes + MPU_HISTORY_ALIGN - 1) & ~(size_t)(MPU_HISTORY_ALIGN - 1);
+
+	return a;
+}
+
+// slots s to s + n - 1, none of them past the end of the arrays
+void derive_run(mpu_history_t *hist, unsigned int s, unsigned int n, int flags)
+{
+	unsigned int i, j;
+	int want;
+
+	want = 0;
+
+	for (i = s; i < s + n; i++)
+		want |= flags & ~hist->derived[i];
+
+	// recalibrating a slot that had it gives the same answer, do the run whole
+	if (want & MPU_HISTORY_CAL_ACCEL) {
+		for (j = 0; j < 3; j++)
+			memcpy(hist->cal_accel[j] + s, hist->accel[j] + s, n * sizeof(short));
+
+		mpu9150_cal_apply(&hist->accel_cal, n, hist->cal_accel[VEC3_X] + s,
+				hist->cal_accel[VEC3_Y] + s, hist->cal_accel[VEC3_Z] + s);
+	}
+
+	if (want & MPU_HISTORY_CAL_MAG) {
+		for (j = 0; j < 3; j++)
+			memcpy(hist->cal_mag[j] + s, hist->mag[j] + s, n * sizeof(short));
+
+		mpu9150_cal_apply(&hist->mag_cal, n, hist->cal_mag[VEC3_X] + s,
+				hist->cal_mag[VEC3_Y] + s, hist->cal_mag[VEC3_Z] + s);
+	}
+
+	if (want & MPU_HISTORY_SI) {
+		for (j = 0; j < 3; j++) {
+			scale_run(hist->gyro_si[j] + s, hist->gyro[j] + s, n, hist->gyro_scale);
+			scale_run(hist->accel_si[j] + s, hist->cal_accel[j] + s, n, hist->accel_scale);
+			scale_run(hist->mag_si[j] + s, hist->cal_mag[j] + s, n, hist->mag_scale[j]);
+		}
+	}
+
+	for (i = s; i < s + n; i++) {
+		if ((want & MPU_HISTORY_EULER) && !(hist->derived[i] & MPU_HISTORY_EULER))
+			derive_euler(hist, i);
+
+		hist->derived[i] |= want;
+	}
+}
+
+void scale_run(float *out, const short *in, unsigned int n, float scale)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		out[i] = in[i] * scale;
+}
+
+void derive_euler(mpu_history_t *hist, unsigned int s)
+{
+	quaternion_t q;
+	vector3d_t v;
+	int i;
+
+	// q30 like the DMP packet
+	for (i = 0; i < 4; i++)
+		q[i] = (float)hist->quat[i][s] / (float)(1L << 30);
+
+	quaternionNormalize(q);
+
+	memset(v, 0, sizeof(v));
+	quaternionToEuler(q, v);
+
+	for (i = 0; i < 3; i++)
+		hist->euler[i][s] = v[i];
+}
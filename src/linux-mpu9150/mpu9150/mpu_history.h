@@ -0,0 +1,112 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef MPU_HISTORY_H
+#define MPU_HISTORY_H
+
+#include "mpu9150.h"
+
+// The last size samples, one array per field and axis so a window of them
+// can be walked or handed to mpu9150_cal_apply() without copying. Only the
+// raw fields are stored by mpu_history_add(). The derived ones are worked
+// out by mpu_history_derive() for the slots asked for and kept until the
+// slot is reused, which pairs with mpu9150_set_lazy() to leave the read
+// path doing nothing a consumer does not use.
+//
+// Samples are numbered from 0 as they are added, sample i lives at slot
+// i & mask of each array. Not thread safe, one thread adds and reads.
+
+// every array starts on its own cache line
+#define MPU_HISTORY_ALIGN		64
+
+// mpu_history_derive() flags
+#define MPU_HISTORY_CAL_ACCEL	0x01	// cal_accel, as calibratedAccel
+#define MPU_HISTORY_CAL_MAG		0x02	// cal_mag, as calibratedMag
+#define MPU_HISTORY_EULER		0x04	// euler, radians from the DMP quaternion
+#define MPU_HISTORY_SI			0x08	// gyro_si, accel_si, mag_si, with both calibrations
+
+typedef struct {
+	unsigned int mask;
+
+	// samples ever added, the next one is number head
+	unsigned long head;
+
+	// raw fields
+	unsigned long long *timestampNs;
+	unsigned long long *magTimestampNs;
+	short *gyro[3];
+	short *accel[3];
+	short *mag[3];
+	long *quat[4];
+
+	// derived fields, valid where the slot's derived flags say so
+	unsigned char *derived;
+	short *cal_accel[3];
+	short *cal_mag[3];
+	float *euler[3];
+
+	// rad/s from gyro, m/s^2 from cal_accel and tesla from cal_mag
+	float *gyro_si[3];
+	float *accel_si[3];
+	float *mag_si[3];
+
+	calmatrix_t accel_cal;
+	calmatrix_t mag_cal;
+
+	float gyro_scale;
+	float accel_scale;
+	float mag_scale[3];
+
+	void *block;
+} mpu_history_t;
+
+// size is rounded up to a power of two. The calibration starts out as
+// the library's identity, see mpu_history_set_cal(), and the SI scales as
+// 0 until mpu_history_set_si_scale().
+int mpu_history_init(mpu_history_t *hist, unsigned int size);
+void mpu_history_free(mpu_history_t *hist);
+
+void mpu_history_add(mpu_history_t *hist, const mpudata_t *mpu);
+
+// The matrices mpu_history_derive() calibrates with, from
+// mpu9150_get_cal_matrix(). Calibrated values already derived are dropped.
+void mpu_history_set_cal(mpu_history_t *hist, const calmatrix_t *accel, const calmatrix_t *mag);
+
+// The factors MPU_HISTORY_SI scales by, from mpu9150_get_si_scale() for
+// the same calibration. SI values already derived are dropped.
+void mpu_history_set_si_scale(mpu_history_t *hist, float gyro, float accel, const float *mag);
+
+// Samples held, the oldest is head - mpu_history_count()
+unsigned int mpu_history_count(mpu_history_t *hist);
+
+// The samples taken in the last ns before the newest one. Returns how many
+// with the number of the first in *first.
+unsigned int mpu_history_window(mpu_history_t *hist, unsigned long long ns, unsigned long *first);
+
+// Fill in the flagged derived fields of samples first to first + n - 1,
+// skipping those already done. -1 if they are not all still held.
+int mpu_history_derive(mpu_history_t *hist, unsigned long first, unsigned int n, int flags);
+
+#define mpu_history_slot(hist, i)	((unsigned int)(i) & (hist)->mask)
+
+#endif /* MPU_HISTORY_H */
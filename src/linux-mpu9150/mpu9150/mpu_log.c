@@ -0,0 +1,356 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+// O_DIRECT
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpu_log.h"
+
+// O_DIRECT wants the buffer, the offset and the length block aligned
+#define MPU_LOG_ALIGN		4096
+
+typedef char mpu_log_header_size_check[sizeof(mpu_log_header_t) == 64 ? 1 : -1];
+typedef char mpu_log_record_size_check[sizeof(mpu_log_record_t) == 56 ? 1 : -1];
+
+static unsigned long long clock_ns(clockid_t clock)
+{
+	struct timespec t;
+
+	if (clock_gettime(clock, &t) < 0)
+		return 0;
+
+	return (unsigned long long)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static int write_all(int fd, const unsigned char *buff, unsigned int len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buff, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		buff += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Buffers are written in the order they filled, only full ones and only
+// whole, the partial tail is left to mpu_log_close()
+static void *log_writer(void *arg)
+{
+	mpu_log_t *log = (mpu_log_t *)arg;
+	int next = 0;
+
+	pthread_mutex_lock(&log->lock);
+
+	while (1) {
+		while (!log->full[next] && !log->stop)
+			pthread_cond_wait(&log->cond, &log->lock);
+
+		if (!log->full[next])
+			break;
+
+		pthread_mutex_unlock(&log->lock);
+
+		if (!log->error && write_all(log->fd, log->buff[next], MPU_LOG_BUFFER_SIZE) < 0) {
+			perror("write(<log-file>)");
+			log->error = 1;
+		}
+
+		pthread_mutex_lock(&log->lock);
+
+		log->full[next] = 0;
+		next = (next + 1) % MPU_LOG_BUFFERS;
+	}
+
+	pthread_mutex_unlock(&log->lock);
+
+	return NULL;
+}
+
+void mpu_log_header_init(mpu_log_header_t *header, int sample_rate, int raw_mode,
+		float gyro_scale, float accel_scale)
+{
+	memset(header, 0, sizeof(mpu_log_header_t));
+
+	header->magic = MPU_LOG_MAGIC;
+	header->version = MPU_LOG_VERSION;
+	header->headerSize = sizeof(mpu_log_header_t);
+	header->recordSize = sizeof(mpu_log_record_t);
+	header->sampleRate = sample_rate;
+	header->flags = raw_mode ? MPU_LOG_RAW_MODE : 0;
+	header->gyroScale = gyro_scale;
+	header->accelScale = accel_scale;
+	header->startMonoNs = clock_ns(CLOCK_MONOTONIC);
+	header->startRealNs = clock_ns(CLOCK_REALTIME);
+}
+
+int mpu_log_create(mpu_log_t *log, const char *path, int direct, const mpu_log_header_t *header)
+{
+	int i;
+
+	memset(log, 0, sizeof(mpu_log_t));
+
+	log->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+
+	// not every filesystem does O_DIRECT, fall back to buffered
+	if (log->fd < 0 && direct && errno == EINVAL) {
+		direct = 0;
+		log->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+
+	if (log->fd < 0) {
+		perror("open(<log-file>)");
+		return -1;
+	}
+
+	log->direct = direct;
+
+	for (i = 0; i < MPU_LOG_BUFFERS; i++) {
+		if (posix_memalign((void **)&log->buff[i], MPU_LOG_ALIGN, MPU_LOG_BUFFER_SIZE)) {
+			log->buff[i] = NULL;
+			mpu_log_close(log);
+			return -1;
+		}
+	}
+
+	memcpy(&log->header, header, sizeof(mpu_log_header_t));
+
+	// the header is the start of the first buffer
+	memcpy(log->buff[0], header, sizeof(mpu_log_header_t));
+	log->used = sizeof(mpu_log_header_t);
+
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_cond_init(&log->cond, NULL);
+
+	if (pthread_create(&log->writer, NULL, log_writer, log)) {
+		printf("Failed to start the log writer\n");
+		pthread_cond_destroy(&log->cond);
+		pthread_mutex_destroy(&log->lock);
+		mpu_log_close(log);
+		return -1;
+	}
+
+	log->writing = 1;
+
+	return 0;
+}
+
+int mpu_log_append(mpu_log_t *log, const mpudata_t *mpu)
+{
+	mpu_log_record_t rec;
+	unsigned char *src = (unsigned char *)&rec;
+	unsigned int n;
+	int i, next;
+
+	rec.timestampNs = mpu->dmpTimestampNs;
+	rec.magTimestampNs = mpu->magTimestampNs;
+	rec.temperature = mpu->temperature;
+	rec.reserved = 0;
+
+	for (i = 0; i < 4; i++)
+		rec.rawQuat[i] = mpu->rawQuat[i];
+
+	for (i = 0; i < 3; i++) {
+		rec.rawGyro[i] = mpu->rawGyro[i];
+		rec.rawAccel[i] = mpu->rawAccel[i];
+		rec.rawMag[i] = mpu->rawMag[i];
+	}
+
+	n = MPU_LOG_BUFFER_SIZE - log->used;
+
+	if (n > sizeof(rec))
+		n = sizeof(rec);
+
+	memcpy(log->buff[log->current] + log->used, src, n);
+	log->used += n;
+
+	if (log->used == MPU_LOG_BUFFER_SIZE) {
+		next = (log->current + 1) % MPU_LOG_BUFFERS;
+
+		pthread_mutex_lock(&log->lock);
+
+		// the disk is behind, back the partial record out
+		if (log->full[next]) {
+			pthread_mutex_unlock(&log->lock);
+			log->used -= n;
+			log->dropped++;
+			return -1;
+		}
+
+		log->full[log->current] = 1;
+		pthread_cond_signal(&log->cond);
+		pthread_mutex_unlock(&log->lock);
+
+		log->current = next;
+		log->used = sizeof(rec) - n;
+
+		memcpy(log->buff[log->current], src + n, log->used);
+	}
+
+	log->records++;
+
+	return 0;
+}
+
+int mpu_log_close(mpu_log_t *log)
+{
+	int flags, i;
+	int result;
+
+	if (log->file) {
+		fclose(log->file);
+		log->file = NULL;
+
+		return log->error ? -1 : 0;
+	}
+
+	if (log->writing) {
+		pthread_mutex_lock(&log->lock);
+		log->stop = 1;
+		pthread_cond_signal(&log->cond);
+		pthread_mutex_unlock(&log->lock);
+
+		pthread_join(log->writer, NULL);
+
+		pthread_cond_destroy(&log->cond);
+		pthread_mutex_destroy(&log->lock);
+
+		// the tail isn't block sized, finish it through the page cache
+		if (log->direct) {
+			flags = fcntl(log->fd, F_GETFL);
+			fcntl(log->fd, F_SETFL, flags & ~O_DIRECT);
+		}
+
+		if (!log->error && write_all(log->fd, log->buff[log->current], log->used) < 0) {
+			perror("write(<log-file>)");
+			log->error = 1;
+		}
+
+		fdatasync(log->fd);
+		log->writing = 0;
+	}
+
+	for (i = 0; i < MPU_LOG_BUFFERS; i++) {
+		if (log->buff[i]) {
+			free(log->buff[i]);
+			log->buff[i] = NULL;
+		}
+	}
+
+	result = log->error ? -1 : 0;
+
+	if (log->fd >= 0 && close(log->fd) < 0)
+		result = -1;
+
+	log->fd = -1;
+
+	return result;
+}
+
+int mpu_log_open(mpu_log_t *log, const char *path)
+{
+	memset(log, 0, sizeof(mpu_log_t));
+	log->fd = -1;
+
+	log->file = fopen(path, "rb");
+
+	if (!log->file) {
+		perror("fopen(<log-file>)");
+		return -1;
+	}
+
+	if (fread(&log->header, sizeof(mpu_log_header_t), 1, log->file) != 1
+			|| log->header.magic != MPU_LOG_MAGIC) {
+		printf("%s is not an IMU log\n", path);
+		mpu_log_close(log);
+		return -1;
+	}
+
+	// newer versions may only grow the header and the records
+	if (log->header.version != MPU_LOG_VERSION
+			|| log->header.headerSize < sizeof(mpu_log_header_t)
+			|| log->header.recordSize < sizeof(mpu_log_record_t)) {
+		printf("Unsupported IMU log version %d\n", log->header.version);
+		mpu_log_close(log);
+		return -1;
+	}
+
+	if (fseek(log->file, log->header.headerSize, SEEK_SET) < 0) {
+		perror("fseek(<log-file>)");
+		mpu_log_close(log);
+		return -1;
+	}
+
+	return 0;
+}
+
+int mpu_log_read(mpu_log_t *log, mpudata_t *mpu)
+{
+	mpu_log_record_t rec;
+	int i;
+
+	if (fread(&rec, sizeof(rec), 1, log->file) != 1)
+		return -1;
+
+	if (log->header.recordSize > sizeof(rec)
+			&& fseek(log->file, log->header.recordSize - sizeof(rec), SEEK_CUR) < 0)
+		return -1;
+
+	memset(mpu, 0, sizeof(mpudata_t));
+
+	for (i = 0; i < 4; i++)
+		mpu->rawQuat[i] = rec.rawQuat[i];
+
+	for (i = 0; i < 3; i++) {
+		mpu->rawGyro[i] = rec.rawGyro[i];
+		mpu->rawAccel[i] = rec.rawAccel[i];
+		mpu->rawMag[i] = rec.rawMag[i];
+	}
+
+	mpu->temperature = rec.temperature;
+	mpu->dmpTimestampNs = rec.timestampNs;
+	mpu->dmpTimestamp = (unsigned long)(rec.timestampNs / 1000000ULL);
+	mpu->magTimestampNs = rec.magTimestampNs;
+	mpu->magTimestamp = (unsigned long)(rec.magTimestampNs / 1000000ULL);
+
+	log->records++;
+
+	return 0;
+}
@@ -0,0 +1,125 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef MPU_LOG_H
+#define MPU_LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "mpu9150.h"
+
+// Append-only binary log of raw samples for offline replay. A file is one
+// mpu_log_header_t followed by mpu_log_record_t back to back, little
+// endian, no framing. The raw fields go through calibration and fusion
+// again on replay, so the log can be re-tuned after the fact.
+
+#define MPU_LOG_MAGIC		0x4C55504D	// "MPUL"
+#define MPU_LOG_VERSION		1
+
+// mpu_log_header_t flags
+#define MPU_LOG_RAW_MODE	0x0001
+
+// Records are gathered into buffers this big and written out whole by a
+// writer thread. A multiple of 4096 so O_DIRECT takes them as they are.
+#define MPU_LOG_BUFFER_SIZE	(256 * 1024)
+#define MPU_LOG_BUFFERS		2
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t headerSize;
+	uint16_t recordSize;
+	uint16_t sampleRate;
+	uint16_t flags;
+	uint16_t reserved0;
+
+	// rawGyro to rad/s and uncalibrated rawAccel to m/s^2
+	float gyroScale;
+	float accelScale;
+
+	// CLOCK_MONOTONIC and CLOCK_REALTIME ns when the log was opened
+	uint64_t startMonoNs;
+	uint64_t startRealNs;
+
+	uint8_t reserved[24];
+} mpu_log_header_t;
+
+typedef struct {
+	uint64_t timestampNs;
+	uint64_t magTimestampNs;
+	int32_t rawQuat[4];
+	int32_t temperature;
+	int16_t rawGyro[3];
+	int16_t rawAccel[3];
+	int16_t rawMag[3];
+	uint16_t reserved;
+} mpu_log_record_t;
+
+typedef struct {
+	// writing
+	int fd;
+	int direct;
+	int writing;
+
+	unsigned char *buff[MPU_LOG_BUFFERS];
+	int full[MPU_LOG_BUFFERS];
+	int current;
+	unsigned int used;
+
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+	int error;
+
+	unsigned long records;
+	unsigned long dropped;
+
+	// reading
+	FILE *file;
+
+	mpu_log_header_t header;
+} mpu_log_t;
+
+// Writing. mpu_log_append() only ever copies into memory, the file writes
+// happen on the log's own thread. With both buffers waiting on the disk a
+// record is dropped and counted rather than blocking the caller. direct
+// opens the file with O_DIRECT to keep the page cache out of it.
+int mpu_log_create(mpu_log_t *log, const char *path, int direct, const mpu_log_header_t *header);
+int mpu_log_append(mpu_log_t *log, const mpudata_t *mpu);
+
+// Fill in the header fields describing the device and the clocks
+void mpu_log_header_init(mpu_log_header_t *header, int sample_rate, int raw_mode,
+		float gyro_scale, float accel_scale);
+
+// Reading, mpu_log_read() returns -1 at the end of the log
+int mpu_log_open(mpu_log_t *log, const char *path);
+int mpu_log_read(mpu_log_t *log, mpudata_t *mpu);
+
+// Either way, 0 if everything made it to or from the file
+int mpu_log_close(mpu_log_t *log);
+
+#endif /* MPU_LOG_H */
+
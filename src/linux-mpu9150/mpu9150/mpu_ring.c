@@ -0,0 +1,99 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpu_ring.h"
+
+int mpu_ring_init(mpu_ring_t *ring, unsigned int size)
+{
+	unsigned int n;
+
+	if (!ring || size < 2)
+		return -1;
+
+	memset(ring, 0, sizeof(mpu_ring_t));
+
+	for (n = 2; n < size; n <<= 1)
+		;
+
+	ring->buff = (mpudata_t *)calloc(n, sizeof(mpudata_t));
+
+	if (!ring->buff)
+		return -1;
+
+	ring->mask = n - 1;
+
+	return 0;
+}
+
+void mpu_ring_free(mpu_ring_t *ring)
+{
+	if (ring && ring->buff) {
+		free(ring->buff);
+		ring->buff = NULL;
+	}
+}
+
+int mpu_ring_push(mpu_ring_t *ring, const mpudata_t *mpu)
+{
+	unsigned int head = ring->head;
+
+	// acquire pairs with the release in pop, the slot is free to reuse
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	memcpy(&ring->buff[head & ring->mask], mpu, sizeof(mpudata_t));
+
+	// publish the slot contents before the new head
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int mpu_ring_pop(mpu_ring_t *ring, mpudata_t *mpu)
+{
+	unsigned int tail = ring->tail;
+
+	if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+		return -1;
+
+	memcpy(mpu, &ring->buff[tail & ring->mask], sizeof(mpudata_t));
+
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+unsigned int mpu_ring_count(mpu_ring_t *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail;
+}
+
+unsigned long mpu_ring_dropped(mpu_ring_t *ring)
+{
+	return __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+}
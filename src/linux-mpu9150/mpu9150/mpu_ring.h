@@ -0,0 +1,64 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef MPU_RING_H
+#define MPU_RING_H
+
+#include "mpu9150.h"
+
+// Lock-free single producer / single consumer queue of samples. One thread
+// may push and one other thread may pop without any locking. Neither side
+// ever blocks, a push to a full ring fails and is counted in dropped.
+
+// keeps head and tail on separate cache lines
+#define MPU_RING_CACHE_LINE	64
+
+typedef struct {
+	mpudata_t *buff;
+	unsigned int mask;
+	unsigned long dropped;
+
+	// written by the producer only
+	unsigned int head __attribute__((aligned(MPU_RING_CACHE_LINE)));
+
+	// written by the consumer only
+	unsigned int tail __attribute__((aligned(MPU_RING_CACHE_LINE)));
+} mpu_ring_t;
+
+// size is rounded up to a power of two
+int mpu_ring_init(mpu_ring_t *ring, unsigned int size);
+void mpu_ring_free(mpu_ring_t *ring);
+
+// producer side, returns -1 if the ring is full
+int mpu_ring_push(mpu_ring_t *ring, const mpudata_t *mpu);
+
+// consumer side, returns -1 if the ring is empty
+int mpu_ring_pop(mpu_ring_t *ring, mpudata_t *mpu);
+
+// consumer side, samples ready to pop
+unsigned int mpu_ring_count(mpu_ring_t *ring);
+
+// either side, samples thrown away because the ring was full
+unsigned long mpu_ring_dropped(mpu_ring_t *ring);
+
+#endif /* MPU_RING_H */
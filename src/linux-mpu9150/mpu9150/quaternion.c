@@ -109,3 +109,63 @@ void quaternionMultiply(quaternion_t qa, quaternion_t qb, quaternion_t qd)
 	qd[QUAT_Z] = qa[QUAT_W] * vb[VEC3_Z] + qb[QUAT_W] * va[VEC3_Z] + crossAB[VEC3_Z];
 }
 
+// Sin and cos of half the angle, picking the form that doesn't cancel
+static void halfAngle(float s, float c, float *s2, float *c2)
+{
+	if (c >= 0.0f) {
+		*c2 = sqrtf((1.0f + c) / 2.0f);
+		*s2 = s / (2.0f * *c2);
+	}
+	else {
+		*s2 = copysignf(sqrtf((1.0f - c) / 2.0f), s);
+		*c2 = s / (2.0f * *s2);
+	}
+}
+
+void quaternionToTilt(quaternion_t q, vector3d_t sinTilt, vector3d_t cosTilt)
+{
+	float rollY = 2.0f * (q[QUAT_Y] * q[QUAT_Z] + q[QUAT_W] * q[QUAT_X]);
+	float rollX = 1.0f - 2.0f * (q[QUAT_X] * q[QUAT_X] + q[QUAT_Y] * q[QUAT_Y]);
+	float norm;
+
+	sinTilt[VEC3_Y] = 2.0f * (q[QUAT_W] * q[QUAT_Y] - q[QUAT_X] * q[QUAT_Z]);
+
+	if (sinTilt[VEC3_Y] > 1.0f)
+		sinTilt[VEC3_Y] = 1.0f;
+	else if (sinTilt[VEC3_Y] < -1.0f)
+		sinTilt[VEC3_Y] = -1.0f;
+
+	cosTilt[VEC3_Y] = sqrtf(1.0f - sinTilt[VEC3_Y] * sinTilt[VEC3_Y]);
+
+	// roll is undefined straight up or down, call it level
+	norm = sqrtf(rollY * rollY + rollX * rollX);
+
+	if (norm < 1.0e-6f) {
+		sinTilt[VEC3_X] = 0.0f;
+		cosTilt[VEC3_X] = 1.0f;
+	}
+	else {
+		sinTilt[VEC3_X] = rollY / norm;
+		cosTilt[VEC3_X] = rollX / norm;
+	}
+
+	sinTilt[VEC3_Z] = 0.0f;
+	cosTilt[VEC3_Z] = 1.0f;
+}
+
+// Same result as eulerToQuaternion() but only one sin/cos for the yaw
+void tiltYawToQuaternion(vector3d_t sinTilt, vector3d_t cosTilt, float yaw, quaternion_t q)
+{
+	float cosX2, sinX2;
+	float cosY2, sinY2;
+	float cosZ2 = cosf(yaw / 2.0f);
+	float sinZ2 = sinf(yaw / 2.0f);
+
+	halfAngle(sinTilt[VEC3_X], cosTilt[VEC3_X], &sinX2, &cosX2);
+	halfAngle(sinTilt[VEC3_Y], cosTilt[VEC3_Y], &sinY2, &cosY2);
+
+	q[QUAT_W] = cosX2 * cosY2 * cosZ2 + sinX2 * sinY2 * sinZ2;
+	q[QUAT_X] = sinX2 * cosY2 * cosZ2 - cosX2 * sinY2 * sinZ2;
+	q[QUAT_Y] = cosX2 * sinY2 * cosZ2 + sinX2 * cosY2 * sinZ2;
+	q[QUAT_Z] = cosX2 * cosY2 * sinZ2 - sinX2 * sinY2 * cosZ2;
+}
@@ -39,6 +39,10 @@ void eulerToQuaternion(vector3d_t v, quaternion_t q);
 void quaternionConjugate(quaternion_t s, quaternion_t d);
 void quaternionMultiply(quaternion_t qa, quaternion_t qb, quaternion_t qd);
 
+// roll (x) and pitch (y) as sin/cos pairs, no Euler angles in between
+void quaternionToTilt(quaternion_t q, vector3d_t sinTilt, vector3d_t cosTilt);
+void tiltYawToQuaternion(vector3d_t sinTilt, vector3d_t cosTilt, float yaw, quaternion_t q);
+
 
 #endif /* MPUQUATERNION_H */
 
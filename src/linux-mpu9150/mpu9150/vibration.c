@@ -0,0 +1,256 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "vibration.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static void *carve(unsigned char **p, size_t bytes);
+static void summarize(vibration_t *vib, int axis);
+static void fft_half(vibration_t *vib);
+
+int vibration_init(vibration_t *vib, int size, int hop, int bands, float sample_rate)
+{
+	unsigned char *p;
+	size_t bytes;
+	int i, j, bits, half;
+
+	memset(vib, 0, sizeof(vibration_t));
+
+	if (size < VIBRATION_MIN_SIZE || size > VIBRATION_MAX_SIZE || (size & (size - 1)))
+		return -1;
+
+	if (bands < 1 || sample_rate <= 0.0f)
+		return -1;
+
+	half = size / 2;
+
+	if (hop <= 0 || hop > size)
+		hop = size;
+
+	if (bands > half)
+		bands = half;
+
+	// 3 inputs, the window, 2 twiddle, 2 work and the power arrays in
+	// floats, 3 band arrays and the bit reversal, each padded to a line
+	bytes = (4 * size + 5 * (half + 1) + 3 * bands) * sizeof(float)
+			+ half * sizeof(unsigned short) + 13 * VIBRATION_ALIGN;
+
+	if (posix_memalign(&vib->block, VIBRATION_ALIGN, bytes))
+		return -1;
+
+	p = (unsigned char *)vib->block;
+
+	for (i = 0; i < 3; i++) {
+		vib->in[i] = (float *)carve(&p, size * sizeof(float));
+		vib->band[i] = (float *)carve(&p, bands * sizeof(float));
+	}
+
+	vib->window = (float *)carve(&p, size * sizeof(float));
+	vib->tw_re = (float *)carve(&p, half * sizeof(float));
+	vib->tw_im = (float *)carve(&p, half * sizeof(float));
+	vib->re = (float *)carve(&p, half * sizeof(float));
+	vib->im = (float *)carve(&p, half * sizeof(float));
+	vib->power = (float *)carve(&p, (half + 1) * sizeof(float));
+	vib->rev = (unsigned short *)carve(&p, half * sizeof(unsigned short));
+
+	vib->size = size;
+	vib->hop = hop;
+	vib->bands = bands;
+	vib->sample_rate = sample_rate;
+
+	vib->window_ms = 0.0f;
+
+	for (i = 0; i < size; i++) {
+		vib->window[i] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / size);
+		vib->window_ms += vib->window[i] * vib->window[i];
+	}
+
+	vib->window_ms /= size;
+
+	for (i = 0; i < half; i++) {
+		vib->tw_re[i] = cosf(2.0f * (float)M_PI * i / size);
+		vib->tw_im[i] = -sinf(2.0f * (float)M_PI * i / size);
+	}
+
+	for (bits = 0; (1 << bits) < half; bits++)
+		;
+
+	for (i = 0; i < half; i++) {
+		for (j = 0, vib->rev[i] = 0; j < bits; j++) {
+			if (i & (1 << j))
+				vib->rev[i] |= 1 << (bits - 1 - j);
+		}
+	}
+
+	return 0;
+}
+
+void vibration_free(vibration_t *vib)
+{
+	if (vib->block) {
+		free(vib->block);
+		vib->block = NULL;
+	}
+}
+
+int vibration_add(vibration_t *vib, const float *accel)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+		vib->in[i][vib->count] = accel[i];
+
+	if (++vib->count < vib->size)
+		return 0;
+
+	for (i = 0; i < 3; i++) {
+		summarize(vib, i);
+
+		memmove(vib->in[i], vib->in[i] + vib->hop,
+			(vib->size - vib->hop) * sizeof(float));
+	}
+
+	vib->count = vib->size - vib->hop;
+
+	return 1;
+}
+
+void *carve(unsigned char **p, size_t bytes)
+{
+	void *ret = *p;
+
+	*p += (bytes + VIBRATION_ALIGN - 1) & ~(size_t)(VIBRATION_ALIGN - 1);
+
+	return ret;
+}
+
+// The even samples go in as the real parts and the odd ones as the
+// imaginary parts of a half size FFT, which is then split into the
+// spectrum of the real signal.
+void summarize(vibration_t *vib, int axis)
+{
+	const float *x = vib->in[axis];
+	float mean, d, sum, peak, scale;
+	float er, ei, or_, oi, xr, xi, wr, wi;
+	int half = vib->size / 2;
+	int i, k, m, b, lo, hi, best;
+
+	for (i = 0, sum = 0.0f; i < vib->size; i++)
+		sum += x[i];
+
+	mean = sum / vib->size;
+
+	for (i = 0, sum = 0.0f, peak = 0.0f; i < vib->size; i++) {
+		d = x[i] - mean;
+		sum += d * d;
+
+		if (fabsf(d) > peak)
+			peak = fabsf(d);
+	}
+
+	vib->rms[axis] = sqrtf(sum / vib->size);
+	vib->peak[axis] = peak;
+
+	for (k = 0; k < half; k++) {
+		vib->re[vib->rev[k]] = vib->window[2 * k] * (x[2 * k] - mean);
+		vib->im[vib->rev[k]] = vib->window[2 * k + 1] * (x[2 * k + 1] - mean);
+	}
+
+	fft_half(vib);
+
+	for (k = 0; k <= half; k++) {
+		i = k < half ? k : 0;
+		m = k > 0 ? half - k : 0;
+
+		er = 0.5f * (vib->re[i] + vib->re[m]);
+		ei = 0.5f * (vib->im[i] - vib->im[m]);
+		or_ = 0.5f * (vib->im[i] + vib->im[m]);
+		oi = -0.5f * (vib->re[i] - vib->re[m]);
+
+		wr = k < half ? vib->tw_re[k] : -1.0f;
+		wi = k < half ? vib->tw_im[k] : 0.0f;
+
+		xr = er + wr * or_ - wi * oi;
+		xi = ei + wr * oi + wi * or_;
+
+		vib->power[k] = xr * xr + xi * xi;
+	}
+
+	// Parseval, both sides of the spectrum but DC and Nyquist, undoing the
+	// window's power loss
+	scale = 2.0f / ((float)vib->size * vib->size * vib->window_ms);
+
+	for (b = 0, best = 1; b < vib->bands; b++) {
+		lo = 1 + b * half / vib->bands;
+		hi = 1 + (b + 1) * half / vib->bands;
+
+		for (k = lo, sum = 0.0f; k < hi; k++) {
+			sum += k < half ? vib->power[k] : 0.5f * vib->power[k];
+
+			if (vib->power[k] > vib->power[best])
+				best = k;
+		}
+
+		vib->band[axis][b] = sqrtf(sum * scale);
+	}
+
+	vib->peak_hz[axis] = best * vib->sample_rate / vib->size;
+}
+
+// In place radix 2 on the bit reversed re and im, size / 2 points. The
+// half size twiddles are every other one of the table.
+void fft_half(vibration_t *vib)
+{
+	float *re = vib->re, *im = vib->im;
+	float tr, ti, wr, wi;
+	int half = vib->size / 2;
+	int len, step, i, j, a, b;
+
+	for (len = 2; len <= half; len <<= 1) {
+		step = vib->size / len;
+
+		for (i = 0; i < half; i += len) {
+			for (j = 0; j < len / 2; j++) {
+				wr = vib->tw_re[j * step];
+				wi = vib->tw_im[j * step];
+				a = i + j;
+				b = a + len / 2;
+
+				tr = re[b] * wr - im[b] * wi;
+				ti = re[b] * wi + im[b] * wr;
+
+				re[b] = re[a] - tr;
+				im[b] = im[a] - ti;
+				re[a] += tr;
+				im[a] += ti;
+			}
+		}
+	}
+}
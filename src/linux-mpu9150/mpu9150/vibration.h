@@ -0,0 +1,87 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Copyright (c) 2013 Pansenti, LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+//  this software and associated documentation files (the "Software"), to deal in 
+//  the Software without restriction, including without limitation the rights to use, 
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+//  Software, and to permit persons to whom the Software is furnished to do so, 
+//  subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all 
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+//  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+//  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION 
+//  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE 
+//  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef VIBRATION_H
+#define VIBRATION_H
+
+// Windowed vibration summary of a 3 axis accel stream, for condition
+// monitoring where the spectrum matters and the samples themselves don't.
+// Every hop samples the last size of them, less their mean, are summed up
+// per axis as the RMS, the largest excursion, and the spectrum of the Hann
+// windowed signal as the RMS in bands equal width bands from just above
+// DC to the Nyquist frequency, with the frequency of the strongest bin.
+// The band RMS squared add up to about rms squared. Values are in the
+// units that were added, e.g. m/s^2.
+//
+// The real FFT runs as a half size complex one, with the real and
+// imaginary parts in separate arrays so the butterfly loops vectorize.
+// Not thread safe, one thread adds and reads.
+
+// window sizes, a power of two
+#define VIBRATION_MIN_SIZE		16
+#define VIBRATION_MAX_SIZE		8192
+
+// arrays start on their own cache line
+#define VIBRATION_ALIGN			64
+
+typedef struct {
+	int size;
+	int hop;
+	int bands;
+	float sample_rate;
+
+	// summaries of the last window, updated when vibration_add() returns 1
+	float rms[3];
+	float peak[3];
+	float peak_hz[3];
+	float *band[3];
+
+	// per axis input in arrival order, count of them so far, a window is
+	// summed up each time it reaches size and then moved down by hop
+	int count;
+	float *in[3];
+
+	// Hann window, its mean square, twiddles e^(-2 pi i k / size) for
+	// k < size / 2, the bit reversal of the half size FFT and its work
+	// arrays, the one sided power spectrum
+	float *window;
+	float window_ms;
+	float *tw_re;
+	float *tw_im;
+	unsigned short *rev;
+	float *re;
+	float *im;
+	float *power;
+
+	void *block;
+} vibration_t;
+
+// hop 0 or more than size is size, no overlap. bands is capped at size / 2.
+int vibration_init(vibration_t *vib, int size, int hop, int bands, float sample_rate);
+void vibration_free(vibration_t *vib);
+
+// One sample, x y z. Returns 1 when it completed a window and the
+// summaries were updated, 0 otherwise.
+int vibration_add(vibration_t *vib, const float *accel);
+
+#endif /* VIBRATION_H */
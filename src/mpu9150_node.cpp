@@ -15,21 +15,38 @@
  */
 #include "ros/ros.h"
 #include "std_msgs/String.h"
+#include "std_msgs/Float32MultiArray.h"
+#include "sensor_msgs/Imu.h"
+#include "sensor_msgs/MagneticField.h"
+#include "diagnostic_msgs/DiagnosticArray.h"
+#include "dynamic_reconfigure/server.h"
+#include "bb_mpu9150/Mpu9150Config.h"
+#include "mpu9150_node.h"
 #include <sstream>
+#include <string>
 
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <signal.h>
 #include <getopt.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 
 // Needed when mixing C and C++ code/libraries
 #ifdef __cplusplus
     extern "C" {
 #endif
         #include "mpu9150.h"
+        #include "mpu_ring.h"
+        #include "mpu_log.h"
+        #include "magfit.h"
+        #include "vibration.h"
         #include "linux_glue.h"
         #include "local_defaults.h"
 
@@ -38,6 +55,43 @@
 #endif
 
 
+// most DMP packets a single mpu9150_read_batch() hands back
+#define MAX_BATCH 32
+
+// new readings the online mag fit takes between tries at solving it
+#define MAG_AUTOCAL_SOLVE_EVERY 50
+
+// Samples folded into one published message, already in SI units
+typedef struct {
+	int count;
+
+	// CLOCK_MONOTONIC ns of the first and last sample, and the last mag read
+	unsigned long long first_ns;
+	unsigned long long last_ns;
+	unsigned long long mag_ns;
+
+	double quat[4];
+	double gyro[3];
+	double accel[3];
+	double mag[3];
+} imu_accum_t;
+
+// What cfg/Mpu9150.cfg changes while running
+typedef struct {
+	int sample_rate;
+	int yaw_mix_factor;
+	int lpf;
+	int gyro_fsr;
+	int accel_fsr;
+} live_config_t;
+
+// Counters at the last /diagnostics message, to see what changed since
+typedef struct {
+	mpu9150_stats_t stats;
+	unsigned long ring_dropped;
+	unsigned long record_dropped;
+} diag_window_t;
+
 int set_cal(int mag, char *cal_file);
 void read_loop(unsigned int sample_rate);
 void print_fused_euler_angles(mpudata_t *mpu);
@@ -46,14 +100,80 @@ void print_calibrated_accel(mpudata_t *mpu);
 void print_calibrated_mag(mpudata_t *mpu);
 void register_sig_handler();
 void sigint_handler(int sig);
+void set_covariance(sensor_msgs::Imu::_orientation_covariance_type &cov, double variance);
+void accum_reset(imu_accum_t *acc);
+void accum_add(imu_accum_t *acc, mpudata_t *mpu);
+void fill_imu_msg(imu_accum_t *acc, sensor_msgs::Imu &msg);
+void fill_mag_msg(imu_accum_t *acc, sensor_msgs::MagneticField &msg);
+std::string euler_string(mpudata_t *mpu, int count);
+ros::Time to_ros_time(unsigned long long mono_ns);
+int start_acquisition(int sample_rate, int poll, int ring_size, int priority, int cpu);
+void stop_acquisition();
+void *acquisition_thread(void *arg);
+int drain_ring(mpudata_t *out, int max, int *n);
+void add_value(diagnostic_msgs::DiagnosticStatus &status, const char *key, unsigned long value);
+void add_timer(diagnostic_msgs::DiagnosticStatus &status, const char *key, mpu9150_timer_t *t);
+void publish_diagnostics(ros::Publisher &pub, const std::string &hardware_id,
+		diag_window_t *last, unsigned long ring_dropped, unsigned long record_dropped,
+		const diagnostic_msgs::DiagnosticStatus &startup);
+void startup_diagnostics(diagnostic_msgs::DiagnosticStatus &status,
+		const std::string &hardware_id, bool self_test);
+void publish_vibration(ros::Publisher &pub, vibration_t *vib);
+void sync_lazy();
+unsigned long long derived_since();
+void mag_autocal(magfit_t *fit, mpudata_t *mpu, const std::string &cache);
+int load_gyro_bias(const char *path, long *bias);
+void keep_gyro_bias(const std::string &path, const long *bias, long *saved);
+void reconfigure_cb(bb_mpu9150::Mpu9150Config &config, uint32_t level);
+void apply_reconfig(live_config_t *live, const live_config_t *next, bool recording);
 
+// the standalone node's stop flag, set on SIGINT
 int done;
 
+// mpudata_t to SI conversion, see mpu9150_get_si_scale()
+float gyro_scale;
+float accel_scale;
+float mag_scale[3];
+
+// Acquisition thread state. The thread is the only caller of the mpu9150
+// library once started and the ROS thread only ever pops from acq_ring,
+// apart from reading the counters for /diagnostics.
+mpu_ring_t acq_ring;
+sem_t acq_sem;
+pthread_t acq_thread;
+int acq_running;
+int acq_stop;
+int acq_poll;
+long acq_period_ns;
+
+// Every acq_bias_period_ns the thread reads the DMP gyro bias into
+// acq_bias and sets acq_bias_ready, the ROS thread saves it and clears it
+unsigned long long acq_bias_period_ns;
+long acq_bias[3];
+int acq_bias_ready;
+
+// With nobody subscribed to what the library derives the ROS thread sets
+// acq_lazy_want. Whichever thread drives the library applies it in
+// sync_lazy(), which records when in acq_lazy_ns before it moves
+// acq_lazy_set.
+int acq_lazy_want;
+int acq_lazy_set;
+unsigned long long acq_lazy_ns;
+
+// The dynamic_reconfigure callback, on whatever thread spins the private
+// node handle, leaves the latest request in reconfig_next and sets
+// reconfig_pending. The ROS loop picks it up.
+pthread_mutex_t reconfig_lock = PTHREAD_MUTEX_INITIALIZER;
+live_config_t reconfig_next;
+int reconfig_pending;
+
 void usage(char *argv_0)
 {
     printf("\nUsage: %s [options]\n", argv_0);
     printf("  -b <i2c-bus>          The I2C bus number where the IMU is. The default is 1 to use /dev/i2c-1.\n");
-    printf("  -s <sample-rate>      The IMU sample rate in Hz. Range 2-50, default 10.\n");
+    printf("  -s <sample-rate>      The IMU sample rate in Hz. Range 2-200, default 10.\n");
+    printf("                           Up to 1000 with the ~raw_mode parameter.\n");
+    printf("                           Also the ~sample_rate parameter.\n");
     printf("  -y <yaw-mix-factor>   Effect of mag yaw on fused yaw data.\n");
     printf("                           0 = gyro only\n");
     printf("                           1 = mag only\n");
@@ -61,6 +181,9 @@ void usage(char *argv_0)
     printf("                           The default is 4.\n");
     printf("  -a <accelcal file>    Path to accelerometer calibration file. Default is ./accelcal.txt\n");
     printf("  -m <magcal file>      Path to mag calibration file. Default is ./magcal.txt\n");
+    printf("  -g <int-gpio>         GPIO number wired to the MPU INT pin. Samples are read\n");
+    printf("                           as soon as the DMP raises the interrupt instead of\n");
+    printf("                           polling at a fixed rate.\n");
     printf("  -v                    Verbose messages\n");
     printf("  -h                    Show this help\n");
 
@@ -69,26 +192,194 @@ void usage(char *argv_0)
     exit(1);
 }
 
+#ifndef MPU9150_NODELET
 int main(int argc, char **argv)
 {
   ros::init(argc, argv, "mpu9150_node");
   ros::NodeHandle n;
-  ros::Publisher chatter_pub = n.advertise<std_msgs::String>("imu_euler", 1000);
-  ros::Rate loop_rate(10);
+  ros::NodeHandle pn("~");
+
+  register_sig_handler();
+
+  return mpu9150_node_run(n, pn, argc, argv, true, &done);
+}
+#endif
+
+void mpu9150_node_stop(int *stop)
+{
+  __atomic_store_n(stop, 1, __ATOMIC_RELAXED);
+}
+
+int mpu9150_node_run(ros::NodeHandle &n, ros::NodeHandle &pn, int argc, char **argv,
+		bool standalone, int *stop)
+{
+  // Publishing config
+  std::string frame_id;
+  bool publish_euler;
+  double orientation_variance, angular_velocity_variance;
+  double linear_acceleration_variance, magnetic_field_variance;
+  int publish_decimation;
+  int decimated = 0;
+  bool publish_average;
+  bool use_thread;
+  int thread_priority, thread_cpu, ring_size;
+  std::string record_file;
+  bool record_direct;
+  bool recording = false;
+  mpu_log_t record_log;
+  mpu_log_header_t record_header;
+  unsigned long record_dropped = 0;
+  double diagnostic_period;
+  diag_window_t diag_last;
+  diagnostic_msgs::DiagnosticStatus diag_startup;
+  unsigned long long diag_next_ns = 0, now_ns;
+  bool autocal;
+  std::string mag_cal_cache;
+  magfit_t mag_fit;
+  unsigned long long last_mag_ns = 0;
+  std::string gyro_bias_file;
+  double gyro_bias_period;
+  long gyro_bias[3], saved_gyro_bias[3];
+  unsigned long long bias_next_ns = 0;
+  int vib_window, vib_hop, vib_bands;
+  bool vib_only;
+  vibration_t vib;
+  int lazy;
+  unsigned long long derived_ns;
+
+  pn.param<std::string>("frame_id", frame_id, "imu_link");
+  pn.param("publish_euler", publish_euler, false);
+  pn.param("orientation_variance", orientation_variance, 0.0025);
+  pn.param("angular_velocity_variance", angular_velocity_variance, 0.0004);
+  pn.param("linear_acceleration_variance", linear_acceleration_variance, 0.01);
+  pn.param("magnetic_field_variance", magnetic_field_variance, 1e-12);
+
+  // publish every Nth sample, or the mean of every N with publish_average
+  pn.param("publish_decimation", publish_decimation, 1);
+  pn.param("publish_average", publish_average, false);
+
+  if (publish_decimation < 1) {
+    ROS_WARN("publish_decimation must be >= 1, using 1");
+    publish_decimation = 1;
+  }
+
+  // Sensor reads on their own thread so publishing can't stall the FIFO.
+  // thread_priority > 0 asks for SCHED_FIFO, thread_cpu >= 0 pins it.
+  pn.param("acquisition_thread", use_thread, true);
+  pn.param("thread_priority", thread_priority, 0);
+  pn.param("thread_cpu", thread_cpu, -1);
+  pn.param("ring_size", ring_size, 256);
+
+  // raw samples to a binary log for imureplay, written on its own thread
+  pn.param<std::string>("record_file", record_file, "");
+  pn.param("record_direct", record_direct, false);
+
+  // 0 turns the /diagnostics output off
+  pn.param("diagnostic_period", diagnostic_period, 1.0);
+
+  // Hard and soft iron fit on the live mag readings, replacing magcal.txt
+  // once it converges. A good fit is kept in mag_cal_cache for next time,
+  // which is loaded at startup with or without mag_autocal.
+  pn.param("mag_autocal", autocal, false);
+  pn.param<std::string>("mag_cal_cache", mag_cal_cache, "");
+
+  // The gyro bias the DMP converged to, saved every gyro_bias_period
+  // seconds and on shutdown and loaded at startup so yaw does not drift
+  // while the DMP relearns it. 0 only saves on shutdown.
+  pn.param<std::string>("gyro_bias_file", gyro_bias_file, "");
+  pn.param("gyro_bias_period", gyro_bias_period, 60.0);
+
+  // RMS, peak and band spectrum of the accel over vib_window samples every
+  // vib_hop of them, 0 turns it off. vibration_only leaves out imu/data
+  // and imu/mag, for monitoring at a raw rate the link could not carry.
+  pn.param("vibration_window", vib_window, 0);
+  pn.param("vibration_hop", vib_hop, 0);
+  pn.param("vibration_bands", vib_bands, 16);
+  pn.param("vibration_only", vib_only, false);
+
+  if (vib_window == 0)
+    vib_only = false;
+
+  ros::Publisher imu_pub = n.advertise<sensor_msgs::Imu>("imu/data", 100);
+  ros::Publisher mag_pub = n.advertise<sensor_msgs::MagneticField>("imu/mag", 100);
+  ros::Publisher euler_pub;
+  ros::Publisher diag_pub;
+  ros::Publisher vib_pub;
+
+  if (diagnostic_period > 0.0)
+    diag_pub = n.advertise<diagnostic_msgs::DiagnosticArray>("diagnostics", 10);
+
+  // the old formatted text output, off unless asked for
+  if (publish_euler)
+    euler_pub = n.advertise<std_msgs::String>("imu_euler", 1000);
+
+  if (vib_window)
+    vib_pub = n.advertise<std_msgs::Float32MultiArray>("vibration", 10);
 
   /* Init the sensor the values are hardcoded at the local_defaults.h file */
     int opt, len;
 	int i2c_bus = DEFAULT_I2C_BUS;
-	int sample_rate = DEFAULT_SAMPLE_RATE_HZ;
+	int sample_rate;
 	int yaw_mix_factor = DEFAULT_YAW_MIX_FACTOR;
 	int verbose = 0;
+	int int_pin = -1;
 	char *mag_cal_file = NULL;
 	char *accel_cal_file = NULL;
 	unsigned long loop_delay;
-	mpudata_t mpu;
+	mpudata_t batch[MAX_BATCH];
+	imu_accum_t acc;
+	int i, nsamples;
+	int compass_rate;
+	bool fast_boot, verify_firmware;
+	bool raw_mode;
+	bool self_test;
+	double batch_latency;
+	int batch_packets;
+	bool poll;
+	int i2c_retries, i2c_retry_us;
+	std::string fusion;
+	double fusion_gain;
+	int fusion_engine;
+	bool ok;
+	live_config_t live;
+
+    // -s on the command line wins over the parameter
+    pn.param("sample_rate", sample_rate, DEFAULT_SAMPLE_RATE_HZ);
+
+    // 0 follows sample_rate up to the AK8975 limit
+    pn.param("compass_rate", compass_rate, 0);
+
+    // opt in: bank sized upload that skips code already loaded by a previous run
+    pn.param("fast_boot", fast_boot, false);
+    pn.param("verify_firmware", verify_firmware, false);
+
+    // DMP off, samples at up to the 1 kHz gyro rate
+    pn.param("raw_mode", raw_mode, false);
+
+    // factory self-test during init, the board has to be level and still
+    pn.param("self_test", self_test, false);
+
+    // seconds of DMP packets the FIFO collects between wakeups, fewer
+    // wakeups for more latency. 0 wakes for every packet.
+    pn.param("batch_latency", batch_latency, 0.0);
+
+    // short or failed reads, retried after i2c_retry_us doubling each time
+    pn.param("i2c_retries", i2c_retries, 2);
+    pn.param("i2c_retry_us", i2c_retry_us, 50);
+
+    // yawmix, madgwick, mahony or ekf, gain 0 is the engine default
+    pn.param<std::string>("fusion", fusion, "yawmix");
+    pn.param("fusion_gain", fusion_gain, 0.0);
+
+    fusion_engine = fusion_engine_id(fusion.c_str());
+
+    if (fusion_engine < 0) {
+        ROS_ERROR("Unknown fusion engine %s", fusion.c_str());
+        return 1;
+    }
 
     // receive the parameters and process them
-    while ((opt = getopt(argc, argv, "b:s:y:a:m:vh")) != -1) {
+    while ((opt = getopt(argc, argv, "b:s:y:a:m:g:vh")) != -1) {
         switch (opt) {
         case 'b':
             i2c_bus = strtoul(optarg, NULL, 0);
@@ -109,7 +400,8 @@ int main(int argc, char **argv)
                 usage(argv[0]);
             }
 
-            if (sample_rate < MIN_SAMPLE_RATE || sample_rate > MAX_SAMPLE_RATE){
+            if (sample_rate < MIN_SAMPLE_RATE
+                    || sample_rate > (raw_mode ? MAX_RAW_SAMPLE_RATE : MAX_SAMPLE_RATE)){
                 printf("sample rate problem\n");
                 usage(argv[0]);
             }
@@ -153,6 +445,14 @@ int main(int argc, char **argv)
             strcpy(mag_cal_file, optarg);
             break;
 
+        case 'g':
+            int_pin = strtol(optarg, NULL, 0);
+
+            if (errno == EINVAL || int_pin < 0)
+                usage(argv[0]);
+
+            break;
+
         case 'v':
             verbose = 1;
             break;
@@ -164,59 +464,974 @@ int main(int argc, char **argv)
         }
     }
 
+	batch_packets = (int)(batch_latency * sample_rate + 0.5);
+
+	// the library sleeps out a batch itself, like a wait on the INT pin
+	poll = int_pin < 0 && batch_packets < 2;
+
     // Initialize the MPU-9150
-	register_sig_handler();
 	mpu9150_set_debug(verbose);
+	mpu9150_set_int_pin(int_pin);
+	mpu9150_set_compass_rate(compass_rate);
+	mpu9150_set_fast_boot(fast_boot, verify_firmware);
+	mpu9150_set_raw_mode(raw_mode);
+	mpu9150_set_self_test(self_test);
+	mpu9150_set_batch(batch_packets);
+	mpu9150_set_i2c_retry(i2c_retries, i2c_retry_us < 0 ? 0 : i2c_retry_us);
+	mpu9150_set_fusion(fusion_engine, fusion_gain);
+
+	// a nodelet loaded again finds the library as the last one left it
+	mpu9150_set_lazy(0);
+	__atomic_store_n(&acq_lazy_want, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&acq_lazy_set, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&acq_lazy_ns, 0ULL, __ATOMIC_RELAXED);
+
 	if (mpu9150_init(i2c_bus, sample_rate, yaw_mix_factor))
-		exit(1);
+		return 1;
 	set_cal(0, accel_cal_file);
 	set_cal(1, mag_cal_file);
 	if (accel_cal_file)
 		free(accel_cal_file);
 	if (mag_cal_file)
 		free(mag_cal_file);
-	memset(&mpu, 0, sizeof(mpudata_t));
+	if (!mag_cal_cache.empty()) {
+		float matrix[9];
+		short offset[3];
+
+		if (magfit_load(mag_cal_cache.c_str(), matrix, offset) == 0) {
+			ROS_INFO("Mag calibration from %s", mag_cal_cache.c_str());
+			mpu9150_set_mag_cal_matrix(matrix, offset);
+		}
+	}
+	if (autocal)
+		magfit_init(&mag_fit, MAGFIT_DEFAULT_MIN_STEP, MAGFIT_DEFAULT_FORGET);
+	memset(saved_gyro_bias, 0, sizeof(saved_gyro_bias));
+	if (raw_mode)
+		gyro_bias_file.clear();
+	if (!gyro_bias_file.empty() && load_gyro_bias(gyro_bias_file.c_str(), gyro_bias) == 0) {
+		if (mpu9150_set_gyro_bias(gyro_bias) == 0) {
+			ROS_INFO("Gyro bias from %s", gyro_bias_file.c_str());
+			memcpy(saved_gyro_bias, gyro_bias, sizeof(saved_gyro_bias));
+		}
+	}
+	if (gyro_bias_file.empty() || gyro_bias_period < 0.0)
+		gyro_bias_period = 0.0;
+	memset(batch, 0, sizeof(batch));
 	if (sample_rate == 0)
 		return -1;
+	if (mpu9150_get_si_scale(&gyro_scale, &accel_scale, mag_scale)) {
+		mpu9150_exit();
+		return 1;
+	}
+
+  if (!record_file.empty()) {
+    float raw_gyro_scale, raw_accel_scale;
+
+    mpu9150_get_raw_scale(&raw_gyro_scale, &raw_accel_scale);
+    mpu_log_header_init(&record_header, sample_rate, raw_mode, raw_gyro_scale, raw_accel_scale);
+
+    if (mpu_log_create(&record_log, record_file.c_str(), record_direct, &record_header))
+      ROS_ERROR("Could not record to %s", record_file.c_str());
+    else
+      recording = true;
+  }
 
     // ROS loop config
-	loop_delay = (1000 / sample_rate) - 2;
+	loop_delay = sample_rate < 500 ? (1000 / sample_rate) - 2 : 0;
 	printf("\nEntering MPU read loop (ctrl-c to exit)\n\n");
 	linux_delay_ms(loop_delay);
 
+  // The fields that never change. Each message published is a new copy
+  // handed over by pointer and never touched again, so subscribers in the
+  // same process (the nodelet) get it without serializing.
+  sensor_msgs::Imu imu_msg;
+  sensor_msgs::MagneticField mag_msg;
+
+  imu_msg.header.frame_id = frame_id;
+  set_covariance(imu_msg.orientation_covariance, orientation_variance);
+  set_covariance(imu_msg.angular_velocity_covariance, angular_velocity_variance);
+  set_covariance(imu_msg.linear_acceleration_covariance, linear_acceleration_variance);
+
+  // REP 145, yaw-mix has no orientation estimate without the DMP
+  if (raw_mode && fusion_engine == FUSION_YAW_MIX)
+    imu_msg.orientation_covariance[0] = -1.0;
+
+  mag_msg.header.frame_id = frame_id;
+  set_covariance(mag_msg.magnetic_field_covariance, magnetic_field_variance);
+
+  // Without the INT pin we poll at the sample rate, the batch read
+  // picks up every packet queued since the last pass so none are lost
+  ros::Rate poll_rate(sample_rate);
+
+  // what mpu9150_init() set up, handed to the server so it starts there
+  // rather than from the cfg defaults
+  live.sample_rate = sample_rate;
+  live.yaw_mix_factor = yaw_mix_factor;
+  live.lpf = 0;
+  live.gyro_fsr = 2000;
+  live.accel_fsr = 2;
+
+  pn.setParam("sample_rate", live.sample_rate);
+  pn.setParam("yaw_mix_factor", live.yaw_mix_factor);
+  pn.setParam("lpf", live.lpf);
+  pn.setParam("gyro_fsr", live.gyro_fsr);
+  pn.setParam("accel_fsr", live.accel_fsr);
+
+  __atomic_store_n(&reconfig_pending, 0, __ATOMIC_RELAXED);
+
+  dynamic_reconfigure::Server<bb_mpu9150::Mpu9150Config> reconfig_server(pn);
+  reconfig_server.setCallback(boost::bind(&reconfigure_cb, _1, _2));
+
+  std::ostringstream hardware_id;
+  hardware_id << "i2c-" << i2c_bus << " 0x" << std::hex << MPU9150_ADDR_AD0_LOW;
+
+  // the registers are read here, before the acquisition thread owns the bus
+  startup_diagnostics(diag_startup, hardware_id.str(), self_test);
+
+  accum_reset(&acc);
+
+  if (vib_window && vibration_init(&vib, vib_window, vib_hop, vib_bands, sample_rate)) {
+    ROS_WARN("vibration_window must be a power of two from %d to %d, vibration off",
+        VIBRATION_MIN_SIZE, VIBRATION_MAX_SIZE);
+    vib_window = 0;
+    vib_only = false;
+  }
+
+  acq_bias_period_ns = (unsigned long long)(gyro_bias_period * 1.0e9);
+
+  if (use_thread) {
+    if (start_acquisition(sample_rate, poll, ring_size, thread_priority, thread_cpu)) {
+      ROS_WARN("Could not start the acquisition thread, reading on the ROS thread");
+      use_thread = false;
+    }
+  }
+
   /**
-   * A count of how many messages we have sent. This is used to create
-   * a unique string for each message.
+   * A count of how many messages we have published. This is used to create
+   * a unique string for each euler message.
    */
   int count = 0;
-  while (ros::ok())
+  unsigned long dropped = 0;
+  memset(&diag_last, 0, sizeof(diag_last));
+
+  while (ros::ok() && !__atomic_load_n(stop, __ATOMIC_RELAXED))
   {
-    std_msgs::String msg;
-    std::stringstream ss;
-
-	if (mpu9150_read(&mpu) == 0) {
-		//print_fused_euler_angles(&mpu);
-	    //ss << "\rX: %0.0f Y: %0.0f Z: %0.0f        ",
-	    ss << "\rX: " << mpu.fusedEuler[VEC3_X] * RAD_TO_DEGREE <<
-            " Y: " << mpu.fusedEuler[VEC3_Y] * RAD_TO_DEGREE <<
-			" Z: " << mpu.fusedEuler[VEC3_Z] * RAD_TO_DEGREE << count;
-
-		// printf_fused_quaternions(&mpu);
-	    // print_calibrated_accel(&mpu);
-	    // print_calibrated_mag(&mpu);
-
-       msg.data = ss.str();
-       ROS_INFO("ROS_INFO: %s\n", msg.data.c_str());
-	}
-//	linux_delay_ms(loop_delay);
-    chatter_pub.publish(msg);
-    ros::spinOnce();
-    loop_rate.sleep();
-    ++count;
+	if (__atomic_load_n(&reconfig_pending, __ATOMIC_ACQUIRE)) {
+		live_config_t next;
+
+		pthread_mutex_lock(&reconfig_lock);
+		next = reconfig_next;
+		__atomic_store_n(&reconfig_pending, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&reconfig_lock);
+
+		if (memcmp(&next, &live, sizeof(live))) {
+			// only one thread may drive the library, what the ring
+			// still holds goes with the FIFO contents
+			if (use_thread)
+				stop_acquisition();
+
+			apply_reconfig(&live, &next, recording);
+
+			sample_rate = live.sample_rate;
+			poll_rate = ros::Rate(sample_rate);
+			mpu9150_get_si_scale(&gyro_scale, &accel_scale, mag_scale);
+
+			// the bins are in Hz, start over with the new rate
+			if (vib_window) {
+				vibration_free(&vib);
+				vibration_init(&vib, vib_window, vib_hop, vib_bands, sample_rate);
+			}
+
+			if (use_thread && start_acquisition(sample_rate, poll, ring_size, thread_priority, thread_cpu)) {
+				ROS_WARN("Could not restart the acquisition thread, reading on the ROS thread");
+				use_thread = false;
+			}
+
+			// show what was refused
+			bb_mpu9150::Mpu9150Config config;
+
+			config.sample_rate = live.sample_rate;
+			config.yaw_mix_factor = live.yaw_mix_factor;
+			config.lpf = live.lpf;
+			config.gyro_fsr = live.gyro_fsr;
+			config.accel_fsr = live.accel_fsr;
+			reconfig_server.updateConfig(config);
+		}
+	}
+
+	// Calibration and fusion are only done for someone. Recording and
+	// the mag fit work on the raw fields, vibration needs calibratedAccel.
+	lazy = !vib_window && imu_pub.getNumSubscribers() == 0
+			&& mag_pub.getNumSubscribers() == 0
+			&& (!publish_euler || euler_pub.getNumSubscribers() == 0);
+
+	if (lazy != __atomic_load_n(&acq_lazy_want, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&acq_lazy_want, lazy, __ATOMIC_RELEASE);
+		ROS_DEBUG(lazy ? "No subscribers, reading raw fields only" : "Subscribed, deriving every sample");
+
+		// nothing of the average is published
+		accum_reset(&acc);
+		decimated = 0;
+	}
+
+	if (!use_thread)
+		sync_lazy();
+
+	derived_ns = derived_since();
+
+	if (use_thread)
+		ok = drain_ring(batch, MAX_BATCH, &nsamples) == 0;
+	else
+		ok = mpu9150_read_batch(batch, MAX_BATCH, &nsamples) == 0;
+
+	if (ok) {
+		for (i = 0; i < nsamples; i++) {
+			if (recording)
+				mpu_log_append(&record_log, &batch[i]);
+
+			// the compass is read slower than the samples come, once per reading
+			if (autocal && batch[i].magTimestampNs != last_mag_ns) {
+				last_mag_ns = batch[i].magTimestampNs;
+				mag_autocal(&mag_fit, &batch[i], mag_cal_cache);
+			}
+
+			if (vib_window) {
+				float accel[3];
+
+				accel[VEC3_X] = batch[i].calibratedAccel[VEC3_X] * accel_scale;
+				accel[VEC3_Y] = batch[i].calibratedAccel[VEC3_Y] * accel_scale;
+				accel[VEC3_Z] = batch[i].calibratedAccel[VEC3_Z] * accel_scale;
+
+				if (vibration_add(&vib, accel))
+					publish_vibration(vib_pub, &vib);
+
+				if (vib_only)
+					continue;
+			}
+
+			// read lazily, there was no one to publish it to
+			if (batch[i].dmpTimestampNs < derived_ns)
+				continue;
+
+			// without averaging acc only ever holds the latest sample
+			if (!publish_average)
+				accum_reset(&acc);
+
+			accum_add(&acc, &batch[i]);
+			acc.count++;
+
+			if (++decimated < publish_decimation)
+				continue;
+
+			// middle of the averaged span, the sample time without averaging
+			sensor_msgs::ImuPtr imu_out(new sensor_msgs::Imu(imu_msg));
+			fill_imu_msg(&acc, *imu_out);
+			imu_out->header.stamp = to_ros_time(acc.first_ns + (acc.last_ns - acc.first_ns) / 2);
+			imu_pub.publish(imu_out);
+
+			sensor_msgs::MagneticFieldPtr mag_out(new sensor_msgs::MagneticField(mag_msg));
+			fill_mag_msg(&acc, *mag_out);
+			mag_out->header.stamp = to_ros_time(acc.mag_ns);
+			mag_pub.publish(mag_out);
+
+			if (publish_euler) {
+				std_msgs::String msg;
+
+				msg.data = euler_string(&batch[i], count);
+				ROS_DEBUG("%s", msg.data.c_str());
+				euler_pub.publish(msg);
+			}
+
+			accum_reset(&acc);
+			decimated = 0;
+			++count;
+		}
+	}
+
+    if (use_thread && mpu_ring_dropped(&acq_ring) != dropped) {
+        dropped = mpu_ring_dropped(&acq_ring);
+        ROS_WARN("Sample ring full, %lu samples dropped so far", dropped);
+    }
+
+    if (recording && record_log.dropped != record_dropped) {
+        record_dropped = record_log.dropped;
+        ROS_WARN("Recording behind, %lu samples dropped so far", record_dropped);
+    }
+
+    if (diagnostic_period > 0.0 && linux_get_ns(&now_ns) == 0 && now_ns >= diag_next_ns) {
+        // the first pass only takes the baseline
+        if (diag_next_ns)
+            publish_diagnostics(diag_pub, hardware_id.str(), &diag_last,
+                    use_thread ? mpu_ring_dropped(&acq_ring) : 0, record_dropped, diag_startup);
+        else
+            mpu9150_get_stats(&diag_last.stats, 1);
+
+        diag_next_ns = now_ns + (unsigned long long)(diagnostic_period * 1.0e9);
+    }
+
+    if (use_thread) {
+        if (__atomic_load_n(&acq_bias_ready, __ATOMIC_ACQUIRE)) {
+            memcpy(gyro_bias, acq_bias, sizeof(gyro_bias));
+            __atomic_store_n(&acq_bias_ready, 0, __ATOMIC_RELEASE);
+            keep_gyro_bias(gyro_bias_file, gyro_bias, saved_gyro_bias);
+        }
+    }
+    else if (gyro_bias_period > 0.0 && linux_get_ns(&now_ns) == 0 && now_ns >= bias_next_ns) {
+        if (bias_next_ns && mpu9150_get_gyro_bias(gyro_bias) == 0)
+            keep_gyro_bias(gyro_bias_file, gyro_bias, saved_gyro_bias);
+
+        bias_next_ns = now_ns + acq_bias_period_ns;
+    }
+
+    // the nodelet manager runs the callbacks itself
+    if (standalone)
+        ros::spinOnce();
+
+    // drain_ring() and mpu9150_read_batch() with the INT pin or a batch already blocked
+    if (!use_thread && poll)
+        poll_rate.sleep();
+  }
+
+  if (use_thread)
+    stop_acquisition();
+
+  // the reading thread is gone, the library is ours again
+  if (!gyro_bias_file.empty() && mpu9150_get_gyro_bias(gyro_bias) == 0)
+    keep_gyro_bias(gyro_bias_file, gyro_bias, saved_gyro_bias);
+
+  mpu9150_exit();
+
+  if (vib_window)
+    vibration_free(&vib);
+
+  if (recording) {
+    if (mpu_log_close(&record_log))
+      ROS_ERROR("Recording to %s failed", record_file.c_str());
+    else
+      ROS_INFO("Recorded %lu samples to %s", record_log.records, record_file.c_str());
   }
+
   return 0;
 }
 
+int start_acquisition(int sample_rate, int poll, int ring_size, int priority, int cpu)
+{
+	pthread_attr_t attr;
+	struct sched_param param;
+	int ret;
+
+	if (mpu_ring_init(&acq_ring, ring_size))
+		return -1;
+
+	if (sem_init(&acq_sem, 0, 0)) {
+		mpu_ring_free(&acq_ring);
+		return -1;
+	}
+
+	acq_stop = 0;
+	acq_poll = poll;
+	acq_period_ns = 1000000000L / sample_rate;
+
+	pthread_attr_init(&attr);
+
+	if (priority > 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = priority;
+
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+
+	ret = pthread_create(&acq_thread, &attr, acquisition_thread, NULL);
+
+	// SCHED_FIFO needs CAP_SYS_NICE or an rtprio limit, run unprivileged without
+	if (ret == EPERM && priority > 0) {
+		ROS_WARN("No permission for SCHED_FIFO priority %d, using the default policy", priority);
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		ret = pthread_create(&acq_thread, &attr, acquisition_thread, NULL);
+	}
+
+	pthread_attr_destroy(&attr);
+
+	if (ret) {
+		sem_destroy(&acq_sem);
+		mpu_ring_free(&acq_ring);
+		return -1;
+	}
+
+	if (cpu >= 0) {
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+
+		if (pthread_setaffinity_np(acq_thread, sizeof(cpus), &cpus))
+			ROS_WARN("Could not pin the acquisition thread to CPU %d", cpu);
+	}
+
+	acq_running = 1;
+
+	return 0;
+}
+
+void stop_acquisition()
+{
+	if (!acq_running)
+		return;
+
+	__atomic_store_n(&acq_stop, 1, __ATOMIC_RELAXED);
+	pthread_join(acq_thread, NULL);
+
+	sem_destroy(&acq_sem);
+	mpu_ring_free(&acq_ring);
+	acq_running = 0;
+}
+
+void reconfigure_cb(bb_mpu9150::Mpu9150Config &config, uint32_t level)
+{
+	pthread_mutex_lock(&reconfig_lock);
+
+	reconfig_next.sample_rate = config.sample_rate;
+	reconfig_next.yaw_mix_factor = config.yaw_mix_factor;
+	reconfig_next.lpf = config.lpf;
+	reconfig_next.gyro_fsr = config.gyro_fsr;
+	reconfig_next.accel_fsr = config.accel_fsr;
+
+	__atomic_store_n(&reconfig_pending, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&reconfig_lock);
+}
+
+// With nothing else reading the device. What fails, or is out of range
+// for the mode, keeps its old value in live.
+void apply_reconfig(live_config_t *live, const live_config_t *next, bool recording)
+{
+	if (next->sample_rate != live->sample_rate) {
+		if (mpu9150_set_sample_rate(next->sample_rate) == 0) {
+			ROS_INFO("Sample rate %d Hz", next->sample_rate);
+			live->sample_rate = next->sample_rate;
+		}
+		else {
+			ROS_WARN("Could not change the sample rate to %d Hz", next->sample_rate);
+		}
+	}
+
+	if (next->lpf != live->lpf) {
+		if (mpu9150_set_lpf(next->lpf) == 0)
+			live->lpf = next->lpf;
+		else
+			ROS_WARN("Could not change the LPF to %d Hz", next->lpf);
+	}
+
+	// a log has one scale in its header for the whole recording
+	if (next->gyro_fsr != live->gyro_fsr || next->accel_fsr != live->accel_fsr) {
+		if (recording) {
+			ROS_WARN("The full scale ranges can not change while recording");
+		}
+		else {
+			if (next->gyro_fsr != live->gyro_fsr) {
+				if (mpu9150_set_gyro_fsr(next->gyro_fsr) == 0)
+					live->gyro_fsr = next->gyro_fsr;
+				else
+					ROS_WARN("Could not change the gyro range to %d dps", next->gyro_fsr);
+			}
+
+			if (next->accel_fsr != live->accel_fsr) {
+				if (mpu9150_set_accel_fsr(next->accel_fsr) == 0)
+					live->accel_fsr = next->accel_fsr;
+				else
+					ROS_WARN("Could not change the accel range to %d g", next->accel_fsr);
+			}
+		}
+	}
+
+	if (next->yaw_mix_factor != live->yaw_mix_factor) {
+		if (mpu9150_set_yaw_mix(next->yaw_mix_factor) == 0)
+			live->yaw_mix_factor = next->yaw_mix_factor;
+	}
+}
+
+void *acquisition_thread(void *arg)
+{
+	mpudata_t batch[MAX_BATCH];
+	struct timespec next, now;
+	unsigned long long now_ns, bias_next_ns = 0;
+	int i, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (!__atomic_load_n(&acq_stop, __ATOMIC_RELAXED)) {
+		sync_lazy();
+
+		if (mpu9150_read_batch(batch, MAX_BATCH, &n) == 0) {
+			for (i = 0; i < n; i++)
+				mpu_ring_push(&acq_ring, &batch[i]);
+
+			sem_post(&acq_sem);
+		}
+
+		if (acq_bias_period_ns && linux_get_ns(&now_ns) == 0 && now_ns >= bias_next_ns) {
+			// the first pass only starts the clock, the DMP has nothing new yet
+			if (bias_next_ns && !__atomic_load_n(&acq_bias_ready, __ATOMIC_ACQUIRE)
+					&& mpu9150_get_gyro_bias(acq_bias) == 0)
+				__atomic_store_n(&acq_bias_ready, 1, __ATOMIC_RELEASE);
+
+			bias_next_ns = now_ns + acq_bias_period_ns;
+		}
+
+		// with the INT pin or a batch the read above blocked until it was due
+		if (!acq_poll)
+			continue;
+
+		next.tv_nsec += acq_period_ns;
+
+		if (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		// a stall longer than a period, restart the schedule from here
+		if (now.tv_sec > next.tv_sec + 1 || (now.tv_sec - next.tv_sec) * 1000000000L
+				+ (now.tv_nsec - next.tv_nsec) > acq_period_ns) {
+			next = now;
+			continue;
+		}
+
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	return NULL;
+}
+
+// Only from the thread driving the library
+void sync_lazy()
+{
+	unsigned long long ns = 0;
+	int want = __atomic_load_n(&acq_lazy_want, __ATOMIC_ACQUIRE);
+
+	if (want == __atomic_load_n(&acq_lazy_set, __ATOMIC_RELAXED))
+		return;
+
+	mpu9150_set_lazy(want);
+	linux_get_ns(&ns);
+
+	__atomic_store_n(&acq_lazy_ns, ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&acq_lazy_set, want, __ATOMIC_RELEASE);
+}
+
+// Samples measured from this time on have their derived fields. A lazy
+// one was read, so measured, before the library was switched back. The
+// few derived ones measured earlier that are still in the FIFO are lost.
+unsigned long long derived_since()
+{
+	if (__atomic_load_n(&acq_lazy_set, __ATOMIC_ACQUIRE))
+		return ~0ULL;
+
+	return __atomic_load_n(&acq_lazy_ns, __ATOMIC_RELAXED);
+}
+
+int drain_ring(mpudata_t *out, int max, int *n)
+{
+	struct timespec timeout;
+
+	*n = 0;
+
+	if (mpu_ring_count(&acq_ring) == 0) {
+		// don't hold up ros::ok() and spinOnce() for long
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_nsec += 100000000L;
+
+		if (timeout.tv_nsec >= 1000000000L) {
+			timeout.tv_nsec -= 1000000000L;
+			timeout.tv_sec++;
+		}
+
+		sem_timedwait(&acq_sem, &timeout);
+	}
+
+	while (*n < max && mpu_ring_pop(&acq_ring, &out[*n]) == 0)
+		(*n)++;
+
+	return *n > 0 ? 0 : -1;
+}
+
+void set_covariance(sensor_msgs::Imu::_orientation_covariance_type &cov, double variance)
+{
+	cov.assign(0.0);
+	cov[0] = variance;
+	cov[4] = variance;
+	cov[8] = variance;
+}
+
+void accum_reset(imu_accum_t *acc)
+{
+	memset(acc, 0, sizeof(imu_accum_t));
+}
+
+void accum_add(imu_accum_t *acc, mpudata_t *mpu)
+{
+	double sign = 1.0;
+	int i;
+
+	// q and -q are the same rotation, keep the sum in one hemisphere
+	if (acc->quat[QUAT_W] * mpu->fusedQuat[QUAT_W] + acc->quat[QUAT_X] * mpu->fusedQuat[QUAT_X]
+			+ acc->quat[QUAT_Y] * mpu->fusedQuat[QUAT_Y] + acc->quat[QUAT_Z] * mpu->fusedQuat[QUAT_Z] < 0.0)
+		sign = -1.0;
+
+	for (i = 0; i < 4; i++)
+		acc->quat[i] += sign * mpu->fusedQuat[i];
+
+	if (acc->count == 0)
+		acc->first_ns = mpu->dmpTimestampNs;
+
+	acc->last_ns = mpu->dmpTimestampNs;
+	acc->mag_ns = mpu->magTimestampNs;
+
+	// same axis convention as calibratedAccel
+	acc->gyro[VEC3_X] -= mpu->rawGyro[VEC3_X] * gyro_scale;
+	acc->gyro[VEC3_Y] += mpu->rawGyro[VEC3_Y] * gyro_scale;
+	acc->gyro[VEC3_Z] += mpu->rawGyro[VEC3_Z] * gyro_scale;
+
+	for (i = 0; i < 3; i++) {
+		acc->accel[i] += mpu->calibratedAccel[i] * accel_scale;
+		acc->mag[i] += mpu->calibratedMag[i] * mag_scale[i];
+	}
+}
+
+void fill_imu_msg(imu_accum_t *acc, sensor_msgs::Imu &msg)
+{
+	double norm;
+
+	// a normalized sum is close enough to the mean for nearby rotations
+	norm = sqrt(acc->quat[QUAT_W] * acc->quat[QUAT_W] + acc->quat[QUAT_X] * acc->quat[QUAT_X]
+			+ acc->quat[QUAT_Y] * acc->quat[QUAT_Y] + acc->quat[QUAT_Z] * acc->quat[QUAT_Z]);
+
+	if (norm == 0.0)
+		norm = 1.0;
+
+	msg.orientation.w = acc->quat[QUAT_W] / norm;
+	msg.orientation.x = acc->quat[QUAT_X] / norm;
+	msg.orientation.y = acc->quat[QUAT_Y] / norm;
+	msg.orientation.z = acc->quat[QUAT_Z] / norm;
+
+	msg.angular_velocity.x = acc->gyro[VEC3_X] / acc->count;
+	msg.angular_velocity.y = acc->gyro[VEC3_Y] / acc->count;
+	msg.angular_velocity.z = acc->gyro[VEC3_Z] / acc->count;
+
+	msg.linear_acceleration.x = acc->accel[VEC3_X] / acc->count;
+	msg.linear_acceleration.y = acc->accel[VEC3_Y] / acc->count;
+	msg.linear_acceleration.z = acc->accel[VEC3_Z] / acc->count;
+}
+
+void fill_mag_msg(imu_accum_t *acc, sensor_msgs::MagneticField &msg)
+{
+	msg.magnetic_field.x = acc->mag[VEC3_X] / acc->count;
+	msg.magnetic_field.y = acc->mag[VEC3_Y] / acc->count;
+	msg.magnetic_field.z = acc->mag[VEC3_Z] / acc->count;
+}
+
+void add_value(diagnostic_msgs::DiagnosticStatus &status, const char *key, unsigned long value)
+{
+	diagnostic_msgs::KeyValue kv;
+	std::ostringstream ss;
+
+	ss << value;
+	kv.key = key;
+	kv.value = ss.str();
+	status.values.push_back(kv);
+}
+
+// Mean over the whole run and the worst case since the last message, in us
+void add_timer(diagnostic_msgs::DiagnosticStatus &status, const char *key, mpu9150_timer_t *t)
+{
+	diagnostic_msgs::KeyValue kv;
+	char buff[64];
+
+	snprintf(buff, sizeof(buff), "%.1f / %.1f",
+		t->count ? t->total_ns / 1000.0 / t->count : 0.0, t->max_ns / 1000.0);
+
+	kv.key = std::string(key) + " mean / max (us)";
+	kv.value = buff;
+	status.values.push_back(kv);
+}
+
+// One status for the sensor. WARN when anything went wrong since the last
+// message, ERROR when no samples came in at all.
+void publish_diagnostics(ros::Publisher &pub, const std::string &hardware_id,
+		diag_window_t *last, unsigned long ring_dropped, unsigned long record_dropped,
+		const diagnostic_msgs::DiagnosticStatus &startup)
+{
+	diagnostic_msgs::DiagnosticArray msg;
+	diagnostic_msgs::DiagnosticStatus status;
+	mpu9150_stats_t st, *prev = &last->stats;
+
+	mpu9150_get_stats(&st, 1);
+
+	status.name = "mpu9150";
+	status.hardware_id = hardware_id;
+
+	if (st.samples == prev->samples) {
+		status.level = diagnostic_msgs::DiagnosticStatus::ERROR;
+		status.message = "No samples";
+	}
+	else if (st.i2c_errors != prev->i2c_errors || st.read_errors != prev->read_errors
+			|| st.compass_errors != prev->compass_errors || st.fusion_errors != prev->fusion_errors) {
+		status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+		status.message = "Read errors";
+	}
+	else if (st.fifo_overflows != prev->fifo_overflows || st.packets_dropped != prev->packets_dropped
+			|| st.corrupt_packets != prev->corrupt_packets || ring_dropped != last->ring_dropped
+			|| record_dropped != last->record_dropped) {
+		status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+		status.message = "Samples lost";
+	}
+	else {
+		status.level = diagnostic_msgs::DiagnosticStatus::OK;
+		status.message = "OK";
+	}
+
+	add_value(status, "Samples", st.samples);
+	add_value(status, "Read errors", st.read_errors);
+	add_value(status, "I2C transfers", st.i2c_transfers);
+	add_value(status, "I2C bytes", st.i2c_bytes);
+	add_value(status, "I2C errors", st.i2c_errors);
+	add_value(status, "I2C retries", st.i2c_retries);
+	add_value(status, "I2C retry sleeps", st.i2c_retry_sleeps);
+	add_value(status, "FIFO overflows", st.fifo_overflows);
+	add_value(status, "FIFO resets", st.fifo_resets);
+	add_value(status, "Packets dropped", st.packets_dropped);
+	add_value(status, "Corrupt packets", st.corrupt_packets);
+	add_value(status, "Compass not ready", st.compass_not_ready);
+	add_value(status, "Compass errors", st.compass_errors);
+	add_value(status, "Fusion errors", st.fusion_errors);
+	add_value(status, "Ring drops", ring_dropped);
+	add_value(status, "Record drops", record_dropped);
+	add_timer(status, "Read", &st.read_time);
+	add_timer(status, "Compass", &st.compass_time);
+	add_timer(status, "Calibrate", &st.calibrate_time);
+	add_timer(status, "Fusion", &st.fusion_time);
+
+	msg.header.stamp = ros::Time::now();
+	msg.status.push_back(status);
+	msg.status.push_back(startup);
+	pub.publish(msg);
+
+	last->stats = st;
+	last->ring_dropped = ring_dropped;
+	last->record_dropped = record_dropped;
+}
+
+// Per axis x y z: rms, peak, peak_hz, then the bands from low to high
+void publish_vibration(ros::Publisher &pub, vibration_t *vib)
+{
+	std_msgs::Float32MultiArrayPtr msg(new std_msgs::Float32MultiArray);
+	int values = 3 + vib->bands;
+	int i, j;
+
+	msg->layout.dim.resize(2);
+	msg->layout.dim[0].label = "axis";
+	msg->layout.dim[0].size = 3;
+	msg->layout.dim[0].stride = 3 * values;
+	msg->layout.dim[1].label = "value";
+	msg->layout.dim[1].size = values;
+	msg->layout.dim[1].stride = values;
+
+	msg->data.reserve(3 * values);
+
+	for (i = 0; i < 3; i++) {
+		msg->data.push_back(vib->rms[i]);
+		msg->data.push_back(vib->peak[i]);
+		msg->data.push_back(vib->peak_hz[i]);
+
+		for (j = 0; j < vib->bands; j++)
+			msg->data.push_back(vib->band[i][j]);
+	}
+
+	pub.publish(msg);
+}
+
+// What init found, repeated with every message so it is not missed. ERROR
+// when a sensor failed the self-test. The register snapshot is hex, one
+// byte per register from 0x00.
+void startup_diagnostics(diagnostic_msgs::DiagnosticStatus &status,
+		const std::string &hardware_id, bool self_test)
+{
+	static const char *sensor[3] = { "Gyro", "Accel", "Compass" };
+	diagnostic_msgs::KeyValue kv;
+	unsigned char regs[MPU9150_NUM_REGS];
+	long bias[2][3];
+	char buff[64];
+	int result, i, n;
+
+	status.name = "mpu9150 startup";
+	status.hardware_id = hardware_id;
+	status.level = diagnostic_msgs::DiagnosticStatus::OK;
+	status.message = "Self-test off";
+
+	result = self_test ? mpu9150_get_self_test(bias[0], bias[1]) : -1;
+
+	if (result >= 0) {
+		status.message = "Self-test passed";
+
+		for (i = 0; i < 3; i++) {
+			kv.key = std::string(sensor[i]) + " self-test";
+			kv.value = (result & (1 << i)) ? "pass" : "FAIL";
+			status.values.push_back(kv);
+
+			if (!(result & (1 << i))) {
+				status.level = diagnostic_msgs::DiagnosticStatus::ERROR;
+				status.message = "Self-test failed";
+			}
+		}
+
+		for (i = 0; i < 2; i++) {
+			snprintf(buff, sizeof(buff), "%.3f %.3f %.3f",
+				bias[i][0] / 65536.0, bias[i][1] / 65536.0, bias[i][2] / 65536.0);
+			kv.key = i ? "Accel self-test bias (g)" : "Gyro self-test bias (dps)";
+			kv.value = buff;
+			status.values.push_back(kv);
+		}
+
+		if (status.level == diagnostic_msgs::DiagnosticStatus::OK)
+			ROS_INFO("Self-test passed");
+		else
+			ROS_ERROR("Self-test failed: gyro %s, accel %s, compass %s",
+				result & 1 ? "pass" : "FAIL", result & 2 ? "pass" : "FAIL",
+				result & 4 ? "pass" : "FAIL");
+	}
+
+	n = mpu9150_reg_snapshot(regs);
+
+	if (n > 0) {
+		kv.key = "Registers";
+		kv.value.clear();
+
+		for (i = 0; i < n; i++) {
+			snprintf(buff, sizeof(buff), "%02X", regs[i]);
+			kv.value += buff;
+		}
+
+		status.values.push_back(kv);
+	}
+}
+
+// Sample times are CLOCK_MONOTONIC. Map them onto ROS time through the
+// current offset between the two clocks, read back to back, so the stamp
+// carries the measurement time and not the time we got around to it.
+ros::Time to_ros_time(unsigned long long mono_ns)
+{
+	unsigned long long now_ns;
+	ros::Time now = ros::Time::now();
+
+	if (linux_get_ns(&now_ns))
+		return now;
+
+	return now - ros::Duration().fromNSec((int64_t)(now_ns - mono_ns));
+}
+
+std::string euler_string(mpudata_t *mpu, int count)
+{
+	std::stringstream ss;
+
+	ss << "\rX: " << mpu->fusedEuler[VEC3_X] * RAD_TO_DEGREE <<
+		" Y: " << mpu->fusedEuler[VEC3_Y] * RAD_TO_DEGREE <<
+		" Z: " << mpu->fusedEuler[VEC3_Z] * RAD_TO_DEGREE << count;
+
+	return ss.str();
+}
+
+// Feed the fit and hand a good solution to the reading thread. Samples
+// already in the ring were calibrated with the old matrix, the few of them
+// get the new scale.
+void mag_autocal(magfit_t *fit, mpudata_t *mpu, const std::string &cache)
+{
+	float matrix[9], radius;
+	short offset[3];
+
+	if (!magfit_add(fit, mpu->rawMag) || fit->samples % MAG_AUTOCAL_SOLVE_EVERY)
+		return;
+
+	if (magfit_solve(fit, matrix, offset, &radius))
+		return;
+
+	// still waiting for the last one, try again with the next solve
+	if (mpu9150_update_mag_cal_matrix(matrix, offset))
+		return;
+
+	mag_scale[0] = mag_scale[1] = mag_scale[2] = MAG_TESLA_PER_LSB;
+
+	ROS_DEBUG("Mag fit from %lu readings, offset %d %d %d radius %.1f", fit->samples,
+			offset[0], offset[1], offset[2], radius);
+
+	if (!cache.empty() && magfit_save(cache.c_str(), matrix, offset))
+		ROS_WARN_THROTTLE(60, "Could not save the mag calibration to %s", cache.c_str());
+}
+
+// Three lines of q16 dps, X Y Z, as mpu9150_get_gyro_bias() has them
+int load_gyro_bias(const char *path, long *bias)
+{
+	char buff[32];
+	char *end;
+	FILE *f;
+	int i;
+
+	f = fopen(path, "r");
+
+	if (!f)
+		return -1;
+
+	for (i = 0; i < 3; i++) {
+		if (!fgets(buff, sizeof(buff), f))
+			break;
+
+		bias[i] = strtol(buff, &end, 10);
+
+		if (end == buff)
+			break;
+	}
+
+	fclose(f);
+
+	if (i != 3) {
+		printf("Ignoring bad gyro bias file %s\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Write the file again if the bias moved since it was last written. All
+// zero is a DMP that has not computed one, keep what is there.
+void keep_gyro_bias(const std::string &path, const long *bias, long *saved)
+{
+	std::string tmp = path + ".tmp";
+	FILE *f;
+	int ok;
+
+	if (!memcmp(bias, saved, 3 * sizeof(long)) || (!bias[0] && !bias[1] && !bias[2]))
+		return;
+
+	f = fopen(tmp.c_str(), "w");
+
+	if (!f) {
+		ROS_WARN_THROTTLE(60, "Could not save the gyro bias to %s", path.c_str());
+		return;
+	}
+
+	ok = fprintf(f, "%ld\n%ld\n%ld\n", bias[0], bias[1], bias[2]) > 0;
+
+	if (fclose(f) || !ok || rename(tmp.c_str(), path.c_str())) {
+		ROS_WARN_THROTTLE(60, "Could not save the gyro bias to %s", path.c_str());
+		remove(tmp.c_str());
+		return;
+	}
+
+	memcpy(saved, bias, 3 * sizeof(long));
+}
+
 void print_fused_euler_angles(mpudata_t *mpu)
 {
 	printf("\rX: %0.0f Y: %0.0f Z: %0.0f        ",
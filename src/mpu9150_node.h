@@ -0,0 +1,29 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  mpu9150_node.h
+ *
+ *    Description: The read and publish loop shared by mpu9150_node and the nodelet
+ *
+ * =====================================================================================
+ */
+
+#ifndef MPU9150_NODE_H
+#define MPU9150_NODE_H
+
+#include "ros/ros.h"
+
+// Set up the IMU from the parameters on pn (and the command line, when
+// standalone) and publish on n until ros::ok() goes false or *stop is set
+// with mpu9150_node_stop(). The caller owns stop and clears it before the
+// run, so a stop that comes in before the loop starts is not lost.
+// Standalone also spins the global callback queue. The mpu9150 library
+// drives a single device, so only one of these runs per process at a time.
+// Returns 0 on a clean shutdown.
+int mpu9150_node_run(ros::NodeHandle &n, ros::NodeHandle &pn, int argc, char **argv,
+		bool standalone, int *stop);
+
+// Any thread, mpu9150_node_run() returns after its current pass
+void mpu9150_node_stop(int *stop);
+
+#endif /* MPU9150_NODE_H */
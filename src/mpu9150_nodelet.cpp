@@ -0,0 +1,76 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  mpu9150_nodelet.cpp
+ *
+ *    Description: mpu9150_node as a nodelet, in-process subscribers get the
+ *                 messages by pointer instead of through TCPROS
+ *
+ * =====================================================================================
+ */
+
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+#include "mpu9150_node.h"
+
+namespace bb_mpu9150
+{
+
+class Mpu9150Nodelet : public nodelet::Nodelet
+{
+public:
+  Mpu9150Nodelet() : running_(false), stop_(0) {}
+
+  virtual ~Mpu9150Nodelet()
+  {
+    if (thread_) {
+      mpu9150_node_stop(&stop_);
+      thread_->join();
+    }
+
+    if (running_)
+      __atomic_store_n(&instance_, 0, __ATOMIC_RELAXED);
+  }
+
+private:
+  virtual void onInit()
+  {
+    // the library has one device's worth of state
+    if (__atomic_exchange_n(&instance_, 1, __ATOMIC_RELAXED)) {
+      NODELET_ERROR("Only one mpu9150 nodelet can run per process");
+      return;
+    }
+
+    running_ = true;
+
+    // the loop blocks on the sensor, onInit() has to return
+    thread_.reset(new boost::thread(boost::bind(&Mpu9150Nodelet::run, this)));
+  }
+
+  void run()
+  {
+    char name[] = "mpu9150_nodelet";
+    char *argv[] = { name, NULL };
+
+    // parameters only, there is no command line
+    if (mpu9150_node_run(getNodeHandle(), getPrivateNodeHandle(), 1, argv, false, &stop_))
+      NODELET_ERROR("mpu9150 nodelet stopped on an error");
+  }
+
+  boost::shared_ptr<boost::thread> thread_;
+  bool running_;
+
+  // this instance's, the next one loaded starts with its own
+  int stop_;
+
+  static int instance_;
+};
+
+int Mpu9150Nodelet::instance_ = 0;
+
+} // namespace bb_mpu9150
+
+PLUGINLIB_EXPORT_CLASS(bb_mpu9150::Mpu9150Nodelet, nodelet::Nodelet)